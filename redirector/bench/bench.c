@@ -0,0 +1,801 @@
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC 1
+#endif
+
+#include "checksum.h"
+#include "common.h"
+#include "rawparser.h"
+#include "rewrite.h"
+
+#define BENCH_FRAME_STRIDE 2048U
+#define BENCH_DEFAULT_FRAMES 1024U
+#define BENCH_DEFAULT_MIN_MS 200U
+#define BENCH_MAX_SIZES 16U
+#define BENCH_MAX_WORKER_RUNS 16U
+#define BENCH_ETH_SIZE 14U
+#define BENCH_MAX_PAYLOAD (BENCH_FRAME_STRIDE - BENCH_ETH_SIZE - 20U - 8U)
+
+#define PCAP_MAGIC 0xa1b2c3d4U
+#define PCAP_MAGIC_NSEC 0xa1b23c4dU
+#define PCAP_LINKTYPE_ETHERNET 1U
+
+enum bench_stage
+{
+    BENCH_STAGE_ETHER = 0,
+    BENCH_STAGE_IP,
+    BENCH_STAGE_UDP,
+    BENCH_STAGE_REWRITE,
+    BENCH_STAGE_REWRITE_CSUM,
+    BENCH_STAGE_REWRITE_OFFLOAD,
+    BENCH_STAGE_COUNT,
+};
+
+static const char* const stage_names[BENCH_STAGE_COUNT] = {
+    "ether", "ip", "udp", "rewrite", "rewrite+csum", "rewrite+offload",
+};
+
+/**
+ * Frames of one benchmark run, laid out BENCH_FRAME_STRIDE apart like pool buffers.
+ */
+struct bench_frames
+{
+    unsigned char* data;
+    uint32_t* lens;
+    uint32_t count;
+};
+
+struct bench_options
+{
+    const char* pcap_path;
+    uint32_t sizes[BENCH_MAX_SIZES];
+    uint32_t size_count;
+    uint32_t workers[BENCH_MAX_WORKER_RUNS];
+    uint32_t worker_count;
+    uint32_t frames;
+    uint32_t min_ms;
+};
+
+struct bench_result
+{
+    uint64_t packets;
+    uint64_t ns;
+    uint64_t cycles;
+};
+
+struct bench_thread
+{
+    pthread_t thread;
+    const struct bench_frames* source;
+    const struct rewrite_ctx* ctx;
+    pthread_barrier_t* barrier;
+    uint32_t min_ms;
+    int exit_code;
+    struct bench_result result;
+};
+
+static void DisplayUsage(void);
+static int GetOptions(int argc, char* argv[], struct bench_options* options);
+static int ParseNumber(const char* str, const char* name, long min, long max, long* value);
+static int ParseList(const char* str, const char* name, long min, long max, uint32_t* values,
+                     uint32_t* count);
+static int AllocFrames(struct bench_frames* frames, uint32_t count);
+static void FreeFrames(struct bench_frames* frames);
+static int CopyFrames(struct bench_frames* copy, const struct bench_frames* source);
+static int LoadPcap(const char* path, struct bench_frames* frames, uint32_t max);
+static int BuildSyntheticFrames(struct bench_frames* frames, uint32_t count, uint32_t payload);
+static uint64_t ReadCycles(void);
+static int RunStagePass(const struct bench_frames* frames, const struct rewrite_ctx* ctx,
+                        enum bench_stage stage);
+static int RunStage(const struct bench_frames* frames, const struct rewrite_ctx* ctx,
+                    enum bench_stage stage, uint32_t min_ms, struct bench_result* result);
+static void* BenchThread(void* arg);
+static int RunWorkers(const struct bench_frames* frames, const struct rewrite_ctx* ctx,
+                      uint32_t workers, uint32_t min_ms, struct bench_result* result);
+static int BenchFrames(const char* label, const struct bench_frames* frames,
+                       const struct rewrite_ctx* ctx, const struct bench_options* options);
+static void PrintHeader(uint32_t frames, uint32_t min_ms);
+static void PrintResult(const char* label, const char* stage, uint32_t workers,
+                        const struct bench_result* result);
+
+int main(int argc, char* argv[])
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t index = 0;
+    long cpus = 0;
+    char label[32] = {0};
+    struct rewrite_ctx ctx = {0};
+    struct bench_frames frames = {0};
+    struct bench_options options = {
+        .pcap_path = NULL,
+        .sizes = {18, 64, 256, 512, 1024, 1472},
+        .size_count = 6,
+        .workers = {1},
+        .worker_count = 1,
+        .frames = BENCH_DEFAULT_FRAMES,
+        .min_ms = BENCH_DEFAULT_MIN_MS,
+    };
+
+    // 1, 2, 4... up to the number of CPUs, unless -j says otherwise
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while (options.worker_count < BENCH_MAX_WORKER_RUNS &&
+           (long)options.workers[options.worker_count - 1] * 2 <= cpus)
+    {
+        options.workers[options.worker_count] = options.workers[options.worker_count - 1] * 2;
+        options.worker_count++;
+    }
+
+    if (GetOptions(argc, argv, &options))
+    {
+        DisplayUsage();
+        goto end;
+    }
+
+    checksum_init();
+
+    // no raw send, so nothing here needs privileges or a real interface
+    if (CreateRewriteCtx(&ctx, "10.2.0.1", "10.3.0.1", 9001, 9000, 0))
+    {
+        (void)fprintf(stderr, "Could not set up rewrite context\n");
+        goto end;
+    }
+
+    if (NULL != options.pcap_path)
+    {
+        if (LoadPcap(options.pcap_path, &frames, options.frames))
+        {
+            (void)fprintf(stderr, "Could not load pcap: %s\n", options.pcap_path);
+            goto end;
+        }
+
+        PrintHeader(frames.count, options.min_ms);
+        exit_code = BenchFrames("pcap", &frames, &ctx, &options);
+        FreeFrames(&frames);
+        goto end;
+    }
+
+    PrintHeader(options.frames, options.min_ms);
+    for (index = 0; index < options.size_count; ++index)
+    {
+        if (BuildSyntheticFrames(&frames, options.frames, options.sizes[index]))
+        {
+            (void)fprintf(stderr, "Could not build synthetic frames\n");
+            goto end;
+        }
+
+        (void)snprintf(label, sizeof(label), "udp/%u", options.sizes[index]);
+        if (BenchFrames(label, &frames, &ctx, &options))
+        {
+            FreeFrames(&frames);
+            goto end;
+        }
+
+        FreeFrames(&frames);
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static void DisplayUsage(void)
+{
+    printf("usage: redirector_bench [-h] [-f PCAP] [-s SIZES] [-n FRAMES] [-t MILLISECONDS] "
+           "[-j WORKERS]\n\n"
+           "Replays traffic through the parse and rewrite pipeline in memory, no privileges "
+           "needed.\n\n"
+           "optional flags:\n"
+           "  -h                  show this help message and exit\n"
+           "  -f PCAP             Replay the IPv4/UDP frames of an ethernet pcap instead of "
+           "synthetic traffic\n"
+           "  -s SIZES            Comma separated synthetic UDP payload sizes (default: "
+           "18,64,256,512,1024,1472)\n"
+           "  -n FRAMES           Distinct frames cycled through per run (default: 1024)\n"
+           "  -t MILLISECONDS     Minimum duration of every measurement (default: 200)\n"
+           "  -j WORKERS          Comma separated worker thread counts for the full pipeline "
+           "(default: powers of two up to the CPU count)\n");
+}
+
+/**
+ * @brief Get Command line options.
+ *
+ * @param argc argc from main
+ * @param argv argv from main
+ * @param options Set from the command line, keeps its defaults for flags not given
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+static int GetOptions(int argc, char* argv[], struct bench_options* options)
+{
+    int exit_code = EXIT_SUCCESS;
+    int option = 0;
+    long value = 0;
+
+    while (-1 != (option = getopt(argc, argv, "hf:s:n:t:j:")))
+    {
+        switch (option)
+        {
+            case 'h':
+                exit_code = EXIT_FAILURE;
+                break;
+
+            case 'f':
+                options->pcap_path = optarg;
+                break;
+
+            case 's':
+                if (ParseList(optarg, "payload size", 0, BENCH_MAX_PAYLOAD, options->sizes,
+                              &options->size_count))
+                {
+                    exit_code = EXIT_FAILURE;
+                }
+                break;
+
+            case 'n':
+                if (ParseNumber(optarg, "frame count", 1, 1L << 20, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                options->frames = (uint32_t)value;
+                break;
+
+            case 't':
+                if (ParseNumber(optarg, "duration", 1, 60000, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                options->min_ms = (uint32_t)value;
+                break;
+
+            case 'j':
+                if (ParseList(optarg, "worker count", 1, 256, options->workers,
+                              &options->worker_count))
+                {
+                    exit_code = EXIT_FAILURE;
+                }
+                break;
+
+            case '?':
+                exit_code = EXIT_FAILURE;
+                break;
+        }
+    }
+
+    return exit_code;
+}
+
+static int ParseNumber(const char* str, const char* name, long min, long max, long* value)
+{
+    int exit_code = EXIT_FAILURE;
+    const int base_10 = 10;
+    char* endptr = NULL;
+    long number = 0;
+
+    number = strtol(str, &endptr, base_10);
+    if ('\0' == *str || *endptr != '\0' || number < min || number > max)
+    {
+        (void)fprintf(stderr, "Invalid %s: %s\n", name, str);
+        goto end;
+    }
+
+    *value = number;
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Parses a comma separated list of numbers, at most BENCH_MAX_SIZES of them.
+ */
+static int ParseList(const char* str, const char* name, long min, long max, uint32_t* values,
+                     uint32_t* count)
+{
+    int exit_code = EXIT_FAILURE;
+    char item[32] = {0};
+    const char* comma = NULL;
+    size_t len = 0;
+    long value = 0;
+    uint32_t parsed = 0;
+
+    while ('\0' != *str)
+    {
+        comma = strchr(str, ',');
+        len = NULL == comma ? strlen(str) : (size_t)(comma - str);
+
+        if (0 == len || len >= sizeof(item) || parsed == BENCH_MAX_SIZES)
+        {
+            (void)fprintf(stderr, "Invalid %s list\n", name);
+            goto end;
+        }
+
+        memcpy(item, str, len);
+        item[len] = '\0';
+        if (ParseNumber(item, name, min, max, &value))
+            goto end;
+
+        values[parsed++] = (uint32_t)value;
+        str += len + (NULL == comma ? 0 : 1);
+    }
+
+    if (0 == parsed)
+    {
+        (void)fprintf(stderr, "Invalid %s list\n", name);
+        goto end;
+    }
+
+    *count = parsed;
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static int AllocFrames(struct bench_frames* frames, uint32_t count)
+{
+    memset(frames, 0, sizeof(*frames));
+
+    frames->data = aligned_alloc(64, (size_t)count * BENCH_FRAME_STRIDE);
+    frames->lens = calloc(count, sizeof(*frames->lens));
+    if (NULL == frames->data || NULL == frames->lens)
+    {
+        perror("alloc");
+        FreeFrames(frames);
+        return EXIT_FAILURE;
+    }
+
+    memset(frames->data, 0, (size_t)count * BENCH_FRAME_STRIDE);
+    frames->count = count;
+    return EXIT_SUCCESS;
+}
+
+static void FreeFrames(struct bench_frames* frames)
+{
+    NFREE(frames->data);
+    NFREE(frames->lens);
+    frames->count = 0;
+}
+
+static int CopyFrames(struct bench_frames* copy, const struct bench_frames* source)
+{
+    if (AllocFrames(copy, source->count))
+        return EXIT_FAILURE;
+
+    memcpy(copy->data, source->data, (size_t)source->count * BENCH_FRAME_STRIDE);
+    memcpy(copy->lens, source->lens, source->count * sizeof(*source->lens));
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Loads the complete ethernet IPv4/UDP frames of a classic pcap file, without libpcap.
+ *
+ * @param path Path of the pcap file, either byte order, micro or nanosecond timestamps.
+ * @param frames Set to the loaded frames.
+ * @param max Most frames to load.
+ * @return int EXIT_SUCCESS if at least one frame was loaded, EXIT_FAILURE otherwise.
+ */
+static int LoadPcap(const char* path, struct bench_frames* frames, uint32_t max)
+{
+    int exit_code = EXIT_FAILURE;
+    int swapped = 0;
+    uint32_t header[6] = {0};
+    uint32_t record[4] = {0};
+    uint32_t loaded = 0;
+    uint32_t incl_len = 0;
+    uint32_t orig_len = 0;
+    unsigned char* frame = NULL;
+    FILE* file = NULL;
+
+    if (AllocFrames(frames, max))
+        goto end;
+
+    file = fopen(path, "rb");
+    if (NULL == file)
+    {
+        perror("fopen");
+        goto clean;
+    }
+
+    if (1 != fread(header, sizeof(header), 1, file))
+    {
+        (void)fprintf(stderr, "pcap header is truncated\n");
+        goto close_file;
+    }
+
+    if (PCAP_MAGIC != header[0] && PCAP_MAGIC_NSEC != header[0])
+    {
+        swapped = 1;
+        if (PCAP_MAGIC != __builtin_bswap32(header[0]) &&
+            PCAP_MAGIC_NSEC != __builtin_bswap32(header[0]))
+        {
+            (void)fprintf(stderr, "not a pcap file, pcapng is not supported\n");
+            goto close_file;
+        }
+    }
+
+    if (PCAP_LINKTYPE_ETHERNET != (swapped ? __builtin_bswap32(header[5]) : header[5]))
+    {
+        (void)fprintf(stderr, "only ethernet captures are supported\n");
+        goto close_file;
+    }
+
+    while (loaded < max && 1 == fread(record, sizeof(record), 1, file))
+    {
+        incl_len = swapped ? __builtin_bswap32(record[2]) : record[2];
+        orig_len = swapped ? __builtin_bswap32(record[3]) : record[3];
+
+        if (incl_len > BENCH_FRAME_STRIDE)
+        {
+            if (fseek(file, (long)incl_len, SEEK_CUR))
+                break;
+            continue;
+        }
+
+        frame = frames->data + (size_t)loaded * BENCH_FRAME_STRIDE;
+        if (1 != fread(frame, incl_len, 1, file))
+            break;
+
+        // truncated captures and anything but IPv4/UDP would only measure the error paths
+        if (incl_len != orig_len || incl_len < BENCH_ETH_SIZE + 28U || 0x08 != frame[12] ||
+            0x00 != frame[13] || IPPROTO_UDP != frame[BENCH_ETH_SIZE + 9U])
+        {
+            continue;
+        }
+
+        frames->lens[loaded++] = incl_len;
+    }
+
+    if (0 == loaded)
+    {
+        (void)fprintf(stderr, "pcap has no complete ethernet IPv4/UDP frames\n");
+        goto close_file;
+    }
+
+    frames->count = loaded;
+    exit_code = EXIT_SUCCESS;
+
+close_file:
+    (void)fclose(file);
+clean:
+    if (exit_code)
+    {
+        FreeFrames(frames);
+    }
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Builds IPv4/UDP frames with valid checksums from many sources to one destination port.
+ */
+static int BuildSyntheticFrames(struct bench_frames* frames, uint32_t count, uint32_t payload)
+{
+    uint32_t index = 0;
+    uint32_t byte = 0;
+    unsigned char* frame = NULL;
+    struct ether_header* eth = NULL;
+    struct ip* ip_header = NULL;
+    struct udphdr* udp_header = NULL;
+    uint16_t udp_len = (uint16_t)(sizeof(*udp_header) + payload);
+
+    if (AllocFrames(frames, count))
+        return EXIT_FAILURE;
+
+    srand(1);
+
+    for (index = 0; index < count; ++index)
+    {
+        frame = frames->data + (size_t)index * BENCH_FRAME_STRIDE;
+        eth = (struct ether_header*)frame;
+        ip_header = (struct ip*)(frame + BENCH_ETH_SIZE);
+        udp_header = (struct udphdr*)(frame + BENCH_ETH_SIZE + sizeof(*ip_header));
+
+        memset(eth->ether_dhost, 0x02, sizeof(eth->ether_dhost));
+        memset(eth->ether_shost, 0x04, sizeof(eth->ether_shost));
+        eth->ether_type = htons(ETHERTYPE_IP);
+
+        ip_header->ip_v = 4;
+        ip_header->ip_hl = 5;
+        ip_header->ip_len = htons((uint16_t)(sizeof(*ip_header) + udp_len));
+        ip_header->ip_id = htons((uint16_t)index);
+        ip_header->ip_ttl = 64;
+        ip_header->ip_p = IPPROTO_UDP;
+        ip_header->ip_src.s_addr = htonl(0x0a000000U | (index & 0xFFFFU));
+        ip_header->ip_dst.s_addr = htonl(0x0a010001U);
+        ip_header->ip_sum = ip_checksum(ip_header, sizeof(*ip_header));
+
+        udp_header->source = htons((uint16_t)(1024U + index % 50000U));
+        udp_header->dest = htons(9000);
+        udp_header->len = htons(udp_len);
+        for (byte = 0; byte < payload; ++byte)
+        {
+            ((unsigned char*)(udp_header + 1))[byte] = (unsigned char)rand();
+        }
+        udp_header->check = udp_checksum(udp_header, udp_len, ip_header->ip_src.s_addr,
+                                         ip_header->ip_dst.s_addr);
+        if (0 == udp_header->check)
+        {
+            udp_header->check = 0xFFFF;
+        }
+
+        frames->lens[index] = (uint32_t)(BENCH_ETH_SIZE + sizeof(*ip_header) + udp_len);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static uint64_t ReadCycles(void)
+{
+#ifdef BENCH_HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Runs one stage over every frame once.
+ *
+ * The frames are rewritten in place, later passes redo the same work on already rewritten
+ * headers, which costs the same.
+ */
+static int RunStagePass(const struct bench_frames* frames, const struct rewrite_ctx* ctx,
+                        enum bench_stage stage)
+{
+    uint32_t index = 0;
+    uint32_t delta = 0;
+    ssize_t len = 0;
+    ssize_t ip_len = 0;
+    unsigned char* frame = NULL;
+
+    for (index = 0; index < frames->count; ++index)
+    {
+        frame = frames->data + (size_t)index * BENCH_FRAME_STRIDE;
+        len = (ssize_t)frames->lens[index];
+        ip_len = (ssize_t)(frame[BENCH_ETH_SIZE] & 0x0F) * 4;
+
+        switch (stage)
+        {
+            case BENCH_STAGE_ETHER:
+                len = ParseEther(frame, len);
+                break;
+
+            case BENCH_STAGE_IP:
+                len = ParseIp(frame + BENCH_ETH_SIZE, len - (ssize_t)BENCH_ETH_SIZE, ctx, &delta);
+                break;
+
+            case BENCH_STAGE_UDP:
+                len = ParseUdp(frame + BENCH_ETH_SIZE + ip_len,
+                               len - (ssize_t)BENCH_ETH_SIZE - ip_len, ctx,
+                               (struct ip*)(frame + BENCH_ETH_SIZE), delta, CSUM_COMPLETE);
+                break;
+
+            case BENCH_STAGE_REWRITE:
+                len = ModifyPacket(frame, len, ctx, NULL, CSUM_COMPLETE, NULL);
+                break;
+
+            case BENCH_STAGE_REWRITE_CSUM:
+                len = ModifyPacket(frame, len, ctx, NULL, CSUM_PARTIAL, NULL);
+                break;
+
+            case BENCH_STAGE_REWRITE_OFFLOAD:
+                len = ModifyPacket(frame, len, ctx, NULL, CSUM_OFFLOAD, NULL);
+                break;
+
+            case BENCH_STAGE_COUNT:
+                break;
+        }
+
+        if (-1 == len)
+        {
+            (void)fprintf(stderr, "frame %u failed the %s stage\n", index, stage_names[stage]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Repeats a stage over the frames for at least min_ms after one warm up pass.
+ */
+static int RunStage(const struct bench_frames* frames, const struct rewrite_ctx* ctx,
+                    enum bench_stage stage, uint32_t min_ms, struct bench_result* result)
+{
+    uint64_t start_ns = 0;
+    uint64_t start_cycles = 0;
+    uint64_t min_ns = (uint64_t)min_ms * 1000000U;
+
+    memset(result, 0, sizeof(*result));
+
+    if (RunStagePass(frames, ctx, stage))
+        return EXIT_FAILURE;
+
+    start_ns = MonotonicNs();
+    start_cycles = ReadCycles();
+
+    do
+    {
+        if (RunStagePass(frames, ctx, stage))
+            return EXIT_FAILURE;
+
+        result->packets += frames->count;
+        result->ns = MonotonicNs() - start_ns;
+    } while (result->ns < min_ns);
+
+    result->cycles = ReadCycles() - start_cycles;
+    return EXIT_SUCCESS;
+}
+
+static void* BenchThread(void* arg)
+{
+    struct bench_thread* bench = arg;
+    struct bench_frames frames = {0};
+
+    // every worker rewrites its own copy, like every worker owning its pool
+    bench->exit_code = CopyFrames(&frames, bench->source);
+
+    (void)pthread_barrier_wait(bench->barrier);
+
+    if (EXIT_SUCCESS == bench->exit_code)
+    {
+        bench->exit_code =
+            RunStage(&frames, bench->ctx, BENCH_STAGE_REWRITE, bench->min_ms, &bench->result);
+    }
+
+    FreeFrames(&frames);
+    return NULL;
+}
+
+/**
+ * @brief Runs the full pipeline on several threads at once and sums their packets.
+ *
+ * The result's ns is the slowest thread's wall time, cycles are the per thread average.
+ */
+static int RunWorkers(const struct bench_frames* frames, const struct rewrite_ctx* ctx,
+                      uint32_t workers, uint32_t min_ms, struct bench_result* result)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t started = 0;
+    uint32_t index = 0;
+    struct bench_thread* threads = NULL;
+    pthread_barrier_t barrier;
+
+    memset(result, 0, sizeof(*result));
+
+    threads = calloc(workers, sizeof(*threads));
+    if (NULL == threads)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    if (pthread_barrier_init(&barrier, NULL, workers))
+    {
+        (void)fprintf(stderr, "Could not create barrier\n");
+        goto clean;
+    }
+
+    for (started = 0; started < workers; ++started)
+    {
+        threads[started].source = frames;
+        threads[started].ctx = ctx;
+        threads[started].barrier = &barrier;
+        threads[started].min_ms = min_ms;
+
+        if (pthread_create(&threads[started].thread, NULL, BenchThread, &threads[started]))
+        {
+            (void)fprintf(stderr, "Could not start bench thread\n");
+            break;
+        }
+    }
+
+    // a thread that did not start would leave the others waiting on the barrier forever
+    if (started != workers)
+    {
+        for (index = started; index < workers; ++index)
+        {
+            (void)pthread_barrier_wait(&barrier);
+        }
+    }
+
+    exit_code = started == workers ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (index = 0; index < started; ++index)
+    {
+        (void)pthread_join(threads[index].thread, NULL);
+        if (threads[index].exit_code)
+        {
+            exit_code = EXIT_FAILURE;
+            continue;
+        }
+
+        result->packets += threads[index].result.packets;
+        result->cycles += threads[index].result.cycles / workers;
+        if (threads[index].result.ns > result->ns)
+        {
+            result->ns = threads[index].result.ns;
+        }
+    }
+
+    (void)pthread_barrier_destroy(&barrier);
+
+clean:
+    NFREE(threads);
+
+end:
+    return exit_code;
+}
+
+static int BenchFrames(const char* label, const struct bench_frames* frames,
+                       const struct rewrite_ctx* ctx, const struct bench_options* options)
+{
+    uint32_t stage = 0;
+    uint32_t index = 0;
+    struct bench_result result = {0};
+
+    for (stage = 0; stage < BENCH_STAGE_COUNT; ++stage)
+    {
+        if (RunStage(frames, ctx, (enum bench_stage)stage, options->min_ms, &result))
+            return EXIT_FAILURE;
+
+        PrintResult(label, stage_names[stage], 1, &result);
+    }
+
+    for (index = 0; index < options->worker_count; ++index)
+    {
+        if (1 == options->workers[index])
+            continue;
+
+        if (RunWorkers(frames, ctx, options->workers[index], options->min_ms, &result))
+            return EXIT_FAILURE;
+
+        PrintResult(label, stage_names[BENCH_STAGE_REWRITE], options->workers[index], &result);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void PrintHeader(uint32_t frames, uint32_t min_ms)
+{
+    printf("%u frames per run, %u ms per measurement, %s checksums, cycles are %s\n\n", frames,
+           min_ms, checksum_impl(),
+#ifdef BENCH_HAS_TSC
+           "TSC ticks"
+#else
+           "not available"
+#endif
+    );
+    printf("%-10s %-13s %7s %14s %10s %10s\n", "traffic", "stage", "workers", "pps", "ns/pkt",
+           "cycles/pkt");
+}
+
+static void PrintResult(const char* label, const char* stage, uint32_t workers,
+                        const struct bench_result* result)
+{
+    double seconds = (double)result->ns / (double)NSEC_PER_SEC;
+    double pps = 0 == result->ns ? 0.0 : (double)result->packets / seconds;
+    // per worker, so the number stays comparable across worker counts
+    double ns_per_pkt = 0 == result->packets
+                            ? 0.0
+                            : (double)result->ns * workers / (double)result->packets;
+    double cycles_per_pkt =
+        0 == result->packets ? 0.0 : (double)result->cycles * workers / (double)result->packets;
+
+    printf("%-10s %-13s %7u %14.0f %10.2f %10.1f\n", label, stage, workers, pps, ns_per_pkt,
+           cycles_per_pkt);
+}
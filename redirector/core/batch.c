@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "batch.h"
+#include "common.h"
+#include "networking.h"
+#include "pool.h"
+#include "tstamp.h"
+#include "uring.h"
+
+static void ReleaseBatch(struct udp_batch* batch, struct buf_pool* pool);
+static uint64_t FirstStamp(const struct udp_batch* batch, uint32_t payload);
+
+int CreateUdpBatch(struct udp_batch* batch, uint32_t size, uint32_t max_delay_us, int gso)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == batch)
+    {
+        (void)fprintf(stderr, "batch can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == size || size > BATCH_MAX_SIZE)
+    {
+        (void)fprintf(stderr, "batch size must be between 1 and %u\n", BATCH_MAX_SIZE);
+        goto end;
+    }
+
+    memset(batch, 0, sizeof(*batch));
+
+    batch->msgs = calloc(size, sizeof(*batch->msgs));
+    batch->iovs = calloc(size, sizeof(*batch->iovs));
+    batch->bufs = calloc(size, sizeof(*batch->bufs));
+    batch->cmsgs = calloc(size, sizeof(*batch->cmsgs));
+    if (NULL == batch->msgs || NULL == batch->iovs || NULL == batch->bufs ||
+        NULL == batch->cmsgs)
+    {
+        perror("calloc");
+        goto clean;
+    }
+
+    batch->size = size;
+    batch->max_delay_us = max_delay_us;
+    batch->gso = gso;
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    DestroyUdpBatch(batch);
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Checks whether a payload can ride along in the last queued message, it must go to the
+ * same destination and keep every segment but the last at the message's segment size.
+ */
+static int CanCoalesce(const struct udp_batch* batch, size_t len,
+                       const struct sockaddr_in* addr)
+{
+    const struct msghdr* hdr = NULL;
+    const struct sockaddr_in* last_addr = NULL;
+    size_t segment = 0;
+    size_t total = 0;
+    size_t index = 0;
+
+    if (!batch->gso || 0 == batch->msg_count || 0 == len)
+        return 0;
+
+    hdr = &batch->msgs[batch->msg_count - 1].msg_hdr;
+    last_addr = hdr->msg_name;
+    if (last_addr->sin_addr.s_addr != addr->sin_addr.s_addr ||
+        last_addr->sin_port != addr->sin_port)
+        return 0;
+
+    segment = hdr->msg_iov[0].iov_len;
+    if (hdr->msg_iovlen >= BATCH_GSO_MAX_SEGMENTS || len > segment ||
+        hdr->msg_iov[hdr->msg_iovlen - 1].iov_len != segment)
+        return 0;
+
+    for (index = 0; index < hdr->msg_iovlen; ++index)
+    {
+        total += hdr->msg_iov[index].iov_len;
+    }
+
+    return total + len <= BATCH_GSO_MAX_BYTES;
+}
+
+int UdpBatchAdd(struct udp_batch* batch, unsigned char* data, size_t len,
+                const struct sockaddr_in* addr, struct pkt_buf* buf)
+{
+    int exit_code = EXIT_FAILURE;
+    struct mmsghdr* msg = NULL;
+    struct cmsghdr* cmsg = NULL;
+    uint16_t segment = 0;
+
+    if (NULL == batch || NULL == data || NULL == addr)
+    {
+        (void)fprintf(stderr, "batch, data and addr can not be NULL\n");
+        goto end;
+    }
+
+    if (batch->count == batch->size)
+    {
+        (void)fprintf(stderr, "batch is full\n");
+        goto end;
+    }
+
+    if (0 == batch->count)
+    {
+        batch->oldest_ns = MonotonicNs();
+    }
+
+    batch->iovs[batch->count].iov_base = data;
+    batch->iovs[batch->count].iov_len = len;
+
+    // payloads are added in order, so a message's iovecs stay next to each other
+    if (CanCoalesce(batch, len, addr))
+    {
+        msg = &batch->msgs[batch->msg_count - 1];
+        if (1 == msg->msg_hdr.msg_iovlen)
+        {
+            segment = (uint16_t)msg->msg_hdr.msg_iov[0].iov_len;
+            msg->msg_hdr.msg_control = batch->cmsgs[batch->msg_count - 1].buf;
+            msg->msg_hdr.msg_controllen = sizeof(batch->cmsgs[batch->msg_count - 1].buf);
+            cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+        msg->msg_hdr.msg_iovlen++;
+    }
+    else
+    {
+        msg = &batch->msgs[batch->msg_count];
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_hdr.msg_name = (void*)addr;
+        msg->msg_hdr.msg_namelen = sizeof(*addr);
+        msg->msg_hdr.msg_iov = &batch->iovs[batch->count];
+        msg->msg_hdr.msg_iovlen = 1;
+        batch->msg_count++;
+    }
+
+    if (NULL != buf)
+    {
+        BufRef(buf);
+    }
+    batch->bufs[batch->count] = buf;
+
+    batch->count++;
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int UdpGsoSupported(int sock)
+{
+    int segment = 0;
+    socklen_t len = sizeof(segment);
+
+    if (getsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, &len))
+    {
+        perror("getsockopt UDP_SEGMENT");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int UdpBatchFlush(struct udp_batch* batch, int sock, struct buf_pool* pool)
+{
+    const unsigned int unsent = UINT32_MAX;
+    int failed = 0;
+    uint32_t index = 0;
+    uint32_t payload = 0;
+
+    if (NULL == batch || 0 == batch->count)
+        goto end;
+
+    // sendmmsg only writes msg_len of the messages that went out, a failed one drops all of
+    // its payloads
+    for (index = 0; index < batch->msg_count; ++index)
+    {
+        batch->msgs[index].msg_len = unsent;
+    }
+
+    if ((int)batch->msg_count != SendUDPBatch(batch->msgs, batch->msg_count, sock) ||
+        NULL != batch->stamps)
+    {
+        for (index = 0; index < batch->msg_count; ++index)
+        {
+            if (unsent == batch->msgs[index].msg_len)
+            {
+                failed += (int)batch->msgs[index].msg_hdr.msg_iovlen;
+            }
+            else if (NULL != batch->stamps)
+            {
+                TstampSent(batch->stamps, FirstStamp(batch, payload));
+            }
+            payload += (uint32_t)batch->msgs[index].msg_hdr.msg_iovlen;
+        }
+    }
+
+    ReleaseBatch(batch, pool);
+
+end:
+    return failed;
+}
+
+int UdpBatchSendSome(struct udp_batch* batch, int sock, struct buf_pool* pool, uint32_t* done,
+                     uint32_t* msgs_done)
+{
+    int failed = 0;
+    int result = 0;
+    uint32_t index = 0;
+    uint32_t offset = 0;
+    uint32_t payload = 0;
+
+    if (NULL == batch || NULL == done || NULL == msgs_done)
+        goto end;
+
+    while (offset < batch->msg_count)
+    {
+        result = sendmmsg(sock, batch->msgs + offset, batch->msg_count - offset, MSG_DONTWAIT);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+                continue;
+
+            // the rest stays with the caller, nothing is lost
+            if (SEND_BACKED_OFF(errno))
+                break;
+
+            failed += (int)batch->msgs[offset].msg_hdr.msg_iovlen;
+            payload += (uint32_t)batch->msgs[offset].msg_hdr.msg_iovlen;
+            offset++;
+            continue;
+        }
+
+        for (index = offset; index < offset + (uint32_t)result; ++index)
+        {
+            if (NULL != batch->stamps)
+            {
+                TstampSent(batch->stamps, FirstStamp(batch, payload));
+            }
+            payload += (uint32_t)batch->msgs[index].msg_hdr.msg_iovlen;
+        }
+        offset += (uint32_t)result;
+    }
+
+    *done = payload;
+    *msgs_done = offset;
+    ReleaseBatch(batch, pool);
+
+end:
+    return failed;
+}
+
+int UdpBatchSubmit(struct udp_batch* batch, int sock, struct uring* ring, struct buf_pool* pool)
+{
+    int failed = 0;
+    uint32_t index = 0;
+    uint32_t payload = 0;
+    const struct msghdr* hdr = NULL;
+
+    if (NULL == batch || NULL == ring || 0 == batch->count)
+        goto end;
+
+    for (index = 0; index < batch->msg_count; ++index)
+    {
+        // a message's iovecs are next to each other, and so are the buffers holding them
+        hdr = &batch->msgs[index].msg_hdr;
+        if (UringSend(ring, sock, hdr, &batch->bufs[payload]))
+        {
+            failed += (int)hdr->msg_iovlen;
+        }
+        else if (NULL != batch->stamps)
+        {
+            TstampSent(batch->stamps, FirstStamp(batch, payload));
+        }
+        payload += (uint32_t)hdr->msg_iovlen;
+    }
+
+    ReleaseBatch(batch, pool);
+
+end:
+    return failed;
+}
+
+int UdpBatchTimeout(const struct udp_batch* batch, uint64_t now_ns)
+{
+    const uint64_t nsec_per_usec = 1000;
+    const uint64_t nsec_per_msec = 1000000;
+    uint64_t due_ns = 0;
+
+    if (NULL == batch || 0 == batch->count)
+        return -1;
+
+    if (batch->count == batch->size)
+        return 0;
+
+    due_ns = batch->oldest_ns + (uint64_t)batch->max_delay_us * nsec_per_usec;
+    if (now_ns >= due_ns)
+        return 0;
+
+    // round up, waking early would only come back with a shorter timeout
+    return (int)((due_ns - now_ns + nsec_per_msec - 1) / nsec_per_msec);
+}
+
+void DestroyUdpBatch(struct udp_batch* batch)
+{
+    if (NULL == batch)
+        return;
+
+    NFREE(batch->msgs);
+    NFREE(batch->iovs);
+    NFREE(batch->bufs);
+    NFREE(batch->cmsgs);
+    batch->size = 0;
+    batch->count = 0;
+    batch->msg_count = 0;
+}
+
+/**
+ * @brief Drops the batch's references on its buffers and empties it.
+ */
+static void ReleaseBatch(struct udp_batch* batch, struct buf_pool* pool)
+{
+    uint32_t index = 0;
+
+    for (index = 0; index < batch->count; ++index)
+    {
+        if (NULL != batch->bufs[index])
+        {
+            BufPoolPut(pool, batch->bufs[index]);
+            batch->bufs[index] = NULL;
+        }
+    }
+
+    batch->count = 0;
+    batch->msg_count = 0;
+}
+
+/**
+ * @brief Kernel receive time of a queued payload, 0 if it is not in a pool buffer.
+ */
+static uint64_t FirstStamp(const struct udp_batch* batch, uint32_t payload)
+{
+    return NULL == batch->bufs[payload] ? 0 : batch->bufs[payload]->rx_stamp;
+}
@@ -1,68 +1,288 @@
+#include <arpa/inet.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "checksum.h"
 
-//https://gist.github.com/GreenRecycleBin/1273762
-uint16_t ip_checksum(struct ip* p_ip_header, size_t len)
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+static uint64_t checksum_partial_generic(const unsigned char* data, size_t len, uint64_t sum);
+#ifdef CHECKSUM_X86
+static uint64_t checksum_partial_sse2(const unsigned char* data, size_t len, uint64_t sum);
+static uint64_t checksum_partial_avx2(const unsigned char* data, size_t len, uint64_t sum);
+#endif
+
+// portable until checksum_init has looked at the CPU
+static uint64_t (*checksum_partial_impl)(const unsigned char*, size_t,
+                                         uint64_t) = checksum_partial_generic;
+static const char* checksum_impl_name = "generic";
+
+void checksum_init(void)
 {
-    register int sum = 0;
-    uint16_t* ptr = (unsigned short*)p_ip_header;
-    uint16_t checksum = 0;
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
 
-    while (len > 1)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        checksum_partial_impl = checksum_partial_avx2;
+        checksum_impl_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        checksum_partial_impl = checksum_partial_sse2;
+        checksum_impl_name = "sse2";
+    }
+#endif
+}
+
+int checksum_use(const char* name)
+{
+    if (0 == strcmp(name, "generic"))
     {
-        sum += *ptr++;
-        len -= 2;
+        checksum_partial_impl = checksum_partial_generic;
+        checksum_impl_name = "generic";
+        return EXIT_SUCCESS;
     }
 
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+
+    if (0 == strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+    {
+        checksum_partial_impl = checksum_partial_avx2;
+        checksum_impl_name = "avx2";
+        return EXIT_SUCCESS;
+    }
+
+    if (0 == strcmp(name, "sse2") && __builtin_cpu_supports("sse2"))
+    {
+        checksum_partial_impl = checksum_partial_sse2;
+        checksum_impl_name = "sse2";
+        return EXIT_SUCCESS;
+    }
+#endif
+
+    return EXIT_FAILURE;
+}
+
+const char* checksum_impl(void)
+{
+    return checksum_impl_name;
+}
+
+uint64_t checksum_partial(const void* data, size_t len, uint64_t sum)
+{
+    return checksum_partial_impl(data, len, sum);
+}
 
-    checksum = (uint16_t)~sum;
+uint16_t checksum_fold(uint64_t sum)
+{
+    // Add the carries
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
 
-    return checksum;
+    return (uint16_t)sum;
+}
+
+uint16_t ip_checksum(struct ip* p_ip_header, size_t len)
+{
+    return (uint16_t)~checksum_fold(checksum_partial(p_ip_header, len, 0));
 }
 
-//https://gist.github.com/GreenRecycleBin/1273763
 uint16_t udp_checksum(struct udphdr* p_udp_header, size_t len, uint32_t src_addr,
                       uint32_t dest_addr)
 {
-    const uint16_t* buf = (const uint16_t*)p_udp_header;
-    uint16_t *ip_src = (void*)&src_addr, *ip_dst = (void*)&dest_addr;
-    uint32_t sum;
-    size_t length = len;
-
-    // Calculate the sum
-    sum = 0;
-    while (len > 1)
+    uint64_t sum = 0;
+
+    // Add the pseudo-header, addresses as they sit in the packet
+    sum += src_addr;
+    sum += dest_addr;
+    sum += htons(IPPROTO_UDP);
+    sum += htons((uint16_t)len);
+
+    sum = checksum_partial(p_udp_header, len, sum);
+
+    // Return the one's complement of sum
+    return (uint16_t)~checksum_fold(sum);
+}
+
+/**
+ * @brief Adds the trailing bytes that do not fill a 32 bit word.
+ *
+ * Memory order is kept, so the sum folds to the same value as summing 16 bit words. An odd
+ * byte is padded with zero on the right as RFC 1071 asks.
+ */
+static uint64_t checksum_tail(const unsigned char* data, size_t len, uint64_t sum)
+{
+    uint16_t word = 0;
+
+    if (len & 2)
     {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xFFFF) + (sum >> 16);
-        len -= 2;
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 2;
     }
 
     if (len & 1)
-        // Add the padding if the packet lenght is odd
-        sum += *((uint8_t*)buf);
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        sum += *data;
+#else
+        sum += (uint64_t)*data << 8;
+#endif
+    }
 
-    // Add the pseudo-header
-    sum += *(ip_src++);
-    sum += *ip_src;
+    return sum;
+}
 
-    sum += *(ip_dst++);
-    sum += *ip_dst;
+/**
+ * @brief One's complement sum with a 64 bit accumulator, 32 bits per add and no carry checks.
+ *
+ * 2^32 additions of 32 bit words fit in 64 bits, far more than any packet.
+ */
+static uint64_t checksum_partial_generic(const unsigned char* data, size_t len, uint64_t sum)
+{
+    uint32_t word = 0;
+    uint64_t sum2 = 0;
 
-    sum += htons(IPPROTO_UDP);
-    sum += htons((uint16_t)length);
+    while (len >= 8)
+    {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        memcpy(&word, data + 4, sizeof(word));
+        sum2 += word;
+        data += 8;
+        len -= 8;
+    }
+
+    if (len >= 4)
+    {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += 4;
+        len -= 4;
+    }
+
+    sum = (uint64_t)checksum_fold(sum) + checksum_fold(sum2);
+
+    return checksum_tail(data, len, sum);
+}
+
+#ifdef CHECKSUM_X86
+/**
+ * @brief One's complement sum, 16 bytes per step. 32 bit lanes are widened into 64 bit
+ * accumulators so no carry is ever lost, loads are unaligned.
+ */
+__attribute__((target("sse2"))) static uint64_t checksum_partial_sse2(const unsigned char* data,
+                                                                      size_t len, uint64_t sum)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc_lo = _mm_setzero_si128();
+    __m128i acc_hi = _mm_setzero_si128();
+    __m128i block;
+    uint64_t lanes[2];
+
+    while (len >= 16)
+    {
+        block = _mm_loadu_si128((const __m128i*)data);
+        acc_lo = _mm_add_epi64(acc_lo, _mm_unpacklo_epi32(block, zero));
+        acc_hi = _mm_add_epi64(acc_hi, _mm_unpackhi_epi32(block, zero));
+        data += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc_lo, acc_hi));
+    sum = (uint64_t)checksum_fold(sum) + checksum_fold(lanes[0]) + checksum_fold(lanes[1]);
+
+    return checksum_partial_generic(data, len, sum);
+}
+
+/**
+ * @brief Same as the SSE2 kernel, 64 bytes per step over two 256 bit loads.
+ */
+__attribute__((target("avx2"))) static uint64_t checksum_partial_avx2(const unsigned char* data,
+                                                                      size_t len, uint64_t sum)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc_a = _mm256_setzero_si256();
+    __m256i acc_b = _mm256_setzero_si256();
+    __m256i block_a;
+    __m256i block_b;
+    __m128i half;
+    uint64_t lane_lo = 0;
+    uint64_t lane_hi = 0;
+
+    // headers and tiny payloads are done before the vector setup pays off
+    if (len < 64)
+        return checksum_partial_generic(data, len, sum);
+
+    while (len >= 64)
+    {
+        block_a = _mm256_loadu_si256((const __m256i*)data);
+        block_b = _mm256_loadu_si256((const __m256i*)(data + 32));
+        acc_a = _mm256_add_epi64(acc_a, _mm256_unpacklo_epi32(block_a, zero));
+        acc_b = _mm256_add_epi64(acc_b, _mm256_unpackhi_epi32(block_a, zero));
+        acc_a = _mm256_add_epi64(acc_a, _mm256_unpacklo_epi32(block_b, zero));
+        acc_b = _mm256_add_epi64(acc_b, _mm256_unpackhi_epi32(block_b, zero));
+        data += 64;
+        len -= 64;
+    }
+
+    if (len >= 32)
+    {
+        block_a = _mm256_loadu_si256((const __m256i*)data);
+        acc_a = _mm256_add_epi64(acc_a, _mm256_unpacklo_epi32(block_a, zero));
+        acc_b = _mm256_add_epi64(acc_b, _mm256_unpackhi_epi32(block_a, zero));
+        data += 32;
+        len -= 32;
+    }
+
+    acc_a = _mm256_add_epi64(acc_a, acc_b);
+    half = _mm_add_epi64(_mm256_castsi256_si128(acc_a), _mm256_extracti128_si256(acc_a, 1));
+    lane_lo = (uint64_t)_mm_cvtsi128_si64(half);
+    lane_hi = (uint64_t)_mm_extract_epi64(half, 1);
+    // gcc does not emit this for target attribute functions, dirty upper halves make every
+    // later SSE instruction of the caller pay a transition penalty. Nothing may live in a
+    // vector register past this point or gcc spills and reloads it, dirtying them again.
+    _mm256_zeroupper();
+
+    sum = (uint64_t)checksum_fold(sum) + checksum_fold(lane_lo) + checksum_fold(lane_hi);
+
+    return checksum_partial_generic(data, len, sum);
+}
+#endif
+
+uint32_t checksum_diff16(uint32_t delta, uint16_t old_value, uint16_t new_value)
+{
+    // ~m + m', kept unfolded, a handful of fields can not overflow 32 bits
+    return delta + (uint16_t)~old_value + new_value;
+}
+
+uint32_t checksum_diff32(uint32_t delta, uint32_t old_value, uint32_t new_value)
+{
+    delta = checksum_diff16(delta, (uint16_t)(old_value >> 16), (uint16_t)(new_value >> 16));
+    return checksum_diff16(delta, (uint16_t)old_value, (uint16_t)new_value);
+}
+
+uint16_t checksum_adjust(uint16_t check, uint32_t delta)
+{
+    uint32_t sum = (uint16_t)~check;
+
+    sum += delta & 0xFFFF;
+    sum += delta >> 16;
 
     // Add the carries
     while (sum >> 16)
         sum = (sum & 0xFFFF) + (sum >> 16);
 
-    // Return the one's complement of sum
     return (uint16_t)~sum;
 }
\ No newline at end of file
@@ -0,0 +1,626 @@
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "filter.h"
+
+#define FILTER_ITEM_SIZE 64U
+
+// frame offsets, cBPF loads are relative to the ethernet header
+#define OFF_ETHERTYPE 12U
+#define OFF_IP4_VHL 14U
+#define OFF_IP4_LEN 16U
+#define OFF_IP4_FRAG 20U
+#define OFF_IP4_PROTO 23U
+#define OFF_IP4_SRC 26U
+#define OFF_IP4_SPORT 14U  // from X, which holds the IPv4 header length
+#define OFF_IP4_DPORT 16U
+#define OFF_IP6_PLEN 18U
+#define OFF_IP6_NEXT 20U
+#define OFF_IP6_SRC 22U
+#define OFF_IP6_DPORT 56U
+#define IP6_HEADERS_LEN 54U  // ethernet and fixed IPv6 header, not counted in the payload length
+
+/**
+ * Jump targets. Conditional jumps only ever skip a few instructions inside one check, anything
+ * further goes through a ja whose 32 bit offset is patched in when the label is placed, so no
+ * spec can overflow the 8 bit jt and jf offsets.
+ */
+enum filter_label
+{
+    FILTER_LABEL_REJECT = 0,
+    FILTER_LABEL_IPV4,
+    FILTER_LABEL_IPV6,
+    FILTER_LABEL_PORT_OK,
+    FILTER_LABEL_SOURCE_OK,
+    FILTER_LABEL_HASH,
+};
+
+struct filter_builder
+{
+    struct filter_prog* prog;
+    uint16_t fixups[FILTER_MAX_INSNS];
+    enum filter_label fixup_labels[FILTER_MAX_INSNS];
+    uint32_t fixup_count;
+    int overflow;
+};
+
+static int NextItem(const char** str, char* item, size_t size);
+static int ParseUnsigned(const char* str, uint32_t max, uint32_t* value);
+static void Emit(struct filter_builder* builder, uint16_t code, uint8_t jt, uint8_t jf,
+                 uint32_t k);
+static void EmitJump(struct filter_builder* builder, enum filter_label label);
+static void EmitExpect(struct filter_builder* builder, uint16_t op, uint32_t k, int holds,
+                       enum filter_label label);
+static void PlaceLabel(struct filter_builder* builder, enum filter_label label);
+static void EmitPorts(struct filter_builder* builder, const struct filter_spec* spec);
+static void EmitPrefixes(struct filter_builder* builder, const struct filter_spec* spec,
+                         int family, uint32_t offset);
+static void EmitAccept(struct filter_builder* builder);
+
+int ParsePortRanges(const char* str, struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    char item[FILTER_ITEM_SIZE] = {0};
+    char* dash = NULL;
+    uint32_t first = 0;
+    uint32_t last = 0;
+
+    if (NULL == str || NULL == spec)
+    {
+        (void)fprintf(stderr, "str and spec can not be NULL\n");
+        goto end;
+    }
+
+    while ('\0' != *str)
+    {
+        if (NextItem(&str, item, sizeof(item)))
+            goto invalid;
+
+        dash = strchr(item, '-');
+        if (NULL != dash)
+        {
+            *dash = '\0';
+        }
+
+        if (ParseUnsigned(item, UINT16_MAX, &first))
+            goto invalid;
+
+        last = first;
+        if (NULL != dash && ParseUnsigned(dash + 1, UINT16_MAX, &last))
+            goto invalid;
+
+        if (last < first || spec->port_count == FILTER_MAX_PORT_RANGES)
+            goto invalid;
+
+        spec->ports[spec->port_count].first = (uint16_t)first;
+        spec->ports[spec->port_count].last = (uint16_t)last;
+        spec->port_count++;
+    }
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+invalid:
+    (void)fprintf(stderr, "Invalid port list, at most %u ports or FIRST-LAST ranges\n",
+                  FILTER_MAX_PORT_RANGES);
+end:
+    return exit_code;
+}
+
+int ParseSourcePrefixes(const char* str, struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    char item[FILTER_ITEM_SIZE] = {0};
+    char* slash = NULL;
+    unsigned char addr[sizeof(struct in6_addr)] = {0};
+    uint32_t len = 0;
+    uint32_t max_len = 0;
+    uint32_t word = 0;
+    uint32_t mask = 0;
+    struct src_prefix* prefix = NULL;
+
+    if (NULL == str || NULL == spec)
+    {
+        (void)fprintf(stderr, "str and spec can not be NULL\n");
+        goto end;
+    }
+
+    while ('\0' != *str)
+    {
+        if (NextItem(&str, item, sizeof(item)) || spec->prefix_count == FILTER_MAX_PREFIXES)
+            goto invalid;
+
+        prefix = &spec->prefixes[spec->prefix_count];
+        memset(prefix, 0, sizeof(*prefix));
+
+        slash = strchr(item, '/');
+        if (NULL != slash)
+        {
+            *slash = '\0';
+        }
+
+        if (1 == inet_pton(AF_INET, item, addr))
+        {
+            prefix->family = AF_INET;
+            max_len = 32;
+        }
+        else if (1 == inet_pton(AF_INET6, item, addr))
+        {
+            prefix->family = AF_INET6;
+            max_len = 128;
+        }
+        else
+        {
+            goto invalid;
+        }
+
+        len = max_len;
+        if (NULL != slash && ParseUnsigned(slash + 1, max_len, &len))
+            goto invalid;
+
+        prefix->len = (uint8_t)len;
+        for (word = 0; word < max_len / 32; ++word)
+        {
+            memcpy(&prefix->addr[word], addr + word * 4, sizeof(prefix->addr[word]));
+            prefix->addr[word] = ntohl(prefix->addr[word]);
+
+            // bits of this word that belong to the network
+            mask = len >= (word + 1) * 32 ? UINT32_MAX
+                   : len <= word * 32     ? 0
+                                          : UINT32_MAX << ((word + 1) * 32 - len);
+            if (prefix->addr[word] & ~mask)
+            {
+                (void)fprintf(stderr, "Prefix has host bits set: %s/%u\n", item, len);
+                goto end;
+            }
+        }
+
+        spec->prefix_count++;
+    }
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+invalid:
+    (void)fprintf(stderr, "Invalid source prefix list, at most %u ADDRESS[/LENGTH] entries\n",
+                  FILTER_MAX_PREFIXES);
+end:
+    return exit_code;
+}
+
+int ParseLengthRange(const char* str, struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    char item[FILTER_ITEM_SIZE] = {0};
+    char* dash = NULL;
+    uint32_t min_len = 0;
+    uint32_t max_len = 0;
+
+    if (NULL == str || NULL == spec)
+    {
+        (void)fprintf(stderr, "str and spec can not be NULL\n");
+        goto end;
+    }
+
+    if (NextItem(&str, item, sizeof(item)) || '\0' != *str)
+        goto invalid;
+
+    dash = strchr(item, '-');
+    if (NULL == dash || 0 == strcmp(item, "-"))
+        goto invalid;
+
+    *dash = '\0';
+    if ('\0' != item[0] && ParseUnsigned(item, UINT16_MAX, &min_len))
+        goto invalid;
+
+    if ('\0' != dash[1] && ParseUnsigned(dash + 1, UINT16_MAX, &max_len))
+        goto invalid;
+
+    if (0 != max_len && max_len < min_len)
+        goto invalid;
+
+    spec->min_len = min_len;
+    spec->max_len = max_len;
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+invalid:
+    (void)fprintf(stderr, "Invalid length range, expected MIN-MAX, MIN- or -MAX\n");
+end:
+    return exit_code;
+}
+
+int BuildFilter(const struct filter_spec* spec, struct filter_prog* prog)
+{
+    int exit_code = EXIT_FAILURE;
+    struct filter_builder* builder = NULL;
+
+    if (NULL == spec || NULL == prog)
+    {
+        (void)fprintf(stderr, "spec and prog can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == spec->port_count || (!spec->ipv4 && !spec->ipv6))
+    {
+        (void)fprintf(stderr, "filter needs at least one port and one address family\n");
+        goto end;
+    }
+
+    // the fixup table is too big for a worker stack
+    builder = calloc(1, sizeof(*builder));
+    if (NULL == builder)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    memset(prog, 0, sizeof(*prog));
+    builder->prog = prog;
+
+    // the cheapest test first, the frame length needs no load from the packet
+    if (spec->min_len || spec->max_len)
+    {
+        Emit(builder, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+    }
+    if (spec->min_len)
+    {
+        EmitExpect(builder, BPF_JGE, spec->min_len, 1, FILTER_LABEL_REJECT);
+    }
+    if (spec->max_len)
+    {
+        EmitExpect(builder, BPF_JGT, spec->max_len, 0, FILTER_LABEL_REJECT);
+    }
+
+    Emit(builder, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFF_ETHERTYPE);
+    if (spec->ipv4)
+    {
+        EmitExpect(builder, BPF_JEQ, ETH_P_IP, 0, FILTER_LABEL_IPV4);
+    }
+    if (spec->ipv6)
+    {
+        EmitExpect(builder, BPF_JEQ, ETH_P_IPV6, 0, FILTER_LABEL_IPV6);
+    }
+    EmitJump(builder, FILTER_LABEL_REJECT);
+
+    if (spec->ipv4)
+    {
+        PlaceLabel(builder, FILTER_LABEL_IPV4);
+
+        // version 4 with a header of at least 20 bytes
+        Emit(builder, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFF_IP4_VHL);
+        EmitExpect(builder, BPF_JGE, 0x45, 1, FILTER_LABEL_REJECT);
+        EmitExpect(builder, BPF_JGT, 0x4f, 0, FILTER_LABEL_REJECT);
+
+        Emit(builder, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFF_IP4_PROTO);
+        EmitExpect(builder, BPF_JEQ, IPPROTO_UDP, 1, FILTER_LABEL_REJECT);
+
+        // fragments can not be rewritten, the first one included, so drop MF or any offset
+        Emit(builder, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFF_IP4_FRAG);
+        EmitExpect(builder, BPF_JSET, 0x3fff, 0, FILTER_LABEL_REJECT);
+
+        Emit(builder, BPF_LDX | BPF_B | BPF_MSH, 0, 0, OFF_IP4_VHL);
+        Emit(builder, BPF_LD | BPF_H | BPF_IND, 0, 0, OFF_IP4_DPORT);
+        EmitPorts(builder, spec);
+        EmitPrefixes(builder, spec, AF_INET, OFF_IP4_SRC);
+
+        Emit(builder, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFF_IP4_LEN);
+        Emit(builder, BPF_ALU | BPF_ADD | BPF_K, 0, 0, ETH_HLEN);
+        EmitAccept(builder);
+    }
+
+    if (spec->ipv6)
+    {
+        PlaceLabel(builder, FILTER_LABEL_IPV6);
+
+        // UDP right after the fixed header, extension headers are not walked
+        Emit(builder, BPF_LD | BPF_B | BPF_ABS, 0, 0, OFF_IP6_NEXT);
+        EmitExpect(builder, BPF_JEQ, IPPROTO_UDP, 1, FILTER_LABEL_REJECT);
+
+        Emit(builder, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFF_IP6_DPORT);
+        EmitPorts(builder, spec);
+        EmitPrefixes(builder, spec, AF_INET6, OFF_IP6_SRC);
+
+        Emit(builder, BPF_LD | BPF_H | BPF_ABS, 0, 0, OFF_IP6_PLEN);
+        Emit(builder, BPF_ALU | BPF_ADD | BPF_K, 0, 0, IP6_HEADERS_LEN);
+        EmitAccept(builder);
+    }
+
+    PlaceLabel(builder, FILTER_LABEL_REJECT);
+    Emit(builder, BPF_RET | BPF_K, 0, 0, 0);
+
+    if (builder->overflow)
+    {
+        (void)fprintf(stderr, "filter needs more than %u instructions\n", FILTER_MAX_INSNS);
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    free(builder);
+end:
+    return exit_code;
+}
+
+int BuildFanoutFilter(const struct port_range* owned_ports, uint32_t workers, int by_source,
+                      struct filter_prog* prog)
+{
+    int exit_code = EXIT_FAILURE;
+    struct filter_builder* builder = NULL;
+
+    if (NULL == prog || 0 == workers)
+    {
+        (void)fprintf(stderr, "prog can not be NULL, workers can not be 0\n");
+        goto end;
+    }
+
+    builder = calloc(1, sizeof(*builder));
+    if (NULL == builder)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    memset(prog, 0, sizeof(*prog));
+    builder->prog = prog;
+
+    // the group runs the program before the link layer header is pushed back, loads start at
+    // the network header and the ethertype is only known from skb->protocol. Anything but IPv4
+    // goes to the first member, its socket filter drops it anyway
+    Emit(builder, BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_PROTOCOL));
+    EmitExpect(builder, BPF_JEQ, ETH_P_IP, 1, FILTER_LABEL_REJECT);
+
+    Emit(builder, BPF_LDX | BPF_B | BPF_MSH, 0, 0, OFF_IP4_VHL - ETH_HLEN);
+
+    // a port in the owned range belongs to member (port - first) % workers
+    if (NULL != owned_ports)
+    {
+        Emit(builder, BPF_LD | BPF_H | BPF_IND, 0, 0, OFF_IP4_DPORT - ETH_HLEN);
+        EmitExpect(builder, BPF_JGE, owned_ports->first, 1, FILTER_LABEL_HASH);
+        EmitExpect(builder, BPF_JGT, owned_ports->last, 0, FILTER_LABEL_HASH);
+        Emit(builder, BPF_ALU | BPF_SUB | BPF_K, 0, 0, owned_ports->first);
+        Emit(builder, BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers);
+        Emit(builder, BPF_RET | BPF_A, 0, 0, 0);
+    }
+
+    // everything else is spread by sender, every datagram of one sender port on one member, or
+    // of one sender address so its rate limit is not multiplied by rotating ports
+    PlaceLabel(builder, FILTER_LABEL_HASH);
+    if (!by_source)
+    {
+        Emit(builder, BPF_LD | BPF_H | BPF_IND, 0, 0, OFF_IP4_SPORT - ETH_HLEN);
+        Emit(builder, BPF_MISC | BPF_TAX, 0, 0, 0);
+    }
+    Emit(builder, BPF_LD | BPF_W | BPF_ABS, 0, 0, OFF_IP4_SRC - ETH_HLEN);
+    if (!by_source)
+    {
+        Emit(builder, BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0);
+    }
+    Emit(builder, BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers);
+    Emit(builder, BPF_RET | BPF_A, 0, 0, 0);
+
+    PlaceLabel(builder, FILTER_LABEL_REJECT);
+    Emit(builder, BPF_RET | BPF_K, 0, 0, 0);
+
+    exit_code = builder->overflow ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    free(builder);
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Copies the next comma separated item of a list and moves past it.
+ *
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the item is empty or too long.
+ */
+static int NextItem(const char** str, char* item, size_t size)
+{
+    const char* comma = strchr(*str, ',');
+    size_t len = NULL == comma ? strlen(*str) : (size_t)(comma - *str);
+
+    if (0 == len || len >= size)
+        return EXIT_FAILURE;
+
+    memcpy(item, *str, len);
+    item[len] = '\0';
+    *str += len + (NULL == comma ? 0 : 1);
+
+    return EXIT_SUCCESS;
+}
+
+static int ParseUnsigned(const char* str, uint32_t max, uint32_t* value)
+{
+    const int base_10 = 10;
+    char* endptr = NULL;
+    unsigned long number = 0;
+
+    if (*str < '0' || *str > '9')
+        return EXIT_FAILURE;
+
+    number = strtoul(str, &endptr, base_10);
+    if ('\0' != *endptr || number > max)
+        return EXIT_FAILURE;
+
+    *value = (uint32_t)number;
+    return EXIT_SUCCESS;
+}
+
+static void Emit(struct filter_builder* builder, uint16_t code, uint8_t jt, uint8_t jf,
+                 uint32_t k)
+{
+    struct filter_prog* prog = builder->prog;
+
+    if (prog->len == FILTER_MAX_INSNS)
+    {
+        builder->overflow = 1;
+        return;
+    }
+
+    prog->insns[prog->len].code = code;
+    prog->insns[prog->len].jt = jt;
+    prog->insns[prog->len].jf = jf;
+    prog->insns[prog->len].k = k;
+    prog->len++;
+}
+
+static void EmitJump(struct filter_builder* builder, enum filter_label label)
+{
+    if (builder->prog->len == FILTER_MAX_INSNS)
+    {
+        builder->overflow = 1;
+        return;
+    }
+
+    builder->fixups[builder->fixup_count] = builder->prog->len;
+    builder->fixup_labels[builder->fixup_count] = label;
+    builder->fixup_count++;
+
+    Emit(builder, BPF_JMP | BPF_JA, 0, 0, 0);
+}
+
+/**
+ * @brief Compares A with k, jumps to label when the result is not the one expected.
+ *
+ * @param op BPF_JEQ, BPF_JGT, BPF_JGE or BPF_JSET.
+ * @param holds 1 to fall through when the comparison is true, 0 when it is false.
+ */
+static void EmitExpect(struct filter_builder* builder, uint16_t op, uint32_t k, int holds,
+                       enum filter_label label)
+{
+    Emit(builder, (uint16_t)(BPF_JMP | op | BPF_K), holds ? 1 : 0, holds ? 0 : 1, k);
+    EmitJump(builder, label);
+}
+
+/**
+ * @brief Points every pending jump to label at the next instruction. Labels are placed once
+ * per use, so the per family labels can be reused by the next family.
+ */
+static void PlaceLabel(struct filter_builder* builder, enum filter_label label)
+{
+    uint32_t index = 0;
+    uint32_t kept = 0;
+    uint16_t target = builder->prog->len;
+
+    for (index = 0; index < builder->fixup_count; ++index)
+    {
+        if (builder->fixup_labels[index] != label)
+        {
+            builder->fixups[kept] = builder->fixups[index];
+            builder->fixup_labels[kept] = builder->fixup_labels[index];
+            kept++;
+            continue;
+        }
+
+        builder->prog->insns[builder->fixups[index]].k =
+            (uint32_t)(target - builder->fixups[index] - 1);
+    }
+
+    builder->fixup_count = kept;
+}
+
+/**
+ * @brief Checks the destination port in A against every range.
+ */
+static void EmitPorts(struct filter_builder* builder, const struct filter_spec* spec)
+{
+    uint32_t index = 0;
+    const struct port_range* range = NULL;
+
+    for (index = 0; index < spec->port_count; ++index)
+    {
+        range = &spec->ports[index];
+
+        if (range->first == range->last)
+        {
+            Emit(builder, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, range->first);
+        }
+        else
+        {
+            // below the range skips to the next one, above it skips the jump to the match
+            Emit(builder, BPF_JMP | BPF_JGE | BPF_K, 0, 2, range->first);
+            Emit(builder, BPF_JMP | BPF_JGT | BPF_K, 1, 0, range->last);
+        }
+        EmitJump(builder, FILTER_LABEL_PORT_OK);
+    }
+
+    EmitJump(builder, FILTER_LABEL_REJECT);
+    PlaceLabel(builder, FILTER_LABEL_PORT_OK);
+}
+
+/**
+ * @brief Checks the source address at offset against the prefixes of one family. Without any
+ * prefixes every source is allowed, with prefixes of the other family only every source is
+ * rejected.
+ */
+static void EmitPrefixes(struct filter_builder* builder, const struct filter_spec* spec,
+                         int family, uint32_t offset)
+{
+    uint32_t index = 0;
+    uint32_t word = 0;
+    uint32_t words = 0;
+    uint32_t size = 0;
+    uint32_t emitted = 0;
+    uint32_t mask = 0;
+    const struct src_prefix* prefix = NULL;
+
+    if (0 == spec->prefix_count)
+        return;
+
+    for (index = 0; index < spec->prefix_count; ++index)
+    {
+        prefix = &spec->prefixes[index];
+        if (prefix->family != family)
+            continue;
+
+        // a load, an and unless the word is whole, and a compare per word, then the jump
+        words = (prefix->len + 31U) / 32U;
+        size = 1;
+        for (word = 0; word < words; ++word)
+        {
+            size += prefix->len >= (word + 1) * 32 ? 2 : 3;
+        }
+
+        emitted = 0;
+        for (word = 0; word < words; ++word)
+        {
+            mask = prefix->len >= (word + 1) * 32 ? UINT32_MAX
+                                                  : UINT32_MAX << ((word + 1) * 32 - prefix->len);
+
+            Emit(builder, BPF_LD | BPF_W | BPF_ABS, 0, 0, offset + word * 4);
+            emitted++;
+            if (UINT32_MAX != mask)
+            {
+                Emit(builder, BPF_ALU | BPF_AND | BPF_K, 0, 0, mask);
+                emitted++;
+            }
+
+            // a mismatch skips the rest of this prefix
+            Emit(builder, BPF_JMP | BPF_JEQ | BPF_K, 0, (uint8_t)(size - emitted - 1),
+                 prefix->addr[word]);
+            emitted++;
+        }
+        EmitJump(builder, FILTER_LABEL_SOURCE_OK);
+    }
+
+    EmitJump(builder, FILTER_LABEL_REJECT);
+    PlaceLabel(builder, FILTER_LABEL_SOURCE_OK);
+}
+
+/**
+ * @brief Returns the capture length in A. It is never capped below the datagram, a forwarder
+ * can not rewrite what it did not copy, frames that are too long are dropped with -l.
+ */
+static void EmitAccept(struct filter_builder* builder)
+{
+    Emit(builder, BPF_RET | BPF_A, 0, 0, 0);
+}
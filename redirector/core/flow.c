@@ -0,0 +1,503 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "flow.h"
+
+// frame offsets, the filter only lets IPv4 UDP through
+#define OFF_IP4_VHL 14U
+#define OFF_IP4_SRC 26U
+#define OFF_IP4_DST 30U
+#define OFF_ETHERTYPE 12U
+#define HEADERS_MIN_LEN 42U  // ethernet, IPv4 without options and UDP
+#define EVICT_MOVES 64U
+
+static uint32_t Tick(uint64_t now_ns);
+static uint32_t HashKey(const struct flow_key* key);
+static uint32_t FindSlot(const struct flow_table* table, const struct flow_key* key,
+                         uint32_t hash);
+static void IndexRemove(struct flow_table* table, uint32_t flow);
+static void WheelInsert(struct flow_table* table, uint32_t flow, uint32_t tick);
+static void WheelRemove(struct flow_table* table, uint32_t flow);
+static void ReleaseFlow(struct flow_table* table, uint32_t flow);
+static void EvictOldest(struct flow_table* table, uint32_t now);
+static int AddHostPrefix(struct filter_spec* spec, uint32_t addr);
+
+int CreateFlowTable(struct flow_table* table, const struct port_range* ports, uint32_t workers,
+                    uint32_t worker, uint32_t timeout)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t port_count = 0;
+    uint32_t slot_count = 16;
+    uint32_t index = 0;
+
+    if (NULL == table || NULL == ports || worker >= workers)
+    {
+        (void)fprintf(stderr, "table and ports can not be NULL, worker must be below workers\n");
+        goto end;
+    }
+
+    memset(table, 0, sizeof(*table));
+
+    port_count = (uint32_t)ports->last - ports->first + 1;
+    if (port_count <= worker)
+    {
+        (void)fprintf(stderr, "Every worker needs at least one reply port\n");
+        goto end;
+    }
+
+    if (0 == timeout || timeout > FLOW_MAX_TIMEOUT)
+    {
+        (void)fprintf(stderr, "Flow timeout must be between 1 and %u seconds\n", FLOW_MAX_TIMEOUT);
+        goto end;
+    }
+
+    table->flow_count = (port_count - worker + workers - 1) / workers;
+    table->flows = aligned_alloc(_Alignof(struct flow), table->flow_count * sizeof(*table->flows));
+    if (NULL == table->flows)
+    {
+        perror("aligned_alloc");
+        goto end;
+    }
+    memset(table->flows, 0, table->flow_count * sizeof(*table->flows));
+
+    // at most half full, so probe sequences stay short and always end
+    while (slot_count < 2 * table->flow_count)
+    {
+        slot_count *= 2;
+    }
+
+    table->slots = calloc(slot_count, sizeof(*table->slots));
+    if (NULL == table->slots)
+    {
+        perror("calloc");
+        goto clean;
+    }
+    table->slot_mask = slot_count - 1;
+
+    for (index = 0; index < slot_count; ++index)
+    {
+        table->slots[index].flow = FLOW_NONE;
+    }
+
+    for (index = 0; index < table->flow_count; ++index)
+    {
+        table->flows[index].nat_port = htons((uint16_t)(ports->first + worker + index * workers));
+        table->flows[index].next = index + 1 < table->flow_count ? index + 1 : FLOW_NONE;
+    }
+
+    for (index = 0; index < FLOW_WHEEL_SLOTS; ++index)
+    {
+        table->wheel[index] = FLOW_NONE;
+    }
+
+    table->free_list = 0;
+    table->tick = Tick(MonotonicNs());
+    table->timeout = timeout;
+    table->first_port = ports->first;
+    table->last_port = ports->last;
+    table->stride = workers;
+    table->offset = worker;
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    DestroyFlowTable(table);
+end:
+    return exit_code;
+}
+
+void DestroyFlowTable(struct flow_table* table)
+{
+    if (NULL == table)
+        return;
+
+    NFREE(table->flows);
+    NFREE(table->slots);
+    table->flow_count = 0;
+    table->active = 0;
+}
+
+int FlowFilterSpec(const struct rule_table* rules, const struct port_range* ports,
+                   struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t index = 0;
+
+    if (NULL == rules || NULL == ports || NULL == spec)
+    {
+        (void)fprintf(stderr, "rules, ports and spec can not be NULL\n");
+        goto end;
+    }
+
+    if (spec->port_count == FILTER_MAX_PORT_RANGES)
+    {
+        (void)fprintf(stderr, "The filter has no room left for the reply ports\n");
+        goto end;
+    }
+    spec->ports[spec->port_count++] = *ports;
+
+    // without prefixes the filter takes every source, replies included
+    for (index = 0; index < rules->rule_count && 0 != spec->prefix_count; ++index)
+    {
+        if (rules->rules[index].rewrite.raw_send &&
+            AddHostPrefix(spec, ntohl(rules->rules[index].rewrite.f_addr.s_addr)))
+        {
+            (void)fprintf(stderr, "The filter has no room left for the reply sources\n");
+            goto end;
+        }
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+enum flow_result FlowTrack(struct flow_table* table, const unsigned char* frame, uint16_t rule,
+                           uint64_t now_ns, struct flow** flow)
+{
+    enum flow_result result = FLOW_CREATED;
+    size_t udp_offset = OFF_IP4_VHL + (size_t)(frame[OFF_IP4_VHL] & 0xFU) * 4;
+    uint32_t hash = 0;
+    uint32_t slot = 0;
+    uint32_t index = 0;
+    struct flow_key key = {0};
+    struct flow* entry = NULL;
+
+    memcpy(&key.client_addr, frame + OFF_IP4_SRC, sizeof(key.client_addr));
+    memcpy(&key.orig_addr, frame + OFF_IP4_DST, sizeof(key.orig_addr));
+    memcpy(&key.client_port, frame + udp_offset, sizeof(key.client_port));
+    memcpy(&key.orig_port, frame + udp_offset + 2, sizeof(key.orig_port));
+
+    hash = HashKey(&key);
+    slot = FindSlot(table, &key, hash);
+    if (FLOW_NONE != table->slots[slot].flow)
+    {
+        entry = &table->flows[table->slots[slot].flow];
+        entry->last_seen_ns = now_ns;
+        entry->forwarded++;
+        *flow = entry;
+        return FLOW_FOUND;
+    }
+
+    if (FLOW_NONE == table->free_list)
+    {
+        EvictOldest(table, Tick(now_ns));
+        // deleting from the index may have shifted the slot we were about to take
+        slot = FindSlot(table, &key, hash);
+        result = FLOW_EVICTED;
+    }
+
+    index = table->free_list;
+    entry = &table->flows[index];
+    table->free_list = entry->next;
+
+    entry->key = key;
+    entry->rule = rule;
+    entry->forwarded = 1;
+    entry->replied = 0;
+    entry->last_seen_ns = now_ns;
+    memcpy(entry->client_mac, frame + ETH_ALEN, ETH_ALEN);
+    memcpy(entry->local_mac, frame, ETH_ALEN);
+    entry->used = 1;
+
+    table->slots[slot].hash = hash;
+    table->slots[slot].flow = index;
+    WheelInsert(table, index, Tick(now_ns) + table->timeout);
+    table->active++;
+
+    *flow = entry;
+    return result;
+}
+
+struct flow* FlowReply(struct flow_table* table, const struct rule_table* rules,
+                       const unsigned char* frame, size_t len, uint64_t now_ns)
+{
+    size_t udp_offset = 0;
+    uint16_t port = 0;
+    uint32_t offset = 0;
+    uint32_t src_addr = 0;
+    uint16_t src_port = 0;
+    struct flow* flow = NULL;
+    const struct rewrite_ctx* rewrite = NULL;
+
+    if (len < HEADERS_MIN_LEN || ETH_P_IP != (frame[OFF_ETHERTYPE] << 8 | frame[OFF_ETHERTYPE + 1]))
+        return NULL;
+
+    udp_offset = OFF_IP4_VHL + (size_t)(frame[OFF_IP4_VHL] & 0xFU) * 4;
+    if (udp_offset + 8 > len)
+        return NULL;
+
+    memcpy(&port, frame + udp_offset + 2, sizeof(port));
+    port = ntohs(port);
+    if (port < table->first_port || port > table->last_port)
+        return NULL;
+
+    // the fanout program sends a port to the worker of its residue, the quotient is the flow
+    offset = (uint32_t)port - table->first_port;
+    if (offset % table->stride != table->offset)
+        return NULL;
+
+    flow = &table->flows[offset / table->stride];
+    if (!flow->used)
+        return NULL;
+
+    // only the address the flow forwards to may answer through it
+    rewrite = &rules->rules[flow->rule].rewrite;
+    memcpy(&src_addr, frame + OFF_IP4_SRC, sizeof(src_addr));
+    memcpy(&src_port, frame + udp_offset, sizeof(src_port));
+    if (src_addr != rewrite->f_addr.s_addr || src_port != rewrite->f_port)
+        return NULL;
+
+    flow->last_seen_ns = now_ns;
+    flow->replied++;
+    return flow;
+}
+
+void FlowRewriteCtx(const struct flow* flow, const struct rule* rule, int reply,
+                    struct rewrite_ctx* ctx)
+{
+    if (reply)
+    {
+        // back the way the datagram came, from where the client sent it to
+        ctx->s_addr.s_addr = flow->key.orig_addr;
+        ctx->f_addr.s_addr = flow->key.client_addr;
+        ctx->s_port = flow->key.orig_port;
+        ctx->f_port = flow->key.client_port;
+    }
+    else
+    {
+        ctx->s_addr = rule->rewrite.s_addr;
+        ctx->f_addr = rule->rewrite.f_addr;
+        ctx->s_port = flow->nat_port;
+        ctx->f_port = rule->rewrite.f_port;
+    }
+
+    SetRewriteSums(ctx);
+}
+
+uint32_t FlowExpire(struct flow_table* table, uint64_t now_ns)
+{
+    uint32_t now = Tick(now_ns);
+    uint32_t expired = 0;
+    uint32_t index = 0;
+    uint32_t next = 0;
+    uint32_t due = 0;
+    struct flow* flow = NULL;
+
+    // a whole turn visits every bucket, anything older is caught by expires <= tick
+    if (now - table->tick >= FLOW_WHEEL_SLOTS)
+    {
+        table->tick = now - FLOW_WHEEL_SLOTS + 1;
+    }
+
+    for (; table->tick <= now; ++table->tick)
+    {
+        for (index = table->wheel[table->tick % FLOW_WHEEL_SLOTS]; FLOW_NONE != index;
+             index = next)
+        {
+            flow = &table->flows[index];
+            next = flow->next;
+
+            if (flow->expires > table->tick)
+                continue;
+
+            // seen since it was filed, it moves on to a bucket the wheel has not reached
+            due = Tick(flow->last_seen_ns) + table->timeout;
+            if (due > now)
+            {
+                WheelRemove(table, index);
+                WheelInsert(table, index, due);
+                continue;
+            }
+
+            ReleaseFlow(table, index);
+            expired++;
+        }
+    }
+
+    return expired;
+}
+
+static uint32_t Tick(uint64_t now_ns)
+{
+    return (uint32_t)(now_ns / NSEC_PER_SEC);
+}
+
+static uint32_t HashKey(const struct flow_key* key)
+{
+    uint64_t addrs = (uint64_t)key->client_addr << 32 | key->orig_addr;
+    uint64_t ports = (uint64_t)key->client_port << 16 | key->orig_port;
+    uint64_t hash = (addrs ^ (ports * 0x9E3779B97F4A7C15ULL)) * 0xC2B2AE3D27D4EB4FULL;
+
+    return (uint32_t)(hash >> 32);
+}
+
+/**
+ * @brief Linear probe for the slot holding key, or the empty slot where it would go.
+ */
+static uint32_t FindSlot(const struct flow_table* table, const struct flow_key* key,
+                         uint32_t hash)
+{
+    uint32_t slot = hash & table->slot_mask;
+    const struct flow_slot* entry = NULL;
+
+    for (;;)
+    {
+        entry = &table->slots[slot];
+        if (FLOW_NONE == entry->flow)
+            return slot;
+
+        if (entry->hash == hash && 0 == memcmp(&table->flows[entry->flow].key, key, sizeof(*key)))
+            return slot;
+
+        slot = (slot + 1) & table->slot_mask;
+    }
+}
+
+/**
+ * @brief Deletes a flow from the index, moving later entries of the probe sequence back into
+ * the hole instead of leaving a tombstone.
+ */
+static void IndexRemove(struct flow_table* table, uint32_t flow)
+{
+    uint32_t hole = FindSlot(table, &table->flows[flow].key, HashKey(&table->flows[flow].key));
+    uint32_t slot = hole;
+    uint32_t home = 0;
+
+    for (;;)
+    {
+        slot = (slot + 1) & table->slot_mask;
+        if (FLOW_NONE == table->slots[slot].flow)
+            break;
+
+        // an entry may only move back if the hole lies between its home slot and itself
+        home = table->slots[slot].hash & table->slot_mask;
+        if (((slot - home) & table->slot_mask) >= ((slot - hole) & table->slot_mask))
+        {
+            table->slots[hole] = table->slots[slot];
+            hole = slot;
+        }
+    }
+
+    table->slots[hole].flow = FLOW_NONE;
+}
+
+static void WheelInsert(struct flow_table* table, uint32_t flow, uint32_t tick)
+{
+    uint32_t* head = &table->wheel[tick % FLOW_WHEEL_SLOTS];
+    struct flow* entry = &table->flows[flow];
+
+    entry->expires = tick;
+    entry->prev = FLOW_NONE;
+    entry->next = *head;
+    if (FLOW_NONE != *head)
+    {
+        table->flows[*head].prev = flow;
+    }
+    *head = flow;
+}
+
+static void WheelRemove(struct flow_table* table, uint32_t flow)
+{
+    struct flow* entry = &table->flows[flow];
+
+    if (FLOW_NONE == entry->prev)
+    {
+        table->wheel[entry->expires % FLOW_WHEEL_SLOTS] = entry->next;
+    }
+    else
+    {
+        table->flows[entry->prev].next = entry->next;
+    }
+
+    if (FLOW_NONE != entry->next)
+    {
+        table->flows[entry->next].prev = entry->prev;
+    }
+}
+
+static void ReleaseFlow(struct flow_table* table, uint32_t flow)
+{
+    IndexRemove(table, flow);
+    WheelRemove(table, flow);
+
+    table->flows[flow].used = 0;
+    table->flows[flow].next = table->free_list;
+    table->free_list = flow;
+    table->active--;
+}
+
+/**
+ * @brief Adds a /32 unless the spec already has it.
+ *
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the spec is full.
+ */
+static int AddHostPrefix(struct filter_spec* spec, uint32_t addr)
+{
+    uint32_t index = 0;
+    struct src_prefix* prefix = NULL;
+
+    for (index = 0; index < spec->prefix_count; ++index)
+    {
+        if (AF_INET == spec->prefixes[index].family && 32 == spec->prefixes[index].len &&
+            addr == spec->prefixes[index].addr[0])
+            return EXIT_SUCCESS;
+    }
+
+    if (spec->prefix_count == FILTER_MAX_PREFIXES)
+        return EXIT_FAILURE;
+
+    prefix = &spec->prefixes[spec->prefix_count++];
+    memset(prefix, 0, sizeof(*prefix));
+    prefix->family = AF_INET;
+    prefix->len = 32;
+    prefix->addr[0] = addr;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Frees the flow that has gone longest without traffic, or close to it. The wheel is
+ * walked from its oldest bucket, flows seen since they were filed are moved on first, but only
+ * so many before the next one is taken regardless.
+ */
+static void EvictOldest(struct flow_table* table, uint32_t now)
+{
+    uint32_t moves = 0;
+    uint32_t bucket = 0;
+    uint32_t index = 0;
+    uint32_t next = 0;
+    uint32_t due = 0;
+    struct flow* flow = NULL;
+
+    for (bucket = 0; bucket < FLOW_WHEEL_SLOTS; ++bucket)
+    {
+        for (index = table->wheel[(table->tick + bucket) % FLOW_WHEEL_SLOTS]; FLOW_NONE != index;
+             index = next)
+        {
+            flow = &table->flows[index];
+            next = flow->next;
+
+            due = Tick(flow->last_seen_ns) + table->timeout;
+            if (due > flow->expires && due > now && moves < EVICT_MOVES)
+            {
+                WheelRemove(table, index);
+                WheelInsert(table, index, due);
+                moves++;
+                continue;
+            }
+
+            ReleaseFlow(table, index);
+            return;
+        }
+    }
+}
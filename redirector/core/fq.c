@@ -0,0 +1,221 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "fq.h"
+
+#define OFF_IP4_VHL 14U
+#define OFF_IP4_SRC 26U
+#define OFF_IP4_DST 30U
+
+static void Activate(struct fair_queue* fq, struct fq_bucket* bucket, int front);
+
+int CreateFairQueue(struct fair_queue* fq, uint32_t node_count, uint32_t flow_limit)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t index = 0;
+
+    if (NULL == fq || 0 == node_count || 0 == flow_limit)
+    {
+        (void)fprintf(stderr, "fq can not be NULL, node_count and flow_limit must be at least 1\n");
+        goto end;
+    }
+
+    memset(fq, 0, sizeof(*fq));
+
+    fq->buckets = calloc(FQ_BUCKETS, sizeof(*fq->buckets));
+    fq->nodes = calloc(node_count, sizeof(*fq->nodes));
+    if (NULL == fq->buckets || NULL == fq->nodes)
+    {
+        perror("calloc");
+        NFREE(fq->buckets);
+        NFREE(fq->nodes);
+        goto end;
+    }
+
+    for (index = 0; index < node_count; ++index)
+    {
+        fq->nodes[index].next = index + 1 < node_count ? &fq->nodes[index + 1] : NULL;
+    }
+    fq->free_list = fq->nodes;
+    fq->flow_limit = flow_limit;
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+void DestroyFairQueue(struct fair_queue* fq, struct buf_pool* pool)
+{
+    struct fq_node* node = NULL;
+
+    if (NULL == fq)
+        return;
+
+    while (NULL != (node = FqDequeue(fq)))
+    {
+        FqRelease(fq, node, pool);
+    }
+
+    NFREE(fq->buckets);
+    NFREE(fq->nodes);
+    fq->free_list = NULL;
+}
+
+uint32_t FqBucket(const unsigned char* frame)
+{
+    size_t udp_offset = OFF_IP4_VHL + (size_t)(frame[OFF_IP4_VHL] & 0xFU) * 4;
+    uint32_t src_addr = 0;
+    uint32_t dst_addr = 0;
+    uint32_t ports = 0;
+    uint64_t hash = 0;
+
+    memcpy(&src_addr, frame + OFF_IP4_SRC, sizeof(src_addr));
+    memcpy(&dst_addr, frame + OFF_IP4_DST, sizeof(dst_addr));
+    memcpy(&ports, frame + udp_offset, sizeof(ports));
+
+    hash = ((uint64_t)src_addr << 32 | dst_addr) ^ ((uint64_t)ports * 0x9E3779B97F4A7C15ULL);
+    hash *= 0xC2B2AE3D27D4EB4FULL;
+
+    return (uint32_t)(hash >> (64U - FQ_BUCKET_BITS));
+}
+
+int FqEnqueue(struct fair_queue* fq, uint32_t bucket, const struct fq_node* entry)
+{
+    struct fq_bucket* queue = &fq->buckets[bucket];
+    struct fq_node* node = fq->free_list;
+
+    if (NULL == node || queue->count >= fq->flow_limit)
+        return EXIT_FAILURE;
+
+    fq->free_list = node->next;
+    *node = *entry;
+    node->next = NULL;
+    node->bucket = bucket;
+    BufRef(node->buf);
+
+    if (NULL == queue->tail)
+    {
+        queue->head = node;
+    }
+    else
+    {
+        queue->tail->next = node;
+    }
+    queue->tail = node;
+    queue->count++;
+    fq->backlog++;
+
+    // a flow that went idle starts its round with a full quantum, behind the busy ones
+    if (!queue->active)
+    {
+        queue->deficit = (int32_t)FQ_QUANTUM;
+        Activate(fq, queue, 0);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+struct fq_node* FqDequeue(struct fair_queue* fq)
+{
+    struct fq_bucket* queue = NULL;
+    struct fq_node* node = NULL;
+
+    while (NULL != (queue = fq->active_head))
+    {
+        // a bucket that spent its quantum goes to the back with the next one
+        if (queue->deficit <= 0)
+        {
+            queue->deficit += (int32_t)FQ_QUANTUM;
+            if (queue != fq->active_tail)
+            {
+                fq->active_head = queue->next_active;
+                queue->next_active = NULL;
+                fq->active_tail->next_active = queue;
+                fq->active_tail = queue;
+            }
+            continue;
+        }
+
+        node = queue->head;
+        queue->head = node->next;
+        queue->count--;
+        queue->deficit -= (int32_t)node->len;
+        fq->backlog--;
+
+        if (NULL == queue->head)
+        {
+            queue->tail = NULL;
+            queue->active = 0;
+            fq->active_head = queue->next_active;
+            if (NULL == fq->active_head)
+            {
+                fq->active_tail = NULL;
+            }
+            queue->next_active = NULL;
+        }
+
+        node->next = NULL;
+        return node;
+    }
+
+    return NULL;
+}
+
+void FqRequeue(struct fair_queue* fq, struct fq_node* node)
+{
+    struct fq_bucket* queue = &fq->buckets[node->bucket];
+
+    node->next = queue->head;
+    queue->head = node;
+    if (NULL == queue->tail)
+    {
+        queue->tail = node;
+    }
+    queue->count++;
+    queue->deficit += (int32_t)node->len;
+    fq->backlog++;
+
+    // it was about to be served, it goes first again
+    if (!queue->active)
+    {
+        Activate(fq, queue, 1);
+    }
+}
+
+void FqRelease(struct fair_queue* fq, struct fq_node* node, struct buf_pool* pool)
+{
+    BufPoolPut(pool, node->buf);
+    node->buf = NULL;
+    node->next = fq->free_list;
+    fq->free_list = node;
+}
+
+/**
+ * @brief Puts a bucket that just got a frame on the active list, at the front or the back.
+ */
+static void Activate(struct fair_queue* fq, struct fq_bucket* bucket, int front)
+{
+    bucket->active = 1;
+    bucket->next_active = NULL;
+
+    if (NULL == fq->active_head)
+    {
+        fq->active_head = bucket;
+        fq->active_tail = bucket;
+    }
+    else if (front)
+    {
+        bucket->next_active = fq->active_head;
+        fq->active_head = bucket;
+    }
+    else
+    {
+        fq->active_tail->next_active = bucket;
+        fq->active_tail = bucket;
+    }
+}
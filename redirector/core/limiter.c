@@ -0,0 +1,148 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "limiter.h"
+
+#define OFF_IP4_SRC 26U
+
+static struct limit_way* FindWay(struct limit_set* set, uint32_t addr);
+static int TakeToken(uint64_t full_ns, uint64_t interval_ns, uint64_t tolerance_ns,
+                     uint64_t now_ns, uint64_t* next_full_ns);
+
+int CreateLimiter(struct limiter* limiter, uint32_t rate, uint32_t burst, uint32_t global_rate)
+{
+    int exit_code = EXIT_FAILURE;
+    uint64_t global_burst = 0;
+
+    if (NULL == limiter || (0 != rate && 0 == burst))
+    {
+        (void)fprintf(stderr, "limiter can not be NULL and a source burst must be at least 1\n");
+        goto end;
+    }
+
+    memset(limiter, 0, sizeof(*limiter));
+
+    if (0 != rate)
+    {
+        limiter->sets =
+            aligned_alloc(_Alignof(struct limit_set), LIMIT_SETS * sizeof(*limiter->sets));
+        if (NULL == limiter->sets)
+        {
+            perror("aligned_alloc");
+            goto end;
+        }
+        memset(limiter->sets, 0, LIMIT_SETS * sizeof(*limiter->sets));
+
+        limiter->interval_ns = NSEC_PER_SEC / rate;
+        limiter->tolerance_ns = (uint64_t)(burst - 1U) * limiter->interval_ns;
+    }
+
+    if (0 != global_rate)
+    {
+        global_burst = global_rate / LIMIT_GLOBAL_BURST_DIV;
+        limiter->global_interval_ns = NSEC_PER_SEC / global_rate;
+        limiter->global_tolerance_ns =
+            (0 == global_burst ? 0 : global_burst - 1U) * limiter->global_interval_ns;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+void DestroyLimiter(struct limiter* limiter)
+{
+    if (NULL == limiter)
+        return;
+
+    NFREE(limiter->sets);
+    limiter->interval_ns = 0;
+    limiter->global_interval_ns = 0;
+}
+
+enum limit_result LimitAdmit(struct limiter* limiter, const unsigned char* frame,
+                             uint64_t now_ns)
+{
+    struct limit_way* way = NULL;
+    uint32_t addr = 0;
+    uint32_t set = 0;
+    uint64_t source_full_ns = 0;
+    uint64_t global_full_ns = 0;
+
+    if (0 != limiter->interval_ns)
+    {
+        memcpy(&addr, frame + OFF_IP4_SRC, sizeof(addr));
+
+        // multiplicative hashing, the top bits of the product pick the set
+        set = (uint32_t)(((uint64_t)addr * 0x9E3779B97F4A7C15ULL) >> (64U - LIMIT_SET_BITS));
+        way = FindWay(&limiter->sets[set], addr);
+        if (TakeToken(way->full_ns, limiter->interval_ns, limiter->tolerance_ns, now_ns,
+                      &source_full_ns))
+            return LIMIT_SOURCE;
+    }
+
+    // checked before the source's token is taken, a capped packet costs its source nothing
+    if (0 != limiter->global_interval_ns)
+    {
+        if (TakeToken(limiter->global_full_ns, limiter->global_interval_ns,
+                      limiter->global_tolerance_ns, now_ns, &global_full_ns))
+            return LIMIT_GLOBAL;
+
+        limiter->global_full_ns = global_full_ns;
+    }
+
+    if (NULL != way)
+    {
+        way->full_ns = source_full_ns;
+    }
+
+    return LIMIT_PASS;
+}
+
+/**
+ * @brief The way holding addr. A source not in the set takes over the way that has been full
+ * the longest, whose bucket then starts out full.
+ */
+static struct limit_way* FindWay(struct limit_set* set, uint32_t addr)
+{
+    uint32_t index = 0;
+    struct limit_way* oldest = &set->ways[0];
+
+    for (index = 0; index < LIMIT_WAYS; ++index)
+    {
+        if (set->ways[index].addr == addr)
+            return &set->ways[index];
+
+        if (set->ways[index].full_ns < oldest->full_ns)
+        {
+            oldest = &set->ways[index];
+        }
+    }
+
+    oldest->addr = addr;
+    oldest->full_ns = 0;
+    return oldest;
+}
+
+/**
+ * @brief GCRA step: a bucket full at full_ns has room for a packet at now_ns unless taking one
+ * would push the time it is full again past now_ns by more than the burst.
+ *
+ * @return int EXIT_SUCCESS with next_full_ns set if a token was available, EXIT_FAILURE if not.
+ */
+static int TakeToken(uint64_t full_ns, uint64_t interval_ns, uint64_t tolerance_ns,
+                     uint64_t now_ns, uint64_t* next_full_ns)
+{
+    uint64_t start_ns = full_ns > now_ns ? full_ns : now_ns;
+
+    if (start_ns - now_ns > tolerance_ns)
+        return EXIT_FAILURE;
+
+    *next_full_ns = start_ns + interval_ns;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "log.h"
+
+static void* LogThread(void* arg);
+static uint32_t DrainRing(struct logger* logger, struct log_ring* ring);
+static void WriteRecord(struct logger* logger, const struct log_record* record);
+static void WriteHex(FILE* out, const char* label, const unsigned char* data, size_t length);
+
+int ParseLogLevel(const char* str, enum log_level* level)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == str || NULL == level)
+    {
+        (void)fprintf(stderr, "str and level can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == strcmp(str, "off"))
+    {
+        *level = LOG_LEVEL_OFF;
+    }
+    else if (0 == strcmp(str, "summary"))
+    {
+        *level = LOG_LEVEL_SUMMARY;
+    }
+    else if (0 == strcmp(str, "hexdump"))
+    {
+        *level = LOG_LEVEL_HEXDUMP;
+    }
+    else
+    {
+        (void)fprintf(stderr, "Invalid log level: %s\n", str);
+        goto end;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int CreateLogger(struct logger* logger, const struct log_config* config, uint32_t ring_count)
+{
+    int exit_code = EXIT_FAILURE;
+    int result = 0;
+    uint32_t index = 0;
+
+    if (NULL == logger || NULL == config)
+    {
+        (void)fprintf(stderr, "logger and config can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == ring_count || 0 == config->sample)
+    {
+        (void)fprintf(stderr, "logger needs at least one ring and a sample rate of at least 1\n");
+        goto end;
+    }
+
+    memset(logger, 0, sizeof(*logger));
+    logger->level = config->level;
+
+    if (LOG_LEVEL_OFF == logger->level)
+    {
+        exit_code = EXIT_SUCCESS;
+        goto end;
+    }
+
+    logger->out = stdout;
+    if (NULL != config->path)
+    {
+        logger->out = fopen(config->path, "a");
+        if (NULL == logger->out)
+        {
+            perror("fopen log file");
+            goto end;
+        }
+    }
+
+    logger->rings = aligned_alloc(_Alignof(struct log_ring), ring_count * sizeof(*logger->rings));
+    if (NULL == logger->rings)
+    {
+        perror("aligned_alloc");
+        goto clean;
+    }
+    memset(logger->rings, 0, ring_count * sizeof(*logger->rings));
+    logger->ring_count = ring_count;
+
+    for (index = 0; index < ring_count; ++index)
+    {
+        logger->rings[index].level = config->level;
+        logger->rings[index].sample = config->sample;
+        logger->rings[index].records =
+            calloc(LOG_RING_SIZE, sizeof(*logger->rings[index].records));
+        if (NULL == logger->rings[index].records)
+        {
+            perror("calloc");
+            goto clean;
+        }
+    }
+
+    logger->start_ns = MonotonicNs();
+    logger->running = 1;
+
+    result = pthread_create(&logger->thread, NULL, LogThread, logger);
+    if (result)
+    {
+        (void)fprintf(stderr, "Could not start log thread: %s\n", strerror(result));
+        goto clean;
+    }
+    logger->started = 1;
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    DestroyLogger(logger);
+
+end:
+    return exit_code;
+}
+
+struct log_ring* LoggerRing(struct logger* logger, uint32_t index)
+{
+    if (NULL == logger || NULL == logger->rings || index >= logger->ring_count)
+        return NULL;
+
+    return &logger->rings[index];
+}
+
+void DestroyLogger(struct logger* logger)
+{
+    uint32_t index = 0;
+    uint64_t dropped = 0;
+
+    if (NULL == logger)
+        return;
+
+    if (logger->started)
+    {
+        __atomic_store_n(&logger->running, 0, __ATOMIC_RELEASE);
+        (void)pthread_join(logger->thread, NULL);
+    }
+
+    for (index = 0; NULL != logger->rings && index < logger->ring_count; ++index)
+    {
+        dropped += logger->rings[index].dropped;
+        NFREE(logger->rings[index].records);
+    }
+    NFREE(logger->rings);
+
+    if (dropped)
+    {
+        (void)fprintf(stderr, "Log rings were full, %llu packets were not logged\n",
+                      (unsigned long long)dropped);
+    }
+
+    if (NULL != logger->out && stdout != logger->out)
+    {
+        (void)fclose(logger->out);
+    }
+
+    memset(logger, 0, sizeof(*logger));
+}
+
+void LogPacket(struct log_ring* ring, const unsigned char* frame, size_t len)
+{
+    uint32_t head = ring->head;
+    size_t limit = LOG_LEVEL_HEXDUMP == ring->level ? LOG_HEXDUMP_BYTES : LOG_SUMMARY_BYTES;
+    struct log_record* record = NULL;
+
+    // pairs with the release in DrainRing, the slot is free once tail moved past it
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->ns = MonotonicNs();
+    record->len = (uint32_t)len;
+    record->captured = (uint32_t)(len < limit ? len : limit);
+    memcpy(record->data, frame, record->captured);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Drains every ring, sleeping in between while they are empty, until told to stop.
+ *
+ * @param arg The logger.
+ * @return void* NULL.
+ */
+static void* LogThread(void* arg)
+{
+    struct logger* logger = arg;
+    const struct timespec interval = {
+        .tv_sec = 0,
+        .tv_nsec = (long)LOG_DRAIN_INTERVAL_MS * 1000000L,
+    };
+    uint32_t index = 0;
+    uint32_t drained = 0;
+    int running = 1;
+
+    while (running)
+    {
+        // read before draining so the last pass still sees everything written before the stop
+        running = __atomic_load_n(&logger->running, __ATOMIC_ACQUIRE);
+
+        drained = 0;
+        for (index = 0; index < logger->ring_count; ++index)
+        {
+            drained += DrainRing(logger, &logger->rings[index]);
+        }
+
+        if (drained)
+        {
+            (void)fflush(logger->out);
+        }
+        else if (running)
+        {
+            (void)nanosleep(&interval, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Writes out and frees every record currently in a ring.
+ *
+ * @return uint32_t number of records written.
+ */
+static uint32_t DrainRing(struct logger* logger, struct log_ring* ring)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t drained = head - tail;
+
+    while (tail != head)
+    {
+        WriteRecord(logger, &ring->records[tail & (LOG_RING_SIZE - 1)]);
+        tail++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    return drained;
+}
+
+/**
+ * @brief Formats one record, a summary line and for hexdump the captured bytes per layer.
+ */
+static void WriteRecord(struct logger* logger, const struct log_record* record)
+{
+    const size_t eth_sz = 14;
+    const size_t udp_sz = sizeof(struct udphdr);
+    const unsigned char* data = record->data;
+    size_t left = record->captured;
+    size_t ip_sz = 0;
+    uint64_t elapsed_ns = record->ns - logger->start_ns;
+    char src[INET_ADDRSTRLEN] = "?";
+    char dst[INET_ADDRSTRLEN] = "?";
+    struct ip ip_header = {0};
+    struct udphdr udp_header = {0};
+
+    // the records hold rewritten ether/ipv4/udp frames, anything shorter is logged as raw bytes
+    if (left >= eth_sz + sizeof(ip_header))
+    {
+        memcpy(&ip_header, data + eth_sz, sizeof(ip_header));
+        ip_sz = (size_t)ip_header.ip_hl * 4;
+        (void)inet_ntop(AF_INET, &ip_header.ip_src, src, sizeof(src));
+        (void)inet_ntop(AF_INET, &ip_header.ip_dst, dst, sizeof(dst));
+    }
+
+    if (0 != ip_sz && left >= eth_sz + ip_sz + udp_sz)
+    {
+        memcpy(&udp_header, data + eth_sz + ip_sz, sizeof(udp_header));
+    }
+
+    (void)fprintf(logger->out, "[%llu.%06llu] SENDING %s:%u --> %s:%u len %u\n",
+                  (unsigned long long)(elapsed_ns / NSEC_PER_SEC),
+                  (unsigned long long)(elapsed_ns % NSEC_PER_SEC / 1000), src,
+                  ntohs(udp_header.source), dst, ntohs(udp_header.dest), record->len);
+
+    if (LOG_LEVEL_HEXDUMP != logger->level)
+        return;
+
+    if (0 == ip_sz || left < eth_sz + ip_sz + udp_sz)
+    {
+        WriteHex(logger->out, "data ", data, left);
+        return;
+    }
+
+    WriteHex(logger->out, "ether", data, eth_sz);
+    WriteHex(logger->out, "ip   ", data + eth_sz, ip_sz);
+    WriteHex(logger->out, "udp  ", data + eth_sz + ip_sz, udp_sz);
+    left -= eth_sz + ip_sz + udp_sz;
+    if (left > 0)
+    {
+        WriteHex(logger->out, "data ", data + eth_sz + ip_sz + udp_sz, left);
+    }
+}
+
+static void WriteHex(FILE* out, const char* label, const unsigned char* data, size_t length)
+{
+    const size_t hex = 16;
+    size_t index = 0;
+
+    for (index = 0; index < length; ++index)
+    {
+        if (index % hex == 0)
+            (void)fprintf(out, "%s  ", label);
+
+        (void)fprintf(out, "%02x ", data[index]);
+
+        if ((index + 1) % hex == 0)
+            (void)fputc('\n', out);
+    }
+
+    if (length % hex != 0)
+        (void)fputc('\n', out);
+}
@@ -0,0 +1,698 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metrics.h"
+
+#define STATS_REQUEST_SIZE 256U
+#define STATS_BASE_SIZE 16384U
+#define STATS_WORKER_SIZE 2048U
+
+static const char* const stage_names[PARSE_STAGE_COUNT] = {"ether", "ip", "udp"};
+
+static const struct
+{
+    const char* name;
+    const char* json;
+    const char* help;
+    size_t offset;
+} histograms[] = {
+    {"redirector_latency_seconds", "latency_ns", "Receive to send latency of forwarded packets.",
+     offsetof(struct worker_metrics, latency)},
+    {"redirector_rx_queue_seconds", "rx_queue_ns",
+     "Kernel receive timestamp to the redirector reading the frame, with -t.",
+     offsetof(struct worker_metrics, rx_queue)},
+    {"redirector_transit_seconds", "transit_ns",
+     "Kernel receive to kernel transmit timestamp of forwarded packets, with -t.",
+     offsetof(struct worker_metrics, transit)},
+};
+
+#define HISTOGRAM_COUNT (sizeof(histograms) / sizeof(*histograms))
+
+// prometheus histogram bounds in nanoseconds, the fine buckets are folded into these
+static const uint64_t latency_bounds_ns[] = {
+    1000,     2000,     5000,      10000,     20000,     50000,     100000,
+    200000,   500000,   1000000,   2000000,   5000000,   10000000,  20000000,
+    50000000, 100000000, 200000000, 500000000, 1000000000,
+};
+
+static uint32_t HistBucket(uint64_t value_ns);
+static uint64_t HistBucketUpper(uint32_t bucket);
+static void MergeLatency(const struct metrics* metrics, size_t offset,
+                         struct latency_hist* merged);
+static uint64_t HistQuantile(const struct latency_hist* hist, double quantile);
+static uint64_t LoadCounter(const uint64_t* counter);
+static int Append(char* buf, size_t size, size_t* used, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+static int FormatPrometheus(const struct metrics* metrics, const struct latency_hist* merged,
+                            char* buf, size_t size, size_t* used);
+static int FormatHistogram(const char* name, const char* help, const struct latency_hist* latency,
+                           char* buf, size_t size, size_t* used);
+static int FormatJson(const struct metrics* metrics, const struct latency_hist* merged,
+                      char* buf, size_t size, size_t* used);
+static int SendAll(int sock, const char* data, size_t len);
+
+int CreateMetrics(struct metrics* metrics, uint32_t worker_count)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == metrics || 0 == worker_count)
+    {
+        (void)fprintf(stderr, "metrics can not be NULL and needs at least one worker\n");
+        goto end;
+    }
+
+    memset(metrics, 0, sizeof(*metrics));
+
+    metrics->workers =
+        aligned_alloc(_Alignof(struct worker_metrics), worker_count * sizeof(*metrics->workers));
+    if (NULL == metrics->workers)
+    {
+        perror("aligned_alloc");
+        goto end;
+    }
+
+    memset(metrics->workers, 0, worker_count * sizeof(*metrics->workers));
+    metrics->worker_count = worker_count;
+    metrics->start_ns = MonotonicNs();
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+void DestroyMetrics(struct metrics* metrics)
+{
+    if (NULL == metrics)
+        return;
+
+    NFREE(metrics->workers);
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+void HistRecord(struct latency_hist* hist, uint64_t value_ns, uint64_t count)
+{
+    MetricAdd(&hist->buckets[HistBucket(value_ns)], count);
+    MetricAdd(&hist->count, count);
+    MetricAdd(&hist->sum_ns, value_ns * count);
+
+    if (value_ns > hist->max_ns)
+    {
+        __atomic_store_n(&hist->max_ns, value_ns, __ATOMIC_RELAXED);
+    }
+}
+
+void LatencyQueue(struct latency_runs* runs, uint64_t rx_ns)
+{
+    // packets of one receive batch share a timestamp and usually a run
+    if (0 != runs->used && (runs->rx_ns[runs->used - 1] == rx_ns || LATENCY_RUNS == runs->used))
+    {
+        runs->count[runs->used - 1]++;
+        return;
+    }
+
+    runs->rx_ns[runs->used] = rx_ns;
+    runs->count[runs->used] = 1;
+    runs->used++;
+}
+
+void LatencyFlush(struct latency_runs* runs, struct latency_hist* hist, uint64_t now_ns)
+{
+    uint32_t index = 0;
+
+    for (index = 0; index < runs->used; ++index)
+    {
+        HistRecord(hist, now_ns - runs->rx_ns[index], runs->count[index]);
+    }
+
+    runs->used = 0;
+}
+
+size_t FormatMetrics(const struct metrics* metrics, enum metrics_format format, char* buf,
+                     size_t size)
+{
+    size_t used = 0;
+    size_t index = 0;
+    int result = EXIT_FAILURE;
+    struct latency_hist* merged = NULL;
+
+    if (NULL == metrics || NULL == buf || 0 == size)
+    {
+        (void)fprintf(stderr, "metrics and buf can not be NULL\n");
+        goto end;
+    }
+
+    // too big for the main thread's stack comfort, and only built once per request
+    merged = calloc(HISTOGRAM_COUNT, sizeof(*merged));
+    if (NULL == merged)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    for (index = 0; index < HISTOGRAM_COUNT; ++index)
+    {
+        MergeLatency(metrics, histograms[index].offset, &merged[index]);
+    }
+
+    if (METRICS_FORMAT_JSON == format)
+    {
+        result = FormatJson(metrics, merged, buf, size, &used);
+    }
+    else
+    {
+        result = FormatPrometheus(metrics, merged, buf, size, &used);
+    }
+
+    if (result)
+    {
+        used = 0;
+    }
+
+end:
+    NFREE(merged);
+    return used;
+}
+
+int CreateStatsSocket(const char* path)
+{
+    int sock = -1;
+    struct sockaddr_un addr = {0};
+    struct stat info = {0};
+
+    if (NULL == path)
+    {
+        (void)fprintf(stderr, "path can not be NULL\n");
+        goto end;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        (void)fprintf(stderr, "stats socket path is too long: %s\n", path);
+        goto end;
+    }
+
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    // a socket left behind by a redirector that did not shut down cleanly
+    if (0 == lstat(path, &info) && S_ISSOCK(info.st_mode))
+    {
+        (void)unlink(path);
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == sock)
+    {
+        perror("socket");
+        goto end;
+    }
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        perror("bind stats socket");
+        goto clean;
+    }
+
+    if (listen(sock, SOMAXCONN))
+    {
+        perror("listen");
+        goto clean;
+    }
+
+    printf("Serving stats on: %s\n", path);
+    goto end;
+
+clean:
+    close(sock);
+    sock = -1;
+
+end:
+    return sock;
+}
+
+int ServeStats(int listen_sock, const struct metrics* metrics)
+{
+    int exit_code = EXIT_FAILURE;
+    int client = -1;
+    int http = 0;
+    ssize_t received = 0;
+    size_t size = 0;
+    size_t body_len = 0;
+    char* body = NULL;
+    char header[128] = {0};
+    char request[STATS_REQUEST_SIZE] = {0};
+    enum metrics_format format = METRICS_FORMAT_PROMETHEUS;
+    // a client that connects and never asks must not stall the main thread
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = 200000};
+
+    if (NULL == metrics)
+    {
+        (void)fprintf(stderr, "metrics can not be NULL\n");
+        goto end;
+    }
+
+    client = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (-1 == client)
+    {
+        if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+        {
+            perror("accept4");
+            goto end;
+        }
+
+        exit_code = EXIT_SUCCESS;
+        goto end;
+    }
+
+    (void)setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    (void)setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    received = recv(client, request, sizeof(request) - 1, 0);
+    if (received < 0)
+    {
+        received = 0;
+    }
+    request[received] = '\0';
+
+    http = 0 == strncmp(request, "GET ", 4);
+    if (0 == strncmp(request, "json", 4) || 0 == strncmp(request, "GET /metrics.json", 17))
+    {
+        format = METRICS_FORMAT_JSON;
+    }
+
+    size = STATS_BASE_SIZE + (size_t)metrics->worker_count * STATS_WORKER_SIZE;
+    body = malloc(size);
+    if (NULL == body)
+    {
+        perror("malloc");
+        goto clean;
+    }
+
+    body_len = FormatMetrics(metrics, format, body, size);
+    if (0 == body_len)
+    {
+        (void)fprintf(stderr, "Could not format metrics\n");
+        goto clean;
+    }
+
+    if (http)
+    {
+        (void)snprintf(header, sizeof(header),
+                       "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+                       METRICS_FORMAT_JSON == format ? "application/json"
+                                                     : "text/plain; version=0.0.4",
+                       body_len);
+        if (SendAll(client, header, strlen(header)))
+        {
+            goto clean;
+        }
+    }
+
+    if (SendAll(client, body, body_len))
+    {
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    NFREE(body);
+    close(client);
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Index of the bucket a value lands in, exact below HIST_SUB_COUNT and log linear above.
+ */
+static uint32_t HistBucket(uint64_t value_ns)
+{
+    uint32_t exponent = 0;
+
+    if (value_ns < HIST_SUB_COUNT)
+        return (uint32_t)value_ns;
+
+    exponent = 63U - (uint32_t)__builtin_clzll(value_ns);
+    if (exponent > HIST_MAX_EXPONENT)
+        return HIST_BUCKETS - 1U;
+
+    return HIST_SUB_COUNT * (exponent - HIST_SUB_BITS + 1U) +
+           (uint32_t)((value_ns >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1U));
+}
+
+/**
+ * @brief Largest value that lands in a bucket.
+ */
+static uint64_t HistBucketUpper(uint32_t bucket)
+{
+    uint32_t exponent = 0;
+    uint64_t sub = 0;
+
+    if (bucket < HIST_SUB_COUNT)
+        return bucket;
+
+    exponent = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1U;
+    sub = bucket % HIST_SUB_COUNT;
+
+    return ((HIST_SUB_COUNT + sub + 1U) << (exponent - HIST_SUB_BITS)) - 1U;
+}
+
+/**
+ * @brief Sums one histogram of every worker, offset is where it sits in worker_metrics.
+ */
+static void MergeLatency(const struct metrics* metrics, size_t offset,
+                         struct latency_hist* merged)
+{
+    uint32_t worker = 0;
+    uint32_t bucket = 0;
+    uint64_t max_ns = 0;
+    const struct latency_hist* hist = NULL;
+
+    for (worker = 0; worker < metrics->worker_count; ++worker)
+    {
+        hist = (const struct latency_hist*)((const char*)&metrics->workers[worker] + offset);
+
+        for (bucket = 0; bucket < HIST_BUCKETS; ++bucket)
+        {
+            merged->buckets[bucket] += LoadCounter(&hist->buckets[bucket]);
+        }
+
+        merged->count += LoadCounter(&hist->count);
+        merged->sum_ns += LoadCounter(&hist->sum_ns);
+        max_ns = LoadCounter(&hist->max_ns);
+        if (max_ns > merged->max_ns)
+        {
+            merged->max_ns = max_ns;
+        }
+    }
+}
+
+/**
+ * @brief Upper bound of the bucket holding the given quantile, capped at the largest sample.
+ */
+static uint64_t HistQuantile(const struct latency_hist* hist, double quantile)
+{
+    uint64_t wanted = 0;
+    uint64_t seen = 0;
+    uint64_t upper = 0;
+    uint32_t bucket = 0;
+
+    if (0 == hist->count)
+        return 0;
+
+    wanted = (uint64_t)(quantile * (double)hist->count + 0.5);
+    if (0 == wanted)
+    {
+        wanted = 1;
+    }
+
+    for (bucket = 0; bucket < HIST_BUCKETS; ++bucket)
+    {
+        seen += hist->buckets[bucket];
+        if (seen >= wanted)
+            break;
+    }
+
+    upper = HistBucketUpper(bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1U);
+
+    return upper < hist->max_ns ? upper : hist->max_ns;
+}
+
+static uint64_t LoadCounter(const uint64_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief snprintf at the end of buf.
+ *
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the output did not fit.
+ */
+static int Append(char* buf, size_t size, size_t* used, const char* format, ...)
+{
+    int written = 0;
+    va_list args;
+
+    va_start(args, format);
+    written = vsnprintf(buf + *used, size - *used, format, args);
+    va_end(args);
+
+    if (written < 0 || (size_t)written >= size - *used)
+        return EXIT_FAILURE;
+
+    *used += (size_t)written;
+    return EXIT_SUCCESS;
+}
+
+static int FormatPrometheus(const struct metrics* metrics, const struct latency_hist* merged,
+                            char* buf, size_t size, size_t* used)
+{
+    const struct
+    {
+        const char* name;
+        const char* help;
+        size_t offset;
+    } counters[] = {
+        {"redirector_rx_packets_total", "Frames received from the filter socket.",
+         offsetof(struct worker_metrics, rx_packets)},
+        {"redirector_truncated_packets_total",
+         "Frames dropped because the capture or buffer missed part of their IP packet.",
+         offsetof(struct worker_metrics, truncated)},
+        {"redirector_unmatched_packets_total",
+         "Frames the filter let through that no rule matched.",
+         offsetof(struct worker_metrics, unmatched)},
+        {"redirector_unresolved_packets_total",
+         "Raw packets dropped while their next hop had no known link layer address.",
+         offsetof(struct worker_metrics, unresolved)},
+        {"redirector_source_limited_packets_total",
+         "Packets dropped because their source sent more than its rate and burst allow.",
+         offsetof(struct worker_metrics, source_limited)},
+        {"redirector_global_limited_packets_total",
+         "Packets dropped because the worker's share of the global rate was used up.",
+         offsetof(struct worker_metrics, global_limited)},
+        {"redirector_forwarded_packets_total", "Packets rewritten and handed to the output.",
+         offsetof(struct worker_metrics, forwarded)},
+        {"redirector_replied_packets_total",
+         "Replies rewritten back to their flow's client, also counted as forwarded.",
+         offsetof(struct worker_metrics, replied)},
+        {"redirector_flows_created_total", "Flows started by a datagram to a raw rule.",
+         offsetof(struct worker_metrics, flows_created)},
+        {"redirector_flows_expired_total", "Flows dropped after their timeout without traffic.",
+         offsetof(struct worker_metrics, flows_expired)},
+        {"redirector_flows_evicted_total", "Flows dropped early to make room in a full table.",
+         offsetof(struct worker_metrics, flows_evicted)},
+        {"redirector_udp_sends_total",
+         "Datagrams handed to the UDP output, a coalesced GSO send counts once.",
+         offsetof(struct worker_metrics, udp_sends)},
+        {"redirector_send_errors_total", "Packets the output failed to send.",
+         offsetof(struct worker_metrics, send_errors)},
+        {"redirector_queue_drops_total",
+         "Packets dropped because their flow's queue or every queue slot was full, with -D.",
+         offsetof(struct worker_metrics, queue_drops)},
+        {"redirector_queue_deferred_total",
+         "Packets put back on their flow's queue because the output had no room, with -D.",
+         offsetof(struct worker_metrics, queue_deferred)},
+        {"redirector_kernel_packets_total", "Frames the kernel matched, from PACKET_STATISTICS.",
+         offsetof(struct worker_metrics, kernel_packets)},
+        {"redirector_kernel_drops_total",
+         "Frames the kernel dropped before the redirector read them, from PACKET_STATISTICS.",
+         offsetof(struct worker_metrics, kernel_drops)},
+    };
+    const double ns_per_sec = (double)NSEC_PER_SEC;
+    size_t counter = 0;
+    size_t index = 0;
+    uint32_t worker = 0;
+    uint32_t stage = 0;
+    const struct worker_metrics* stats = NULL;
+
+    if (Append(buf, size, used,
+               "# HELP redirector_uptime_seconds Seconds since the redirector started.\n"
+               "# TYPE redirector_uptime_seconds gauge\n"
+               "redirector_uptime_seconds %.3f\n",
+               (double)(MonotonicNs() - metrics->start_ns) / ns_per_sec))
+        return EXIT_FAILURE;
+
+    for (counter = 0; counter < sizeof(counters) / sizeof(*counters); ++counter)
+    {
+        if (Append(buf, size, used, "# HELP %s %s\n# TYPE %s counter\n", counters[counter].name,
+                   counters[counter].help, counters[counter].name))
+            return EXIT_FAILURE;
+
+        for (worker = 0; worker < metrics->worker_count; ++worker)
+        {
+            stats = &metrics->workers[worker];
+            if (Append(buf, size, used, "%s{worker=\"%u\"} %llu\n", counters[counter].name,
+                       worker,
+                       (unsigned long long)LoadCounter(
+                           (const uint64_t*)((const char*)stats + counters[counter].offset))))
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (Append(buf, size, used,
+               "# HELP redirector_parse_errors_total Frames dropped because a header did not "
+               "parse.\n# TYPE redirector_parse_errors_total counter\n"))
+        return EXIT_FAILURE;
+
+    for (worker = 0; worker < metrics->worker_count; ++worker)
+    {
+        for (stage = 0; stage < PARSE_STAGE_COUNT; ++stage)
+        {
+            if (Append(buf, size, used,
+                       "redirector_parse_errors_total{worker=\"%u\",stage=\"%s\"} %llu\n", worker,
+                       stage_names[stage],
+                       (unsigned long long)LoadCounter(
+                           &metrics->workers[worker].parse_errors[stage])))
+                return EXIT_FAILURE;
+        }
+    }
+
+    for (index = 0; index < HISTOGRAM_COUNT; ++index)
+    {
+        if (FormatHistogram(histograms[index].name, histograms[index].help, &merged[index], buf,
+                            size, used))
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Appends one merged histogram, its fine buckets folded into the Prometheus bounds.
+ */
+static int FormatHistogram(const char* name, const char* help, const struct latency_hist* latency,
+                           char* buf, size_t size, size_t* used)
+{
+    const double ns_per_sec = (double)NSEC_PER_SEC;
+    uint64_t cumulative = 0;
+    uint32_t bucket = 0;
+    size_t bound = 0;
+
+    if (Append(buf, size, used, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name))
+        return EXIT_FAILURE;
+
+    for (bound = 0; bound < sizeof(latency_bounds_ns) / sizeof(*latency_bounds_ns); ++bound)
+    {
+        for (; bucket < HIST_BUCKETS && HistBucketUpper(bucket) <= latency_bounds_ns[bound];
+             ++bucket)
+        {
+            cumulative += latency->buckets[bucket];
+        }
+
+        if (Append(buf, size, used, "%s_bucket{le=\"%g\"} %llu\n", name,
+                   (double)latency_bounds_ns[bound] / ns_per_sec,
+                   (unsigned long long)cumulative))
+            return EXIT_FAILURE;
+    }
+
+    return Append(buf, size, used,
+                  "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+                  (unsigned long long)latency->count, name, (double)latency->sum_ns / ns_per_sec,
+                  name, (unsigned long long)latency->count);
+}
+
+static int FormatJson(const struct metrics* metrics, const struct latency_hist* merged,
+                      char* buf, size_t size, size_t* used)
+{
+    uint32_t worker = 0;
+    size_t index = 0;
+    const struct latency_hist* latency = NULL;
+    const struct worker_metrics* stats = NULL;
+
+    if (Append(buf, size, used, "{\"uptime_seconds\":%.3f,\"workers\":[",
+               (double)(MonotonicNs() - metrics->start_ns) / (double)NSEC_PER_SEC))
+        return EXIT_FAILURE;
+
+    for (worker = 0; worker < metrics->worker_count; ++worker)
+    {
+        stats = &metrics->workers[worker];
+        if (Append(buf, size, used,
+                   "%s{\"worker\":%u,\"rx_packets\":%llu,\"parse_errors\":{\"ether\":%llu,"
+                   "\"ip\":%llu,\"udp\":%llu},\"truncated\":%llu,\"unmatched\":%llu,"
+                   "\"unresolved\":%llu,"
+                   "\"limited\":{\"source\":%llu,\"global\":%llu},"
+                   "\"forwarded\":%llu,\"replied\":%llu,\"flows\":{\"created\":%llu,"
+                   "\"expired\":%llu,\"evicted\":%llu},\"udp_sends\":%llu,\"send_errors\":%llu,"
+                   "\"queue\":{\"drops\":%llu,\"deferred\":%llu},"
+                   "\"kernel_packets\":%llu,\"kernel_drops\":%llu}",
+                   0 == worker ? "" : ",", worker,
+                   (unsigned long long)LoadCounter(&stats->rx_packets),
+                   (unsigned long long)LoadCounter(&stats->parse_errors[PARSE_STAGE_ETHER]),
+                   (unsigned long long)LoadCounter(&stats->parse_errors[PARSE_STAGE_IP]),
+                   (unsigned long long)LoadCounter(&stats->parse_errors[PARSE_STAGE_UDP]),
+                   (unsigned long long)LoadCounter(&stats->truncated),
+                   (unsigned long long)LoadCounter(&stats->unmatched),
+                   (unsigned long long)LoadCounter(&stats->unresolved),
+                   (unsigned long long)LoadCounter(&stats->source_limited),
+                   (unsigned long long)LoadCounter(&stats->global_limited),
+                   (unsigned long long)LoadCounter(&stats->forwarded),
+                   (unsigned long long)LoadCounter(&stats->replied),
+                   (unsigned long long)LoadCounter(&stats->flows_created),
+                   (unsigned long long)LoadCounter(&stats->flows_expired),
+                   (unsigned long long)LoadCounter(&stats->flows_evicted),
+                   (unsigned long long)LoadCounter(&stats->udp_sends),
+                   (unsigned long long)LoadCounter(&stats->send_errors),
+                   (unsigned long long)LoadCounter(&stats->queue_drops),
+                   (unsigned long long)LoadCounter(&stats->queue_deferred),
+                   (unsigned long long)LoadCounter(&stats->kernel_packets),
+                   (unsigned long long)LoadCounter(&stats->kernel_drops)))
+            return EXIT_FAILURE;
+    }
+
+    if (Append(buf, size, used, "]"))
+        return EXIT_FAILURE;
+
+    for (index = 0; index < HISTOGRAM_COUNT; ++index)
+    {
+        latency = &merged[index];
+        if (Append(buf, size, used,
+                   ",\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,"
+                   "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+                   histograms[index].json, (unsigned long long)latency->count,
+                   (unsigned long long)(latency->count ? latency->sum_ns / latency->count : 0),
+                   (unsigned long long)HistQuantile(latency, 0.5),
+                   (unsigned long long)HistQuantile(latency, 0.9),
+                   (unsigned long long)HistQuantile(latency, 0.99),
+                   (unsigned long long)HistQuantile(latency, 0.999),
+                   (unsigned long long)latency->max_ns))
+            return EXIT_FAILURE;
+    }
+
+    return Append(buf, size, used, "}\n");
+}
+
+static int SendAll(int sock, const char* data, size_t len)
+{
+    ssize_t sent = 0;
+
+    while (len > 0)
+    {
+        sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (EINTR == errno)
+                continue;
+
+            perror("send stats");
+            return EXIT_FAILURE;
+        }
+
+        data += sent;
+        len -= (size_t)sent;
+    }
+
+    return EXIT_SUCCESS;
+}
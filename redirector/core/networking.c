@@ -1,13 +1,12 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <features.h>
-#include <ifaddrs.h>
 #include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
 #include <net/ethernet.h>
 #include <net/if.h>
-#include <netinet/ip.h>
-#include <netinet/udp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,104 +15,57 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "batch.h"
 #include "common.h"
 #include "networking.h"
-#include "rawparser.h"
+#include "pool.h"
 
-int GetInterface(const char* address, char** interface)
+#ifndef PACKET_FANOUT_FLAG_IGNORE_OUTGOING
+#define PACKET_FANOUT_FLAG_IGNORE_OUTGOING 0x4000
+#endif
+
+int GetRawDevice(const char* interface, struct sockaddr_ll* device)
 {
     int exit_code = EXIT_FAILURE;
+    unsigned int interface_index = 0;
 
-    unsigned int if_index = 0;
-    char* temp = NULL;
-    struct ifaddrs* ifaddr = NULL;
-    struct ifaddrs* ifa = NULL;
-    int found = 0;
-
-    if (NULL == address)
-    {
-        (void)fprintf(stderr, "address can not be NULL\n");
-        goto end;
-    }
-
-    if (NULL == interface || NULL != *interface)
-    {
-        (void)fprintf(stderr, "interface must be a NULL double pointer\n");
-        goto end;
-    }
-
-    if (getifaddrs(&ifaddr) == -1)
-    {
-        perror("getifaddrs");
-        goto end;
-    }
-
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
-    {
-        if (ifa->ifa_addr == NULL)
-            continue;
-        if (ifa->ifa_addr->sa_family == AF_INET)
-        {
-            char host[INET_ADDRSTRLEN];
-            if (inet_ntop(AF_INET, &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr, host,
-                          sizeof(host)))
-            {
-                if (strcmp(host, address) == 0)
-                {
-                    if_index = if_nametoindex(ifa->ifa_name);
-                    found = 1;
-                    break;
-                }
-            }
-        }
-    }
-
-    freeifaddrs(ifaddr);
-
-    if (!found || 0 == if_index)
+    if (NULL == interface || NULL == device)
     {
-        (void)fprintf(stderr, "Could not get interface index for address: %s\n", address);
+        (void)fprintf(stderr, "interface and device can not be NULL\n");
         goto end;
     }
 
-    temp = calloc(IF_NAMESIZE, sizeof(*temp));
-    if (NULL == temp)
+    interface_index = if_nametoindex(interface);
+    if (0 == interface_index)
     {
-        perror("calloc");
+        (void)fprintf(stderr, "Could not get interface index for: %s\n", interface);
         goto end;
     }
 
-    if (NULL == if_indextoname(if_index, temp))
-    {
-        (void)fprintf(stderr, "Could not get interface name for address: %s\n", address);
-        goto clean;
-    }
+    memset(device, 0, sizeof(*device));
+    device->sll_family = AF_PACKET;
+    device->sll_protocol = htons(ETH_P_ALL);
+    device->sll_ifindex = (int)interface_index;
 
-    *interface = temp;
     exit_code = EXIT_SUCCESS;
-    goto end;
-
-clean:
-    NFREE(temp);
 
 end:
     return exit_code;
 }
 
-int SendRawSocket(int sock, size_t packet_len, const unsigned char* packet, const char* interface)
+int SendRawSocket(int sock, size_t packet_len, const unsigned char* packet,
+                  const struct sockaddr_ll* device)
 {
     int exit_code = EXIT_FAILURE;
-    struct sockaddr_ll device = {0};
-    unsigned int interface_index = 0;
 
     if (NULL == packet)
     {
         (void)fprintf(stderr, "packet can not be NULL\n");
         goto end;
     }
-    if (NULL == interface)
+    if (NULL == device)
     {
-        (void)fprintf(stderr, "interface can not be NULL\n");
+        (void)fprintf(stderr, "device can not be NULL\n");
         goto end;
     }
     if (packet_len <= 0)
@@ -127,42 +79,142 @@ int SendRawSocket(int sock, size_t packet_len, const unsigned char* packet, cons
         goto end;
     }
 
-    interface_index = if_nametoindex(interface);
-    if (0 == interface_index)
-    {
-        (void)fprintf(stderr, "Could not get interface index for: %s\n", interface);
+    if (-1 == sendto(sock, packet, packet_len, 0, (const struct sockaddr*)device, sizeof(*device)))
         goto end;
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+
+    return exit_code;
+}
+
+int EnableVnetHdr(int sock)
+{
+    const int enabled = 1;
+
+    if (setsockopt(sock, SOL_PACKET, PACKET_VNET_HDR, &enabled, sizeof(enabled)))
+    {
+        perror("setsockopt PACKET_VNET_HDR");
+        return EXIT_FAILURE;
     }
 
-    device.sll_family = AF_PACKET;
-    device.sll_protocol = htons(ETH_P_ALL);
-    device.sll_ifindex = (int)interface_index;
+    return EXIT_SUCCESS;
+}
 
-    if (-1 == sendto(sock, packet, packet_len, 0, (struct sockaddr*)&device, sizeof(device)))
+int SendRawVnet(int sock, const struct virtio_net_hdr* vnet, size_t packet_len,
+                const unsigned char* packet, const struct sockaddr_ll* device)
+{
+    int exit_code = EXIT_FAILURE;
+    struct iovec iovs[2];
+    struct msghdr msg = {0};
+
+    if (NULL == vnet || NULL == packet || NULL == device)
     {
-        perror("sendto failed");
+        (void)fprintf(stderr, "vnet, packet and device can not be NULL\n");
+        goto end;
     }
 
+    // the kernel reads the header and the frame as one stream, they need not be adjacent
+    iovs[0].iov_base = (void*)vnet;
+    iovs[0].iov_len = VNET_HDR_LEN;
+    iovs[1].iov_base = (void*)packet;
+    iovs[1].iov_len = packet_len;
+    msg.msg_name = (void*)device;
+    msg.msg_namelen = sizeof(*device);
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = 2;
+
+    if (-1 == sendmsg(sock, &msg, 0))
+        goto end;
+
     exit_code = EXIT_SUCCESS;
 
 end:
-
     return exit_code;
 }
 
-int CreateRawFilterSocket(struct sock_fprog* bpf)
+int EnableTimestamping(int sock, int rx)
+{
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (rx)
+    {
+        flags |= SOF_TIMESTAMPING_RX_SOFTWARE;
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
+    {
+        perror("setsockopt SO_TIMESTAMPING");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void ReadRecvControl(const struct msghdr* msg, struct pkt_buf* buf)
+{
+    struct cmsghdr* cmsg = NULL;
+    struct scm_timestamping stamps;
+
+    buf->status = 0;
+    buf->rx_stamp = 0;
+    for (cmsg = CMSG_FIRSTHDR(msg); NULL != cmsg; cmsg = CMSG_NXTHDR((struct msghdr*)msg, cmsg))
+    {
+        if (SOL_PACKET == cmsg->cmsg_level && PACKET_AUXDATA == cmsg->cmsg_type)
+        {
+            buf->status = ((struct tpacket_auxdata*)CMSG_DATA(cmsg))->tp_status;
+        }
+        else if (SOL_SOCKET == cmsg->cmsg_level && SCM_TIMESTAMPING == cmsg->cmsg_type)
+        {
+            // software stamps sit in the first slot, the others are for hardware
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            buf->rx_stamp =
+                (uint64_t)stamps.ts[0].tv_sec * NSEC_PER_SEC + (uint64_t)stamps.ts[0].tv_nsec;
+        }
+    }
+}
+
+int EnableBusyPoll(int sock, uint32_t usec, uint32_t budget)
+{
+    const int prefer = 1;
+    int value = (int)usec;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)))
+    {
+        perror("setsockopt SO_BUSY_POLL");
+        return EXIT_FAILURE;
+    }
+
+    // both only exist since 5.11, busy polling works without them
+    if (setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)))
+    {
+        perror("setsockopt SO_PREFER_BUSY_POLL");
+    }
+
+    value = (int)budget;
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &value, sizeof(value)))
+    {
+        perror("setsockopt SO_BUSY_POLL_BUDGET");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int CreateRawFilterSocket(const struct sock_fprog* bpf)
 {
     int sock = -1;
+    const int enabled = 1;
 
-    const int recv_timeout = 10;
-    struct timeval time_val = {.tv_sec = recv_timeout, .tv_usec = 0};
     if (NULL == bpf)
     {
         (void)fprintf(stderr, "bpf can not be NULL\n");
         goto end;
     }
 
-    sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    // non blocking, the forwarding engine waits for readiness in epoll and drains until EAGAIN
+    sock = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_ALL));
 
     if (-1 == sock)
     {
@@ -177,9 +229,18 @@ int CreateRawFilterSocket(struct sock_fprog* bpf)
         goto clean;
     }
 
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&time_val, sizeof(time_val)))
+    if (setsockopt(sock, SOL_PACKET, PACKET_AUXDATA, &enabled, sizeof(enabled)))
     {
-        (void)fprintf(stderr, "Could not set receive timeout\n");
+        perror("setsockopt failed");
+        (void)fprintf(stderr, "Could not enable packet auxdata\n");
+        goto clean;
+    }
+
+    // raw send mode transmits on this socket, dont capture our own rewritten frames
+    if (setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &enabled, sizeof(enabled)))
+    {
+        perror("setsockopt failed");
+        (void)fprintf(stderr, "Could not ignore outgoing packets\n");
         goto clean;
     }
 
@@ -192,166 +253,199 @@ end:
     return sock;
 }
 
-ssize_t RecvAndModifyPacket(int sock, uint16_t f_port, uint16_t s_port,
-                            unsigned char** data_section, char* f_addr, char* s_addr,
-                            unsigned char** packet)
+int JoinFanoutGroup(int sock, uint16_t group_id, struct sock_fprog* steer)
 {
-    ssize_t exit_code = -1;
-    ssize_t bytes_parsed = -1;
-    ssize_t bytes_recv = -1;
-    ssize_t pointer = 0;
-
-    (void)f_port;
+    int exit_code = EXIT_FAILURE;
+    // hash on the flow so every datagram of a conversation lands on the same worker, defrag so
+    // fragments of one datagram are not spread out
+    int mode = NULL == steer ? PACKET_FANOUT_HASH : PACKET_FANOUT_CBPF;
+    int fanout = (int)group_id | ((mode | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    // the group has its own hook, PACKET_IGNORE_OUTGOING on the member sockets does not apply
+    int ignore_outgoing = PACKET_FANOUT_FLAG_IGNORE_OUTGOING << 16;
 
-    unsigned char* temp_packet = NULL;
-    unsigned char* temp = NULL;
+    if (sock < 0)
+    {
+        (void)fprintf(stderr, "sock must be a valid socket\n");
+        goto end;
+    }
 
-    struct ip* ip_ptr = NULL;
+    if (setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &(int){fanout | ignore_outgoing},
+                   sizeof(fanout)))
+    {
+        // kernels before 6.5 do not know the flag, the group then also sees our own sends
+        if (EINVAL != errno ||
+            setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)))
+        {
+            perror("setsockopt PACKET_FANOUT");
+            goto end;
+        }
 
-    const char label[] = "data ";
+        (void)fprintf(stderr, "Fanout group can not ignore outgoing packets on this kernel\n");
+    }
 
-    if (NULL == f_addr)
+    // the program belongs to the group, every member setting the same one is harmless
+    if (NULL != steer && setsockopt(sock, SOL_PACKET, PACKET_FANOUT_DATA, steer, sizeof(*steer)))
     {
-        (void)fprintf(stderr, "f_addr can not be NULL\n");
+        perror("setsockopt PACKET_FANOUT_DATA");
         goto end;
     }
 
-    if (NULL == s_addr)
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int GetPacketStats(int sock, uint64_t* packets, uint64_t* drops)
+{
+    int exit_code = EXIT_FAILURE;
+    union tpacket_stats_u stats = {0};
+    socklen_t len = sizeof(stats);
+
+    if (NULL == packets || NULL == drops)
     {
-        (void)fprintf(stderr, "s_addr can not be NULL\n");
+        (void)fprintf(stderr, "packets and drops can not be NULL\n");
         goto end;
     }
 
-    if (NULL == packet || NULL != *packet)
+    // the V1/V2 and V3 layouts share packets and drops, and the kernel clears both on read
+    if (getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &stats, &len))
     {
-        (void)fprintf(stderr, "packet must be a NULL double pointer\n");
+        perror("getsockopt PACKET_STATISTICS");
         goto end;
     }
 
-    // hate doing this, but i run into many issues doing partial recvs with raw socket bpf, so
-    // while I would prefer to recv ether size -> parse ether -> recv ip size etc, I cant
-    temp_packet = calloc(UINT16_MAX, sizeof(*temp_packet));
+    *packets = stats.stats1.tp_packets;
+    *drops = stats.stats1.tp_drops;
+    exit_code = EXIT_SUCCESS;
 
-    if (NULL == temp_packet)
-    {
-        perror("calloc");
+end:
+    return exit_code;
+}
+
+int RecvPacketBatch(int sock, struct buf_pool* pool, struct pkt_buf** bufs, unsigned int max,
+                    uint64_t* truncated)
+{
+    int received = -1;
+    int count = 0;
+    int index = 0;
+    unsigned int wanted = 0;
+    struct mmsghdr msgs[BATCH_MAX_SIZE];
+    struct iovec iovs[BATCH_MAX_SIZE];
+    // PACKET_AUXDATA tells frames whose UDP checksum the kernel left unfinished apart
+    union
+    {
+        char buf[RECV_CONTROL_LEN];
+        size_t align;
+    } controls[BATCH_MAX_SIZE];
+
+    if (NULL == pool || NULL == bufs || NULL == truncated)
+    {
+        (void)fprintf(stderr, "pool, bufs and truncated can not be NULL\n");
         goto end;
     }
 
-    bytes_recv = recv(sock, temp_packet, UINT16_MAX, 0);
-
-    if (bytes_recv < 0)
+    if (max > BATCH_MAX_SIZE)
     {
-        (void)fprintf(stderr, "Failed to receive data on raw_sock\n");
-        goto clean;
+        max = BATCH_MAX_SIZE;
     }
 
-    temp = realloc(temp_packet, (size_t)bytes_recv * sizeof(*temp_packet));
-
-    // dont actually fail out from realloc, it doesnt change any logic, i just prefer to not be
-    // a memory hog
-    if (NULL != temp)
+    for (wanted = 0; wanted < max; ++wanted)
     {
-        temp_packet = temp;
+        bufs[wanted] = BufPoolGet(pool);
+        if (NULL == bufs[wanted])
+            break;
+
+        iovs[wanted].iov_base = bufs[wanted]->data;
+        iovs[wanted].iov_len = pool->buf_size;
+        memset(&msgs[wanted], 0, sizeof(msgs[wanted]));
+        msgs[wanted].msg_hdr.msg_iov = &iovs[wanted];
+        msgs[wanted].msg_hdr.msg_iovlen = 1;
+        msgs[wanted].msg_hdr.msg_control = controls[wanted].buf;
+        msgs[wanted].msg_hdr.msg_controllen = sizeof(controls[wanted].buf);
     }
 
-    // so because we had to unfortunately do one big recv, were going to have to parse the
-    // header by tracking bytes left + pointer arithmetic
+    // every buffer is queued for output, the socket keeps the frames until some come back
+    if (0 == wanted)
+        goto end;
 
-    bytes_parsed = ParseEther(temp_packet, bytes_recv);
+    // MSG_TRUNC makes packet sockets report the real frame length even if it did not fit
+    count = recvmmsg(sock, msgs, wanted, MSG_DONTWAIT | MSG_TRUNC, NULL);
 
-    if (-1 == bytes_parsed)
+    if (count < 0)
     {
-        (void)fprintf(stderr, "Could not parse ether header\n");
-        goto clean;
+        if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+        {
+            // nothing left to drain, not an error
+            received = 0;
+        }
+        else
+        {
+            perror("recvmmsg");
+        }
+        count = 0;
     }
-
-    pointer = pointer + bytes_parsed;
-    bytes_recv = bytes_recv - bytes_parsed;
-
-    bytes_parsed = ParseIp(temp_packet + pointer, bytes_recv, f_addr, s_addr);
-
-    if (-1 == bytes_parsed)
+    else
     {
-        (void)fprintf(stderr, "Could not parse ip header\n");
-        goto clean;
+        received = 0;
     }
 
-    ip_ptr = (struct ip*)(temp_packet + pointer);
-
-    pointer = pointer + bytes_parsed;
-    bytes_recv = bytes_recv - bytes_parsed;
-
-    bytes_parsed = ParseUdp(temp_packet + pointer, bytes_recv, f_port, s_port, ip_ptr);
-
-    if (-1 == bytes_parsed)
+    for (index = 0; index < count; ++index)
     {
-        (void)fprintf(stderr, "Could not parse ip header\n");
-        goto clean;
-    }
+        if (msgs[index].msg_len > pool->buf_size)
+        {
+            (*truncated)++;
+            BufPoolPut(pool, bufs[index]);
+            continue;
+        }
 
-    pointer = pointer + bytes_parsed;
-    bytes_recv = bytes_recv - bytes_parsed;
+        bufs[index]->len = msgs[index].msg_len;
+        ReadRecvControl(&msgs[index].msg_hdr, bufs[index]);
 
-    if (bytes_recv > 0)
-    {
-        PrintHex(label, temp_packet + pointer, (size_t)bytes_recv);
+        bufs[received++] = bufs[index];
     }
 
-    if (NULL != data_section)
+    // hand back whatever recvmmsg did not fill
+    for (index = count; index < (int)wanted; ++index)
     {
-        *data_section = temp_packet + pointer;
+        BufPoolPut(pool, bufs[index]);
     }
 
-    exit_code = pointer + bytes_recv;
-    *packet = temp_packet;
-
-    goto end;
-
-clean:
-    NFREE(temp_packet);
 end:
-    return exit_code;
+    return received;
 }
 
-int SendUDP(unsigned char* packet, size_t packet_len, int sock, struct sockaddr_in* addr)
+int SendUDPBatch(struct mmsghdr* msgs, unsigned int count, int sock)
 {
-    int exit_code = EXIT_FAILURE;
+    int sent = 0;
+    int result = 0;
+    unsigned int offset = 0;
 
-    if (NULL == packet)
+    if (NULL == msgs)
     {
-        (void)fprintf(stderr, "packet can not be NULL\n");
+        (void)fprintf(stderr, "msgs can not be NULL\n");
         goto end;
     }
 
-    if (packet_len <= 0)
+    while (offset < count)
     {
-        (void)fprintf(stderr, "packet_len must be greater than 0\n");
-        goto end;
-    }
+        result = sendmmsg(sock, msgs + offset, count - offset, 0);
 
-    if (sendto(sock, packet, packet_len, 0, (struct sockaddr*)addr, sizeof(struct sockaddr)) < 0)
-    {
-        perror("sendto failed");
-        goto end;
-    }
-
-    exit_code = EXIT_SUCCESS;
-
-end:
-    return exit_code;
-}
+        if (result < 0)
+        {
+            if (EINTR == errno)
+                continue;
 
-int CreateUdpSocket()
-{
-    int sock = -1;
+            // the first message in this window failed, drop it and carry on with the rest, the
+            // caller counts it
+            offset++;
+            continue;
+        }
 
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0)
-    {
-        perror("Could not create UDP socket");
-        return -1;
+        sent += result;
+        offset += (unsigned int)result;
     }
 
-    return sock;
+end:
+    return sent;
 }
\ No newline at end of file
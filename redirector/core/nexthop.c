@@ -0,0 +1,616 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nexthop.h"
+#include "xdp.h"
+
+#define NL_REQUEST_SIZE 128U
+#define NL_REPLY_SIZE 4096U
+#define NL_EVENT_RCVBUF (1 << 20)
+
+// a neighbour entry whose address can be used, and one that needs no confirming either
+#define NUD_USABLE (NUD_REACHABLE | NUD_PERMANENT | NUD_NOARP | NUD_STALE | NUD_DELAY | NUD_PROBE)
+#define NUD_SETTLED (NUD_REACHABLE | NUD_PERMANENT | NUD_NOARP)
+
+/**
+ * A request to the kernel, header, family specific message and attributes back to back.
+ */
+struct nl_request
+{
+    struct nlmsghdr header;
+    unsigned char payload[NL_REQUEST_SIZE];
+};
+
+static int OpenRouteSocket(uint32_t groups, int flags);
+static void InitRequest(struct nl_request* request, uint16_t type, uint16_t flags,
+                        const void* msg, size_t len);
+static void AddAttr(struct nl_request* request, uint16_t type, const void* data, size_t len);
+static int Query(int sock, uint32_t seq, struct nl_request* request, unsigned char* reply);
+static void ParseAttrs(struct rtattr* attr, int len, struct rtattr** attrs, uint16_t max);
+static int GetLinkAddress(struct nexthop_cache* cache, int if_index, uint8_t* mac);
+static void GetNeighbour(struct nexthop_cache* cache, struct nexthop_route* route);
+static int KickNeighbour(struct nexthop_cache* cache, const struct nexthop_route* route);
+static void ResolveHop(struct nexthop_cache* cache, uint32_t index);
+static void PublishHop(struct nexthop_cache* cache, uint32_t index);
+static void ApplyNeighbour(struct nexthop_cache* cache, const struct nlmsghdr* msg);
+static void PrintHop(const struct nexthop_cache* cache, const struct rule_table* rules,
+                     uint32_t index);
+
+int CreateNexthopCache(struct nexthop_cache* cache, const struct rule_table* rules,
+                       const struct xdp_path* xdp)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t index = 0;
+    const struct rewrite_ctx* rewrite = NULL;
+
+    if (NULL == cache || NULL == rules)
+    {
+        (void)fprintf(stderr, "cache and rules can not be NULL\n");
+        goto end;
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    cache->event_sock = -1;
+    cache->query_sock = -1;
+    cache->hop_count = rules->rule_count;
+    cache->xdp = xdp;
+
+    cache->hops = calloc(cache->hop_count, sizeof(*cache->hops));
+    cache->routes = calloc(cache->hop_count, sizeof(*cache->routes));
+    cache->buf = malloc(NEXTHOP_BUF_SIZE);
+    if (NULL == cache->hops || NULL == cache->routes || NULL == cache->buf)
+    {
+        perror("calloc");
+        goto clean;
+    }
+
+    // subscribed before the first lookups, a change racing with them is still seen
+    cache->event_sock = OpenRouteSocket(RTMGRP_LINK | RTMGRP_NEIGH | RTMGRP_IPV4_IFADDR |
+                                            RTMGRP_IPV4_ROUTE,
+                                        SOCK_NONBLOCK);
+    cache->query_sock = OpenRouteSocket(0, 0);
+    if (-1 == cache->event_sock || -1 == cache->query_sock)
+    {
+        (void)fprintf(stderr, "Could not open netlink sockets\n");
+        goto clean;
+    }
+
+    for (index = 0; index < cache->hop_count; ++index)
+    {
+        rewrite = &rules->rules[index].rewrite;
+        if (!rewrite->raw_send)
+            continue;
+
+        cache->routes[index].f_addr = rewrite->f_addr;
+        cache->routes[index].s_addr = rewrite->s_addr;
+        cache->routes[index].if_index = rewrite->if_index;
+        ResolveHop(cache, index);
+        PrintHop(cache, rules, index);
+    }
+
+    if (UpdateNexthopCache(cache, MonotonicNs()))
+    {
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    DestroyNexthopCache(cache);
+end:
+    return exit_code;
+}
+
+void DestroyNexthopCache(struct nexthop_cache* cache)
+{
+    if (NULL == cache)
+        return;
+
+    if (-1 != cache->event_sock)
+        close(cache->event_sock);
+    if (-1 != cache->query_sock)
+        close(cache->query_sock);
+    cache->event_sock = -1;
+    cache->query_sock = -1;
+
+    NFREE(cache->hops);
+    NFREE(cache->routes);
+    NFREE(cache->buf);
+    cache->hop_count = 0;
+}
+
+int UpdateNexthopCache(struct nexthop_cache* cache, uint64_t now_ns)
+{
+    int exit_code = EXIT_FAILURE;
+    int resync = 0;
+    uint32_t index = 0;
+    ssize_t received = 0;
+    size_t len = 0;
+    struct nlmsghdr* msg = NULL;
+    struct nexthop_route* route = NULL;
+
+    for (;;)
+    {
+        received = recv(cache->event_sock, cache->buf, NEXTHOP_BUF_SIZE, 0);
+        if (-1 == received)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+
+            // notifications were lost, whatever they said is looked up again
+            if (ENOBUFS == errno)
+            {
+                resync = 1;
+                continue;
+            }
+
+            perror("recv netlink");
+            goto end;
+        }
+
+        len = (size_t)received;
+        for (msg = (struct nlmsghdr*)cache->buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len))
+        {
+            switch (msg->nlmsg_type)
+            {
+                case RTM_NEWNEIGH:
+                case RTM_DELNEIGH:
+                    ApplyNeighbour(cache, msg);
+                    break;
+                case RTM_NEWLINK:
+                case RTM_DELLINK:
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                case RTM_NEWROUTE:
+                case RTM_DELROUTE:
+                    // any of these can move a gateway, cheaper to ask again than to mirror the FIB
+                    resync = 1;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    for (index = 0; index < cache->hop_count; ++index)
+    {
+        route = &cache->routes[index];
+        if (0 == route->if_index)
+            continue;
+
+        if (resync)
+        {
+            ResolveHop(cache, index);
+        }
+
+        // the kernel only confirms entries its own traffic uses, so stale ones are nudged too
+        if (0 != route->gateway.s_addr && !(route->neigh_state & NUD_SETTLED) &&
+            now_ns - route->kick_ns >= NEXTHOP_KICK_INTERVAL_NS)
+        {
+            route->kick_ns = now_ns;
+            (void)KickNeighbour(cache, route);
+        }
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int LookupRoute(int sock, struct in_addr f_addr, struct in_addr s_addr, int if_index,
+                int* out_index, struct in_addr* gateway)
+{
+    int exit_code = EXIT_FAILURE;
+    int temp_sock = -1;
+    uint32_t oif = (uint32_t)if_index;
+    struct nl_request request;
+    struct rtmsg rtm = {0};
+    struct rtmsg* reply_rtm = NULL;
+    struct rtattr* attrs[RTA_MAX + 1];
+    unsigned char reply[NL_REPLY_SIZE];
+    struct nlmsghdr* msg = (struct nlmsghdr*)reply;
+
+    if (NULL == out_index)
+    {
+        (void)fprintf(stderr, "out_index can not be NULL\n");
+        goto end;
+    }
+
+    if (-1 == sock)
+    {
+        temp_sock = OpenRouteSocket(0, 0);
+        if (-1 == temp_sock)
+            goto end;
+        sock = temp_sock;
+    }
+
+    rtm.rtm_family = AF_INET;
+    rtm.rtm_dst_len = 32;
+    rtm.rtm_src_len = 32;
+    InitRequest(&request, RTM_GETROUTE, NLM_F_REQUEST, &rtm, sizeof(rtm));
+    AddAttr(&request, RTA_DST, &f_addr, sizeof(f_addr));
+    AddAttr(&request, RTA_SRC, &s_addr, sizeof(s_addr));
+    if (0 != if_index)
+    {
+        AddAttr(&request, RTA_OIF, &oif, sizeof(oif));
+    }
+
+    if (Query(sock, 0, &request, reply) || RTM_NEWROUTE != msg->nlmsg_type)
+        goto clean;
+
+    reply_rtm = NLMSG_DATA(msg);
+    ParseAttrs(RTM_RTA(reply_rtm), (int)RTM_PAYLOAD(msg), attrs, RTA_MAX);
+
+    // local and broadcast destinations have no next hop a raw frame could be sent to
+    if (RTN_UNICAST != reply_rtm->rtm_type || NULL == attrs[RTA_OIF])
+    {
+        errno = EHOSTUNREACH;
+        goto clean;
+    }
+
+    memcpy(&oif, RTA_DATA(attrs[RTA_OIF]), sizeof(oif));
+    *out_index = (int)oif;
+
+    if (NULL != gateway)
+    {
+        *gateway = f_addr;
+        if (NULL != attrs[RTA_GATEWAY] && RTA_PAYLOAD(attrs[RTA_GATEWAY]) == sizeof(*gateway))
+        {
+            memcpy(gateway, RTA_DATA(attrs[RTA_GATEWAY]), sizeof(*gateway));
+        }
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    if (-1 != temp_sock)
+        close(temp_sock);
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Opens a NETLINK_ROUTE socket, joined to groups when there are any.
+ *
+ * @return int the socket, or -1 on failure.
+ */
+static int OpenRouteSocket(uint32_t groups, int flags)
+{
+    int sock = -1;
+    int rcvbuf = NL_EVENT_RCVBUF;
+    struct sockaddr_nl addr = {0};
+
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | flags, NETLINK_ROUTE);
+    if (-1 == sock)
+    {
+        perror("socket AF_NETLINK");
+        goto end;
+    }
+
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        perror("bind netlink");
+        close(sock);
+        sock = -1;
+        goto end;
+    }
+
+    // bursts of route changes would otherwise overflow it and force a resync
+    if (0 != groups && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+    {
+        perror("setsockopt SO_RCVBUF");
+    }
+
+end:
+    return sock;
+}
+
+static void InitRequest(struct nl_request* request, uint16_t type, uint16_t flags,
+                        const void* msg, size_t len)
+{
+    memset(request, 0, sizeof(*request));
+    request->header.nlmsg_len = (uint32_t)NLMSG_LENGTH(len);
+    request->header.nlmsg_type = type;
+    request->header.nlmsg_flags = flags;
+    memcpy(NLMSG_DATA(&request->header), msg, len);
+}
+
+/**
+ * @brief Appends an attribute, the requests are small and fixed so they always fit.
+ */
+static void AddAttr(struct nl_request* request, uint16_t type, const void* data, size_t len)
+{
+    struct rtattr* attr =
+        (struct rtattr*)((unsigned char*)request + NLMSG_ALIGN(request->header.nlmsg_len));
+
+    attr->rta_type = type;
+    attr->rta_len = (uint16_t)RTA_LENGTH(len);
+    memcpy(RTA_DATA(attr), data, len);
+    request->header.nlmsg_len = (uint32_t)(NLMSG_ALIGN(request->header.nlmsg_len) +
+                                           RTA_ALIGN(attr->rta_len));
+}
+
+/**
+ * @brief Sends a request and waits for its answer on a blocking socket.
+ *
+ * @param sock Socket to ask on, nothing else may be waiting on it.
+ * @param seq Sequence number of the request.
+ * @param request Request to send.
+ * @param reply Receives the answer, NL_REPLY_SIZE bytes.
+ * @return int EXIT_SUCCESS with the answer at the start of reply, EXIT_FAILURE with errno set
+ * to the kernel's error otherwise. An acknowledged request without an answer succeeds with an
+ * NLMSG_ERROR of 0 in reply.
+ */
+static int Query(int sock, uint32_t seq, struct nl_request* request, unsigned char* reply)
+{
+    ssize_t received = 0;
+    struct nlmsghdr* msg = (struct nlmsghdr*)reply;
+    struct nlmsgerr* err = NULL;
+
+    request->header.nlmsg_seq = seq;
+    if (-1 == send(sock, request, request->header.nlmsg_len, 0))
+        return EXIT_FAILURE;
+
+    do
+    {
+        received = recv(sock, reply, NL_REPLY_SIZE, 0);
+        if (-1 == received)
+            return EXIT_FAILURE;
+    } while (!NLMSG_OK(msg, (size_t)received) || msg->nlmsg_seq != seq);
+
+    if (NLMSG_ERROR == msg->nlmsg_type)
+    {
+        err = NLMSG_DATA(msg);
+        if (0 != err->error)
+        {
+            errno = -err->error;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void ParseAttrs(struct rtattr* attr, int len, struct rtattr** attrs, uint16_t max)
+{
+    memset(attrs, 0, sizeof(*attrs) * ((size_t)max + 1));
+
+    // RTA_NEXT by hand, the macro mixes signed and unsigned lengths
+    while (RTA_OK(attr, len))
+    {
+        if (attr->rta_type <= max)
+        {
+            attrs[attr->rta_type] = attr;
+        }
+
+        len -= (int)RTA_ALIGN(attr->rta_len);
+        attr = (struct rtattr*)((unsigned char*)attr + RTA_ALIGN(attr->rta_len));
+    }
+}
+
+/**
+ * @brief Reads the hardware address of an ethernet interface.
+ *
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if it is gone or not ethernet.
+ */
+static int GetLinkAddress(struct nexthop_cache* cache, int if_index, uint8_t* mac)
+{
+    struct nl_request request;
+    struct ifinfomsg ifi = {0};
+    struct ifinfomsg* reply_ifi = NULL;
+    struct rtattr* attrs[IFLA_MAX + 1];
+    unsigned char reply[NL_REPLY_SIZE];
+    struct nlmsghdr* msg = (struct nlmsghdr*)reply;
+
+    ifi.ifi_family = AF_UNSPEC;
+    ifi.ifi_index = if_index;
+    InitRequest(&request, RTM_GETLINK, NLM_F_REQUEST, &ifi, sizeof(ifi));
+
+    if (Query(cache->query_sock, ++cache->seq, &request, reply) || RTM_NEWLINK != msg->nlmsg_type)
+        return EXIT_FAILURE;
+
+    reply_ifi = NLMSG_DATA(msg);
+    ParseAttrs(IFLA_RTA(reply_ifi), (int)IFLA_PAYLOAD(msg), attrs, IFLA_MAX);
+
+    if (ARPHRD_ETHER != reply_ifi->ifi_type || NULL == attrs[IFLA_ADDRESS] ||
+        ETH_ALEN != RTA_PAYLOAD(attrs[IFLA_ADDRESS]))
+        return EXIT_FAILURE;
+
+    memcpy(mac, RTA_DATA(attrs[IFLA_ADDRESS]), ETH_ALEN);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Looks up the neighbour entry of a route's gateway, a missing one leaves state 0.
+ */
+static void GetNeighbour(struct nexthop_cache* cache, struct nexthop_route* route)
+{
+    struct nl_request request;
+    struct ndmsg ndm = {0};
+    unsigned char reply[NL_REPLY_SIZE];
+    struct nlmsghdr* msg = (struct nlmsghdr*)reply;
+
+    route->neigh_state = 0;
+
+    ndm.ndm_family = AF_INET;
+    ndm.ndm_ifindex = route->if_index;
+    InitRequest(&request, RTM_GETNEIGH, NLM_F_REQUEST, &ndm, sizeof(ndm));
+    AddAttr(&request, NDA_DST, &route->gateway, sizeof(route->gateway));
+
+    if (Query(cache->query_sock, ++cache->seq, &request, reply) || RTM_NEWNEIGH != msg->nlmsg_type)
+        return;
+
+    // the answer reads like a notification, and is applied like one
+    ApplyNeighbour(cache, msg);
+}
+
+/**
+ * @brief Makes the kernel resolve a route's gateway as if it had traffic for it, an unknown or
+ * failed entry is probed again and a stale one confirmed.
+ */
+static int KickNeighbour(struct nexthop_cache* cache, const struct nexthop_route* route)
+{
+    struct nl_request request;
+    struct ndmsg ndm = {0};
+    unsigned char reply[NL_REPLY_SIZE];
+
+    ndm.ndm_family = AF_INET;
+    ndm.ndm_ifindex = route->if_index;
+    ndm.ndm_state = NUD_NONE;
+    ndm.ndm_flags = NTF_USE;
+    InitRequest(&request, RTM_NEWNEIGH, NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK, &ndm,
+                sizeof(ndm));
+    AddAttr(&request, NDA_DST, &route->gateway, sizeof(route->gateway));
+
+    if (Query(cache->query_sock, ++cache->seq, &request, reply))
+    {
+        perror("Could not resolve next hop");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Looks up a rule's route, interface address and neighbour again and publishes them.
+ */
+static void ResolveHop(struct nexthop_cache* cache, uint32_t index)
+{
+    int out_index = 0;
+    struct nexthop_route* route = &cache->routes[index];
+
+    route->neigh_state = 0;
+    if (LookupRoute(cache->query_sock, route->f_addr, route->s_addr, route->if_index,
+                    &out_index, &route->gateway) ||
+        GetLinkAddress(cache, route->if_index, route->local_mac))
+    {
+        route->gateway.s_addr = 0;
+    }
+    else
+    {
+        GetNeighbour(cache, route);
+    }
+
+    PublishHop(cache, index);
+}
+
+/**
+ * @brief Publishes a rule's L2 header under its sequence count, if it changed.
+ */
+static void PublishHop(struct nexthop_cache* cache, uint32_t index)
+{
+    const struct nexthop_route* route = &cache->routes[index];
+    struct nexthop* hop = &cache->hops[index];
+    union nexthop_l2 l2 = {0};
+
+    // stale, delay and probe entries still name the right station, it is just being confirmed
+    if (0 != route->gateway.s_addr && (route->neigh_state & NUD_USABLE))
+    {
+        memcpy(l2.hop.dst_mac, route->neigh_mac, ETH_ALEN);
+        memcpy(l2.hop.src_mac, route->local_mac, ETH_ALEN);
+        l2.hop.resolved = 1;
+    }
+
+    if (l2.words[0] == hop->l2.words[0] && l2.words[1] == hop->l2.words[1])
+        return;
+
+    __atomic_store_n(&hop->seq, hop->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&hop->l2.words[0], l2.words[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&hop->l2.words[1], l2.words[1], __ATOMIC_RELAXED);
+    __atomic_store_n(&hop->seq, hop->seq + 1, __ATOMIC_RELEASE);
+
+    // the fast path passes the rule's frames to the workers while it has no next hop
+    if (NULL != cache->xdp)
+    {
+        (void)XdpSetHop(cache->xdp, index, l2.hop.resolved ? (const uint8_t*)&l2.hop : NULL);
+    }
+}
+
+/**
+ * @brief Updates every route whose gateway a neighbour message is about.
+ */
+static void ApplyNeighbour(struct nexthop_cache* cache, const struct nlmsghdr* msg)
+{
+    uint32_t index = 0;
+    struct ndmsg* ndm = NLMSG_DATA(msg);
+    struct rtattr* attrs[NDA_MAX + 1];
+    struct nexthop_route* route = NULL;
+    struct in_addr dst = {0};
+
+    if (msg->nlmsg_len < NLMSG_LENGTH(sizeof(*ndm)) || AF_INET != ndm->ndm_family)
+        return;
+
+    ParseAttrs((struct rtattr*)((unsigned char*)ndm + NLMSG_ALIGN(sizeof(*ndm))),
+               (int)(msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm))), attrs, NDA_MAX);
+    if (NULL == attrs[NDA_DST] || sizeof(dst) != RTA_PAYLOAD(attrs[NDA_DST]))
+        return;
+
+    memcpy(&dst, RTA_DATA(attrs[NDA_DST]), sizeof(dst));
+
+    for (index = 0; index < cache->hop_count; ++index)
+    {
+        route = &cache->routes[index];
+        if (0 == route->if_index || route->if_index != ndm->ndm_ifindex ||
+            route->gateway.s_addr != dst.s_addr)
+            continue;
+
+        route->neigh_state = RTM_DELNEIGH == msg->nlmsg_type ? 0 : ndm->ndm_state;
+        if (NULL != attrs[NDA_LLADDR] && ETH_ALEN == RTA_PAYLOAD(attrs[NDA_LLADDR]))
+        {
+            memcpy(route->neigh_mac, RTA_DATA(attrs[NDA_LLADDR]), ETH_ALEN);
+        }
+        else
+        {
+            // an incomplete or failed entry has no address to use
+            route->neigh_state = (uint16_t)(route->neigh_state & ~NUD_USABLE);
+        }
+
+        PublishHop(cache, index);
+    }
+}
+
+static void PrintHop(const struct nexthop_cache* cache, const struct rule_table* rules,
+                     uint32_t index)
+{
+    const struct nexthop_route* route = &cache->routes[index];
+    const uint8_t* mac = cache->hops[index].l2.hop.dst_mac;
+    char gateway[INET_ADDRSTRLEN] = {0};
+
+    if (0 == route->gateway.s_addr)
+    {
+        printf("No route to %s from %s on %s yet\n", rules->rules[index].rewrite.f_addr_str,
+               rules->rules[index].rewrite.s_addr_str, rules->rules[index].rewrite.if_name);
+        return;
+    }
+
+    (void)inet_ntop(AF_INET, &route->gateway, gateway, sizeof(gateway));
+    if (!cache->hops[index].l2.hop.resolved)
+    {
+        printf("Next hop to %s is %s, resolving its link layer address\n",
+               rules->rules[index].rewrite.f_addr_str, gateway);
+        return;
+    }
+
+    printf("Next hop to %s is %s at %02x:%02x:%02x:%02x:%02x:%02x\n",
+           rules->rules[index].rewrite.f_addr_str, gateway, mac[0], mac[1], mac[2], mac[3],
+           mac[4], mac[5]);
+}
@@ -0,0 +1,377 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "packet_ring.h"
+
+#define OFF_IP4_TOT_LEN (ETH_HLEN + 2U)
+
+static struct tpacket_block_desc* GetBlock(struct rx_ring* ring, uint32_t block_idx);
+static void ReleaseBlock(struct rx_ring* ring);
+static struct tpacket2_hdr* GetTxFrame(struct tx_ring* ring, uint32_t frame_idx);
+static size_t TxDataOffset(void);
+static int CoversIpPacket(const struct tpacket3_hdr* hdr);
+
+int SetupRxRing(int sock, const struct rx_ring_config* config, struct rx_ring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+    int version = TPACKET_V3;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t map_len = 0;
+    void* map = MAP_FAILED;
+
+    if (NULL == config || NULL == ring)
+    {
+        (void)fprintf(stderr, "config and ring can not be NULL\n");
+        goto end;
+    }
+
+    if (page_size <= 0 || 0 == config->block_size ||
+        0 != config->block_size % (uint32_t)page_size)
+    {
+        (void)fprintf(stderr, "ring block size must be a multiple of the page size (%ld)\n",
+                      page_size);
+        goto end;
+    }
+
+    if (config->block_size < RX_RING_FRAME_SIZE || 0 == config->frame_count)
+    {
+        (void)fprintf(stderr, "ring needs at least one %u byte frame per block\n",
+                      RX_RING_FRAME_SIZE);
+        goto end;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+
+    // V3 frames are variable length, frame_size and frame_nr only size the blocks
+    ring->req.tp_block_size = config->block_size;
+    ring->req.tp_frame_size = RX_RING_FRAME_SIZE;
+    ring->req.tp_block_nr =
+        (config->frame_count + (config->block_size / RX_RING_FRAME_SIZE) - 1) /
+        (config->block_size / RX_RING_FRAME_SIZE);
+    ring->req.tp_frame_nr = ring->req.tp_block_nr * (config->block_size / RX_RING_FRAME_SIZE);
+    ring->req.tp_retire_blk_tov = config->block_timeout_ms;
+    ring->req.tp_feature_req_word = 0;
+
+    if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)))
+    {
+        perror("setsockopt PACKET_VERSION");
+        goto end;
+    }
+
+    if (setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &ring->req, sizeof(ring->req)))
+    {
+        perror("setsockopt PACKET_RX_RING");
+        goto end;
+    }
+
+    map_len = (size_t)ring->req.tp_block_size * ring->req.tp_block_nr;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sock, 0);
+    if (MAP_FAILED == map)
+    {
+        // MAP_LOCKED needs RLIMIT_MEMLOCK headroom, the ring still works unlocked
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+    }
+
+    if (MAP_FAILED == map)
+    {
+        perror("mmap rx ring");
+        goto end;
+    }
+
+    ring->map = map;
+    ring->map_len = map_len;
+
+    printf("RX ring: %u blocks of %u bytes, %u ms block timeout\n", ring->req.tp_block_nr,
+           ring->req.tp_block_size, ring->req.tp_retire_blk_tov);
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int RxRingNextFrame(struct rx_ring* ring, unsigned char** frame, size_t* frame_len,
+                    uint32_t* status)
+{
+    int found = 0;
+    struct tpacket3_hdr* hdr = NULL;
+
+    if (NULL == ring || NULL == ring->map || NULL == frame || NULL == frame_len || NULL == status)
+    {
+        goto end;
+    }
+
+    while (!found)
+    {
+        if (NULL != ring->block && 0 == ring->frames_left)
+        {
+            ReleaseBlock(ring);
+        }
+
+        if (NULL == ring->block)
+        {
+            struct tpacket_block_desc* block = GetBlock(ring, ring->block_idx);
+
+            // pairs with the kernel's release of the block to userspace
+            if (0 == (__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+                      TP_STATUS_USER))
+            {
+                goto end;
+            }
+
+            ring->block = block;
+            ring->frames_left = block->hdr.bh1.num_pkts;
+            ring->frame = (struct tpacket3_hdr*)((unsigned char*)block +
+                                                 block->hdr.bh1.offset_to_first_pkt);
+            continue;
+        }
+
+        hdr = ring->frame;
+        ring->frames_left--;
+        ring->frame = (struct tpacket3_hdr*)((unsigned char*)hdr + hdr->tp_next_offset);
+
+        // the filter trims the ethernet trailer, only a capture that misses part of the IP
+        // packet, cut short by the ring's frame size, can not be rewritten safely
+        if (hdr->tp_snaplen != hdr->tp_len && !CoversIpPacket(hdr))
+        {
+            ring->truncated++;
+            continue;
+        }
+
+        *frame = (unsigned char*)hdr + hdr->tp_mac;
+        *frame_len = hdr->tp_snaplen;
+        *status = hdr->tp_status;
+        found = 1;
+    }
+
+end:
+    return found;
+}
+
+/**
+ * @brief Checks that a frame captured short of its length still holds its whole IP packet.
+ */
+static int CoversIpPacket(const struct tpacket3_hdr* hdr)
+{
+    const unsigned char* frame = (const unsigned char*)hdr + hdr->tp_mac;
+    uint16_t tot_len = 0;
+
+    if (hdr->tp_snaplen < OFF_IP4_TOT_LEN + sizeof(tot_len))
+        return 0;
+
+    memcpy(&tot_len, frame + OFF_IP4_TOT_LEN, sizeof(tot_len));
+    return ETH_HLEN + (uint32_t)ntohs(tot_len) <= hdr->tp_snaplen;
+}
+
+void TeardownRxRing(struct rx_ring* ring)
+{
+    if (NULL == ring || NULL == ring->map)
+        return;
+
+    (void)munmap(ring->map, ring->map_len);
+    memset(ring, 0, sizeof(*ring));
+}
+
+int SetupTxRing(unsigned int if_index, struct tx_ring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+    int version = TPACKET_V2;
+    struct sockaddr_ll device = {0};
+    void* map = MAP_FAILED;
+
+    if (NULL == ring || 0 == if_index)
+    {
+        (void)fprintf(stderr, "ring can not be NULL and if_index must be valid\n");
+        goto end;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+
+    // protocol 0, this socket only sends and never gets a copy of received traffic
+    ring->sock = socket(AF_PACKET, SOCK_RAW, 0);
+    if (-1 == ring->sock)
+    {
+        perror("socket");
+        goto end;
+    }
+
+    if (setsockopt(ring->sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)))
+    {
+        perror("setsockopt PACKET_VERSION");
+        goto clean;
+    }
+
+    ring->req.tp_block_size = TX_RING_BLOCK_SIZE;
+    ring->req.tp_frame_size = TX_RING_FRAME_SIZE;
+    ring->req.tp_frame_nr = TX_RING_FRAME_COUNT;
+    ring->req.tp_block_nr = TX_RING_FRAME_COUNT / (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE);
+
+    if (setsockopt(ring->sock, SOL_PACKET, PACKET_TX_RING, &ring->req, sizeof(ring->req)))
+    {
+        perror("setsockopt PACKET_TX_RING");
+        goto clean;
+    }
+
+    // protocol stays 0 here too, binding with ETH_P_ALL would start capturing on the interface
+    device.sll_family = AF_PACKET;
+    device.sll_ifindex = (int)if_index;
+
+    if (bind(ring->sock, (struct sockaddr*)&device, sizeof(device)))
+    {
+        perror("bind tx ring");
+        goto clean;
+    }
+
+    ring->map_len = (size_t)ring->req.tp_block_size * ring->req.tp_block_nr;
+    map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->sock, 0);
+    if (MAP_FAILED == map)
+    {
+        perror("mmap tx ring");
+        goto clean;
+    }
+
+    ring->map = map;
+
+    printf("TX ring: %u frames of %u bytes\n", ring->req.tp_frame_nr, ring->req.tp_frame_size);
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    close(ring->sock);
+    ring->sock = -1;
+
+end:
+    return exit_code;
+}
+
+int TxRingSend(struct tx_ring* ring, const unsigned char* frame, size_t frame_len)
+{
+    int exit_code = EXIT_FAILURE;
+    struct tpacket2_hdr* hdr = NULL;
+    uint32_t status = 0;
+
+    if (NULL == ring || NULL == ring->map || NULL == frame)
+    {
+        (void)fprintf(stderr, "ring and frame can not be NULL\n");
+        goto end;
+    }
+
+    // oversized frames and a full ring are per packet failures, the caller counts them
+    if (0 == frame_len || frame_len > TxRingMaxFrame())
+        goto end;
+
+    hdr = GetTxFrame(ring, ring->frame_idx);
+    status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+    if (TP_STATUS_AVAILABLE != status && 0 == (status & TP_STATUS_WRONG_FORMAT))
+    {
+        // ring is full of frames the kernel has not sent yet, push them out and look again
+        (void)TxRingFlush(ring);
+        status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if (TP_STATUS_AVAILABLE != status && 0 == (status & TP_STATUS_WRONG_FORMAT))
+            goto end;
+    }
+
+    memcpy((unsigned char*)hdr + TxDataOffset(), frame, frame_len);
+    hdr->tp_len = (uint32_t)frame_len;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    ring->frame_idx = (ring->frame_idx + 1) % ring->req.tp_frame_nr;
+    ring->pending++;
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int TxRingFlush(struct tx_ring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == ring || NULL == ring->map)
+    {
+        (void)fprintf(stderr, "ring can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == ring->pending)
+    {
+        exit_code = EXIT_SUCCESS;
+        goto end;
+    }
+
+    // the kernel sends every SEND_REQUEST slot, slots go back to AVAILABLE once transmitted
+    if (-1 == send(ring->sock, NULL, 0, MSG_DONTWAIT) && EAGAIN != errno && ENOBUFS != errno)
+    {
+        perror("send tx ring");
+        goto end;
+    }
+
+    ring->pending = 0;
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+size_t TxRingMaxFrame(void)
+{
+    return TX_RING_FRAME_SIZE - TxDataOffset();
+}
+
+void TeardownTxRing(struct tx_ring* ring)
+{
+    if (NULL == ring || NULL == ring->map)
+        return;
+
+    (void)TxRingFlush(ring);
+    (void)munmap(ring->map, ring->map_len);
+    close(ring->sock);
+    memset(ring, 0, sizeof(*ring));
+}
+
+static struct tpacket_block_desc* GetBlock(struct rx_ring* ring, uint32_t block_idx)
+{
+    return (struct tpacket_block_desc*)(ring->map + (size_t)block_idx * ring->req.tp_block_size);
+}
+
+/**
+ * @brief Hands the current block back to the kernel and moves on to the next one.
+ *
+ * @param ring Ring whose current block has been fully consumed.
+ */
+static void ReleaseBlock(struct rx_ring* ring)
+{
+    __atomic_store_n(&ring->block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->block = NULL;
+    ring->frame = NULL;
+    ring->frames_left = 0;
+    ring->block_idx = (ring->block_idx + 1) % ring->req.tp_block_nr;
+}
+
+static struct tpacket2_hdr* GetTxFrame(struct tx_ring* ring, uint32_t frame_idx)
+{
+    return (struct tpacket2_hdr*)(ring->map + (size_t)frame_idx * ring->req.tp_frame_size);
+}
+
+/**
+ * @brief Offset of the frame data in a TX slot, TPACKET_ALIGN without the signed mask.
+ *
+ * @return size_t bytes between the start of a slot and its link layer header.
+ */
+static size_t TxDataOffset(void)
+{
+    return (sizeof(struct tpacket2_hdr) + TPACKET_ALIGNMENT - 1U) / TPACKET_ALIGNMENT *
+           TPACKET_ALIGNMENT;
+}
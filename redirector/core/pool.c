@@ -0,0 +1,162 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "pool.h"
+
+static void* MapPoolMemory(size_t* map_len, int* hugepages);
+
+int CreateBufPool(struct buf_pool* pool, uint32_t count, size_t buf_size)
+{
+    int exit_code = EXIT_FAILURE;
+    const size_t cache_line = 64;
+    uint32_t index = 0;
+    void* map = NULL;
+
+    if (NULL == pool)
+    {
+        (void)fprintf(stderr, "pool can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == count || 0 == buf_size)
+    {
+        (void)fprintf(stderr, "pool needs at least one buffer of at least one byte\n");
+        goto end;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    pool->buf_size = (buf_size + cache_line - 1) / cache_line * cache_line;
+    pool->count = count;
+    pool->map_len = pool->buf_size * count;
+
+    map = MapPoolMemory(&pool->map_len, &pool->hugepages);
+    if (NULL == map)
+    {
+        goto end;
+    }
+    pool->map = map;
+
+    pool->bufs = calloc(count, sizeof(*pool->bufs));
+    if (NULL == pool->bufs)
+    {
+        perror("calloc");
+        goto clean;
+    }
+
+    // thread the free list back to front so the first get hands out the first slot
+    for (index = count; index > 0; --index)
+    {
+        struct pkt_buf* buf = &pool->bufs[index - 1];
+        buf->data = pool->map + (size_t)(index - 1) * pool->buf_size;
+        buf->next = pool->free_list;
+        pool->free_list = buf;
+    }
+    pool->available = count;
+
+    printf("Buffer pool: %u buffers of %zu bytes%s\n", pool->count, pool->buf_size,
+           pool->hugepages ? " on hugepages" : "");
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    (void)munmap(pool->map, pool->map_len);
+    memset(pool, 0, sizeof(*pool));
+
+end:
+    return exit_code;
+}
+
+struct pkt_buf* BufPoolGet(struct buf_pool* pool)
+{
+    struct pkt_buf* buf = pool->free_list;
+
+    if (NULL != buf)
+    {
+        pool->free_list = buf->next;
+        pool->available--;
+        buf->next = NULL;
+        buf->refcnt = 1;
+        buf->len = 0;
+        buf->status = 0;
+    }
+
+    return buf;
+}
+
+void BufRef(struct pkt_buf* buf)
+{
+    buf->refcnt++;
+}
+
+void BufPoolPut(struct buf_pool* pool, struct pkt_buf* buf)
+{
+    if (NULL == buf)
+        return;
+
+    if (--buf->refcnt > 0)
+        return;
+
+    buf->next = pool->free_list;
+    pool->free_list = buf;
+    pool->available++;
+}
+
+void DestroyBufPool(struct buf_pool* pool)
+{
+    if (NULL == pool || NULL == pool->map)
+        return;
+
+    if (pool->available != pool->count)
+    {
+        (void)fprintf(stderr, "buffer pool destroyed with %u buffers in use\n",
+                      pool->count - pool->available);
+    }
+
+    NFREE(pool->bufs);
+    (void)munmap(pool->map, pool->map_len);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief Maps prefaulted anonymous memory, explicit hugepages first and THP as the fallback.
+ *
+ * @param map_len Size to map, rounded up to the hugepage size if hugepages are used.
+ * @param hugepages Set to 1 if the memory is backed by explicit hugepages.
+ * @return void* the mapping, or NULL on failure.
+ */
+static void* MapPoolMemory(size_t* map_len, int* hugepages)
+{
+    const size_t huge_page = 2UL * 1024 * 1024;
+    size_t huge_len = (*map_len + huge_page - 1) / huge_page * huge_page;
+    void* map = MAP_FAILED;
+
+    // MAP_POPULATE faults and zeroes every page now, never on the forwarding path
+    map = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (MAP_FAILED != map)
+    {
+        *map_len = huge_len;
+        *hugepages = 1;
+        return map;
+    }
+
+    map = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == map)
+    {
+        perror("mmap buffer pool");
+        return NULL;
+    }
+
+    // transparent hugepages are only a hint, ignore failure, then fault everything in up front
+    (void)madvise(map, *map_len, MADV_HUGEPAGE);
+    memset(map, 0, *map_len);
+    *hugepages = 0;
+
+    return map;
+}
@@ -4,7 +4,6 @@
 #include <netinet/udp.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 
@@ -12,26 +11,82 @@
 #include "common.h"
 #include "networking.h"
 #include "rawparser.h"
+#include "rewrite.h"
+
+ssize_t ModifyPacket(unsigned char* packet, ssize_t packet_len, const struct rewrite_ctx* ctx,
+                     unsigned char** data_section, enum csum_state csum,
+                     enum parse_stage* failed_stage)
+{
+    ssize_t exit_code = -1;
+    ssize_t bytes_parsed = -1;
+    ssize_t bytes_left = packet_len;
+    ssize_t pointer = 0;
+    uint32_t addr_delta = 0;
+    enum parse_stage stage = PARSE_STAGE_ETHER;
+
+    struct ip* ip_ptr = NULL;
+
+    // failures are not printed, they happen per packet and the caller counts them by stage
+    if (NULL == packet || NULL == ctx)
+        goto end;
+
+    // the whole frame is in one buffer, so parse the headers by tracking bytes left + pointer
+    // arithmetic
+
+    bytes_parsed = ParseEther(packet, bytes_left);
+
+    if (-1 == bytes_parsed)
+        goto end;
+
+    pointer = pointer + bytes_parsed;
+    bytes_left = bytes_left - bytes_parsed;
+    stage = PARSE_STAGE_IP;
+
+    bytes_parsed = ParseIp(packet + pointer, bytes_left, ctx, &addr_delta);
+
+    if (-1 == bytes_parsed)
+        goto end;
+
+    ip_ptr = (struct ip*)(packet + pointer);
+
+    pointer = pointer + bytes_parsed;
+    bytes_left = bytes_left - bytes_parsed;
+    stage = PARSE_STAGE_UDP;
+
+    bytes_parsed = ParseUdp(packet + pointer, bytes_left, ctx, ip_ptr, addr_delta, csum);
+
+    if (-1 == bytes_parsed)
+        goto end;
+
+    pointer = pointer + bytes_parsed;
+    bytes_left = bytes_left - bytes_parsed;
+
+    if (NULL != data_section)
+    {
+        *data_section = packet + pointer;
+    }
+
+    exit_code = pointer + bytes_left;
+
+end:
+    if (-1 == exit_code && NULL != failed_stage)
+    {
+        *failed_stage = stage;
+    }
+
+    return exit_code;
+}
 
 ssize_t ParseEther(unsigned char* packet, ssize_t bytes_left)
 {
     ssize_t parsed_bytes = -1;
     const int eth_sz = 14;
-    const char label[] = "ether";
 
     if (NULL == packet)
-    {
-        (void)fprintf(stderr, "packet can not be NULL\n");
         goto end;
-    }
 
     if (bytes_left < eth_sz)
-    {
-        (void)fprintf(stderr, "packet is too small\n");
         goto end;
-    }
-
-    PrintHex(label, packet, (size_t)eth_sz);
 
     parsed_bytes = eth_sz;
     goto end;
@@ -45,78 +100,61 @@ end:
  * 
  * @param packet pointer to the packet at the start of IP
  * @param bytes_left the amount of bytes that can be parsed
+ * @param ctx addresses to write into the header
+ * @param addr_delta set to the checksum delta of the address rewrite, for the UDP pseudo header
  * @return ssize_t the amount of bytes actually parsed
  */
-ssize_t ParseIp(unsigned char* packet, ssize_t bytes_left, const char* d_addr, const char* s_addr)
+ssize_t ParseIp(unsigned char* packet, ssize_t bytes_left, const struct rewrite_ctx* ctx,
+                uint32_t* addr_delta)
 {
 
     ssize_t parsed_bytes = -1;
+    ssize_t header_len = 0;
     const ssize_t min_bytes = 20;
     uint16_t checksum = 0;
-    const char label[] = "ip   ";
-
-    struct in_addr src = {0};
-    struct in_addr dst = {0};
+    uint32_t delta = 0;
 
     struct ip* ip_headr = (struct ip*)packet;
 
-    if (NULL == packet)
-    {
-        (void)fprintf(stderr, "packet can not be NULL\n");
+    if (NULL == packet || NULL == ctx || NULL == addr_delta)
         goto end;
-    }
 
     if (bytes_left < min_bytes)
-    {
-        (void)fprintf(stderr, "packet is too small\n");
         goto end;
-    }
 
     if (ip_headr->ip_v != 4)
-    {
-        (void)fprintf(stderr, "field %d should be 4\n", ip_headr->ip_v);
         goto end;
-    }
 
     if (ip_headr->ip_hl < 5)
-    {
-        (void)fprintf(stderr, "Invalid IP header length: %d\n", ip_headr->ip_hl);
         goto end;
-    }
 
-    parsed_bytes = (ssize_t)ip_headr->ip_hl * 4;
+    header_len = (ssize_t)ip_headr->ip_hl * 4;
 
-    if (parsed_bytes > bytes_left)
-    {
-        (void)fprintf(stderr, "ip data does not reflect bytes recv\n");
+    if (header_len > bytes_left)
         goto end;
-    }
-
-    PrintHex(label, packet, (size_t)parsed_bytes);
 
-    if (inet_aton(s_addr, &src) == 0)
-    {
-        (void)fprintf(stderr, "Invalid source IP: %s\n", s_addr);
+    // the frame may carry ethernet padding after the packet but never less than the packet
+    if (ntohs(ip_headr->ip_len) < header_len || ntohs(ip_headr->ip_len) > bytes_left)
         goto end;
-    }
 
-    if (inet_aton(d_addr, &dst) == 0)
-    {
-        (void)fprintf(stderr, "Invalid destination IP: %s\n", d_addr);
-        goto end;
-    }
+    // only the two addresses change, so adjust the checksum instead of summing the header again,
+    // the sum of the new addresses is precomputed and only the old ones are added here
+    delta = checksum_diff32(ctx->addr_sum, ip_headr->ip_src.s_addr, 0);
+    delta = checksum_diff32(delta, ip_headr->ip_dst.s_addr, 0);
 
-    ip_headr->ip_src = src;
-    ip_headr->ip_dst = dst;
-    ip_headr->ip_sum = 0;
+    ip_headr->ip_src = ctx->s_addr;
+    ip_headr->ip_dst = ctx->f_addr;
 
-    checksum = ip_checksum(ip_headr, (size_t)parsed_bytes);
+    checksum = checksum_adjust(ip_headr->ip_sum, delta);
     if (checksum == 0)
     {
         checksum = 0xFFFF;
     }
     ip_headr->ip_sum = checksum;
 
+    *addr_delta = delta;
+    parsed_bytes = header_len;
+
 end:
     return parsed_bytes;
 }
@@ -126,81 +164,80 @@ end:
  * 
  * @param packet pointer to the packet at the start of UDP
  * @param bytes_left the amount of bytes that can be parsed
+ * @param ctx ports to write into the header
+ * @param addr_delta checksum delta of the pseudo header addresses, from ParseIp
+ * @param csum CSUM_PARTIAL if the checksum field only holds the pseudo header sum of a
+ * CHECKSUM_PARTIAL packet, the checksum is then computed in full. CSUM_OFFLOAD leaves it a
+ * pseudo header sum for the kernel or NIC to finish.
  * @return ssize_t the amount of bytes actually parsed
  */
-ssize_t ParseUdp(unsigned char* packet, ssize_t bytes_left, uint16_t f_port, uint16_t s_port,
-                 struct ip* ip_header)
+ssize_t ParseUdp(unsigned char* packet, ssize_t bytes_left, const struct rewrite_ctx* ctx,
+                 struct ip* ip_header, uint32_t addr_delta, enum csum_state csum)
 {
     ssize_t parsed_bytes = -1;
     const ssize_t min_bytes = 8;
-    const char label[] = "udp  ";
+    uint32_t delta = addr_delta;
 
     struct udphdr* udp_header = (struct udphdr*)packet;
 
     if (NULL == packet)
-    {
-        (void)fprintf(stderr, "packet can not be NULL\n");
         goto end;
-    }
-    if (NULL == ip_header)
-    {
-        (void)fprintf(stderr, "ip_header can not be NULL\n");
+    if (NULL == ctx || NULL == ip_header)
         goto end;
-    }
 
     if (bytes_left < min_bytes)
-    {
-        (void)fprintf(stderr, "packet is too small\n");
         goto end;
-    }
 
-    udp_header->dest = htons(f_port);
-    udp_header->source = htons(s_port);
-
-    udp_header->check = 0;
-    udp_header->check = udp_checksum(udp_header, ntohs(udp_header->len), ip_header->ip_src.s_addr,
-                                     ip_header->ip_dst.s_addr);
-
-    parsed_bytes = min_bytes;
-
-    PrintHex(label, packet, (size_t)parsed_bytes);
-
-end:
-    return parsed_bytes;
-}
-
-int PrintHex(const char* label, const unsigned char* data, size_t length)
-{
-    int exit_code = EXIT_FAILURE;
-    const size_t hex = 16;
-    size_t index = 0;
-
-    if (NULL == data)
-    {
-        (void)fprintf(stderr, "data can not be NULL\n");
+    // bounded by the IP packet, not the frame, which may end in padding
+    if (ntohs(udp_header->len) < min_bytes || ntohs(udp_header->len) > bytes_left ||
+        ntohs(udp_header->len) > ntohs(ip_header->ip_len) - ip_header->ip_hl * 4)
         goto end;
-    }
 
-    if (NULL == label)
+    if (CSUM_OFFLOAD == csum)
     {
-        (void)fprintf(stderr, "label can not be NULL\n");
-        goto end;
+        udp_header->dest = ctx->f_port;
+        udp_header->source = ctx->s_port;
+
+        // the ports are summed with the data once the frame is sent, only the addresses of the
+        // pseudo header change the seed, which is a sum and not its complement
+        udp_header->check = (uint16_t)~checksum_adjust((uint16_t)~udp_header->check, addr_delta);
     }
+    else if (CSUM_PARTIAL == csum)
+    {
+        udp_header->dest = ctx->f_port;
+        udp_header->source = ctx->s_port;
 
-    for (index = 0; index < length; ++index)
+        udp_header->check = 0;
+        udp_header->check = udp_checksum(udp_header, ntohs(udp_header->len),
+                                         ip_header->ip_src.s_addr, ip_header->ip_dst.s_addr);
+        // a zero on the wire says there is no checksum, the same sum is sent as 0xFFFF
+        if (0 == udp_header->check)
+        {
+            udp_header->check = 0xFFFF;
+        }
+    }
+    else
     {
-        if (index % hex == 0)
-            printf("%s  ", label);
+        delta += ctx->port_sum;
+        delta = checksum_diff16(delta, udp_header->dest, 0);
+        delta = checksum_diff16(delta, udp_header->source, 0);
 
-        printf("%02x ", data[index]);
+        udp_header->dest = ctx->f_port;
+        udp_header->source = ctx->s_port;
 
-        if ((index + 1) % hex == 0)
-            printf("\n");
+        // a zero checksum means the sender did not compute one, keep it that way
+        if (0 != udp_header->check)
+        {
+            udp_header->check = checksum_adjust(udp_header->check, delta);
+            if (0 == udp_header->check)
+            {
+                udp_header->check = 0xFFFF;
+            }
+        }
     }
 
-    if (length % hex != 0)
-        printf("\n");
+    parsed_bytes = min_bytes;
 
 end:
-    return exit_code;
+    return parsed_bytes;
 }
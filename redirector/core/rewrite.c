@@ -0,0 +1,100 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "networking.h"
+#include "nexthop.h"
+#include "rewrite.h"
+
+int CreateRewriteCtx(struct rewrite_ctx* ctx, const char* f_addr, const char* s_addr,
+                     uint16_t f_port, uint16_t s_port, int raw_send)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == ctx || NULL == f_addr || NULL == s_addr)
+    {
+        (void)fprintf(stderr, "ctx, f_addr and s_addr can not be NULL\n");
+        goto end;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    if (inet_pton(AF_INET, f_addr, &ctx->f_addr) <= 0)
+    {
+        (void)fprintf(stderr, "Invalid destination IP: %s\n", f_addr);
+        goto end;
+    }
+
+    if (inet_pton(AF_INET, s_addr, &ctx->s_addr) <= 0)
+    {
+        (void)fprintf(stderr, "Invalid source IP: %s\n", s_addr);
+        goto end;
+    }
+
+    // normalized text forms, only used for logging
+    (void)inet_ntop(AF_INET, &ctx->f_addr, ctx->f_addr_str, sizeof(ctx->f_addr_str));
+    (void)inet_ntop(AF_INET, &ctx->s_addr, ctx->s_addr_str, sizeof(ctx->s_addr_str));
+
+    ctx->f_port = htons(f_port);
+    ctx->s_port = htons(s_port);
+    SetRewriteSums(ctx);
+
+    ctx->dest_addr.sin_family = AF_INET;
+    ctx->dest_addr.sin_port = ctx->f_port;
+    ctx->dest_addr.sin_addr = ctx->f_addr;
+
+    ctx->raw_send = raw_send;
+    if (!raw_send)
+    {
+        exit_code = EXIT_SUCCESS;
+        goto end;
+    }
+
+    // the interface the kernel would send from s_addr to f_addr on, s_addr has to be local
+    if (LookupRoute(-1, ctx->f_addr, ctx->s_addr, 0, &ctx->if_index, NULL))
+    {
+        (void)fprintf(stderr, "Could not route to %s from %s: %s\n", f_addr, s_addr,
+                      strerror(errno));
+        goto end;
+    }
+
+    if (NULL == if_indextoname((unsigned int)ctx->if_index, ctx->if_name))
+    {
+        perror("if_indextoname");
+        goto end;
+    }
+
+    if (GetRawDevice(ctx->if_name, &ctx->device))
+    {
+        (void)fprintf(stderr, "Could not get device for interface: %s\n", ctx->if_name);
+        goto end;
+    }
+
+    printf("Sending packets on interface: %s\n", ctx->if_name);
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+void SetRewriteSums(struct rewrite_ctx* ctx)
+{
+    uint64_t sum = 0;
+
+    // the m' half of RFC 1624, the same for every packet
+    sum = checksum_partial(&ctx->s_addr, sizeof(ctx->s_addr), 0);
+    sum = checksum_partial(&ctx->f_addr, sizeof(ctx->f_addr), sum);
+    ctx->addr_sum = checksum_fold(sum);
+
+    sum = checksum_partial(&ctx->s_port, sizeof(ctx->s_port), 0);
+    sum = checksum_partial(&ctx->f_port, sizeof(ctx->f_port), sum);
+    ctx->port_sum = checksum_fold(sum);
+}
@@ -0,0 +1,618 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "filter.h"
+#include "rawparser.h"
+#include "rewrite.h"
+#include "rules.h"
+
+#define RULES_LINE_SIZE 512U
+#define RULES_FIELDS 6U
+
+static uint32_t PrefixMask(uint8_t len);
+static int ParseRuleLine(char* line, struct rule_table* table);
+static void SortedRules(const struct rule_table* table, uint16_t* order);
+static uint32_t ChainForPort(const struct rule_table* table, const uint16_t* order,
+                             uint32_t port, uint16_t* members);
+static uint32_t MergePortRanges(const struct rule_table* table, struct port_range* ranges);
+
+int CreateRuleTable(struct rule_table* table)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == table)
+    {
+        (void)fprintf(stderr, "table can not be NULL\n");
+        goto end;
+    }
+
+    memset(table, 0, sizeof(*table));
+
+    table->rules = calloc(RULES_MAX, sizeof(*table->rules));
+    table->port_chain = calloc(RULE_PORTS, sizeof(*table->port_chain));
+    if (NULL == table->rules || NULL == table->port_chain)
+    {
+        perror("calloc");
+        DestroyRuleTable(table);
+        goto end;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+void DestroyRuleTable(struct rule_table* table)
+{
+    if (NULL == table)
+        return;
+
+    NFREE(table->rules);
+    NFREE(table->port_chain);
+    NFREE(table->chain_start);
+    NFREE(table->chain_rules);
+    memset(table, 0, sizeof(*table));
+}
+
+int AddRule(struct rule_table* table, const struct port_range* ports,
+            const struct src_prefix* prefix, const char* f_addr, uint16_t f_port,
+            const char* s_addr, int raw_send)
+{
+    int exit_code = EXIT_FAILURE;
+    struct rule* rule = NULL;
+
+    if (NULL == table || NULL == ports)
+    {
+        (void)fprintf(stderr, "table and ports can not be NULL\n");
+        goto end;
+    }
+
+    if (table->rule_count == RULES_MAX)
+    {
+        (void)fprintf(stderr, "At most %u rules are supported\n", RULES_MAX);
+        goto end;
+    }
+
+    if (ports->last < ports->first)
+    {
+        (void)fprintf(stderr, "Invalid port range %u-%u\n", ports->first, ports->last);
+        goto end;
+    }
+
+    if (NULL != prefix && AF_INET != prefix->family)
+    {
+        (void)fprintf(stderr, "Only IPv4 source prefixes can be forwarded\n");
+        goto end;
+    }
+
+    rule = &table->rules[table->rule_count];
+    memset(rule, 0, sizeof(*rule));
+    rule->ports = *ports;
+
+    if (NULL != prefix)
+    {
+        rule->src_len = prefix->len;
+        rule->src_mask = PrefixMask(prefix->len);
+        rule->src_net = prefix->addr[0];
+    }
+
+    if (CreateRewriteCtx(&rule->rewrite, f_addr, s_addr, f_port, ports->first, raw_send))
+    {
+        (void)fprintf(stderr, "Could not set up packet rewrite\n");
+        goto end;
+    }
+
+    if (raw_send)
+    {
+        table->has_raw = 1;
+    }
+    else
+    {
+        table->has_udp = 1;
+    }
+
+    table->rule_count++;
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int LoadRules(const char* path, struct rule_table* table)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t line_number = 0;
+    char line[RULES_LINE_SIZE] = {0};
+    FILE* file = NULL;
+
+    if (NULL == path || NULL == table)
+    {
+        (void)fprintf(stderr, "path and table can not be NULL\n");
+        goto end;
+    }
+
+    file = fopen(path, "r");
+    if (NULL == file)
+    {
+        perror("fopen rules file");
+        goto end;
+    }
+
+    while (NULL != fgets(line, sizeof(line), file))
+    {
+        line_number++;
+
+        if (NULL == strchr(line, '\n') && !feof(file))
+        {
+            (void)fprintf(stderr, "%s:%u: line is too long\n", path, line_number);
+            goto clean;
+        }
+
+        if (ParseRuleLine(line, table))
+        {
+            (void)fprintf(stderr, "%s:%u: invalid rule\n", path, line_number);
+            goto clean;
+        }
+    }
+
+    if (ferror(file))
+    {
+        perror("fgets");
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    (void)fclose(file);
+end:
+    return exit_code;
+}
+
+int IndexRules(struct rule_table* table)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t port = 0;
+    uint32_t index = 0;
+    uint32_t other = 0;
+    uint32_t pass = 0;
+    uint32_t members = 0;
+    uint32_t chain = 0;
+    uint32_t total = 0;
+    uint16_t* order = NULL;
+    uint16_t* current = NULL;
+    uint8_t* boundary = NULL;
+    const struct rule* rule = NULL;
+    const struct rule* rival = NULL;
+
+    if (NULL == table || 0 == table->rule_count)
+    {
+        (void)fprintf(stderr, "table needs at least one rule\n");
+        goto end;
+    }
+
+    // the same ports and the same sources would make the file order decide silently
+    for (index = 0; index < table->rule_count; ++index)
+    {
+        rule = &table->rules[index];
+        for (other = index + 1; other < table->rule_count; ++other)
+        {
+            rival = &table->rules[other];
+            if (rule->src_len == rival->src_len && rule->src_net == rival->src_net &&
+                rule->ports.first <= rival->ports.last && rival->ports.first <= rule->ports.last)
+            {
+                (void)fprintf(stderr, "Rules %u and %u overlap for the same sources\n", index + 1,
+                              other + 1);
+                goto end;
+            }
+        }
+    }
+
+    order = calloc(table->rule_count, sizeof(*order));
+    current = calloc(table->rule_count, sizeof(*current));
+    boundary = calloc(RULE_PORTS + 1, sizeof(*boundary));
+    if (NULL == order || NULL == current || NULL == boundary)
+    {
+        perror("calloc");
+        goto clean;
+    }
+
+    SortedRules(table, order);
+
+    // the rules covering a port only change where a range starts or ends
+    boundary[0] = 1;
+    for (index = 0; index < table->rule_count; ++index)
+    {
+        boundary[table->rules[index].ports.first] = 1;
+        boundary[table->rules[index].ports.last + 1U] = 1;
+    }
+
+    NFREE(table->chain_start);
+    NFREE(table->chain_rules);
+
+    // the first pass counts the chains and their members, the second one fills them in
+    for (pass = 0; pass < 2; ++pass)
+    {
+        chain = 0;
+        total = 0;
+        members = 0;
+
+        for (port = 0; port < RULE_PORTS; ++port)
+        {
+            if (boundary[port])
+            {
+                members = ChainForPort(table, order, port, current);
+                if (members)
+                {
+                    chain++;
+                    if (1 == pass)
+                    {
+                        table->chain_start[chain] = total;
+                        memcpy(&table->chain_rules[total], current, members * sizeof(*current));
+                    }
+                    total += members;
+                }
+            }
+
+            if (1 == pass)
+            {
+                table->port_chain[port] = (uint16_t)(members ? chain : 0);
+            }
+        }
+
+        if (0 == pass)
+        {
+            table->chain_start = calloc(chain + 2U, sizeof(*table->chain_start));
+            table->chain_rules = calloc(total, sizeof(*table->chain_rules));
+            if (NULL == table->chain_start || NULL == table->chain_rules)
+            {
+                perror("calloc");
+                goto clean;
+            }
+        }
+    }
+
+    // chain 0 is empty, chain c ends where c + 1 starts
+    table->chain_start[chain + 1U] = total;
+    table->chain_count = chain;
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    NFREE(order);
+    NFREE(current);
+    NFREE(boundary);
+end:
+    return exit_code;
+}
+
+int RuleFilterSpec(const struct rule_table* table, struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t index = 0;
+    uint32_t other = 0;
+    uint32_t count = 0;
+    struct port_range* ranges = NULL;
+    struct src_prefix prefixes[FILTER_MAX_PREFIXES];
+    const struct rule* rule = NULL;
+
+    if (NULL == table || NULL == spec || 0 == table->rule_count)
+    {
+        (void)fprintf(stderr, "table needs at least one rule and spec can not be NULL\n");
+        goto end;
+    }
+
+    ranges = calloc(table->rule_count, sizeof(*ranges));
+    if (NULL == ranges)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    count = MergePortRanges(table, ranges);
+    memcpy(spec->ports, ranges, count * sizeof(*ranges));
+    spec->port_count = count;
+
+    // sources given on the command line win, otherwise filter on the rules' prefixes when no
+    // rule takes every source and they fit
+    if (spec->prefix_count)
+    {
+        exit_code = EXIT_SUCCESS;
+        goto clean;
+    }
+
+    count = 0;
+    for (index = 0; index < table->rule_count; ++index)
+    {
+        rule = &table->rules[index];
+        if (0 == rule->src_len)
+        {
+            exit_code = EXIT_SUCCESS;
+            goto clean;
+        }
+
+        for (other = 0; other < count; ++other)
+        {
+            if (prefixes[other].len == rule->src_len && prefixes[other].addr[0] == rule->src_net)
+                break;
+        }
+
+        if (other < count)
+            continue;
+
+        if (count == FILTER_MAX_PREFIXES)
+        {
+            exit_code = EXIT_SUCCESS;
+            goto clean;
+        }
+
+        memset(&prefixes[count], 0, sizeof(prefixes[count]));
+        prefixes[count].family = AF_INET;
+        prefixes[count].len = rule->src_len;
+        prefixes[count].addr[0] = rule->src_net;
+        count++;
+    }
+
+    memcpy(spec->prefixes, prefixes, count * sizeof(*prefixes));
+    spec->prefix_count = count;
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    NFREE(ranges);
+end:
+    return exit_code;
+}
+
+const struct rule* MatchRule(const struct rule_table* table, const unsigned char* frame,
+                             size_t len, enum parse_stage* failed_stage)
+{
+    const size_t eth_sz = 14;
+    const size_t udp_sz = 8;
+    size_t ip_sz = 0;
+    size_t ip_len = 0;
+    size_t udp_len = 0;
+    uint32_t index = 0;
+    uint32_t src_addr = 0;
+    uint16_t chain = 0;
+    uint16_t dst_port = 0;
+    const struct rule* rule = NULL;
+
+    *failed_stage = PARSE_STAGE_ETHER;
+    if (len < eth_sz)
+        return NULL;
+
+    // the same checks ParseIp and ParseUdp make, so a frame that fails here is counted the same
+    *failed_stage = PARSE_STAGE_IP;
+    if (len < eth_sz + 20 || 4 != frame[eth_sz] >> 4 || (frame[eth_sz] & 0x0F) < 5)
+        return NULL;
+
+    ip_sz = (size_t)(frame[eth_sz] & 0x0F) * 4;
+    ip_len = (size_t)(frame[eth_sz + 2] << 8 | frame[eth_sz + 3]);
+    if (len < eth_sz + ip_sz || ip_len < ip_sz || len < eth_sz + ip_len)
+        return NULL;
+
+    *failed_stage = PARSE_STAGE_UDP;
+    if (ip_len < ip_sz + udp_sz)
+        return NULL;
+
+    udp_len = (size_t)(frame[eth_sz + ip_sz + 4] << 8 | frame[eth_sz + ip_sz + 5]);
+    if (udp_len < udp_sz || udp_len > ip_len - ip_sz)
+        return NULL;
+
+    *failed_stage = PARSE_STAGE_COUNT;
+
+    dst_port = (uint16_t)(frame[eth_sz + ip_sz + 2] << 8 | frame[eth_sz + ip_sz + 3]);
+    chain = table->port_chain[dst_port];
+    if (0 == chain)
+        return NULL;
+
+    memcpy(&src_addr, frame + eth_sz + 12, sizeof(src_addr));
+    src_addr = ntohl(src_addr);
+
+    for (index = table->chain_start[chain]; index < table->chain_start[chain + 1U]; ++index)
+    {
+        rule = &table->rules[table->chain_rules[index]];
+        if ((src_addr & rule->src_mask) == rule->src_net)
+            return rule;
+    }
+
+    return NULL;
+}
+
+static uint32_t PrefixMask(uint8_t len)
+{
+    return 0 == len ? 0 : UINT32_MAX << (32U - len);
+}
+
+/**
+ * @brief Parses one line of a rules file and adds its rule, comments and blank lines add none.
+ */
+static int ParseRuleLine(char* line, struct rule_table* table)
+{
+    int exit_code = EXIT_FAILURE;
+    const int base_10 = 10;
+    uint32_t count = 0;
+    unsigned long f_port = 0;
+    char* fields[RULES_FIELDS] = {0};
+    char* field = NULL;
+    char* saveptr = NULL;
+    char* endptr = NULL;
+    struct filter_spec* parsed = NULL;
+    const struct src_prefix* prefix = NULL;
+
+    line[strcspn(line, "#")] = '\0';
+
+    for (field = strtok_r(line, " \t\r\n", &saveptr); NULL != field;
+         field = strtok_r(NULL, " \t\r\n", &saveptr))
+    {
+        if (count == RULES_FIELDS)
+            goto end;
+
+        fields[count++] = field;
+    }
+
+    if (0 == count)
+    {
+        exit_code = EXIT_SUCCESS;
+        goto end;
+    }
+
+    if (RULES_FIELDS != count)
+        goto end;
+
+    // the filter's parsers already know ports, ranges and prefixes
+    parsed = calloc(1, sizeof(*parsed));
+    if (NULL == parsed)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    if (ParsePortRanges(fields[0], parsed) || 1 != parsed->port_count)
+        goto clean;
+
+    if (0 != strcmp(fields[1], "-"))
+    {
+        if (ParseSourcePrefixes(fields[1], parsed) || 1 != parsed->prefix_count)
+            goto clean;
+
+        prefix = &parsed->prefixes[0];
+    }
+
+    f_port = strtoul(fields[3], &endptr, base_10);
+    if ('\0' == *fields[3] || '\0' != *endptr || f_port > UINT16_MAX)
+    {
+        (void)fprintf(stderr, "Invalid forward port: %s\n", fields[3]);
+        goto clean;
+    }
+
+    if (0 != strcmp(fields[5], "udp") && 0 != strcmp(fields[5], "raw"))
+    {
+        (void)fprintf(stderr, "Output has to be udp or raw: %s\n", fields[5]);
+        goto clean;
+    }
+
+    exit_code = AddRule(table, &parsed->ports[0], prefix, fields[2], (uint16_t)f_port, fields[4],
+                        0 == strcmp(fields[5], "raw"));
+
+clean:
+    NFREE(parsed);
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Orders rule indices by source prefix length, longest first, file order otherwise.
+ */
+static void SortedRules(const struct rule_table* table, uint16_t* order)
+{
+    uint32_t index = 0;
+    uint32_t slot = 0;
+    uint16_t rule = 0;
+
+    for (index = 0; index < table->rule_count; ++index)
+    {
+        rule = (uint16_t)index;
+        for (slot = index; slot > 0 && table->rules[order[slot - 1]].src_len <
+                                           table->rules[rule].src_len;
+             --slot)
+        {
+            order[slot] = order[slot - 1];
+        }
+        order[slot] = rule;
+    }
+}
+
+/**
+ * @brief Collects the rules covering a port in lookup order.
+ *
+ * @return uint32_t number of rules written to members.
+ */
+static uint32_t ChainForPort(const struct rule_table* table, const uint16_t* order,
+                             uint32_t port, uint16_t* members)
+{
+    uint32_t index = 0;
+    uint32_t count = 0;
+    const struct rule* rule = NULL;
+
+    for (index = 0; index < table->rule_count; ++index)
+    {
+        rule = &table->rules[order[index]];
+        if (port >= rule->ports.first && port <= rule->ports.last)
+        {
+            members[count++] = order[index];
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Merges the rules' port ranges and joins the closest ones until they fit the filter.
+ *
+ * @param ranges Room for one range per rule.
+ * @return uint32_t number of ranges written.
+ */
+static uint32_t MergePortRanges(const struct rule_table* table, struct port_range* ranges)
+{
+    uint32_t index = 0;
+    uint32_t slot = 0;
+    uint32_t count = 0;
+    uint32_t closest = 0;
+    uint32_t gap = 0;
+    struct port_range range = {0};
+
+    // insertion sort by first port, merging ranges that touch or overlap on the way
+    for (index = 0; index < table->rule_count; ++index)
+    {
+        range = table->rules[index].ports;
+        for (slot = count; slot > 0 && ranges[slot - 1].first > range.first; --slot)
+        {
+            ranges[slot] = ranges[slot - 1];
+        }
+        ranges[slot] = range;
+        count++;
+    }
+
+    for (index = 1, slot = 0; index < count; ++index)
+    {
+        if ((uint32_t)ranges[index].first <= (uint32_t)ranges[slot].last + 1U)
+        {
+            if (ranges[index].last > ranges[slot].last)
+            {
+                ranges[slot].last = ranges[index].last;
+            }
+            continue;
+        }
+
+        ranges[++slot] = ranges[index];
+    }
+    count = 0 == count ? 0 : slot + 1;
+
+    while (count > FILTER_MAX_PORT_RANGES)
+    {
+        closest = 0;
+        for (index = 0; index + 1 < count; ++index)
+        {
+            if (0 == index || (uint32_t)(ranges[index + 1].first - ranges[index].last) < gap)
+            {
+                gap = (uint32_t)(ranges[index + 1].first - ranges[index].last);
+                closest = index;
+            }
+        }
+
+        ranges[closest].last = ranges[closest + 1].last;
+        memmove(&ranges[closest + 1], &ranges[closest + 2],
+                (count - closest - 2) * sizeof(*ranges));
+        count--;
+    }
+
+    return count;
+}
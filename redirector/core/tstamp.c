@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+// struct scm_timestamping needs struct timespec first
+#include <linux/errqueue.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "tstamp.h"
+
+// room for the timestamps and an IP_RECVERR extended error with its offender address
+#define TSTAMP_CONTROL_LEN 256U
+
+static int ReadStamp(const struct msghdr* msg, uint32_t* key, uint64_t* tx_ns);
+
+void TstampInit(struct tstamp_ring* ring, int sock)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->sock = sock;
+}
+
+uint32_t TstampReap(struct tstamp_ring* ring, struct latency_hist* hist)
+{
+    int count = 0;
+    int index = 0;
+    uint32_t reaped = 0;
+    uint32_t key = 0;
+    uint32_t slot = 0;
+    uint64_t tx_ns = 0;
+    struct mmsghdr msgs[TSTAMP_REAP_BATCH];
+    union
+    {
+        char buf[TSTAMP_CONTROL_LEN];
+        size_t align;
+    } controls[TSTAMP_REAP_BATCH];
+
+    for (;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (index = 0; index < (int)TSTAMP_REAP_BATCH; ++index)
+        {
+            msgs[index].msg_hdr.msg_control = controls[index].buf;
+            msgs[index].msg_hdr.msg_controllen = sizeof(controls[index].buf);
+        }
+
+        // with OPT_TSONLY the queued errors carry no payload, only control messages
+        count = recvmmsg(ring->sock, msgs, TSTAMP_REAP_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (count <= 0)
+        {
+            if (count < 0 && EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+            {
+                perror("recvmmsg MSG_ERRQUEUE");
+            }
+            break;
+        }
+
+        for (index = 0; index < count; ++index)
+        {
+            if (ReadStamp(&msgs[index].msg_hdr, &key, &tx_ns))
+                continue;
+
+            reaped++;
+
+            // keys older than the ring were overwritten by later sends
+            if (ring->next_key - key - 1U >= TSTAMP_SLOTS)
+                continue;
+
+            slot = key % TSTAMP_SLOTS;
+            if (0 != ring->rx_ns[slot] && tx_ns >= ring->rx_ns[slot])
+            {
+                HistRecord(hist, tx_ns - ring->rx_ns[slot], 1);
+            }
+            ring->rx_ns[slot] = 0;
+        }
+
+        if (count < (int)TSTAMP_REAP_BATCH)
+            break;
+    }
+
+    return reaped;
+}
+
+/**
+ * @brief Finds the software transmit timestamp and its OPT_ID key in one error queue message.
+ *
+ * @return int EXIT_SUCCESS if the message was a transmit timestamp, EXIT_FAILURE otherwise.
+ */
+static int ReadStamp(const struct msghdr* msg, uint32_t* key, uint64_t* tx_ns)
+{
+    int have_key = 0;
+    int have_stamp = 0;
+    struct cmsghdr* cmsg = NULL;
+    struct scm_timestamping stamps;
+    struct sock_extended_err err;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); NULL != cmsg; cmsg = CMSG_NXTHDR((struct msghdr*)msg, cmsg))
+    {
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_TIMESTAMPING == cmsg->cmsg_type)
+        {
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            *tx_ns = (uint64_t)stamps.ts[0].tv_sec * NSEC_PER_SEC + (uint64_t)stamps.ts[0].tv_nsec;
+            have_stamp = 1;
+        }
+        else if ((SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type) ||
+                 (SOL_PACKET == cmsg->cmsg_level && PACKET_TX_TIMESTAMP == cmsg->cmsg_type))
+        {
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (ENOMSG == err.ee_errno && SO_EE_ORIGIN_TIMESTAMPING == err.ee_origin &&
+                SCM_TSTAMP_SND == err.ee_info)
+            {
+                *key = err.ee_data;
+                have_key = 1;
+            }
+        }
+    }
+
+    return have_key && have_stamp ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,613 @@
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "networking.h"
+#include "pool.h"
+#include "uring.h"
+
+#define URING_RECV_TAG 0ULL  // user_data of the receive, a send's is its slot + 1
+#define URING_BUF_GROUP 0U
+
+static int SetupRing(struct uring* ring);
+static int ProbeOps(const struct uring* ring);
+static int RegisterBufRing(struct uring* ring);
+static struct io_uring_sqe* GetSqe(struct uring* ring);
+static int ArmReceive(struct uring* ring);
+static void RestockBufRing(struct uring* ring);
+static void Reap(struct uring* ring);
+static void ReceiveCompletion(struct uring* ring, const struct io_uring_cqe* cqe);
+static void FinishSend(struct uring* ring, uint32_t slot, int32_t res);
+
+int UringOpen(struct uring* ring, int sock, struct buf_pool* pool, uint32_t send_slots)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t slot = 0;
+    const struct io_uring_cqe* cqe = NULL;
+
+    if (NULL == ring || NULL == pool || 0 == send_slots)
+    {
+        (void)fprintf(stderr, "ring and pool can not be NULL and send_slots can not be 0\n");
+        goto end;
+    }
+
+    if (pool->count > UINT16_MAX + 1U || pool->buf_size <= URING_RECV_HEADROOM)
+    {
+        (void)fprintf(stderr, "pool buffers can not be addressed by io_uring buffer ids\n");
+        goto end;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    ring->sock = sock;
+    ring->pool = pool;
+
+    if (SetupRing(ring) || ProbeOps(ring) || RegisterBufRing(ring))
+    {
+        goto clean;
+    }
+
+    ring->sends = calloc(send_slots, sizeof(*ring->sends));
+    if (NULL == ring->sends)
+    {
+        perror("calloc");
+        goto clean;
+    }
+
+    ring->send_count = send_slots;
+    for (slot = 0; slot < send_slots; ++slot)
+    {
+        ring->sends[slot].next_free = slot + 1;
+    }
+    ring->free_send = 0;
+
+    // no source address, only the PACKET_AUXDATA telling unfinished checksums apart
+    ring->recv_msg.msg_controllen = URING_RECV_CONTROL;
+
+    RestockBufRing(ring);
+    if (ArmReceive(ring) || UringSubmit(ring))
+    {
+        goto clean;
+    }
+
+    // kernels without multishot recvmsg reject the request right away
+    cqe = &ring->cqes[*ring->cq_head & ring->cq_mask];
+    if (*ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) &&
+        URING_RECV_TAG == cqe->user_data && cqe->res < 0)
+    {
+        (void)fprintf(stderr, "io_uring can not receive multishot: %s\n", strerror(-cqe->res));
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    UringClose(ring);
+end:
+    return exit_code;
+}
+
+void UringClose(struct uring* ring)
+{
+    uint32_t index = 0;
+    uint32_t buf = 0;
+
+    if (NULL == ring)
+        return;
+
+    // the ring goes first, its receive may still be writing into the pool until then
+    if (-1 != ring->fd)
+        close(ring->fd);
+    ring->fd = -1;
+
+    // the kernel takes buffers in ring order, the last buf_count entries were never used
+    for (index = 0; NULL != ring->buf_ring && index < ring->buf_count; ++index)
+    {
+        buf = ring->buf_ring->bufs[(uint16_t)(ring->buf_tail - ring->buf_count + index) &
+                                   (URING_BUF_RING_SIZE - 1)]
+                  .bid;
+        BufPoolPut(ring->pool, &ring->pool->bufs[buf]);
+    }
+    ring->buf_count = 0;
+
+    for (index = 0; index < ring->received_count; ++index)
+    {
+        BufPoolPut(ring->pool,
+                   ring->received[(ring->received_head + index) % URING_BUF_RING_SIZE].buf);
+    }
+    ring->received_count = 0;
+
+    // free slots hold no buffers, the others never completed
+    for (index = 0; NULL != ring->sends && index < ring->send_count; ++index)
+    {
+        for (buf = 0; buf < BATCH_GSO_MAX_SEGMENTS; ++buf)
+        {
+            BufPoolPut(ring->pool, ring->sends[index].bufs[buf]);
+        }
+    }
+
+    if (NULL != ring->sqes)
+        (void)munmap(ring->sqes, ring->sqes_map_len);
+    if (NULL != ring->ring_map)
+        (void)munmap(ring->ring_map, ring->ring_map_len);
+    if (NULL != ring->buf_ring)
+        (void)munmap(ring->buf_ring, ring->buf_ring_len);
+    ring->sqes = NULL;
+    ring->ring_map = NULL;
+    ring->buf_ring = NULL;
+
+    NFREE(ring->sends);
+    ring->send_count = 0;
+}
+
+uint32_t UringReceive(struct uring* ring, struct uring_frame* frames, uint32_t max)
+{
+    uint32_t count = 0;
+
+    Reap(ring);
+
+    for (count = 0; count < max && 0 != ring->received_count; ++count)
+    {
+        frames[count] = ring->received[ring->received_head];
+        ring->received_head = (ring->received_head + 1) % URING_BUF_RING_SIZE;
+        ring->received_count--;
+    }
+
+    // buffers the caller put back since the last call go to the kernel again
+    RestockBufRing(ring);
+    if (!ring->recv_armed && 0 != ring->buf_count && EXIT_SUCCESS == ArmReceive(ring))
+    {
+        (void)UringSubmit(ring);
+    }
+
+    return count;
+}
+
+int UringSend(struct uring* ring, int sock, const struct msghdr* msg,
+              struct pkt_buf* const* bufs)
+{
+    int exit_code = EXIT_FAILURE;
+    size_t index = 0;
+    uint32_t slot_index = ring->free_send;
+    struct uring_send* slot = NULL;
+    struct io_uring_sqe* sqe = NULL;
+
+    if (NULL == msg || msg->msg_iovlen > BATCH_GSO_MAX_SEGMENTS ||
+        msg->msg_namelen > sizeof(slot->name) || msg->msg_controllen > sizeof(slot->control))
+    {
+        (void)fprintf(stderr, "message does not fit an io_uring send slot\n");
+        goto end;
+    }
+
+    // sends mostly complete while they are submitted, their slots are free once reaped
+    if (slot_index == ring->send_count)
+    {
+        (void)UringSubmit(ring);
+        Reap(ring);
+        slot_index = ring->free_send;
+    }
+
+    // like a full socket buffer for sendmmsg, the caller drops what does not fit
+    if (slot_index == ring->send_count)
+        goto end;
+
+    sqe = GetSqe(ring);
+    if (NULL == sqe)
+        goto end;
+
+    slot = &ring->sends[slot_index];
+    ring->free_send = slot->next_free;
+
+    slot->msg = *msg;
+    slot->msg.msg_flags = 0;
+    if (0 != msg->msg_namelen)
+    {
+        memcpy(&slot->name, msg->msg_name, msg->msg_namelen);
+        slot->msg.msg_name = &slot->name;
+    }
+    if (0 != msg->msg_controllen)
+    {
+        memcpy(slot->control, msg->msg_control, msg->msg_controllen);
+        slot->msg.msg_control = slot->control;
+    }
+
+    memcpy(slot->iovs, msg->msg_iov, msg->msg_iovlen * sizeof(*slot->iovs));
+    slot->msg.msg_iov = slot->iovs;
+    for (index = 0; index < msg->msg_iovlen; ++index)
+    {
+        slot->bufs[index] = NULL == bufs ? NULL : bufs[index];
+        if (NULL != slot->bufs[index])
+        {
+            BufRef(slot->bufs[index]);
+        }
+    }
+
+    // without MSG_DONTWAIT a full socket makes the kernel wait for room instead of failing
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)slot_index + 1;
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int UringSubmit(struct uring* ring)
+{
+    long submitted = 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_cached, __ATOMIC_RELEASE);
+    if (0 == ring->sq_pending)
+        return EXIT_SUCCESS;
+
+    submitted = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, 0, 0, NULL, 0);
+    if (-1 == submitted)
+    {
+        // the SQEs stay queued and go out with the next submit
+        if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+            return EXIT_SUCCESS;
+
+        perror("io_uring_enter");
+        return EXIT_FAILURE;
+    }
+
+    ring->sq_pending -= (uint32_t)submitted;
+    return EXIT_SUCCESS;
+}
+
+uint64_t UringSendErrors(struct uring* ring)
+{
+    uint64_t errors = ring->send_errors;
+
+    ring->send_errors = 0;
+    return errors;
+}
+
+/**
+ * @brief Creates the ring and maps its queues, the SQ and CQ rings share one mapping.
+ */
+static int SetupRing(struct uring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t index = 0;
+    size_t sq_len = 0;
+    size_t cq_len = 0;
+    unsigned char* map = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    struct io_uring_params params = {0};
+
+    // multishot receives can complete far more often than anything is submitted
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (-1 == ring->fd)
+    {
+        (void)fprintf(stderr, "io_uring is not available: %s\n", strerror(errno));
+        goto end;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        (void)fprintf(stderr, "io_uring needs a 5.4 or newer kernel\n");
+        goto end;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+    map = mmap(NULL, ring->ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ring->fd, (off_t)IORING_OFF_SQ_RING);
+    if (MAP_FAILED == map)
+    {
+        perror("mmap io_uring");
+        goto end;
+    }
+    ring->ring_map = map;
+
+    ring->sqes_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, ring->sqes_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, (off_t)IORING_OFF_SQES);
+    if (MAP_FAILED == sqes)
+    {
+        perror("mmap io_uring sqes");
+        goto end;
+    }
+    ring->sqes = sqes;
+
+    ring->sq_head = (uint32_t*)(map + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(map + params.sq_off.tail);
+    ring->sq_array = (uint32_t*)(map + params.sq_off.array);
+    ring->sq_mask = *(uint32_t*)(map + params.sq_off.ring_mask);
+    ring->sq_cached = *ring->sq_tail;
+    ring->cq_head = (uint32_t*)(map + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(map + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(map + params.cq_off.cqes);
+
+    // SQEs are used in ring order, so the indirection array never changes
+    for (index = 0; index < params.sq_entries; ++index)
+    {
+        ring->sq_array[index] = index;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Checks that the kernel knows sendmsg and recvmsg, both arrived in 5.3.
+ */
+static int ProbeOps(const struct uring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+    const unsigned int op_count = 256;
+    struct io_uring_probe* probe = NULL;
+
+    probe = calloc(1, sizeof(*probe) + op_count * sizeof(struct io_uring_probe_op));
+    if (NULL == probe)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    if (-1 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, op_count))
+    {
+        (void)fprintf(stderr, "io_uring can not be probed: %s\n", strerror(errno));
+        goto clean;
+    }
+
+    if (probe->last_op < IORING_OP_RECVMSG ||
+        !(probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_RECVMSG].flags & IO_URING_OP_SUPPORTED))
+    {
+        (void)fprintf(stderr, "io_uring does not support sendmsg and recvmsg\n");
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    NFREE(probe);
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Maps the provided buffer ring receives pick their buffers from and registers it.
+ */
+static int RegisterBufRing(struct uring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+    void* map = MAP_FAILED;
+    struct io_uring_buf_reg reg = {0};
+
+    ring->buf_ring_len = URING_BUF_RING_SIZE * sizeof(struct io_uring_buf);
+    map = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (MAP_FAILED == map)
+    {
+        perror("mmap buffer ring");
+        goto end;
+    }
+    ring->buf_ring = map;
+
+    reg.ring_addr = (uint64_t)(uintptr_t)map;
+    reg.ring_entries = URING_BUF_RING_SIZE;
+    reg.bgid = URING_BUF_GROUP;
+    if (-1 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        (void)fprintf(stderr, "io_uring can not provide buffer rings: %s\n", strerror(errno));
+        goto end;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Takes the next free SQE, submitting what is queued if the SQ is full.
+ *
+ * @return struct io_uring_sqe* the zeroed SQE, or NULL if the kernel has not consumed any yet.
+ */
+static struct io_uring_sqe* GetSqe(struct uring* ring)
+{
+    struct io_uring_sqe* sqe = NULL;
+
+    if (ring->sq_cached - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+    {
+        (void)UringSubmit(ring);
+        if (ring->sq_cached - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+            return NULL;
+    }
+
+    sqe = &ring->sqes[ring->sq_cached & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_cached++;
+    ring->sq_pending++;
+
+    return sqe;
+}
+
+/**
+ * @brief Queues the multishot recvmsg, it keeps completing until the kernel runs out of
+ * buffers or CQ space.
+ */
+static int ArmReceive(struct uring* ring)
+{
+    struct io_uring_sqe* sqe = GetSqe(ring);
+
+    if (NULL == sqe)
+        return EXIT_FAILURE;
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ring->sock;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_RECV_TAG;
+    ring->recv_armed = 1;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Moves free pool buffers onto the buffer ring until it and the frames waiting to be
+ * returned fill it, so a reap can never find more frames than there is room for.
+ */
+static void RestockBufRing(struct uring* ring)
+{
+    struct pkt_buf* buf = NULL;
+    struct io_uring_buf* entry = NULL;
+    uint16_t added = 0;
+
+    while (ring->buf_count + ring->received_count < URING_BUF_RING_SIZE)
+    {
+        buf = BufPoolGet(ring->pool);
+        if (NULL == buf)
+            break;
+
+        // resv of the first entry is the tail, it is only ever written below
+        entry = &ring->buf_ring->bufs[(uint16_t)(ring->buf_tail + added) &
+                                      (URING_BUF_RING_SIZE - 1)];
+        entry->addr = (uint64_t)(uintptr_t)buf->data;
+        entry->len = (uint32_t)ring->pool->buf_size;
+        entry->bid = (uint16_t)(buf - ring->pool->bufs);
+        added++;
+        ring->buf_count++;
+    }
+
+    if (0 == added)
+        return;
+
+    ring->buf_tail = (uint16_t)(ring->buf_tail + added);
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Consumes every completion, frames are queued for UringReceive and sends released.
+ */
+static void Reap(struct uring* ring)
+{
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    const struct io_uring_cqe* cqe = NULL;
+
+    for (; head != tail; ++head)
+    {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        if (URING_RECV_TAG == cqe->user_data)
+        {
+            ReceiveCompletion(ring, cqe);
+        }
+        else
+        {
+            FinishSend(ring, (uint32_t)(cqe->user_data - 1), cqe->res);
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues the frame of a receive completion, if it carried a usable one.
+ */
+static void ReceiveCompletion(struct uring* ring, const struct io_uring_cqe* cqe)
+{
+    struct pkt_buf* buf = NULL;
+    struct io_uring_recvmsg_out* out = NULL;
+    struct msghdr control = {0};
+    struct uring_frame* frame = NULL;
+
+    // the last completion of a receive, it is posted again once buffers are back
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        ring->recv_armed = 0;
+    }
+
+    if (cqe->res < 0)
+    {
+        // running out of buffers only pauses receiving
+        if (-ENOBUFS != cqe->res)
+        {
+            (void)fprintf(stderr, "io_uring receive failed: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return;
+
+    buf = &ring->pool->bufs[cqe->flags >> IORING_CQE_BUFFER_SHIFT];
+    ring->buf_count--;
+
+    out = (struct io_uring_recvmsg_out*)buf->data;
+    if ((size_t)cqe->res < URING_RECV_HEADROOM || (out->flags & MSG_TRUNC))
+    {
+        ring->truncated++;
+        BufPoolPut(ring->pool, buf);
+        return;
+    }
+
+    buf->len = out->payloadlen;
+
+    // the control area sits at its requested size between the header and the frame
+    control.msg_control = buf->data + sizeof(*out);
+    control.msg_controllen = out->controllen;
+    ReadRecvControl(&control, buf);
+
+    // never full, the buffer came off a ring that is only restocked up to the free room
+    frame = &ring->received[(ring->received_head + ring->received_count) % URING_BUF_RING_SIZE];
+    ring->received_count++;
+    frame->buf = buf;
+    frame->packet = buf->data + URING_RECV_HEADROOM;
+    frame->len = buf->len;
+    frame->status = buf->status;
+}
+
+/**
+ * @brief Releases the buffers of a completed send and frees its slot.
+ */
+static void FinishSend(struct uring* ring, uint32_t slot_index, int32_t res)
+{
+    size_t index = 0;
+    struct uring_send* slot = NULL;
+
+    if (slot_index >= ring->send_count)
+        return;
+
+    slot = &ring->sends[slot_index];
+    if (res < 0)
+    {
+        ring->send_errors += slot->msg.msg_iovlen;
+    }
+
+    for (index = 0; index < slot->msg.msg_iovlen; ++index)
+    {
+        BufPoolPut(ring->pool, slot->bufs[index]);
+        slot->bufs[index] = NULL;
+    }
+
+    slot->next_free = ring->free_send;
+    ring->free_send = slot_index;
+}
@@ -0,0 +1,904 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "xdp.h"
+
+#define XDP_LOG_SIZE 65536U
+#define XDP_CPU_PATH "/sys/devices/system/cpu/possible"
+
+// frame offsets, the program only handles IPv4 headers without options
+#define OFF_ETHERTYPE 12
+#define OFF_IP4_VHL 14
+#define OFF_IP4_FRAG 20
+#define OFF_IP4_PROTO 23
+#define OFF_IP4_SUM 24
+#define OFF_IP4_SRC 26
+#define OFF_IP4_DST 30
+#define OFF_UDP_PORTS 34
+#define OFF_UDP_DPORT 36
+#define OFF_UDP_SUM 40
+#define HEADERS_LEN 42
+#define IP4_VHL_PLAIN 0x45
+
+// stack slots of the program, the verifier wants them aligned to their size
+#define STACK_KEY (-16)
+#define STACK_KEY_PORT (-12)
+#define STACK_KEY_ADDR (-10)
+#define STACK_STATS_KEY (-24)
+
+/**
+ * LPM trie key, the port and address in network order so a prefix of the key is a port plus a
+ * prefix of the source network. Only XDP_KEY_SIZE bytes are passed to the kernel.
+ */
+struct xdp_rule_key
+{
+    uint32_t prefixlen;
+    uint8_t data[6];
+};
+
+#define XDP_KEY_SIZE (offsetof(struct xdp_rule_key, data) + 6U)
+#define XDP_KEY_PREFIX_BASE 16U  // the port always has to match in full
+
+/**
+ * What the program writes into a matching frame, laid out so the addresses and ports are
+ * copied with one load and store each. Everything is in network order except if_index and rule.
+ */
+struct xdp_rule_value
+{
+    uint32_t s_addr;
+    uint32_t f_addr;
+    uint32_t addr_sum;
+    uint32_t port_sum;
+    uint16_t s_port;
+    uint16_t f_port;
+    uint32_t if_index;
+    uint32_t forward;          // 0 passes the frame on, udp rules and unresolved next hops
+    uint32_t rule;             // index in the rule table, finds a rule's entries again
+    uint8_t l2[2 * ETH_ALEN];  // destination and source MAC in frame order, copied as 3 words
+};
+
+enum xdp_label
+{
+    XDP_LABEL_PASS = 0,
+    XDP_LABEL_PORTS,
+    XDP_LABEL_REDIRECT,
+};
+
+struct xdp_builder
+{
+    struct bpf_insn insns[XDP_MAX_INSNS];
+    uint32_t len;
+    uint32_t fixups[XDP_MAX_INSNS];
+    enum xdp_label fixup_labels[XDP_MAX_INSNS];
+    uint32_t fixup_count;
+    int overflow;
+};
+
+static int Bpf(enum bpf_cmd cmd, union bpf_attr* attr);
+static int CreateMap(enum bpf_map_type type, uint32_t key_size, uint32_t value_size,
+                     uint32_t max_entries, uint32_t flags, const char* name);
+static int FillRules(struct xdp_path* path, const struct rule_table* rules,
+                     const struct filter_spec* spec);
+static int AddRuleEntries(struct xdp_path* path, const struct rule_table* rules,
+                          const struct rule* rule, uint32_t net, uint8_t len);
+static int LoadProgram(struct xdp_path* path, const struct filter_spec* spec);
+static void BuildProgram(struct xdp_builder* builder, const struct xdp_path* path,
+                         const struct filter_spec* spec);
+static void Emit(struct xdp_builder* builder, uint8_t code, uint8_t dst, uint8_t src,
+                 int16_t off, int32_t imm);
+static void EmitJump(struct xdp_builder* builder, uint8_t code, uint8_t dst, uint8_t src,
+                     int32_t imm, enum xdp_label label);
+static void EmitLoadMap(struct xdp_builder* builder, uint8_t dst, int map_fd);
+static void EmitChecksumAdjust(struct xdp_builder* builder, int16_t offset);
+static void EmitCount(struct xdp_builder* builder, const struct xdp_path* path);
+static void PlaceLabel(struct xdp_builder* builder, enum xdp_label label);
+static uint32_t PrefixMask(uint8_t len);
+static int PossibleCpus(void);
+
+int CreateXdpPath(struct xdp_path* path, const struct rule_table* rules,
+                  const struct filter_spec* spec, const char* if_name, uint32_t sockets)
+{
+    int exit_code = EXIT_FAILURE;
+    union bpf_attr attr;
+
+    if (NULL == path || NULL == rules || NULL == spec || NULL == if_name)
+    {
+        (void)fprintf(stderr, "path, rules, spec and if_name can not be NULL\n");
+        goto end;
+    }
+
+    memset(path, 0, sizeof(*path));
+    path->rules_fd = -1;
+    path->stats_fd = -1;
+    path->xsks_fd = -1;
+    path->prog_fd = -1;
+    path->link_fd = -1;
+
+    path->if_index = (int)if_nametoindex(if_name);
+    if (0 == path->if_index)
+    {
+        (void)fprintf(stderr, "Unknown interface: %s\n", if_name);
+        goto end;
+    }
+    (void)snprintf(path->if_name, sizeof(path->if_name), "%s", if_name);
+
+    if (FillRules(path, rules, spec))
+    {
+        goto clean;
+    }
+
+    path->stats_fd =
+        CreateMap(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 1, 0,
+                  "redirector_stat");
+    if (-1 == path->stats_fd)
+    {
+        goto clean;
+    }
+
+    if (0 != sockets)
+    {
+        path->xsks_fd = CreateMap(BPF_MAP_TYPE_XSKMAP, sizeof(uint32_t), sizeof(int), sockets,
+                                  0, "redirector_xsks");
+        if (-1 == path->xsks_fd)
+        {
+            goto clean;
+        }
+    }
+
+    if (LoadProgram(path, spec))
+    {
+        goto clean;
+    }
+
+    // a link detaches by itself when the last fd to it is closed, even if the process crashes
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = (uint32_t)path->prog_fd;
+    attr.link_create.target_ifindex = (uint32_t)path->if_index;
+    attr.link_create.attach_type = BPF_XDP;
+    path->link_fd = Bpf(BPF_LINK_CREATE, &attr);
+    if (-1 == path->link_fd)
+    {
+        (void)fprintf(stderr, "Could not attach XDP program to %s: %s%s\n", if_name,
+                      strerror(errno), EBUSY == errno ? ", another one is attached" : "");
+        goto clean;
+    }
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    DestroyXdpPath(path);
+end:
+    return exit_code;
+}
+
+void DestroyXdpPath(struct xdp_path* path)
+{
+    if (NULL == path)
+        return;
+
+    if (-1 != path->link_fd)
+        close(path->link_fd);
+    if (-1 != path->prog_fd)
+        close(path->prog_fd);
+    if (-1 != path->stats_fd)
+        close(path->stats_fd);
+    if (-1 != path->xsks_fd)
+        close(path->xsks_fd);
+    if (-1 != path->rules_fd)
+        close(path->rules_fd);
+
+    path->link_fd = -1;
+    path->prog_fd = -1;
+    path->stats_fd = -1;
+    path->xsks_fd = -1;
+    path->rules_fd = -1;
+}
+
+int XdpAddSocket(const struct xdp_path* path, uint32_t queue, int xsk_fd)
+{
+    int exit_code = EXIT_FAILURE;
+    union bpf_attr attr;
+
+    if (NULL == path || -1 == path->xsks_fd)
+    {
+        (void)fprintf(stderr, "path must have been created with sockets\n");
+        goto end;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)path->xsks_fd;
+    attr.key = (uint64_t)(uintptr_t)&queue;
+    attr.value = (uint64_t)(uintptr_t)&xsk_fd;
+    if (-1 == Bpf(BPF_MAP_UPDATE_ELEM, &attr))
+    {
+        perror("bpf xsk map update");
+        goto end;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int XdpForwarded(const struct xdp_path* path, uint64_t* forwarded)
+{
+    int exit_code = EXIT_FAILURE;
+    int cpus = 0;
+    int index = 0;
+    uint32_t key = 0;
+    uint64_t* values = NULL;
+    union bpf_attr attr;
+
+    if (NULL == path || NULL == forwarded)
+    {
+        (void)fprintf(stderr, "path and forwarded can not be NULL\n");
+        goto end;
+    }
+
+    // per CPU maps return one value for every possible CPU, not just the online ones
+    cpus = PossibleCpus();
+    if (cpus <= 0)
+    {
+        goto end;
+    }
+
+    values = calloc((size_t)cpus, sizeof(*values));
+    if (NULL == values)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)path->stats_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)values;
+    if (-1 == Bpf(BPF_MAP_LOOKUP_ELEM, &attr))
+    {
+        perror("bpf map lookup");
+        goto clean;
+    }
+
+    *forwarded = 0;
+    for (index = 0; index < cpus; ++index)
+    {
+        *forwarded += values[index];
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+clean:
+    NFREE(values);
+end:
+    return exit_code;
+}
+
+int XdpSetHop(const struct xdp_path* path, uint32_t rule, const uint8_t* l2)
+{
+    int exit_code = EXIT_FAILURE;
+    struct xdp_rule_key key = {0};
+    struct xdp_rule_key next = {0};
+    struct xdp_rule_value value;
+    union bpf_attr attr;
+
+    if (NULL == path || -1 == path->rules_fd)
+    {
+        (void)fprintf(stderr, "path must have a rules map\n");
+        goto end;
+    }
+
+    // a rule owns entries for every port and source prefix, walk them all, hops change rarely
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = (uint32_t)path->rules_fd;
+    attr.key = 0;
+    attr.next_key = (uint64_t)(uintptr_t)&next;
+    while (0 == Bpf(BPF_MAP_GET_NEXT_KEY, &attr))
+    {
+        key = next;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        attr.value = (uint64_t)(uintptr_t)&value;
+        if (-1 == Bpf(BPF_MAP_LOOKUP_ELEM, &attr))
+        {
+            perror("bpf map lookup");
+            goto end;
+        }
+
+        if (rule == value.rule)
+        {
+            value.forward = (uint32_t)(NULL != l2);
+            if (NULL != l2)
+            {
+                memcpy(value.l2, l2, sizeof(value.l2));
+            }
+
+            attr.flags = BPF_EXIST;
+            if (-1 == Bpf(BPF_MAP_UPDATE_ELEM, &attr))
+            {
+                perror("bpf map update");
+                goto end;
+            }
+        }
+
+        attr.flags = 0;
+        attr.value = 0;
+        attr.next_key = (uint64_t)(uintptr_t)&next;
+    }
+
+    if (ENOENT != errno)
+    {
+        perror("bpf map next key");
+        goto end;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static int Bpf(enum bpf_cmd cmd, union bpf_attr* attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int CreateMap(enum bpf_map_type type, uint32_t key_size, uint32_t value_size,
+                     uint32_t max_entries, uint32_t flags, const char* name)
+{
+    int map_fd = -1;
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    attr.map_flags = flags;
+    (void)snprintf(attr.map_name, sizeof(attr.map_name), "%s", name);
+
+    map_fd = Bpf(BPF_MAP_CREATE, &attr);
+    if (-1 == map_fd)
+    {
+        (void)fprintf(stderr, "Could not create bpf map %s: %s\n", name, strerror(errno));
+    }
+
+    return map_fd;
+}
+
+/**
+ * @brief Creates the rules map with an entry for every port of every rule.
+ *
+ * The source prefixes of the spec are intersected with every rule's prefix, so the program
+ * accepts the same sources the packet filter does. Rules are added longest prefix first, when
+ * two rules intersect a spec prefix to the same network the more specific rule keeps it.
+ */
+static int FillRules(struct xdp_path* path, const struct rule_table* rules,
+                     const struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    int len = 0;
+    uint32_t index = 0;
+    uint32_t prefix = 0;
+    uint32_t mask = 0;
+    uint32_t net = 0;
+    uint64_t max_entries = 0;
+    const struct rule* rule = NULL;
+    const struct src_prefix* src = NULL;
+
+    for (index = 0; index < rules->rule_count; ++index)
+    {
+        rule = &rules->rules[index];
+        max_entries += (uint64_t)(rule->ports.last - rule->ports.first + 1U) *
+                       (0 == spec->prefix_count ? 1U : spec->prefix_count);
+    }
+
+    if (0 == max_entries || max_entries > XDP_MAX_ENTRIES)
+    {
+        (void)fprintf(stderr, "The rules need %llu XDP map entries, at most %u fit\n",
+                      (unsigned long long)max_entries, XDP_MAX_ENTRIES);
+        goto end;
+    }
+
+    // LPM tries are never preallocated, max_entries is only a limit
+    path->rules_fd = CreateMap(BPF_MAP_TYPE_LPM_TRIE, (uint32_t)XDP_KEY_SIZE,
+                               sizeof(struct xdp_rule_value), (uint32_t)max_entries,
+                               BPF_F_NO_PREALLOC, "redirector_rule");
+    if (-1 == path->rules_fd)
+    {
+        goto end;
+    }
+
+    for (len = 32; len >= 0; --len)
+    {
+        for (index = 0; index < rules->rule_count; ++index)
+        {
+            rule = &rules->rules[index];
+            if (rule->src_len != len)
+                continue;
+
+            if (0 == spec->prefix_count &&
+                AddRuleEntries(path, rules, rule, rule->src_net, rule->src_len))
+            {
+                goto end;
+            }
+
+            for (prefix = 0; prefix < spec->prefix_count; ++prefix)
+            {
+                src = &spec->prefixes[prefix];
+                mask = src->len < rule->src_len ? PrefixMask(src->len) : rule->src_mask;
+                if ((src->addr[0] ^ rule->src_net) & mask)
+                    continue;
+
+                // the longer of two nested prefixes is their intersection
+                net = src->len > rule->src_len ? src->addr[0] : rule->src_net;
+                if (AddRuleEntries(path, rules, rule, net,
+                                   (uint8_t)(src->len > rule->src_len ? src->len : rule->src_len)))
+                {
+                    goto end;
+                }
+            }
+        }
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static int AddRuleEntries(struct xdp_path* path, const struct rule_table* rules,
+                          const struct rule* rule, uint32_t net, uint8_t len)
+{
+    int exit_code = EXIT_FAILURE;
+    uint32_t port = 0;
+    uint16_t port_n = 0;
+    uint32_t net_n = htonl(net);
+    struct xdp_rule_key key = {0};
+    struct xdp_rule_value value = {0};
+    union bpf_attr attr;
+
+    value.s_addr = rule->rewrite.s_addr.s_addr;
+    value.f_addr = rule->rewrite.f_addr.s_addr;
+    value.addr_sum = rule->rewrite.addr_sum;
+    value.port_sum = rule->rewrite.port_sum;
+    value.s_port = rule->rewrite.s_port;
+    value.f_port = rule->rewrite.f_port;
+    value.if_index = (uint32_t)rule->rewrite.if_index;
+    value.rule = (uint32_t)(rule - rules->rules);
+    // raw rules start passing, XdpSetHop turns them on once their next hop is known
+    value.forward = 0;
+
+    key.prefixlen = XDP_KEY_PREFIX_BASE + len;
+    memcpy(&key.data[sizeof(port_n)], &net_n, sizeof(net_n));
+
+    for (port = rule->ports.first; port <= rule->ports.last; ++port)
+    {
+        port_n = htons((uint16_t)port);
+        memcpy(key.data, &port_n, sizeof(port_n));
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = (uint32_t)path->rules_fd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        attr.value = (uint64_t)(uintptr_t)&value;
+        attr.flags = BPF_NOEXIST;
+
+        if (-1 == Bpf(BPF_MAP_UPDATE_ELEM, &attr))
+        {
+            // a more specific rule was added for this network already
+            if (EEXIST == errno)
+                continue;
+
+            perror("bpf map update");
+            goto end;
+        }
+        path->entries++;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static int LoadProgram(struct xdp_path* path, const struct filter_spec* spec)
+{
+    int exit_code = EXIT_FAILURE;
+    const char license[] = "GPL";
+    char* log = NULL;
+    struct xdp_builder* builder = NULL;
+    union bpf_attr attr;
+
+    builder = calloc(1, sizeof(*builder));
+    if (NULL == builder)
+    {
+        perror("calloc");
+        goto end;
+    }
+
+    BuildProgram(builder, path, spec);
+    if (builder->overflow || 0 != builder->fixup_count)
+    {
+        (void)fprintf(stderr, "XDP program does not fit in %u instructions\n", XDP_MAX_INSNS);
+        goto clean;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uint64_t)(uintptr_t)builder->insns;
+    attr.insn_cnt = builder->len;
+    attr.license = (uint64_t)(uintptr_t)license;
+    (void)snprintf(attr.prog_name, sizeof(attr.prog_name), "redirector");
+
+    path->prog_fd = Bpf(BPF_PROG_LOAD, &attr);
+    if (-1 != path->prog_fd)
+    {
+        printf("XDP %s on %s: %u map entries, %u bpf instructions\n",
+               -1 == path->xsks_fd ? "fast path" : "socket redirect", path->if_name,
+               path->entries, builder->len);
+        exit_code = EXIT_SUCCESS;
+        goto clean;
+    }
+
+    // only pay for the verifier log when there is something to explain
+    (void)fprintf(stderr, "Could not load XDP program: %s\n", strerror(errno));
+    log = calloc(1, XDP_LOG_SIZE);
+    if (NULL == log)
+    {
+        goto clean;
+    }
+
+    attr.log_level = 1;
+    attr.log_size = XDP_LOG_SIZE;
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    path->prog_fd = Bpf(BPF_PROG_LOAD, &attr);
+    if (-1 == path->prog_fd)
+    {
+        (void)fprintf(stderr, "%s\n", log);
+    }
+    else
+    {
+        close(path->prog_fd);
+        path->prog_fd = -1;
+    }
+
+clean:
+    NFREE(log);
+    NFREE(builder);
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Emits the program. r6 holds the context, r7 the frame, r8 the matched rule and r9 the
+ * checksum delta of the address change, which the UDP checksum shares with the IP one. With
+ * sockets the program stops after the lookup and redirects on the rx queue index.
+ */
+static void BuildProgram(struct xdp_builder* builder, const struct xdp_path* path,
+                         const struct filter_spec* spec)
+{
+    size_t word = 0;
+
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6,
+         (int16_t)offsetof(struct xdp_md, data), 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_9, BPF_REG_6,
+         (int16_t)offsetof(struct xdp_md, data_end), 0);
+
+    // the verifier only allows access to bytes a bounds check has proven to be there
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, HEADERS_LEN);
+    EmitJump(builder, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_9, 0, XDP_LABEL_PASS);
+
+    if (spec->min_len > HEADERS_LEN)
+    {
+        Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+        Emit(builder, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, (int32_t)spec->min_len);
+        EmitJump(builder, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_9, 0, XDP_LABEL_PASS);
+    }
+
+    if (0 != spec->max_len)
+    {
+        Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+        Emit(builder, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, (int32_t)spec->max_len);
+        EmitJump(builder, BPF_JMP | BPF_JLT | BPF_X, BPF_REG_2, BPF_REG_9, 0, XDP_LABEL_PASS);
+    }
+
+    // loads are in host order, so the constants compared against are converted once here
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_ETHERTYPE, 0);
+    EmitJump(builder, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, htons(ETH_P_IP), XDP_LABEL_PASS);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_B, BPF_REG_2, BPF_REG_7, OFF_IP4_VHL, 0);
+    EmitJump(builder, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, IP4_VHL_PLAIN, XDP_LABEL_PASS);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_B, BPF_REG_2, BPF_REG_7, OFF_IP4_PROTO, 0);
+    EmitJump(builder, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, IPPROTO_UDP, XDP_LABEL_PASS);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_IP4_FRAG, 0);
+    Emit(builder, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_2, 0, 0, htons(IP_MF | IP_OFFMASK));
+    EmitJump(builder, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 0, XDP_LABEL_PASS);
+
+    // key: prefix length, destination port, source address, copied in 16 bit halves
+    Emit(builder, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, STACK_KEY,
+         XDP_KEY_PREFIX_BASE + 32);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_UDP_DPORT, 0);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_2, STACK_KEY_PORT, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_IP4_SRC, 0);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_2, STACK_KEY_ADDR, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_IP4_SRC + 2, 0);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_2, STACK_KEY_ADDR + 2, 0);
+
+    EmitLoadMap(builder, BPF_REG_1, path->rules_fd);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, STACK_KEY);
+    Emit(builder, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    EmitJump(builder, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, XDP_LABEL_PASS);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_0, 0, 0);
+
+    // userspace does the rewrite, the frame only has to get to the socket of its queue
+    if (-1 != path->xsks_fd)
+    {
+        EmitCount(builder, path);
+        EmitLoadMap(builder, BPF_REG_1, path->xsks_fd);
+        Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+             (int16_t)offsetof(struct xdp_md, rx_queue_index), 0);
+        Emit(builder, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+        Emit(builder, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+        Emit(builder, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+        PlaceLabel(builder, XDP_LABEL_PASS);
+        Emit(builder, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+        Emit(builder, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+        return;
+    }
+
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, forward), 0);
+    EmitJump(builder, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 0, XDP_LABEL_PASS);
+
+    // the frame leaves addressed to the next hop, not back to this host
+    for (word = 0; word < sizeof(((struct xdp_rule_value*)NULL)->l2) / sizeof(uint32_t); ++word)
+    {
+        Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_8,
+             (int16_t)(offsetof(struct xdp_rule_value, l2) + word * sizeof(uint32_t)), 0);
+        Emit(builder, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2,
+             (int16_t)(word * sizeof(uint32_t)), 0);
+    }
+
+    // ~m of both old addresses plus the precomputed m', the same delta ParseIp builds
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_9, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, addr_sum), 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_7, OFF_IP4_SRC, 0);
+    Emit(builder, BPF_ALU | BPF_XOR | BPF_K, BPF_REG_3, 0, 0, -1);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_9, BPF_REG_3, 0, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_7, OFF_IP4_DST, 0);
+    Emit(builder, BPF_ALU | BPF_XOR | BPF_K, BPF_REG_3, 0, 0, -1);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_9, BPF_REG_3, 0, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_IP4_SUM, 0);
+    EmitChecksumAdjust(builder, OFF_IP4_SUM);
+
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, s_addr), 0);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2, OFF_IP4_SRC, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, f_addr), 0);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2, OFF_IP4_DST, 0);
+
+    // a zero UDP checksum means the sender did not compute one, keep it that way
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_7, OFF_UDP_SUM, 0);
+    EmitJump(builder, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 0, XDP_LABEL_PORTS);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, port_sum), 0);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_9, BPF_REG_3, 0, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_7, OFF_UDP_PORTS, 0);
+    Emit(builder, BPF_ALU | BPF_XOR | BPF_K, BPF_REG_3, 0, 0, -1);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_9, BPF_REG_3, 0, 0);
+    EmitChecksumAdjust(builder, OFF_UDP_SUM);
+
+    PlaceLabel(builder, XDP_LABEL_PORTS);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, s_port), 0);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_2, OFF_UDP_PORTS, 0);
+
+    EmitCount(builder, path);
+
+    // back out of the interface it came in on, or over to the rule's interface
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_8,
+         (int16_t)offsetof(struct xdp_rule_value, if_index), 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+         (int16_t)offsetof(struct xdp_md, ingress_ifindex), 0);
+    EmitJump(builder, BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_2, 0, XDP_LABEL_REDIRECT);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_TX);
+    Emit(builder, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    PlaceLabel(builder, XDP_LABEL_REDIRECT);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0);
+    Emit(builder, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect);
+    Emit(builder, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    PlaceLabel(builder, XDP_LABEL_PASS);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    Emit(builder, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+static void Emit(struct xdp_builder* builder, uint8_t code, uint8_t dst, uint8_t src,
+                 int16_t off, int32_t imm)
+{
+    if (builder->len == XDP_MAX_INSNS)
+    {
+        builder->overflow = 1;
+        return;
+    }
+
+    builder->insns[builder->len].code = code;
+    builder->insns[builder->len].dst_reg = (unsigned int)dst & 0xFU;
+    builder->insns[builder->len].src_reg = (unsigned int)src & 0xFU;
+    builder->insns[builder->len].off = off;
+    builder->insns[builder->len].imm = imm;
+    builder->len++;
+}
+
+/**
+ * @brief Emits a jump whose offset is patched in when label is placed.
+ */
+static void EmitJump(struct xdp_builder* builder, uint8_t code, uint8_t dst, uint8_t src,
+                     int32_t imm, enum xdp_label label)
+{
+    if (builder->len == XDP_MAX_INSNS)
+    {
+        builder->overflow = 1;
+        return;
+    }
+
+    builder->fixups[builder->fixup_count] = builder->len;
+    builder->fixup_labels[builder->fixup_count] = label;
+    builder->fixup_count++;
+
+    Emit(builder, code, dst, src, 0, imm);
+}
+
+/**
+ * @brief Loads a map into a register, a 16 byte instruction the kernel resolves from the fd.
+ */
+static void EmitLoadMap(struct xdp_builder* builder, uint8_t dst, int map_fd)
+{
+    Emit(builder, BPF_LD | BPF_IMM | BPF_DW, dst, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    Emit(builder, 0, 0, 0, 0, 0);
+}
+
+/**
+ * @brief Applies the delta in r9 to the checksum in r2 and stores it at offset, the same
+ * HC' = ~(~HC + ~m + m') checksum_adjust computes. r3 is clobbered.
+ */
+static void EmitChecksumAdjust(struct xdp_builder* builder, int16_t offset)
+{
+    int fold = 0;
+
+    Emit(builder, BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_2, 0, 0, 0xFFFF);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_2, BPF_REG_9, 0, 0);
+
+    // the sum stays below 2^36, three folds bring it down to 16 bits
+    for (fold = 0; fold < 3; ++fold)
+    {
+        Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_2, 0, 0);
+        Emit(builder, BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_3, 0, 0, 16);
+        Emit(builder, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_2, 0, 0, 0xFFFF);
+        Emit(builder, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_2, BPF_REG_3, 0, 0);
+    }
+
+    Emit(builder, BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_2, 0, 0, 0xFFFF);
+    Emit(builder, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 1, 0);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0xFFFF);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_H, BPF_REG_7, BPF_REG_2, offset, 0);
+}
+
+/**
+ * @brief Adds one to the per CPU counter, no atomic needed. r0 to r5 are clobbered.
+ */
+static void EmitCount(struct xdp_builder* builder, const struct xdp_path* path)
+{
+    Emit(builder, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, STACK_STATS_KEY, 0);
+    EmitLoadMap(builder, BPF_REG_1, path->stats_fd);
+    Emit(builder, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, STACK_STATS_KEY);
+    Emit(builder, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    Emit(builder, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 3, 0);
+    Emit(builder, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_2, BPF_REG_0, 0, 0);
+    Emit(builder, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, 1);
+    Emit(builder, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_2, 0, 0);
+}
+
+/**
+ * @brief Points every pending jump to label at the next instruction.
+ */
+static void PlaceLabel(struct xdp_builder* builder, enum xdp_label label)
+{
+    uint32_t index = 0;
+    uint32_t kept = 0;
+
+    for (index = 0; index < builder->fixup_count; ++index)
+    {
+        if (builder->fixup_labels[index] != label)
+        {
+            builder->fixups[kept] = builder->fixups[index];
+            builder->fixup_labels[kept] = builder->fixup_labels[index];
+            kept++;
+            continue;
+        }
+
+        builder->insns[builder->fixups[index]].off =
+            (int16_t)(builder->len - builder->fixups[index] - 1U);
+    }
+
+    builder->fixup_count = kept;
+}
+
+static uint32_t PrefixMask(uint8_t len)
+{
+    return 0 == len ? 0 : UINT32_MAX << (32U - len);
+}
+
+/**
+ * @brief Reads how many CPUs the kernel could ever bring online, "0-7" or "0,2-5" style.
+ *
+ * @return int highest possible CPU plus one, or -1 on failure.
+ */
+static int PossibleCpus(void)
+{
+    int cpus = -1;
+    char list[128] = {0};
+    char* cursor = list;
+    char* endptr = NULL;
+    unsigned long cpu = 0;
+    FILE* file = NULL;
+
+    file = fopen(XDP_CPU_PATH, "r");
+    if (NULL == file)
+    {
+        perror("fopen " XDP_CPU_PATH);
+        goto end;
+    }
+
+    if (NULL == fgets(list, sizeof(list), file))
+    {
+        (void)fprintf(stderr, "Could not read %s\n", XDP_CPU_PATH);
+        goto clean;
+    }
+
+    while ('\0' != *cursor && '\n' != *cursor)
+    {
+        cpu = strtoul(cursor, &endptr, 10);
+        if (endptr == cursor)
+        {
+            (void)fprintf(stderr, "Invalid CPU list: %s\n", list);
+            cpus = -1;
+            goto clean;
+        }
+
+        if ((int)cpu + 1 > cpus)
+        {
+            cpus = (int)cpu + 1;
+        }
+
+        cursor = endptr;
+        if (',' == *cursor || '-' == *cursor)
+        {
+            cursor++;
+        }
+    }
+
+clean:
+    (void)fclose(file);
+end:
+    return cpus;
+}
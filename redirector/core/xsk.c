@@ -0,0 +1,373 @@
+#include <errno.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "xsk.h"
+
+static int MapRing(int fd, const struct xdp_ring_offset* off, off_t pgoff, uint32_t size,
+                   size_t desc_size, struct xsk_ring* ring);
+static void UnmapRing(struct xsk_ring* ring);
+static int BindSocket(struct xsk_socket* xsk, uint16_t flags);
+static void KickTx(struct xsk_socket* xsk);
+
+int XskOpen(struct xsk_socket* xsk, int if_index, uint32_t queue, enum xsk_mode mode)
+{
+    int exit_code = EXIT_FAILURE;
+    int ring_size = 0;
+    uint32_t frame = 0;
+    char if_name[IF_NAMESIZE] = {0};
+    void* umem = MAP_FAILED;
+    struct xdp_umem_reg reg = {0};
+    struct xdp_mmap_offsets off = {0};
+    struct xdp_options options = {0};
+    socklen_t len = sizeof(off);
+
+    if (NULL == xsk || 0 >= if_index)
+    {
+        (void)fprintf(stderr, "xsk can not be NULL and if_index must be valid\n");
+        goto end;
+    }
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->if_index = if_index;
+    xsk->queue = queue;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (-1 == xsk->fd)
+    {
+        perror("socket AF_XDP");
+        goto end;
+    }
+
+    xsk->umem_len = (size_t)XSK_FRAME_COUNT * XSK_FRAME_SIZE;
+    umem = mmap(NULL, xsk->umem_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (MAP_FAILED == umem)
+    {
+        perror("mmap umem");
+        goto clean;
+    }
+    xsk->umem = umem;
+
+    reg.addr = (uint64_t)(uintptr_t)xsk->umem;
+    reg.len = xsk->umem_len;
+    reg.chunk_size = XSK_FRAME_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)))
+    {
+        perror("setsockopt XDP_UMEM_REG");
+        goto clean;
+    }
+
+    // the fill and completion rings can hold every frame, so handing one back never fails
+    ring_size = XSK_FRAME_COUNT;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)))
+    {
+        perror("setsockopt XDP_UMEM_FILL_RING");
+        goto clean;
+    }
+
+    ring_size = XSK_RING_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)))
+    {
+        perror("setsockopt XDP_RX_RING");
+        goto clean;
+    }
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len))
+    {
+        perror("getsockopt XDP_MMAP_OFFSETS");
+        goto clean;
+    }
+
+    if (MapRing(xsk->fd, &off.fr, (off_t)XDP_UMEM_PGOFF_FILL_RING, XSK_FRAME_COUNT,
+                sizeof(uint64_t), &xsk->fill) ||
+        MapRing(xsk->fd, &off.cr, (off_t)XDP_UMEM_PGOFF_COMPLETION_RING, XSK_FRAME_COUNT,
+                sizeof(uint64_t), &xsk->comp) ||
+        MapRing(xsk->fd, &off.rx, XDP_PGOFF_RX_RING, XSK_RING_SIZE, sizeof(struct xdp_desc),
+                &xsk->rx) ||
+        MapRing(xsk->fd, &off.tx, XDP_PGOFF_TX_RING, XSK_RING_SIZE, sizeof(struct xdp_desc),
+                &xsk->tx))
+    {
+        goto clean;
+    }
+
+    for (frame = 0; frame < XSK_FRAME_COUNT; ++frame)
+    {
+        XskRecycle(xsk, (uint64_t)frame * XSK_FRAME_SIZE);
+    }
+    __atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+
+    if (XSK_MODE_COPY == mode || BindSocket(xsk, XDP_ZEROCOPY))
+    {
+        if (XSK_MODE_ZEROCOPY == mode || BindSocket(xsk, XDP_COPY))
+        {
+            (void)fprintf(stderr, "Could not bind AF_XDP socket to queue %u: %s\n", queue,
+                          strerror(errno));
+            goto clean;
+        }
+    }
+
+    len = sizeof(options);
+    if (0 == getsockopt(xsk->fd, SOL_XDP, XDP_OPTIONS, &options, &len))
+    {
+        xsk->zerocopy = !!(options.flags & XDP_OPTIONS_ZEROCOPY);
+    }
+
+    printf("AF_XDP socket on %s queue %u, %s mode, %u frames of %u bytes\n",
+           NULL == if_indextoname((unsigned int)if_index, if_name) ? "?" : if_name, queue,
+           xsk->zerocopy ? "zero copy" : "copy", XSK_FRAME_COUNT, XSK_FRAME_SIZE);
+
+    exit_code = EXIT_SUCCESS;
+    goto end;
+
+clean:
+    XskClose(xsk);
+end:
+    return exit_code;
+}
+
+void XskClose(struct xsk_socket* xsk)
+{
+    if (NULL == xsk)
+        return;
+
+    UnmapRing(&xsk->fill);
+    UnmapRing(&xsk->comp);
+    UnmapRing(&xsk->rx);
+    UnmapRing(&xsk->tx);
+
+    // the socket goes first, the kernel may still be writing into the UMEM until then
+    if (-1 != xsk->fd)
+        close(xsk->fd);
+    xsk->fd = -1;
+
+    if (NULL != xsk->umem)
+        (void)munmap(xsk->umem, xsk->umem_len);
+    xsk->umem = NULL;
+}
+
+uint32_t XskReceive(struct xsk_socket* xsk, struct xdp_desc* descs, uint32_t max)
+{
+    uint32_t count = 0;
+    uint32_t index = 0;
+    const struct xdp_desc* ring = xsk->rx.descs;
+
+    count = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - xsk->rx.cached;
+    if (count > max)
+    {
+        count = max;
+    }
+
+    for (index = 0; index < count; ++index)
+    {
+        descs[index] = ring[(xsk->rx.cached + index) & xsk->rx.mask];
+    }
+
+    // the descriptors are copied out, so the slots can go back to the kernel right away
+    xsk->rx.cached += count;
+    __atomic_store_n(xsk->rx.consumer, xsk->rx.cached, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+void XskRecycle(struct xsk_socket* xsk, uint64_t addr)
+{
+    uint64_t* ring = xsk->fill.descs;
+
+    // never full, the ring has a slot for every frame of the UMEM
+    ring[xsk->fill.cached & xsk->fill.mask] = addr;
+    xsk->fill.cached++;
+}
+
+int XskSend(struct xsk_socket* xsk, uint64_t addr, uint32_t len)
+{
+    int exit_code = EXIT_FAILURE;
+    struct xdp_desc* ring = xsk->tx.descs;
+
+    if (xsk->tx.cached - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) == XSK_RING_SIZE)
+    {
+        KickTx(xsk);
+        if (xsk->tx.cached - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) ==
+            XSK_RING_SIZE)
+        {
+            goto end;
+        }
+    }
+
+    ring[xsk->tx.cached & xsk->tx.mask].addr = addr;
+    ring[xsk->tx.cached & xsk->tx.mask].len = len;
+    ring[xsk->tx.cached & xsk->tx.mask].options = 0;
+    xsk->tx.cached++;
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+int XskFlush(struct xsk_socket* xsk)
+{
+    uint32_t count = 0;
+    uint32_t index = 0;
+    const uint64_t* ring = xsk->comp.descs;
+
+    KickTx(xsk);
+
+    // sent frames become free again once the kernel reports them on the completion ring
+    count = __atomic_load_n(xsk->comp.producer, __ATOMIC_ACQUIRE) - xsk->comp.cached;
+    for (index = 0; index < count; ++index)
+    {
+        XskRecycle(xsk, ring[(xsk->comp.cached + index) & xsk->comp.mask]);
+    }
+    xsk->comp.cached += count;
+    __atomic_store_n(xsk->comp.consumer, xsk->comp.cached, __ATOMIC_RELEASE);
+
+    __atomic_store_n(xsk->fill.producer, xsk->fill.cached, __ATOMIC_RELEASE);
+
+    return EXIT_SUCCESS;
+}
+
+int XskDrops(struct xsk_socket* xsk, uint64_t* drops)
+{
+    int exit_code = EXIT_FAILURE;
+    uint64_t total = 0;
+    struct xdp_statistics stats = {0};
+    socklen_t len = sizeof(stats);
+
+    if (NULL == xsk || NULL == drops)
+    {
+        (void)fprintf(stderr, "xsk and drops can not be NULL\n");
+        goto end;
+    }
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &stats, &len))
+    {
+        perror("getsockopt XDP_STATISTICS");
+        goto end;
+    }
+
+    // unlike PACKET_STATISTICS these are totals, not reset on read
+    total = stats.rx_dropped + stats.rx_invalid_descs + stats.rx_ring_full;
+    *drops = total - xsk->drops_seen;
+    xsk->drops_seen = total;
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+uint64_t XskSendErrors(struct xsk_socket* xsk)
+{
+    uint64_t errors = xsk->send_errors;
+
+    xsk->send_errors = 0;
+    return errors;
+}
+
+int ParseXskMode(const char* str, enum xsk_mode* mode)
+{
+    int exit_code = EXIT_FAILURE;
+
+    if (NULL == str || NULL == mode)
+    {
+        (void)fprintf(stderr, "str and mode can not be NULL\n");
+        goto end;
+    }
+
+    if (0 == strcmp(str, "copy"))
+    {
+        *mode = XSK_MODE_COPY;
+    }
+    else if (0 == strcmp(str, "zerocopy"))
+    {
+        *mode = XSK_MODE_ZEROCOPY;
+    }
+    else
+    {
+        (void)fprintf(stderr, "Invalid AF_XDP mode: %s\n", str);
+        goto end;
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static int MapRing(int fd, const struct xdp_ring_offset* off, off_t pgoff, uint32_t size,
+                   size_t desc_size, struct xsk_ring* ring)
+{
+    int exit_code = EXIT_FAILURE;
+    void* map = MAP_FAILED;
+
+    ring->map_len = off->desc + size * desc_size;
+    map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+               pgoff);
+    if (MAP_FAILED == map)
+    {
+        perror("mmap xsk ring");
+        goto end;
+    }
+
+    ring->map = map;
+    ring->producer = (uint32_t*)((unsigned char*)map + off->producer);
+    ring->consumer = (uint32_t*)((unsigned char*)map + off->consumer);
+    ring->descs = (unsigned char*)map + off->desc;
+    ring->mask = size - 1;
+    ring->cached = 0;  // a new socket's rings all start at index 0
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+static void UnmapRing(struct xsk_ring* ring)
+{
+    if (NULL != ring->map)
+        (void)munmap(ring->map, ring->map_len);
+    memset(ring, 0, sizeof(*ring));
+}
+
+static int BindSocket(struct xsk_socket* xsk, uint16_t flags)
+{
+    struct sockaddr_xdp addr = {0};
+
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_flags = flags;
+    addr.sxdp_ifindex = (uint32_t)xsk->if_index;
+    addr.sxdp_queue_id = xsk->queue;
+
+    return bind(xsk->fd, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+/**
+ * @brief Publishes the TX ring and has the kernel send whatever it has not consumed yet. Copy
+ * mode sends from inside the syscall, zero copy drivers are only woken up. Failed wakeups
+ * are counted for XskSendErrors instead of printed, this runs on every flush.
+ */
+static void KickTx(struct xsk_socket* xsk)
+{
+    if (xsk->tx.cached == __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_store_n(xsk->tx.producer, xsk->tx.cached, __ATOMIC_RELEASE);
+
+    // EAGAIN and ENOBUFS only mean the kernel picks the rest up on the next kick
+    if (-1 == sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) && EAGAIN != errno &&
+        EBUSY != errno && ENOBUFS != errno && ENETDOWN != errno)
+    {
+        xsk->send_errors++;
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "pool.h"
+
+struct uring;
+struct tstamp_ring;
+
+#define BATCH_DEFAULT_SIZE 32U
+#define BATCH_MAX_SIZE 1024U
+#define BATCH_DEFAULT_DELAY_US 0U
+#define BATCH_GSO_MAX_SEGMENTS 64U  // UDP_MAX_SEGMENTS of the oldest kernels with UDP_SEGMENT
+#define BATCH_GSO_MAX_BYTES 65507U  // largest IPv4 UDP payload
+
+/**
+ * Control message carrying the UDP_SEGMENT size of one coalesced send.
+ */
+union gso_cmsg
+{
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+};
+
+/**
+ * Payloads waiting to go out of the UDP socket with a single sendmmsg(). With GSO, a run of
+ * payloads to the same destination shares one message whose iovecs the kernel cuts back into
+ * datagrams of the first payload's size, so only the last of them may be shorter.
+ */
+struct udp_batch
+{
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    struct pkt_buf** bufs;
+    union gso_cmsg* cmsgs;
+    int gso;
+    uint32_t size;
+    uint32_t count;      // payloads, one iovec each
+    uint32_t msg_count;  // messages they are spread over
+    uint32_t max_delay_us;
+    uint64_t oldest_ns;
+    struct tstamp_ring* stamps;  // every message sent is recorded here with -t, NULL otherwise
+};
+
+/**
+ * @brief Allocates room for size queued payloads.
+ *
+ * @param batch Batch to initialize.
+ * @param size Most payloads sent by one sendmmsg(), at most BATCH_MAX_SIZE.
+ * @param max_delay_us How long the oldest payload may wait for the batch to fill, 0 to flush
+ * at the end of every wakeup.
+ * @param gso Coalesce payloads to the same destination into UDP_SEGMENT sends.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateUdpBatch(struct udp_batch* batch, uint32_t size, uint32_t max_delay_us, int gso);
+
+/**
+ * @brief Queues a payload, takes a reference on buf until the batch is flushed.
+ *
+ * @param batch Batch to queue on, must not be full.
+ * @param data Payload to send.
+ * @param len Length of the payload.
+ * @param addr Destination, must stay valid until the batch is flushed.
+ * @param buf Buffer holding data, NULL if data does not live in a pool buffer.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int UdpBatchAdd(struct udp_batch* batch, unsigned char* data, size_t len,
+                const struct sockaddr_in* addr, struct pkt_buf* buf);
+
+/**
+ * @brief Checks that a UDP socket can send with UDP_SEGMENT, the kernel has it since 4.18.
+ *
+ * @param sock UDP socket to check.
+ * @return int EXIT_SUCCESS if it can, EXIT_FAILURE otherwise.
+ */
+int UdpGsoSupported(int sock);
+
+/**
+ * @brief Sends every queued payload and releases their buffers. With stamps set, every message
+ * that went out is recorded with the receive timestamp of its first payload.
+ *
+ * @param batch Batch to flush.
+ * @param sock UDP socket to send on.
+ * @param pool Pool the queued buffers belong to, may be NULL if none were queued with a buffer.
+ * @return int number of payloads that could not be sent.
+ */
+int UdpBatchFlush(struct udp_batch* batch, int sock, struct buf_pool* pool);
+
+/**
+ * @brief Sends the queued payloads without waiting for room on the socket, then releases the
+ * batch. Payloads are sent in order, sending stops at the first message the socket has no room
+ * for.
+ *
+ * @param batch Batch to send.
+ * @param sock UDP socket to send on.
+ * @param pool Pool the queued buffers belong to, may be NULL if none were queued with a buffer.
+ * @param done Set to the number of payloads from the start of the batch that were sent or
+ * failed, the ones after them were not tried. Their buffers are released all the same, a
+ * caller that wants to retry them has to hold references of its own.
+ * @param msgs_done Set to the number of messages those payloads went out in, a GSO message
+ * counts once.
+ * @return int number of payloads that could not be sent for reasons other than a full socket.
+ */
+int UdpBatchSendSome(struct udp_batch* batch, int sock, struct buf_pool* pool, uint32_t* done,
+                     uint32_t* msgs_done);
+
+/**
+ * @brief Queues every message of the batch on an io_uring instead of sending it, then releases
+ * the batch. The ring keeps its own references until the sends complete.
+ *
+ * @param batch Batch to submit.
+ * @param sock UDP socket to send on.
+ * @param ring Ring to queue on, the caller submits it.
+ * @param pool Pool the queued buffers belong to, may be NULL if none were queued with a buffer.
+ * @return int number of payloads that could not be queued.
+ */
+int UdpBatchSubmit(struct udp_batch* batch, int sock, struct uring* ring, struct buf_pool* pool);
+
+/**
+ * @brief Milliseconds until the batch is due, for use as an epoll timeout.
+ *
+ * @param batch Batch to check.
+ * @param now_ns Current CLOCK_MONOTONIC time.
+ * @return int -1 if nothing is queued, 0 if the batch should be flushed now.
+ */
+int UdpBatchTimeout(const struct udp_batch* batch, uint64_t now_ns);
+void DestroyUdpBatch(struct udp_batch* batch);
+#endif /*BATCH_H*/
\ No newline at end of file
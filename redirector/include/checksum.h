@@ -5,7 +5,70 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * @brief Picks the fastest one's complement sum kernel this CPU supports (AVX2, SSE2 or the
+ * portable 64 bit accumulator). Call once at startup, the portable kernel is used until then.
+ */
+void checksum_init(void);
+
+/**
+ * @brief Switches to one kernel by name, for tests and benchmarks that compare them.
+ *
+ * @param name generic, sse2 or avx2.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the name is unknown or the CPU lacks it.
+ */
+int checksum_use(const char* name);
+
+/**
+ * @brief Name of the kernel checksum_init picked.
+ */
+const char* checksum_impl(void);
+
+/**
+ * @brief Adds data to a one's complement sum, any alignment and any length.
+ *
+ * @param data Start of the data, summed as 16 bit words in memory order.
+ * @param len Length in bytes, an odd trailing byte is zero padded.
+ * @param sum Sum to add to, 0 to start a new one.
+ * @return uint64_t the unfolded sum.
+ */
+uint64_t checksum_partial(const void* data, size_t len, uint64_t sum);
+
+/**
+ * @brief Folds a sum from checksum_partial to 16 bits, without the final complement.
+ */
+uint16_t checksum_fold(uint64_t sum);
+
 uint16_t ip_checksum(struct ip* p_ip_header, size_t len);
 uint16_t udp_checksum(struct udphdr* p_udp_header, size_t len, uint32_t src_addr,
                       uint32_t dest_addr);
+
+/**
+ * @brief Accumulates the change of a 16 bit field into a checksum delta (RFC 1624).
+ *
+ * Values are taken as they sit in the packet, no byte order conversion is needed.
+ *
+ * @param delta Delta accumulated so far, 0 to start a new one.
+ * @param old_value Value the field held when the checksum was computed.
+ * @param new_value Value the field holds now.
+ * @return uint32_t the updated delta, unfolded.
+ */
+uint32_t checksum_diff16(uint32_t delta, uint16_t old_value, uint16_t new_value);
+
+/**
+ * @brief Accumulates the change of a 32 bit field, an IPv4 address, into a checksum delta.
+ */
+uint32_t checksum_diff32(uint32_t delta, uint32_t old_value, uint32_t new_value);
+
+/**
+ * @brief Applies an accumulated delta to a checksum, HC' = ~(~HC + ~m + m') from RFC 1624.
+ *
+ * Constant time no matter how much data the checksum covers. A result of 0x0000 and 0xFFFF
+ * are the same value in one's complement, callers that can not send 0x0000 (UDP) map it.
+ *
+ * @param check Checksum as it sits in the header.
+ * @param delta Delta built with checksum_diff16 and checksum_diff32.
+ * @return uint16_t the adjusted checksum.
+ */
+uint16_t checksum_adjust(uint16_t check, uint32_t delta);
 #endif /*CHECKSUM_H*/
\ No newline at end of file
@@ -1,5 +1,7 @@
 #ifndef COMMON_H
 #define COMMON_H
+#include <stdint.h>
+#include <time.h>
 
 #define NFREE(ptr)  \
     do              \
@@ -8,4 +10,34 @@
         ptr = NULL; \
     } while (0)
 
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+/**
+ * @brief Current CLOCK_MONOTONIC time, served from the vDSO without a syscall.
+ *
+ * @return uint64_t nanoseconds since an unspecified starting point.
+ */
+static inline uint64_t MonotonicNs(void)
+{
+    struct timespec now = {0};
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Current CLOCK_REALTIME time, the clock kernel software timestamps are taken with.
+ *
+ * @return uint64_t nanoseconds since the epoch.
+ */
+static inline uint64_t RealtimeNs(void)
+{
+    struct timespec now = {0};
+
+    (void)clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
 #endif /*COMMON_H*/
\ No newline at end of file
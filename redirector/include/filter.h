@@ -0,0 +1,112 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include <linux/filter.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_MAX_PORT_RANGES 64U
+#define FILTER_MAX_PREFIXES 32U
+#define FILTER_MAX_INSNS 1024U
+
+/**
+ * Inclusive range of UDP destination ports, host order. A single port has first == last.
+ */
+struct port_range
+{
+    uint16_t first;
+    uint16_t last;
+};
+
+/**
+ * Source network, the address words are in host order as cBPF loads them.
+ */
+struct src_prefix
+{
+    int family;
+    uint8_t len;
+    uint32_t addr[4];
+};
+
+/**
+ * What the kernel lets through to the packet socket, everything else is dropped before it is
+ * queued, copied or wakes anyone up.
+ */
+struct filter_spec
+{
+    struct port_range ports[FILTER_MAX_PORT_RANGES];
+    uint32_t port_count;
+    struct src_prefix prefixes[FILTER_MAX_PREFIXES];
+    uint32_t prefix_count;
+    int ipv4;
+    int ipv6;
+    uint32_t min_len;
+    uint32_t max_len;
+};
+
+struct filter_prog
+{
+    struct sock_filter insns[FILTER_MAX_INSNS];
+    uint16_t len;
+};
+
+/**
+ * @brief Adds the ports of a list like "9000,9100-9199" to the spec.
+ *
+ * @param str Comma separated ports and inclusive port ranges.
+ * @param spec Spec the ranges are appended to.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int ParsePortRanges(const char* str, struct filter_spec* spec);
+
+/**
+ * @brief Adds the networks of a list like "10.0.0.0/8,192.168.1.7,2001:db8::/32" to the spec.
+ *
+ * Host bits set in a prefix are an error, a bare address is a host route.
+ *
+ * @param str Comma separated IPv4 and IPv6 prefixes.
+ * @param spec Spec the prefixes are appended to.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int ParseSourcePrefixes(const char* str, struct filter_spec* spec);
+
+/**
+ * @brief Parses "MIN-MAX", "MIN-" or "-MAX" into the frame length bounds of the spec.
+ *
+ * @param str Inclusive bounds on the frame length including the ethernet header.
+ * @param spec Spec whose min_len and max_len are set.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int ParseLengthRange(const char* str, struct filter_spec* spec);
+
+/**
+ * @brief Compiles a spec into a classic BPF program for SO_ATTACH_FILTER.
+ *
+ * Accepted frames are ethernet IPv4 or IPv6 UDP to one of the ports, from one of the prefixes
+ * when any are given for that family, within the length bounds. IPv4 fragments, IPv4 headers
+ * that are not version 4 with a length of at least 20 bytes, and IPv6 with extension headers
+ * are dropped. The accepted capture length is the ethernet header plus the IP datagram, link
+ * layer padding is never copied.
+ *
+ * @param spec What to accept, at least one port and one family.
+ * @param prog Set to the program.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int BuildFilter(const struct filter_spec* spec, struct filter_prog* prog);
+
+/**
+ * @brief Compiles the PACKET_FANOUT_CBPF program that picks the member of a fanout group.
+ *
+ * IPv4 UDP to a port of owned_ports goes to member (port - first) % workers, so a worker that
+ * only hands out ports of its own residue gets every datagram sent back to them. Anything else
+ * is spread by source address and port, or by source address alone with by_source.
+ *
+ * @param owned_ports Ports split between the members, NULL if no replies are steered.
+ * @param workers Number of members.
+ * @param by_source Keep every datagram of a source address on one member, for per source state
+ * such as the rate limiter's buckets.
+ * @param prog Set to the program.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int BuildFanoutFilter(const struct port_range* owned_ports, uint32_t workers, int by_source,
+                      struct filter_prog* prog);
+#endif /*FILTER_H*/
@@ -0,0 +1,161 @@
+#ifndef FLOW_H
+#define FLOW_H
+#include <linux/if_ether.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "rewrite.h"
+#include "rules.h"
+
+#define FLOW_WHEEL_SLOTS 4096U  // one second ticks, longer than any timeout
+#define FLOW_MAX_TIMEOUT 3600U
+#define FLOW_DEFAULT_TIMEOUT 30U
+#define FLOW_NONE UINT32_MAX
+
+/**
+ * The conversation a datagram belongs to, as the sender addressed it. Network order.
+ */
+struct flow_key
+{
+    uint32_t client_addr;
+    uint32_t orig_addr;
+    uint16_t client_port;
+    uint16_t orig_port;
+};
+
+/**
+ * One tracked conversation, a cache line each. The flow owns the source port its datagrams are
+ * forwarded from, a reply to that port finds it without hashing. The links chain it into its
+ * timer wheel bucket while in use and into the free list otherwise.
+ */
+struct flow
+{
+    _Alignas(64) struct flow_key key;
+    uint32_t next;
+    uint32_t prev;
+    uint16_t nat_port;  // network order
+    uint16_t rule;
+    uint32_t expires;   // tick of the wheel bucket the flow sits in
+    uint32_t forwarded;
+    uint64_t last_seen_ns;
+    uint32_t replied;
+    uint8_t client_mac[ETH_ALEN];
+    uint8_t local_mac[ETH_ALEN];
+    uint8_t used;
+};
+
+/**
+ * Open addressing index from key to flow. The hash is kept next to the flow so most probes
+ * never touch the flow itself.
+ */
+struct flow_slot
+{
+    uint32_t hash;
+    uint32_t flow;  // FLOW_NONE when empty
+};
+
+/**
+ * The flows of one worker, owned by that worker alone. Every flow is preallocated, one per
+ * source port the worker may hand out: the ports of the range whose offset from its first port
+ * leaves the worker's index as remainder. Expiry is lazy, a flow only moves to a later wheel
+ * bucket once the wheel reaches the bucket it was filed under.
+ */
+struct flow_table
+{
+    struct flow* flows;
+    uint32_t flow_count;
+    struct flow_slot* slots;
+    uint32_t slot_mask;
+    uint32_t free_list;
+    uint32_t active;
+    uint32_t wheel[FLOW_WHEEL_SLOTS];
+    uint32_t tick;  // next wheel bucket to expire
+    uint32_t timeout;
+    uint16_t first_port;
+    uint16_t last_port;
+    uint32_t stride;
+    uint32_t offset;
+};
+
+enum flow_result
+{
+    FLOW_FOUND = 0,
+    FLOW_CREATED,
+    FLOW_EVICTED,  // created in place of the least recently seen flow
+};
+
+/**
+ * @brief Preallocates the flows and index of one worker.
+ *
+ * @param table Table to initialize.
+ * @param ports Source ports handed out to flows, shared by every worker.
+ * @param workers Number of workers the ports are split between.
+ * @param worker Index of the worker owning this table.
+ * @param timeout Seconds a flow without traffic in either direction is kept.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateFlowTable(struct flow_table* table, const struct port_range* ports, uint32_t workers,
+                    uint32_t worker, uint32_t timeout);
+void DestroyFlowTable(struct flow_table* table);
+
+/**
+ * @brief Lets replies to the flow ports through a filter derived from the rules. When the
+ * filter checks sources, the addresses raw rules forward to are added as hosts.
+ *
+ * @param rules Indexed rule table.
+ * @param ports Source ports handed out to flows.
+ * @param spec Spec from RuleFilterSpec.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the filter has no room left.
+ */
+int FlowFilterSpec(const struct rule_table* rules, const struct port_range* ports,
+                   struct filter_spec* spec);
+
+/**
+ * @brief Finds the flow of a datagram on its way to a rule's destination, creating it if it is
+ * new. A full table gives up its least recently seen flow.
+ *
+ * @param table Worker's table.
+ * @param frame Frame starting at the ethernet header, MatchRule has checked its headers.
+ * @param rule Index of the rule the frame matched.
+ * @param now_ns Current CLOCK_MONOTONIC time.
+ * @param flow Set to the flow.
+ * @return enum flow_result whether the flow was found or had to be created.
+ */
+enum flow_result FlowTrack(struct flow_table* table, const unsigned char* frame, uint16_t rule,
+                           uint64_t now_ns, struct flow** flow);
+
+/**
+ * @brief Finds the flow a datagram answers, by its destination port.
+ *
+ * @param table Worker's table.
+ * @param rules Rule table the flows were created from.
+ * @param frame Frame starting at the ethernet header.
+ * @param len Length of the frame.
+ * @param now_ns Current CLOCK_MONOTONIC time.
+ * @return struct flow* the flow, NULL if the port is not in use or the datagram does not come
+ * from where the flow forwards to.
+ */
+struct flow* FlowReply(struct flow_table* table, const struct rule_table* rules,
+                       const unsigned char* frame, size_t len, uint64_t now_ns);
+
+/**
+ * @brief Fills in the addresses and ports a flow rewrites with, in either direction.
+ *
+ * @param flow Flow to rewrite for.
+ * @param rule Rule the flow forwards through.
+ * @param reply Rewrite a reply back to the client instead of a datagram to the rule's target.
+ * @param ctx Set to the rewrite, only its addresses, ports and their sums.
+ */
+void FlowRewriteCtx(const struct flow* flow, const struct rule* rule, int reply,
+                    struct rewrite_ctx* ctx);
+
+/**
+ * @brief Drops the flows whose timeout ran out.
+ *
+ * @param table Worker's table.
+ * @param now_ns Current CLOCK_MONOTONIC time.
+ * @return uint32_t number of flows expired.
+ */
+uint32_t FlowExpire(struct flow_table* table, uint64_t now_ns);
+#endif /*FLOW_H*/
@@ -0,0 +1,127 @@
+#ifndef FQ_H
+#define FQ_H
+#include <linux/virtio_net.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#define FQ_BUCKET_BITS 10U  // 1024 queues, flows hashing to the same one share it
+#define FQ_BUCKETS (1U << FQ_BUCKET_BITS)
+#define FQ_QUANTUM 1514U  // bytes a queue may send per round, a full ethernet frame
+#define FQ_DEFAULT_FLOW_LIMIT 64U
+#define FQ_MAX_FLOW_LIMIT 4096U
+#define FQ_RETRY_MS 1  // how long an output that pushed back is left alone
+
+struct rule;
+
+/**
+ * A rewritten frame waiting for its output, holding a reference on the buffer it lives in.
+ * Nodes are preallocated with the queue and move between the free list and the queues.
+ */
+struct fq_node
+{
+    struct fq_node* next;
+    struct pkt_buf* buf;
+    const struct rule* rule;
+    struct virtio_net_hdr* vnet;  // header to send a raw frame with, NULL without -V
+    unsigned char* packet;        // starting at the ethernet header
+    unsigned char* data;          // UDP payload inside packet
+    uint32_t len;
+    uint32_t bucket;
+    uint64_t rx_ns;
+};
+
+struct fq_bucket
+{
+    struct fq_node* head;
+    struct fq_node* tail;
+    struct fq_bucket* next_active;
+    uint32_t count;
+    int32_t deficit;  // bytes left in this round
+    int active;
+};
+
+/**
+ * Per flow queues in front of the outputs of one worker, served deficit round robin. Flows hash
+ * to a fixed set of buckets, every bucket holds at most flow_limit frames and a frame that
+ * finds its bucket or the node free list empty is dropped at the tail. Only buckets with frames
+ * are on the active list, so enqueue and dequeue never scan. Owned by one worker, nothing is
+ * synchronized.
+ */
+struct fair_queue
+{
+    struct fq_bucket* buckets;
+    struct fq_node* nodes;
+    struct fq_node* free_list;
+    struct fq_bucket* active_head;
+    struct fq_bucket* active_tail;
+    uint32_t flow_limit;
+    uint32_t backlog;   // frames queued in all buckets
+    uint64_t retry_ns;  // an output pushed back, nothing is sent before then
+};
+
+/**
+ * @brief Allocates the buckets and every node the queue will ever use.
+ *
+ * @param fq Queue to initialize.
+ * @param node_count Frames queued in all buckets together, keep it below the pool's buffer
+ * count so receives always find a buffer.
+ * @param flow_limit Frames queued in one bucket.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateFairQueue(struct fair_queue* fq, uint32_t node_count, uint32_t flow_limit);
+
+/**
+ * @brief Releases the buffers of every frame still queued and frees the queue.
+ *
+ * @param fq Queue to destroy.
+ * @param pool Pool the queued buffers belong to.
+ */
+void DestroyFairQueue(struct fair_queue* fq, struct buf_pool* pool);
+
+/**
+ * @brief The bucket of a frame's flow, from its addresses and ports as received.
+ *
+ * @param frame Frame starting at the ethernet header, MatchRule has checked its headers.
+ * @return uint32_t bucket index below FQ_BUCKETS.
+ */
+uint32_t FqBucket(const unsigned char* frame);
+
+/**
+ * @brief Queues a copy of entry at the tail of a bucket and takes a reference on its buffer.
+ *
+ * @param fq Queue to add to.
+ * @param bucket Bucket from FqBucket.
+ * @param entry Frame to queue, its next and bucket fields are ignored.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the frame was dropped.
+ */
+int FqEnqueue(struct fair_queue* fq, uint32_t bucket, const struct fq_node* entry);
+
+/**
+ * @brief Takes the next frame in deficit round robin order.
+ *
+ * @param fq Queue to take from.
+ * @return struct fq_node* the frame, NULL if nothing is queued. Hand it back with FqRequeue
+ * or FqRelease.
+ */
+struct fq_node* FqDequeue(struct fair_queue* fq);
+
+/**
+ * @brief Puts a dequeued frame back at the head of its bucket and refunds its bytes, as if it
+ * had never been taken. Frames taken together go back in reverse order.
+ *
+ * @param fq Queue the frame was taken from.
+ * @param node Frame to put back.
+ */
+void FqRequeue(struct fair_queue* fq, struct fq_node* node);
+
+/**
+ * @brief Drops the reference of a dequeued frame and returns its node to the free list.
+ *
+ * @param fq Queue the frame was taken from.
+ * @param node Frame that was sent or failed.
+ * @param pool Pool its buffer belongs to.
+ */
+void FqRelease(struct fair_queue* fq, struct fq_node* node, struct buf_pool* pool);
+#endif /*FQ_H*/
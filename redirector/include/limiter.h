@@ -0,0 +1,76 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIMIT_WAYS 4U       // sources per set, a set fills one cache line
+#define LIMIT_SET_BITS 12U  // 4096 sets, 16384 sources per worker
+#define LIMIT_SETS (1U << LIMIT_SET_BITS)
+#define LIMIT_MAX_RATE 1000000000U  // one packet per nanosecond
+#define LIMIT_GLOBAL_BURST_DIV 100U  // the global cap lets 10 ms worth of packets through at once
+
+/**
+ * The token bucket of one source, kept as the time it would be full again (GCRA). Refilling is
+ * then a comparison with the current time instead of a multiplication, and a bucket that was
+ * never used or went idle simply has a time in the past.
+ */
+struct limit_way
+{
+    uint32_t addr;  // network order
+    uint32_t unused;
+    uint64_t full_ns;
+};
+
+struct limit_set
+{
+    _Alignas(64) struct limit_way ways[LIMIT_WAYS];
+};
+
+/**
+ * Per source and global admission control of one worker, owned by that worker alone. Sources
+ * hash to a set and take over its least recently full way when they are not in it, so the
+ * table never grows and a lookup touches one cache line. Time comes from the caller's coarse
+ * clock, the table never reads one.
+ */
+struct limiter
+{
+    struct limit_set* sets;
+    uint64_t interval_ns;   // one packet's worth of tokens per source, 0 for no per source limit
+    uint64_t tolerance_ns;  // burst - 1 packets worth
+    uint64_t global_full_ns;
+    uint64_t global_interval_ns;  // 0 for no global cap
+    uint64_t global_tolerance_ns;
+};
+
+enum limit_result
+{
+    LIMIT_PASS = 0,
+    LIMIT_SOURCE,  // the source used up its burst
+    LIMIT_GLOBAL,  // the worker's share of the global cap is used up
+};
+
+/**
+ * @brief Allocates the buckets of one worker.
+ *
+ * @param limiter Limiter to initialize.
+ * @param rate Packets per second every source may send, 0 for no per source limit.
+ * @param burst Packets a source may send at once after being idle, at least 1 with a rate.
+ * @param global_rate Packets per second this worker admits from all sources together, 0 for
+ * no cap.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateLimiter(struct limiter* limiter, uint32_t rate, uint32_t burst, uint32_t global_rate);
+void DestroyLimiter(struct limiter* limiter);
+
+/**
+ * @brief Takes a packet's worth of tokens from its source's bucket and from the global one.
+ * Nothing is taken when either is empty.
+ *
+ * @param limiter Worker's limiter.
+ * @param frame Frame starting at the ethernet header, MatchRule has checked its headers.
+ * @param now_ns CLOCK_MONOTONIC time, read once per receive batch is precise enough.
+ * @return enum limit_result LIMIT_PASS if the packet may be forwarded.
+ */
+enum limit_result LimitAdmit(struct limiter* limiter, const unsigned char* frame,
+                             uint64_t now_ns);
+#endif /*LIMITER_H*/
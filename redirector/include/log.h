@@ -0,0 +1,126 @@
+#ifndef LOG_H
+#define LOG_H
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_RING_SIZE 1024U
+#define LOG_SUMMARY_BYTES 64U
+#define LOG_HEXDUMP_BYTES 256U
+#define LOG_DEFAULT_SAMPLE 1U
+#define LOG_DRAIN_INTERVAL_MS 10U
+
+enum log_level
+{
+    LOG_LEVEL_OFF = 0,
+    LOG_LEVEL_SUMMARY,
+    LOG_LEVEL_HEXDUMP,
+};
+
+struct log_config
+{
+    enum log_level level;
+    uint32_t sample;
+    const char* path;
+};
+
+/**
+ * One logged packet. Only the first bytes of the frame are copied, all formatting happens on
+ * the log thread.
+ */
+struct log_record
+{
+    uint64_t ns;
+    uint32_t len;
+    uint32_t captured;
+    unsigned char data[LOG_HEXDUMP_BYTES];
+};
+
+/**
+ * Single producer, single consumer ring between one worker and the log thread. head is only
+ * written by the worker and tail only by the log thread, each on its own cache line.
+ */
+struct log_ring
+{
+    _Alignas(64) uint32_t head;
+    enum log_level level;
+    uint32_t sample;
+    uint32_t seen;
+    uint64_t dropped;
+    _Alignas(64) uint32_t tail;
+    struct log_record* records;
+};
+
+struct logger
+{
+    enum log_level level;
+    FILE* out;
+    struct log_ring* rings;
+    uint32_t ring_count;
+    uint64_t start_ns;
+    int running;
+    int started;
+    pthread_t thread;
+};
+
+/**
+ * @brief Parses off, summary or hexdump.
+ *
+ * @param str String to parse.
+ * @param level Set to the parsed level on success.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int ParseLogLevel(const char* str, enum log_level* level);
+
+/**
+ * @brief Creates one ring per worker and starts the thread that drains them.
+ *
+ * With LOG_LEVEL_OFF no memory is allocated and no thread is started, LogSample always says no.
+ *
+ * @param logger Logger to initialize.
+ * @param config Level, sampling rate and output file, NULL path for stdout.
+ * @param ring_count Number of producers, one ring each.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateLogger(struct logger* logger, const struct log_config* config, uint32_t ring_count);
+
+/**
+ * @brief Returns the ring a producer logs into, NULL when logging is off.
+ */
+struct log_ring* LoggerRing(struct logger* logger, uint32_t index);
+
+/**
+ * @brief Stops the log thread after it drained every ring and closes the output file.
+ */
+void DestroyLogger(struct logger* logger);
+
+/**
+ * @brief Copies the head of a frame into the ring, dropped and counted if the ring is full.
+ *
+ * Never blocks and never touches stdio.
+ *
+ * @param ring Ring of the calling worker.
+ * @param frame Frame starting at the ethernet header.
+ * @param len Length of the frame.
+ */
+void LogPacket(struct log_ring* ring, const unsigned char* frame, size_t len);
+
+/**
+ * @brief Decides whether the current packet is logged, 1 in every sample packets are.
+ *
+ * @param ring Ring of the calling worker, may be NULL.
+ * @return int 1 if the packet should be passed to LogPacket.
+ */
+static inline int LogSample(struct log_ring* ring)
+{
+    if (NULL == ring || LOG_LEVEL_OFF == ring->level)
+        return 0;
+
+    if (++ring->seen < ring->sample)
+        return 0;
+
+    ring->seen = 0;
+    return 1;
+}
+#endif /*LOG_H*/
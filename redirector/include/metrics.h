@@ -0,0 +1,148 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rawparser.h"
+
+// log linear buckets, 2^HIST_SUB_BITS per power of two, about 6% relative error
+#define HIST_SUB_BITS 4U
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+#define HIST_MAX_EXPONENT 39U
+#define HIST_BUCKETS (HIST_SUB_COUNT * (HIST_MAX_EXPONENT - HIST_SUB_BITS + 2U))
+#define LATENCY_RUNS 64U
+
+/**
+ * A latency in nanoseconds, HDR style. Only the owning worker writes.
+ */
+struct latency_hist
+{
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/**
+ * Counters of one worker, on cache lines of their own so workers never share a line. The
+ * worker is the only writer, readers load every field without locks and may see a slightly
+ * stale but never torn value.
+ */
+struct worker_metrics
+{
+    _Alignas(64) uint64_t rx_packets;
+    uint64_t parse_errors[PARSE_STAGE_COUNT];
+    uint64_t truncated;
+    uint64_t unmatched;
+    uint64_t unresolved;
+    uint64_t source_limited;
+    uint64_t global_limited;
+    uint64_t forwarded;
+    uint64_t replied;
+    uint64_t flows_created;
+    uint64_t flows_expired;
+    uint64_t flows_evicted;
+    uint64_t udp_sends;
+    uint64_t send_errors;
+    uint64_t queue_drops;
+    uint64_t queue_deferred;
+    uint64_t kernel_packets;
+    uint64_t kernel_drops;
+    _Alignas(64) struct latency_hist latency;  // read from the socket to handed to the output
+    struct latency_hist rx_queue;  // kernel receive timestamp to read from the socket, with -t
+    struct latency_hist transit;   // kernel receive to kernel transmit timestamp, with -t
+};
+
+/**
+ * Packets queued on an output that batches, grouped by the receive batch they arrived in, until
+ * the output is flushed and their latency is known. Private to one engine.
+ */
+struct latency_runs
+{
+    uint64_t rx_ns[LATENCY_RUNS];
+    uint32_t count[LATENCY_RUNS];
+    uint32_t used;
+};
+
+struct metrics
+{
+    struct worker_metrics* workers;
+    uint32_t worker_count;
+    uint64_t start_ns;
+};
+
+enum metrics_format
+{
+    METRICS_FORMAT_PROMETHEUS = 0,
+    METRICS_FORMAT_JSON,
+};
+
+/**
+ * @brief Adds to a counter owned by the calling thread, a plain add with no lock prefix.
+ *
+ * @param counter Counter to add to.
+ * @param value Amount to add.
+ */
+static inline void MetricAdd(uint64_t* counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+int CreateMetrics(struct metrics* metrics, uint32_t worker_count);
+void DestroyMetrics(struct metrics* metrics);
+
+/**
+ * @brief Records count samples of one latency value.
+ *
+ * @param hist Histogram of the calling worker.
+ * @param value_ns Latency in nanoseconds, values past the last bucket land in it.
+ * @param count Number of packets that saw this latency.
+ */
+void HistRecord(struct latency_hist* hist, uint64_t value_ns, uint64_t count);
+
+/**
+ * @brief Remembers that a packet received at rx_ns is waiting in an output queue.
+ *
+ * When every run is in use the packet joins the newest run, its latency is then slightly
+ * underestimated.
+ */
+void LatencyQueue(struct latency_runs* runs, uint64_t rx_ns);
+
+/**
+ * @brief Records every queued packet as sent at now_ns and empties the runs.
+ */
+void LatencyFlush(struct latency_runs* runs, struct latency_hist* hist, uint64_t now_ns);
+
+/**
+ * @brief Formats a snapshot of every worker's counters and the merged latency histograms.
+ *
+ * @param metrics Metrics to read, no lock is taken.
+ * @param format Prometheus text exposition format or JSON.
+ * @param buf Buffer to format into.
+ * @param size Size of buf.
+ * @return size_t length of the output, 0 if it did not fit.
+ */
+size_t FormatMetrics(const struct metrics* metrics, enum metrics_format format, char* buf,
+                     size_t size);
+
+/**
+ * @brief Creates a listening UNIX stream socket for the stats endpoint, replacing a stale one.
+ *
+ * @param path Filesystem path of the socket.
+ * @return int the listening socket, or -1 on failure.
+ */
+int CreateStatsSocket(const char* path);
+
+/**
+ * @brief Accepts one client and answers it with a metrics snapshot.
+ *
+ * A request line of "json" or "GET /metrics.json" gets JSON, anything else the Prometheus
+ * format. Requests starting with GET get an HTTP/1.0 response so curl --unix-socket works.
+ *
+ * @param listen_sock Socket from CreateStatsSocket.
+ * @param metrics Metrics to report.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int ServeStats(int listen_sock, const struct metrics* metrics);
+#endif /*METRICS_H*/
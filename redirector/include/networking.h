@@ -1,21 +1,146 @@
 #ifndef NETWORKING_H
 #define NETWORKING_H
+#include <errno.h>
 #include <linux/filter.h>
+#include <linux/errqueue.h>
+#include <linux/if_packet.h>
+#include <linux/virtio_net.h>
 #include <stdint.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 
+#include "pool.h"
+
+#define VNET_HDR_LEN sizeof(struct virtio_net_hdr)
+// PACKET_AUXDATA and the SO_TIMESTAMPING receive timestamp of one frame
+#define RECV_CONTROL_LEN \
+    (CMSG_SPACE(sizeof(struct tpacket_auxdata)) + CMSG_SPACE(sizeof(struct scm_timestamping)))
+// the socket or the device queue is full, trying again later may succeed
+#define SEND_BACKED_OFF(err) (EAGAIN == (err) || EWOULDBLOCK == (err) || ENOBUFS == (err))
+
 /**
  * @brief Create a raw filter socket with the given BPF program.
  *
  * @param bpf Pointer to the BPF program to attach to the socket.
  * @return int The file descriptor of the created socket, or -1 on failure.
  */
-int CreateRawFilterSocket(struct sock_fprog* bpf);
-ssize_t RecvAndModifyPacket(int sock, uint16_t f_port, uint16_t s_port,
-                            unsigned char** data_section, char* f_addr, char* s_addr,
-                            unsigned char** packet);
-int SendRawSocket(int sock, size_t packet_len, const unsigned char* packet, const char* interface);
-int GetInterface(const char* address, char** interface);
-int CreateUdpSocket();
-int SendUDP(unsigned char* packet, size_t packet_len, int sock, struct sockaddr_in* addr);
+int CreateRawFilterSocket(const struct sock_fprog* bpf);
+
+/**
+ * @brief Joins a packet socket to a PACKET_FANOUT group that spreads flows by hash, or by a
+ * classic BPF program returning the member index. Members are numbered in the order they join.
+ *
+ * @param sock Packet socket to join.
+ * @param group_id Id shared by every socket of the group.
+ * @param steer Program picking the member, NULL to hash on the flow.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int JoinFanoutGroup(int sock, uint16_t group_id, struct sock_fprog* steer);
+
+/**
+ * @brief Builds the sockaddr_ll raw frames are sent to, resolved once instead of per packet.
+ *
+ * @param interface Name of the interface frames are sent out of.
+ * @param device Set to the link layer address of the interface.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int GetRawDevice(const char* interface, struct sockaddr_ll* device);
+
+/**
+ * @brief Sends a frame on a packet socket. Failures are not reported, errno is left for the
+ * caller to count them and check a full socket or device queue with SEND_BACKED_OFF.
+ *
+ * @param sock Packet socket to send on.
+ * @param packet_len Length of the frame.
+ * @param packet Frame starting at the ethernet header.
+ * @param device Interface to send out of.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int SendRawSocket(int sock, size_t packet_len, const unsigned char* packet,
+                  const struct sockaddr_ll* device);
+
+/**
+ * @brief Makes a packet socket put a virtio_net_hdr in front of every frame it receives and
+ * expect one in front of every frame it sends. Frames keep their GSO size and partial checksum
+ * instead of being segmented and summed in software.
+ *
+ * @param sock Packet socket without a ring.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int EnableVnetHdr(int sock);
+
+/**
+ * @brief Sends a frame on a socket with PACKET_VNET_HDR, the header and the frame in one write.
+ *
+ * @param sock Packet socket to send on.
+ * @param vnet Header describing the frame's checksum and GSO state.
+ * @param packet_len Length of the frame.
+ * @param packet Frame starting at the ethernet header.
+ * @param device Interface to send out of.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure, errno as for SendRawSocket.
+ */
+int SendRawVnet(int sock, const struct virtio_net_hdr* vnet, size_t packet_len,
+                const unsigned char* packet, const struct sockaddr_ll* device);
+/**
+ * @brief Turns on software SO_TIMESTAMPING. Every send gets a transmit timestamp on the error
+ * queue, keyed by the SOF_TIMESTAMPING_OPT_ID counter of the socket, without its payload.
+ *
+ * @param sock Socket to timestamp.
+ * @param rx Also timestamp received frames, delivered as SCM_TIMESTAMPING control messages.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int EnableTimestamping(int sock, int rx);
+
+/**
+ * @brief Reads the TP_STATUS_* flags and the receive timestamp of a frame out of the control
+ * messages it was received with.
+ *
+ * @param msg Header of the receive, only its control area is read.
+ * @param buf Buffer holding the frame, its status and rx_stamp are set.
+ */
+void ReadRecvControl(const struct msghdr* msg, struct pkt_buf* buf);
+
+/**
+ * @brief Lets receives on a socket busy poll the device queue its frames arrive on instead of
+ * waiting for the interrupt. A non blocking receive polls the queue once before EAGAIN.
+ *
+ * @param sock Socket to receive from.
+ * @param usec Microseconds a blocking receive may busy poll.
+ * @param budget Most frames one poll of the queue processes.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the kernel does not allow busy polling.
+ */
+int EnableBusyPoll(int sock, uint32_t usec, uint32_t budget);
+
+/**
+ * @brief Receives up to max frames from a non blocking socket with a single recvmmsg().
+ *
+ * @param sock Socket to receive from.
+ * @param pool Pool the receive buffers are taken from.
+ * @param bufs Set to the received buffers, with len filled in, the caller puts them back.
+ * @param max Most frames to receive, capped at BATCH_MAX_SIZE.
+ * @param truncated Incremented for every frame dropped because it did not fit a buffer.
+ * @return int number of frames received, 0 if none were pending, or -1 on failure or if the
+ * pool has no buffer left.
+ */
+int RecvPacketBatch(int sock, struct buf_pool* pool, struct pkt_buf** bufs, unsigned int max,
+                    uint64_t* truncated);
+
+/**
+ * @brief Reads and resets the kernel's PACKET_STATISTICS counters of a packet socket.
+ *
+ * @param sock Packet socket to read.
+ * @param packets Set to the frames that passed the filter since the last call, drops included.
+ * @param drops Set to the frames dropped since the last call because the socket was full.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int GetPacketStats(int sock, uint64_t* packets, uint64_t* drops);
+
+/**
+ * @brief Sends count prepared messages with as few sendmmsg() calls as possible.
+ *
+ * A message the kernel rejects is skipped without a report, the rest of the batch is still sent.
+ *
+ * @return int number of messages sent.
+ */
+int SendUDPBatch(struct mmsghdr* msgs, unsigned int count, int sock);
 #endif /*NETWORKING_H*/
\ No newline at end of file
@@ -0,0 +1,131 @@
+#ifndef NEXTHOP_H
+#define NEXTHOP_H
+#include <linux/if_ether.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "rules.h"
+
+struct xdp_path;
+
+#define NEXTHOP_BUF_SIZE 16384U
+#define NEXTHOP_KICK_INTERVAL_NS 1000000000ULL
+
+/**
+ * The ethernet addresses a raw rule's frames leave with, in frame order so both are written
+ * with one copy. Two words so readers can load it without a lock.
+ */
+union nexthop_l2
+{
+    uint64_t words[2];
+    struct
+    {
+        uint8_t dst_mac[ETH_ALEN];
+        uint8_t src_mac[ETH_ALEN];
+        uint32_t resolved;  // 0 while the next hop has no usable link layer address
+    } hop;
+};
+
+/**
+ * The published L2 header of one rule. Only the thread owning the cache writes it, under a
+ * sequence count that is odd while an update is in progress, workers retry a read that saw an
+ * update.
+ */
+struct nexthop
+{
+    uint32_t seq;
+    union nexthop_l2 l2;
+};
+
+/**
+ * Where one raw rule's frames go next, as the kernel's routing and neighbour tables say. The
+ * egress interface is picked once, the TX ring and AF_XDP sockets are bound to it.
+ */
+struct nexthop_route
+{
+    struct in_addr f_addr;
+    struct in_addr s_addr;
+    int if_index;
+    struct in_addr gateway;  // f_addr itself when it is on link, 0 while it has no route
+    uint8_t local_mac[ETH_ALEN];
+    uint8_t neigh_mac[ETH_ALEN];
+    uint16_t neigh_state;  // NUD_* of the gateway's neighbour entry, 0 if there is none
+    uint64_t kick_ns;
+};
+
+/**
+ * Interface, route and neighbour state for every raw rule, kept current from RTNL
+ * notifications. Owned by one thread, workers only read the published hops.
+ */
+struct nexthop_cache
+{
+    int event_sock;  // subscribed to link, address, route and neighbour changes
+    int query_sock;
+    uint32_t seq;
+    struct nexthop* hops;  // one per rule, indexed like the rule table
+    struct nexthop_route* routes;
+    uint32_t hop_count;
+    unsigned char* buf;
+    const struct xdp_path* xdp;  // fast path sending with the hops too, NULL without one
+};
+
+/**
+ * @brief Resolves the egress interface, gateway and link layer addresses of every raw rule and
+ * subscribes to the changes that can move them. Next hops without a neighbour entry are asked
+ * for, their frames are dropped until the answer arrives.
+ *
+ * @param cache Cache to initialize.
+ * @param rules Indexed rule table whose rewrite contexts hold the egress interface.
+ * @param xdp XDP fast path whose rules map gets every published hop, may be NULL.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateNexthopCache(struct nexthop_cache* cache, const struct rule_table* rules,
+                       const struct xdp_path* xdp);
+void DestroyNexthopCache(struct nexthop_cache* cache);
+
+/**
+ * @brief Applies pending notifications, republishes the hops they changed and asks the kernel
+ * to resolve next hops that are not reachable, at most once per NEXTHOP_KICK_INTERVAL_NS.
+ *
+ * @param cache Cache to update, call whenever its event_sock is readable and once a second.
+ * @param now_ns Current CLOCK_MONOTONIC time.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the netlink sockets failed.
+ */
+int UpdateNexthopCache(struct nexthop_cache* cache, uint64_t now_ns);
+
+/**
+ * @brief Asks the kernel for the route a locally sent datagram takes.
+ *
+ * @param sock NETLINK_ROUTE socket, -1 to use a temporary one.
+ * @param f_addr Destination address.
+ * @param s_addr Source address, has to be local.
+ * @param if_index Interface the route has to leave through, 0 for any.
+ * @param out_index Set to the egress interface.
+ * @param gateway Set to the next hop, f_addr when it is on link. May be NULL.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if there is no usable route.
+ */
+int LookupRoute(int sock, struct in_addr f_addr, struct in_addr s_addr, int if_index,
+                int* out_index, struct in_addr* gateway);
+
+/**
+ * @brief Reads a rule's published L2 header, on the forwarding path.
+ *
+ * @param hop Published hop of the rule.
+ * @param l2 Set to the addresses.
+ * @return int non zero when the next hop is resolved.
+ */
+static inline int ReadNexthop(const struct nexthop* hop, union nexthop_l2* l2)
+{
+    uint32_t seq = 0;
+
+    do
+    {
+        seq = __atomic_load_n(&hop->seq, __ATOMIC_ACQUIRE);
+        l2->words[0] = __atomic_load_n(&hop->l2.words[0], __ATOMIC_RELAXED);
+        l2->words[1] = __atomic_load_n(&hop->l2.words[1], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1U) || seq != __atomic_load_n(&hop->seq, __ATOMIC_RELAXED));
+
+    return 0 != l2->hop.resolved;
+}
+#endif /*NEXTHOP_H*/
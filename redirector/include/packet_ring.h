@@ -0,0 +1,103 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+#include <linux/if_packet.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RX_RING_DEFAULT_BLOCK_SIZE (1U << 20)
+#define RX_RING_DEFAULT_FRAME_COUNT 4096U
+#define RX_RING_DEFAULT_BLOCK_TIMEOUT 1U
+#define RX_RING_FRAME_SIZE 2048U
+
+#define TX_RING_BLOCK_SIZE (1U << 16)
+#define TX_RING_FRAME_SIZE 2048U
+#define TX_RING_FRAME_COUNT 1024U
+
+struct rx_ring_config
+{
+    int enabled;
+    uint32_t block_size;
+    uint32_t frame_count;
+    uint32_t block_timeout_ms;
+};
+
+struct rx_ring
+{
+    unsigned char* map;
+    size_t map_len;
+    struct tpacket_req3 req;
+    uint32_t block_idx;
+    struct tpacket_block_desc* block;
+    struct tpacket3_hdr* frame;
+    uint32_t frames_left;
+    uint64_t truncated;  // frames skipped because the capture misses part of their IP packet
+};
+
+struct tx_ring
+{
+    int sock;
+    unsigned char* map;
+    size_t map_len;
+    struct tpacket_req req;
+    uint32_t frame_idx;
+    uint32_t pending;
+};
+
+/**
+ * @brief Switches a packet socket to TPACKET_V3 and maps a receive ring for it.
+ *
+ * @param sock Packet socket to attach the ring to, must not have received a ring yet.
+ * @param config Block size, frame count and block retire timeout of the ring.
+ * @param ring Ring to initialize.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int SetupRxRing(int sock, const struct rx_ring_config* config, struct rx_ring* ring);
+
+/**
+ * @brief Returns the next frame the kernel has handed to userspace.
+ *
+ * Frames are rewritten in place, a frame stays valid until the next call. Blocks are handed back
+ * to the kernel once every frame in them has been returned. A frame whose capture ends before
+ * its IP packet does is skipped and counted in truncated.
+ *
+ * @param ring Ring to read from.
+ * @param frame Set to the start of the frame's link layer header.
+ * @param frame_len Set to the captured length of the frame.
+ * @param status Set to the frame's TP_STATUS_* flags.
+ * @return int 1 if a frame was returned, 0 if the ring is empty.
+ */
+int RxRingNextFrame(struct rx_ring* ring, unsigned char** frame, size_t* frame_len,
+                    uint32_t* status);
+void TeardownRxRing(struct rx_ring* ring);
+
+/**
+ * @brief Creates a send only packet socket bound to an interface and maps a TPACKET_V2 TX ring.
+ *
+ * @param if_index Index of the interface frames are sent out of.
+ * @param ring Ring to initialize, owns the socket.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int SetupTxRing(unsigned int if_index, struct tx_ring* ring);
+
+/**
+ * @brief Copies a frame into the next free TX slot, it is sent on the next TxRingFlush.
+ *
+ * Flushes on its own when the ring has no free slot left.
+ *
+ * @param ring Ring to queue the frame on.
+ * @param frame Frame starting at the link layer header.
+ * @param frame_len Length of the frame, must fit in one TX_RING_FRAME_SIZE slot.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the frame could not be queued.
+ */
+int TxRingSend(struct tx_ring* ring, const unsigned char* frame, size_t frame_len);
+
+/**
+ * @brief Hands every queued frame to the kernel with a single send().
+ *
+ * @param ring Ring to flush.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int TxRingFlush(struct tx_ring* ring);
+size_t TxRingMaxFrame(void);
+void TeardownTxRing(struct tx_ring* ring);
+#endif /*PACKET_RING_H*/
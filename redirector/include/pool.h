@@ -0,0 +1,68 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_DEFAULT_BUF_COUNT 1024U
+#define POOL_DEFAULT_BUF_SIZE 2048U
+#define POOL_JUMBO_BUF_SIZE 9216U
+
+struct pkt_buf
+{
+    struct pkt_buf* next;
+    unsigned char* data;
+    uint32_t refcnt;
+    uint32_t len;
+    uint32_t status;
+    uint64_t rx_stamp;  // kernel receive time in CLOCK_REALTIME ns, 0 without SO_TIMESTAMPING
+};
+
+/**
+ * A pool belongs to the thread that created it, get/put are not synchronized.
+ */
+struct buf_pool
+{
+    unsigned char* map;
+    size_t map_len;
+    size_t buf_size;
+    uint32_t count;
+    uint32_t available;
+    int hugepages;
+    struct pkt_buf* bufs;
+    struct pkt_buf* free_list;
+};
+
+/**
+ * @brief Preallocates and prefaults count buffers of buf_size bytes, on hugepages if possible.
+ *
+ * @param pool Pool to initialize.
+ * @param count Number of buffers in the pool.
+ * @param buf_size Usable size of every buffer, rounded up to a cache line.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateBufPool(struct buf_pool* pool, uint32_t count, size_t buf_size);
+
+/**
+ * @brief Takes a buffer off the free list with a reference count of 1, O(1) and not zeroed.
+ *
+ * @param pool Pool to take the buffer from.
+ * @return struct pkt_buf* the buffer, or NULL if the pool is exhausted.
+ */
+struct pkt_buf* BufPoolGet(struct buf_pool* pool);
+
+/**
+ * @brief Adds a reference to a buffer so it can be handed to another output.
+ *
+ * @param buf Buffer to reference.
+ */
+void BufRef(struct pkt_buf* buf);
+
+/**
+ * @brief Drops a reference, the buffer goes back on the free list when the last one is gone.
+ *
+ * @param pool Pool the buffer was taken from.
+ * @param buf Buffer to release, NULL is ignored.
+ */
+void BufPoolPut(struct buf_pool* pool, struct pkt_buf* buf);
+void DestroyBufPool(struct buf_pool* pool);
+#endif /*POOL_H*/
\ No newline at end of file
@@ -5,10 +5,46 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "rewrite.h"
+
+enum parse_stage
+{
+    PARSE_STAGE_ETHER = 0,
+    PARSE_STAGE_IP,
+    PARSE_STAGE_UDP,
+    PARSE_STAGE_COUNT,
+};
+
+/**
+ * What the UDP checksum field of a received frame holds and what it has to hold once sent.
+ */
+enum csum_state
+{
+    CSUM_PARTIAL = 0,  // CHECKSUM_PARTIAL, only the pseudo header sum, computed in full
+    CSUM_COMPLETE,     // a finished checksum, adjusted for the rewritten fields
+    CSUM_OFFLOAD,      // CHECKSUM_PARTIAL and sent that way, only the pseudo header sum is adjusted
+};
+
+/**
+ * @brief Rewrites the addresses, ports and checksums of an ether/ipv4/udp frame in place.
+ *
+ * @param packet pointer to the start of the ethernet header
+ * @param packet_len length of the frame
+ * @param ctx addresses and ports to write, see CreateRewriteCtx
+ * @param data_section set to the start of the UDP payload if not NULL
+ * @param csum CSUM_PARTIAL if the kernel marked the frame CHECKSUM_PARTIAL
+ * (TP_STATUS_CSUMNOTREADY), its UDP checksum is then recomputed in full instead of adjusted.
+ * CSUM_OFFLOAD for such a frame that leaves with VIRTIO_NET_HDR_F_NEEDS_CSUM.
+ * @param failed_stage set to the header that could not be parsed on failure, may be NULL
+ * @return ssize_t length of the rewritten frame, or -1 on failure, which is not printed
+ */
+ssize_t ModifyPacket(unsigned char* packet, ssize_t packet_len, const struct rewrite_ctx* ctx,
+                     unsigned char** data_section, enum csum_state csum,
+                     enum parse_stage* failed_stage);
 ssize_t ParseEther(unsigned char* packet, ssize_t bytes_left);
-ssize_t ParseIp(unsigned char* packet, ssize_t bytes_left, const char* d_addr, const char* s_addr);
-ssize_t ParseUdp(unsigned char* packet, ssize_t bytes_left, uint16_t f_port, uint16_t s_port,
-                 struct ip* ip_header);
-int PrintHex(const char* label, const unsigned char* data, size_t length);
+ssize_t ParseIp(unsigned char* packet, ssize_t bytes_left, const struct rewrite_ctx* ctx,
+                uint32_t* addr_delta);
+ssize_t ParseUdp(unsigned char* packet, ssize_t bytes_left, const struct rewrite_ctx* ctx,
+                 struct ip* ip_header, uint32_t addr_delta, enum csum_state csum);
 
 #endif /*RAWPARSER_H*/
\ No newline at end of file
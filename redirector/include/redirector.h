@@ -1,6 +1,46 @@
 #ifndef REDIRECTOR_H
 #define REDIRECTOR_H
+#include <stddef.h>
 #include <stdint.h>
 
-int StartRedirector(uint16_t l_port, uint16_t f_port, int raw_send, char* f_addr, char* s_addr);
+#include "filter.h"
+#include "flow.h"
+#include "log.h"
+#include "packet_ring.h"
+#include "rules.h"
+#include "xsk.h"
+
+#define MAX_WORKERS 256U
+
+struct redirector_config
+{
+    const struct rule_table* rules;
+    int tx_ring;
+    uint32_t workers;
+    size_t buf_size;
+    uint32_t batch_size;
+    uint32_t batch_delay_us;
+    int udp_gso;
+    int uring;
+    int vnet_hdr;
+    uint32_t spin_us;  // low latency mode: busy poll and spin this long after the last frame
+    int rt_priority;   // SCHED_FIFO priority of the workers, 0 to keep SCHED_OTHER
+    int timestamping;
+    uint32_t source_rate;   // packets per second admitted from one source, 0 for no limit
+    uint32_t source_burst;
+    uint32_t global_rate;   // packets per second admitted from all sources, 0 for no cap
+    uint32_t fq_flow_limit;  // frames queued per flow ahead of the outputs, 0 to send at once
+    struct rx_ring_config rx_ring;
+    struct filter_spec filter;
+    struct log_config log;
+    const char* stats_path;
+    const char* xdp_if;
+    const char* xsk_if;
+    enum xsk_mode xsk_mode;
+    int return_path;
+    struct port_range reply_ports;
+    uint32_t flow_timeout;
+};
+
+int StartRedirector(const struct redirector_config* config);
 #endif /*REDIRECTOR_H*/
\ No newline at end of file
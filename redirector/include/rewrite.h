@@ -0,0 +1,55 @@
+#ifndef REWRITE_H
+#define REWRITE_H
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+/**
+ * Everything the per packet rewrite needs, resolved once at startup and shared read only by
+ * every worker. Nothing on the forwarding path parses a string or asks the kernel for an
+ * interface.
+ */
+struct rewrite_ctx
+{
+    struct in_addr f_addr;
+    struct in_addr s_addr;
+    uint16_t f_port;
+    uint16_t s_port;
+    uint32_t addr_sum;
+    uint32_t port_sum;
+    int raw_send;
+    int if_index;
+    char if_name[IF_NAMESIZE];
+    char f_addr_str[INET_ADDRSTRLEN];
+    char s_addr_str[INET_ADDRSTRLEN];
+    struct sockaddr_ll device;
+    struct sockaddr_in dest_addr;
+};
+
+/**
+ * @brief Parses the configured addresses and ports into a rewrite context.
+ *
+ * Ports are stored in network order, the sums of the new addresses and ports are precomputed
+ * so the checksum adjust per packet only has to add the words being replaced. In raw mode the
+ * interface the route from s_addr to f_addr leaves through is resolved as well.
+ *
+ * @param ctx Context to initialize.
+ * @param f_addr Address packets are forwarded to, written as the IP destination.
+ * @param s_addr Address written as the IP source.
+ * @param f_port Port packets are forwarded to, host order.
+ * @param s_port Port written as the UDP source, host order.
+ * @param raw_send Resolve the interface and sockaddr_ll for raw sends.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateRewriteCtx(struct rewrite_ctx* ctx, const char* f_addr, const char* s_addr,
+                     uint16_t f_port, uint16_t s_port, int raw_send);
+
+/**
+ * @brief Precomputes addr_sum and port_sum from the addresses and ports already in ctx.
+ *
+ * @param ctx Context whose f_addr, s_addr, f_port and s_port are set.
+ */
+void SetRewriteSums(struct rewrite_ctx* ctx);
+#endif /*REWRITE_H*/
@@ -0,0 +1,116 @@
+#ifndef RULES_H
+#define RULES_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "rawparser.h"
+#include "rewrite.h"
+
+#define RULES_MAX 1024U
+#define RULE_PORTS 65536U
+
+/**
+ * Where matching traffic goes. rewrite holds the forward address and port, the source address
+ * and, for raw output, the interface. Packets leave with the first port of the range as their
+ * UDP source port.
+ */
+struct rule
+{
+    struct port_range ports;
+    uint32_t src_net;  // host order, src_mask 0 matches every source
+    uint32_t src_mask;
+    uint8_t src_len;
+    struct rewrite_ctx rewrite;
+};
+
+/**
+ * Rules indexed by destination port. Every port maps to a chain, the rules covering it with the
+ * longest source prefix first, so a lookup is one array load plus a short scan. Ports covered
+ * by the same rules share a chain, chain 0 is the empty one.
+ */
+struct rule_table
+{
+    struct rule* rules;
+    uint32_t rule_count;
+    int has_udp;
+    int has_raw;
+    uint16_t* port_chain;
+    uint32_t* chain_start;
+    uint16_t* chain_rules;
+    uint32_t chain_count;
+};
+
+/**
+ * @brief Allocates an empty table.
+ *
+ * @param table Table to initialize.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateRuleTable(struct rule_table* table);
+void DestroyRuleTable(struct rule_table* table);
+
+/**
+ * @brief Appends a rule, the table has to be indexed again before it is used.
+ *
+ * @param table Table to add to.
+ * @param ports Destination ports the rule applies to.
+ * @param prefix IPv4 source network the rule applies to, NULL for every source.
+ * @param f_addr Address packets are forwarded to.
+ * @param f_port Port packets are forwarded to, host order.
+ * @param s_addr Address packets are sent from.
+ * @param raw_send Send rewritten frames on the interface routing to f_addr instead of over UDP.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int AddRule(struct rule_table* table, const struct port_range* ports,
+            const struct src_prefix* prefix, const char* f_addr, uint16_t f_port,
+            const char* s_addr, int raw_send);
+
+/**
+ * @brief Adds every rule of a rules file.
+ *
+ * One rule per line, blank lines and lines starting with # are skipped:
+ *
+ *     PORTS  SOURCE  FORWARD_ADDRESS  FORWARD_PORT  SOURCE_ADDRESS  udp|raw
+ *     9000   -       10.0.0.5         9001          10.0.0.1        udp
+ *
+ * PORTS is a port or FIRST-LAST range, SOURCE an IPv4 prefix or - for any source.
+ *
+ * @param path Path of the rules file.
+ * @param table Table the rules are appended to.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int LoadRules(const char* path, struct rule_table* table);
+
+/**
+ * @brief Builds the port index, rules with overlapping ports and equal prefixes are an error.
+ *
+ * @param table Table with at least one rule.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int IndexRules(struct rule_table* table);
+
+/**
+ * @brief Fills in the ports, and when every rule has one the source prefixes, the filter has to
+ * let through. Ranges are merged, past the filter's limits the closest ones are joined and the
+ * kernel lets a little more through than the rules match.
+ *
+ * @param table Indexed table.
+ * @param spec Spec whose ports are replaced, its prefixes too unless it already had some.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int RuleFilterSpec(const struct rule_table* table, struct filter_spec* spec);
+
+/**
+ * @brief Finds the rule for a received frame.
+ *
+ * @param table Indexed table.
+ * @param frame Frame starting at the ethernet header.
+ * @param len Length of the frame.
+ * @param failed_stage Set to the header that was too short to look at when NULL is returned
+ * for a frame that could not be matched at all, PARSE_STAGE_COUNT when no rule matched.
+ * @return const struct rule* the most specific matching rule, or NULL.
+ */
+const struct rule* MatchRule(const struct rule_table* table, const unsigned char* frame,
+                             size_t len, enum parse_stage* failed_stage);
+#endif /*RULES_H*/
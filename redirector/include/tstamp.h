@@ -0,0 +1,54 @@
+#ifndef TSTAMP_H
+#define TSTAMP_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+#define TSTAMP_SLOTS 4096U  // power of two, sends whose transmit timestamp may still be pending
+#define TSTAMP_REAP_BATCH 64U
+
+/**
+ * Kernel receive times of the packets sent on one socket with SO_TIMESTAMPING, indexed by the
+ * SOF_TIMESTAMPING_OPT_ID key the kernel hands every send in order. A transmit timestamp read
+ * back from the error queue finds its packet's receive time under the same key. Owned by one
+ * worker, nothing is synchronized.
+ */
+struct tstamp_ring
+{
+    int sock;
+    uint32_t next_key;  // key the kernel gives the next send
+    uint64_t rx_ns[TSTAMP_SLOTS];
+};
+
+/**
+ * @brief Starts tracking the sends on a socket, its key counter must still be at 0.
+ *
+ * @param ring Ring to initialize.
+ * @param sock Socket with SO_TIMESTAMPING and SOF_TIMESTAMPING_OPT_ID, see EnableTimestamping.
+ */
+void TstampInit(struct tstamp_ring* ring, int sock);
+
+/**
+ * @brief Records a send that went to the kernel, call it for every one in order so the keys
+ * stay in step.
+ *
+ * @param ring Ring of the socket sent on.
+ * @param rx_ns Kernel receive time of the sent packet, 0 if it has none.
+ */
+static inline void TstampSent(struct tstamp_ring* ring, uint64_t rx_ns)
+{
+    ring->rx_ns[ring->next_key % TSTAMP_SLOTS] = rx_ns;
+    ring->next_key++;
+}
+
+/**
+ * @brief Reads the transmit timestamps waiting on the socket's error queue and records how long
+ * after its kernel receive every packet left.
+ *
+ * @param ring Ring of the socket.
+ * @param hist Histogram of the calling worker.
+ * @return uint32_t number of timestamps read.
+ */
+uint32_t TstampReap(struct tstamp_ring* ring, struct latency_hist* hist);
+#endif /*TSTAMP_H*/
@@ -0,0 +1,141 @@
+#ifndef URING_H
+#define URING_H
+#include <linux/if_packet.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "batch.h"
+#include "networking.h"
+#include "pool.h"
+
+#define URING_SQ_ENTRIES 256U
+#define URING_CQ_ENTRIES 4096U
+#define URING_BUF_RING_SIZE 512U  // power of two, receive buffers the kernel can pick from
+#define URING_RECV_CONTROL RECV_CONTROL_LEN
+// a multishot recvmsg writes its header and control messages in front of the frame
+#define URING_RECV_HEADROOM (sizeof(struct io_uring_recvmsg_out) + URING_RECV_CONTROL)
+
+/**
+ * A received frame, inside a pool buffer the caller puts back when done with it.
+ */
+struct uring_frame
+{
+    struct pkt_buf* buf;
+    unsigned char* packet;
+    uint32_t len;
+    uint32_t status;  // TP_STATUS_* flags from PACKET_AUXDATA
+};
+
+/**
+ * One sendmsg in flight. The kernel may only read the message once the socket has room, so
+ * the header, address and control message are copies and the buffers stay referenced until
+ * its completion arrives.
+ */
+struct uring_send
+{
+    struct msghdr msg;
+    struct sockaddr_storage name;
+    _Alignas(struct cmsghdr) char control[sizeof(union gso_cmsg)];
+    struct iovec iovs[BATCH_GSO_MAX_SEGMENTS];
+    struct pkt_buf* bufs[BATCH_GSO_MAX_SEGMENTS];
+    uint32_t next_free;
+};
+
+/**
+ * An io_uring with one multishot recvmsg kept posted on the filter socket. The kernel picks
+ * receive buffers from a provided buffer ring stocked from the pool, sends are queued as SQEs
+ * and submitted together. The ring fd is polled like any socket, it is readable while
+ * completions are waiting. Owned by one worker, nothing is synchronized.
+ */
+struct uring
+{
+    int fd;
+    int sock;
+    int recv_armed;
+    struct buf_pool* pool;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_cached;   // tail including the SQEs not submitted yet
+    uint32_t sq_pending;  // SQEs queued since the last submit
+    struct io_uring_sqe* sqes;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_map;
+    size_t ring_map_len;
+    size_t sqes_map_len;
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_len;
+    uint16_t buf_tail;
+    uint32_t buf_count;  // buffers on the buffer ring
+    // frames reaped but not returned yet, together with the buffer ring never above its size
+    struct uring_frame received[URING_BUF_RING_SIZE];
+    uint32_t received_head;
+    uint32_t received_count;
+    struct msghdr recv_msg;
+    struct uring_send* sends;
+    uint32_t send_count;
+    uint32_t free_send;  // head of the free slots, send_count when none is left
+    uint64_t send_errors;
+    uint64_t truncated;  // frames dropped because they did not fit a buffer
+};
+
+/**
+ * @brief Sets up the ring and its buffer ring and posts the multishot receive. Fails without
+ * side effects on kernels that lack io_uring, provided buffer rings (5.19) or multishot
+ * recvmsg (6.0), so the caller can fall back to recvmmsg.
+ *
+ * @param ring Ring to initialize.
+ * @param sock Non blocking filter socket to receive from.
+ * @param pool Pool of buffers at least URING_RECV_HEADROOM larger than a frame, the buffer ids
+ * are their indices, so it must hold at most 65536.
+ * @param send_slots Most sends in flight at once.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int UringOpen(struct uring* ring, int sock, struct buf_pool* pool, uint32_t send_slots);
+void UringClose(struct uring* ring);
+
+/**
+ * @brief Reaps completions, returning received frames and releasing finished sends. Frames
+ * beyond max are kept for the next call. The buffer ring is restocked and the receive posted
+ * again if the kernel ended it.
+ *
+ * @param ring Ring to reap.
+ * @param frames Filled with the received frames.
+ * @param max Most frames to return.
+ * @return uint32_t number of frames returned, 0 once no frame is left.
+ */
+uint32_t UringReceive(struct uring* ring, struct uring_frame* frames, uint32_t max);
+
+/**
+ * @brief Queues a sendmsg, it goes out on the next UringSubmit.
+ *
+ * @param ring Ring to queue on.
+ * @param sock Socket to send on.
+ * @param msg Message to send, with at most BATCH_GSO_MAX_SEGMENTS iovecs. Copied, only the
+ * data has to stay valid.
+ * @param bufs Pool buffer of every iovec, NULL for data outside the pool. Each is referenced
+ * until the send completes. May be NULL if none is.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if every send slot stays in flight.
+ */
+int UringSend(struct uring* ring, int sock, const struct msghdr* msg,
+              struct pkt_buf* const* bufs);
+
+/**
+ * @brief Hands every queued SQE to the kernel with a single io_uring_enter().
+ *
+ * @param ring Ring to submit.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int UringSubmit(struct uring* ring);
+
+/**
+ * @brief Payloads whose send failed after submission since the last call.
+ */
+uint64_t UringSendErrors(struct uring* ring);
+#endif /*URING_H*/
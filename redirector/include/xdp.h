@@ -0,0 +1,81 @@
+#ifndef XDP_H
+#define XDP_H
+#include <net/if.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "rules.h"
+
+#define XDP_MAX_INSNS 128U
+#define XDP_MAX_ENTRIES 262144U
+
+/**
+ * An XDP program on one interface that rewrites and sends raw rule traffic without it ever
+ * reaching userspace, or with AF_XDP sockets hands rule traffic to them instead. The rules live
+ * in an LPM trie keyed by destination port and source address, anything the program does not
+ * forward is passed on to the packet socket.
+ */
+struct xdp_path
+{
+    int rules_fd;
+    int stats_fd;
+    int xsks_fd;  // -1 when the program rewrites in kernel
+    int prog_fd;
+    int link_fd;
+    int if_index;
+    uint32_t entries;
+    char if_name[IF_NAMESIZE];
+};
+
+/**
+ * @brief Loads the rules into a map, loads the program and attaches it to an interface, in
+ * native mode when the driver supports XDP and generic mode otherwise.
+ *
+ * Only frames the packet filter would accept are forwarded: plain IPv4 UDP without options or
+ * fragments, inside the spec's length bounds and source prefixes. Without sockets, frames
+ * matching a udp rule are passed, sending those needs the kernel's routing, and so are those of
+ * a raw rule until XdpSetHop gives it a next hop. With sockets every
+ * matching frame is redirected to the socket of the queue it arrived on, or passed while that
+ * queue has none.
+ *
+ * @param path Fast path to set up, detached again by DestroyXdpPath or when the process exits.
+ * @param rules Indexed rule table.
+ * @param spec Filter spec given on the command line.
+ * @param if_name Interface the rule traffic arrives on.
+ * @param sockets Queues that get an AF_XDP socket, 0 to rewrite in kernel.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int CreateXdpPath(struct xdp_path* path, const struct rule_table* rules,
+                  const struct filter_spec* spec, const char* if_name, uint32_t sockets);
+void DestroyXdpPath(struct xdp_path* path);
+
+/**
+ * @brief Starts redirecting a queue's rule traffic to an AF_XDP socket bound to it.
+ *
+ * @param path Fast path created with sockets.
+ * @param queue Receive queue the socket is bound to.
+ * @param xsk_fd The AF_XDP socket.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int XdpAddSocket(const struct xdp_path* path, uint32_t queue, int xsk_fd);
+
+/**
+ * @brief Points the entries of a raw rule at its next hop, or passes its frames on to the
+ * packet socket while the next hop is not known.
+ *
+ * @param path Fast path created without sockets.
+ * @param rule Index of the rule in the rule table.
+ * @param l2 Destination and source MAC the frames leave with, NULL while unresolved.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int XdpSetHop(const struct xdp_path* path, uint32_t rule, const uint8_t* l2);
+
+/**
+ * @brief Sums the per CPU count of frames the program sent or redirected to a socket.
+ *
+ * @param path Attached fast path.
+ * @param forwarded Set to the number of frames sent from the kernel.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int XdpForwarded(const struct xdp_path* path, uint64_t* forwarded);
+#endif /*XDP_H*/
@@ -0,0 +1,125 @@
+#ifndef XSK_H
+#define XSK_H
+#include <linux/if_xdp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define XSK_FRAME_SIZE 2048U
+#define XSK_FRAME_COUNT 4096U
+#define XSK_RING_SIZE 2048U
+#define XSK_NO_FRAME UINT64_MAX
+
+enum xsk_mode
+{
+    XSK_MODE_AUTO = 0,  // zero copy when the driver supports it, copy otherwise
+    XSK_MODE_COPY,
+    XSK_MODE_ZEROCOPY,
+};
+
+/**
+ * One of the four single producer single consumer rings shared with the kernel. The cached
+ * index is the side we own, it is only published with a release store once a batch is done.
+ */
+struct xsk_ring
+{
+    uint32_t* producer;
+    uint32_t* consumer;
+    void* descs;
+    uint32_t mask;
+    uint32_t cached;
+    void* map;
+    size_t map_len;
+};
+
+/**
+ * An AF_XDP socket bound to one queue of an interface, with a UMEM of its own that the RX and
+ * TX rings share. A received frame is rewritten in place and either handed back to the fill
+ * ring or put on the TX ring as is, the completion ring then returns it to the fill ring.
+ */
+struct xsk_socket
+{
+    int fd;
+    int if_index;
+    uint32_t queue;
+    int zerocopy;
+    unsigned char* umem;
+    size_t umem_len;
+    struct xsk_ring fill;
+    struct xsk_ring comp;
+    struct xsk_ring rx;
+    struct xsk_ring tx;
+    uint64_t drops_seen;
+    uint64_t send_errors;
+};
+
+/**
+ * @brief Creates the socket, registers its UMEM, maps the rings and binds to an interface
+ * queue. Every frame starts out on the fill ring.
+ *
+ * @param xsk Socket to initialize.
+ * @param if_index Interface to bind to.
+ * @param queue Receive queue of the interface to bind to.
+ * @param mode Copy, zero copy, or zero copy falling back to copy.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int XskOpen(struct xsk_socket* xsk, int if_index, uint32_t queue, enum xsk_mode mode);
+void XskClose(struct xsk_socket* xsk);
+
+/**
+ * @brief Takes received frames off the RX ring, they belong to the caller until they are
+ * recycled or sent.
+ *
+ * @param xsk Socket to read from.
+ * @param descs Filled with the UMEM address and length of every frame.
+ * @param max Most frames to take.
+ * @return uint32_t number of frames taken.
+ */
+uint32_t XskReceive(struct xsk_socket* xsk, struct xdp_desc* descs, uint32_t max);
+
+/**
+ * @brief Queues a frame for the fill ring, the kernel sees it after the next XskFlush.
+ */
+void XskRecycle(struct xsk_socket* xsk, uint64_t addr);
+
+/**
+ * @brief Queues a frame on the TX ring, it goes out on the next XskFlush.
+ *
+ * @param xsk Socket to send on.
+ * @param addr UMEM address of the frame.
+ * @param len Length of the frame.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE if the TX ring stays full.
+ */
+int XskSend(struct xsk_socket* xsk, uint64_t addr, uint32_t len);
+
+/**
+ * @brief Publishes the fill and TX rings, wakes the kernel up to send and moves completed
+ * frames back to the fill ring.
+ *
+ * @param xsk Socket to flush.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int XskFlush(struct xsk_socket* xsk);
+
+/**
+ * @brief Frames the kernel dropped for this socket since the last call.
+ *
+ * @param xsk Socket to read the XDP_STATISTICS of.
+ * @param drops Set to the number of new drops.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int XskDrops(struct xsk_socket* xsk, uint64_t* drops);
+
+/**
+ * @brief Wakeups of the TX ring the kernel failed since the last call.
+ */
+uint64_t XskSendErrors(struct xsk_socket* xsk);
+
+/**
+ * @brief Parses "copy" or "zerocopy".
+ *
+ * @param str Mode name.
+ * @param mode Set to the parsed mode.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+int ParseXskMode(const char* str, enum xsk_mode* mode);
+#endif /*XSK_H*/
@@ -1,59 +1,175 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "filter.h"
+#include "flow.h"
+#include "fq.h"
+#include "limiter.h"
+#include "log.h"
+#include "packet_ring.h"
+#include "pool.h"
 #include "redirector.h"
+#include "rules.h"
 
 static void DisplayUsage();
 static int GetOptions(int argc, char* argv[], char** listen_port, char** forward_port,
-                           char** forward_address, char** src_address, int* raw_send);
+                      char** forward_address, char** src_address, char** rules_file,
+                      int* raw_send, struct redirector_config* config);
+static int ParseNumber(const char* str, const char* name, long min, long max, long* value);
 int main(int argc, char* argv[])
 {
     int exit_code = EXIT_FAILURE;
-    int raw_send = 0;  // disabled
     const int base_10 = 10;
-    long l_port = -1;
+    uint32_t index = 0;
     long f_port = -1;
+    int raw_send = 0;  // disabled
     char* listen_port = NULL;
     char* forward_port = NULL;
     char* forward_address = NULL;
     char* src_address = NULL;
+    char* rules_file = NULL;
     char* endptr = NULL;
+    struct filter_spec listen = {0};
+    struct rule_table rules = {0};
+    struct redirector_config config = {
+        .workers = 1,
+        .buf_size = POOL_DEFAULT_BUF_SIZE,
+        .batch_size = BATCH_DEFAULT_SIZE,
+        .batch_delay_us = BATCH_DEFAULT_DELAY_US,
+        .flow_timeout = FLOW_DEFAULT_TIMEOUT,
+        .filter =
+            {
+                .ipv4 = 1,  // only IPv4 can be rewritten, drop IPv6 in the kernel
+            },
+        .rx_ring =
+            {
+                .enabled = 0,
+                .block_size = RX_RING_DEFAULT_BLOCK_SIZE,
+                .frame_count = RX_RING_DEFAULT_FRAME_COUNT,
+                .block_timeout_ms = RX_RING_DEFAULT_BLOCK_TIMEOUT,
+            },
+        .log =
+            {
+                .level = LOG_LEVEL_SUMMARY,
+                .sample = LOG_DEFAULT_SAMPLE,
+                .path = NULL,  // stdout
+            },
+    };
 
-    if (GetOptions(argc, argv, &listen_port, &forward_port, &forward_address, &src_address, &raw_send))
+    if (GetOptions(argc, argv, &listen_port, &forward_port, &forward_address, &src_address,
+                   &rules_file, &raw_send, &config))
     {
         DisplayUsage();
         goto end;
     }
 
-    l_port = strtol(listen_port, &endptr, base_10);
-    if (*endptr != '\0')
+    for (index = 0; index < config.filter.prefix_count; ++index)
     {
-        fprintf(stderr, "Invalid listen port: %s\n", listen_port);
-        goto end;
+        if (AF_INET != config.filter.prefixes[index].family)
+        {
+            (void)fprintf(stderr, "Only IPv4 source prefixes can be forwarded\n");
+            goto end;
+        }
     }
 
-    endptr = NULL;
-    f_port = strtol(forward_port, &endptr, base_10);
-    if (*endptr != '\0')
+    if (CreateRuleTable(&rules))
     {
-        fprintf(stderr, "Invalid forward port: %s\n", forward_port);
         goto end;
     }
 
-    if (l_port > UINT16_MAX || l_port < 0)
+    if (NULL != rules_file)
     {
-        (void)fprintf(stderr, "Not a valid port number\n");
-        goto end;
+        if (LoadRules(rules_file, &rules))
+        {
+            goto clean;
+        }
     }
-    if (f_port > UINT16_MAX || f_port < 0)
+    else
     {
-        (void)fprintf(stderr, "Not a valid port number\n");
-        goto end;
+        if (ParsePortRanges(listen_port, &listen))
+        {
+            goto clean;
+        }
+
+        f_port = strtol(forward_port, &endptr, base_10);
+        if (*endptr != '\0')
+        {
+            fprintf(stderr, "Invalid forward port: %s\n", forward_port);
+            goto clean;
+        }
+
+        if (f_port > UINT16_MAX || f_port < 0)
+        {
+            (void)fprintf(stderr, "Not a valid port number\n");
+            goto clean;
+        }
+
+        // the command line tuple is one rule per listen range
+        for (index = 0; index < listen.port_count; ++index)
+        {
+            if (AddRule(&rules, &listen.ports[index], NULL, forward_address, (uint16_t)f_port,
+                        src_address, raw_send))
+            {
+                goto clean;
+            }
+        }
+    }
+
+    if (IndexRules(&rules))
+    {
+        goto clean;
     }
 
-    exit_code =
-        StartRedirector((uint16_t)l_port, (uint16_t)f_port, raw_send, forward_address, src_address);
+    if (config.tx_ring && !rules.has_raw)
+    {
+        (void)fprintf(stderr, "-X option requires -r or a raw rule\n");
+        goto clean;
+    }
+
+    if (config.vnet_hdr && !rules.has_raw)
+    {
+        (void)fprintf(stderr, "-V option requires -r or a raw rule\n");
+        goto clean;
+    }
+
+    if (NULL != config.xdp_if && !rules.has_raw)
+    {
+        (void)fprintf(stderr, "-x option requires -r or a raw rule\n");
+        goto clean;
+    }
+
+    if (NULL != config.xdp_if && NULL != config.xsk_if)
+    {
+        (void)fprintf(stderr, "-x option can not be combined with -k\n");
+        goto clean;
+    }
+
+    if (config.return_path)
+    {
+        if (!rules.has_raw || NULL != config.xdp_if)
+        {
+            (void)fprintf(stderr, "-w option requires -r or a raw rule and no -x\n");
+            goto clean;
+        }
+
+        for (index = config.reply_ports.first; index <= config.reply_ports.last; ++index)
+        {
+            if (0 != rules.port_chain[index])
+            {
+                (void)fprintf(stderr, "-w ports can not overlap the ports of a rule\n");
+                goto clean;
+            }
+        }
+    }
+
+    config.rules = &rules;
+    exit_code = StartRedirector(&config);
+
+clean:
+    DestroyRuleTable(&rules);
 end:
     return exit_code;
 }
@@ -66,16 +182,90 @@ static void DisplayUsage()
 {
 
     printf(
-        "usage: redirector [-h] -P FILTER_PORT -p FORWARD_PORT -a FORWARD_ADDRESS -A "
-        "SOURCE_ADDRESS\n\n"
+        "usage: redirector [-h] [-r] [-X] [-V] [-t] [-x INTERFACE] [-k INTERFACE] [-z MODE] "
+        "[-w REPLY_PORTS] [-W TIMEOUT] [-q RATE] [-e BURST] [-g GLOBAL_RATE] [-D FLOW_LIMIT] "
+        "[-j WORKERS] [-m BUF_SIZE] [-b BATCH] [-d DELAY] [-G] [-U] [-Y SPIN_US] [-Q PRIORITY] "
+        "[-R] [-B BLOCK_SIZE] [-F FRAME_COUNT] [-T BLOCK_TIMEOUT] [-L LEVEL] [-S SAMPLE] "
+        "[-o LOG_FILE] [-M STATS_SOCKET] [-s SOURCES] [-l LENGTHS] (-f "
+        "RULES_FILE | -P FILTER_PORTS -p FORWARD_PORT -a FORWARD_ADDRESS -A SOURCE_ADDRESS)\n\n"
         "Send a shell command to the configured agent.\n\n"
         "required flags:\n"
         "  -h                  show this help message and exit\n"
         "  -r                  Send packets using raw sockets\n"
-        "  -P FILTER_PORT      Destination port redirector will filter for\n"
+        "  -P FILTER_PORTS     Destination ports and FIRST-LAST ranges redirector will filter for, "
+        "the first is the source port of forwarded packets\n"
         "  -p FORWARD_PORT     Port redirector will forward traffic to\n"
         "  -A SOURCE_ADDRESS   Source address that traffic will be forwarded from\n"
-        "  -a FORWARD_ADDRESS  Address redirector will forward traffic to\n");
+        "  -a FORWARD_ADDRESS  Address redirector will forward traffic to\n"
+        "  -f RULES_FILE       Instead of the flags above, forward with the rules in RULES_FILE,\n"
+        "                      one PORTS SOURCE FORWARD_ADDRESS FORWARD_PORT SOURCE_ADDRESS\n"
+        "                      udp|raw per line, SOURCE is an IPv4 prefix or -, packets leave\n"
+        "                      from the first port of PORTS\n\n");
+
+    // split in two, a single literal would pass the 4095 characters C99 guarantees
+    printf(
+        "optional flags:\n"
+        "  -X                  With raw output, send through a PACKET_TX_RING flushed once per\n"
+        "                      batch\n"
+        "  -V                  With raw output, keep checksum offload and GSO with\n"
+        "                      PACKET_VNET_HDR, frames up to BUF_SIZE go out in one write,\n"
+        "                      -m 65535 takes whole GSO frames\n"
+        "  -t                  Measure kernel receive to kernel transmit latency with software\n"
+        "                      SO_TIMESTAMPING, frames from the TX ring, -R or AF_XDP are not\n"
+        "                      timestamped\n"
+        "  -x INTERFACE        Rewrite and send raw rule traffic arriving on INTERFACE in an XDP "
+        "program,\n"
+        "                      everything else still goes through userspace\n"
+        "  -k INTERFACE        Receive rule traffic arriving on INTERFACE through AF_XDP sockets, "
+        "worker N\n"
+        "                      on queue N, raw rules on INTERFACE send from the socket's UMEM\n"
+        "  -z MODE             AF_XDP mode: copy or zerocopy (default: zerocopy when the driver "
+        "supports it)\n"
+        "  -w REPLY_PORTS      Track raw rule flows and rewrite replies back to the sender, every "
+        "flow is\n"
+        "                      forwarded from its own port of the FIRST-LAST range\n"
+        "  -W TIMEOUT          Seconds a flow without traffic is kept (default: 30)\n"
+        "  -q RATE             Forward at most RATE packets per second from every source address, "
+        "the rest\n"
+        "                      is dropped before it is rewritten, workers are assigned by source "
+        "address\n"
+        "  -e BURST            Packets a source may send at once after being idle (default: RATE "
+        "/ 10)\n"
+        "  -g GLOBAL_RATE      Forward at most GLOBAL_RATE packets per second from all sources, "
+        "split\n"
+        "                      evenly between the workers\n"
+        "  -D FLOW_LIMIT       Queue up to FLOW_LIMIT frames per flow and send them round robin, a "
+        "full\n"
+        "                      output is retried instead of dropping, each worker keeps its own "
+        "queues\n"
+        "  -j WORKERS          Worker threads, one core each, flows spread with PACKET_FANOUT "
+        "(default: 1)\n"
+        "  -m BUF_SIZE         Size of the preallocated receive buffers, 9216 for jumbo frames "
+        "(default: 2048)\n"
+        "  -b BATCH            Packets received and sent per recvmmsg/sendmmsg, at most 1024 "
+        "(default: 32)\n"
+        "  -d DELAY            Microseconds a UDP send batch may wait to fill up (default: 0)\n"
+        "  -G                  Coalesce UDP payloads to the same destination into one UDP_SEGMENT "
+        "send\n"
+        "  -U                  Receive and send through io_uring with a multishot recvmsg, falls "
+        "back to\n"
+        "                      recvmmsg/sendmmsg when the kernel lacks it\n"
+        "  -Y SPIN_US          Low latency mode: busy poll the device queue and spin for SPIN_US "
+        "after the\n"
+        "                      last frame before sleeping again, memory is locked with mlockall\n"
+        "  -Q PRIORITY         With -Y, run the workers SCHED_FIFO at PRIORITY (1-99)\n"
+        "  -R                  Receive through a TPACKET_V3 mmap ring instead of recv\n"
+        "  -B BLOCK_SIZE       Ring block size in bytes, multiple of the page size (default: "
+        "1048576)\n"
+        "  -F FRAME_COUNT      Minimum number of 2048 byte frames the ring holds (default: 4096)\n"
+        "  -T BLOCK_TIMEOUT    Milliseconds before a partially filled block is handed over "
+        "(default: 1)\n"
+        "  -L LEVEL            Packet logging: off, summary or hexdump (default: summary)\n"
+        "  -S SAMPLE           Log one in every SAMPLE packets (default: 1)\n"
+        "  -o LOG_FILE         Append the packet log to LOG_FILE instead of stdout\n"
+        "  -M STATS_SOCKET     Serve Prometheus and JSON metrics on a UNIX socket at this path\n"
+        "  -s SOURCES          Only accept sources in these comma separated IPv4 prefixes\n"
+        "  -l LENGTHS          Only accept frames of MIN-MAX, MIN- or -MAX bytes\n");
 }
 
 /**
@@ -86,15 +276,24 @@ static void DisplayUsage()
  * @param listen_port Double pointer to dst port redirector will be filtering for
  * @param forward_port Double pointer to dst port redirector will be forwarding traffic to
  * @param forward_address Double pointer to address redirector will be forwarding traffic to
+ * @param src_address Double pointer to address redirector will be forwarding traffic from
+ * @param rules_file Double pointer to the rules file replacing the four addresses and ports
+ * @param raw_send Set when packets are to be sent using raw sockets
+ * @param config Redirector configuration that optional flags are written to
  * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
  */
 static int GetOptions(int argc, char* argv[], char** listen_port, char** forward_port,
-                      char** forward_address, char** src_address, int* raw_send)
+                      char** forward_address, char** src_address, char** rules_file,
+                      int* raw_send, struct redirector_config* config)
 {
     int exit_code = EXIT_SUCCESS;
     const int enabled = 1;
     int help = 0;
+    int xsk_mode_set = 0;
+    int flow_timeout_set = 0;
     int option = 0;
+    long value = 0;
+    struct filter_spec reply = {0};
 
     if (NULL == argv)
     {
@@ -126,7 +325,27 @@ static int GetOptions(int argc, char* argv[], char** listen_port, char** forward
         goto end;
     }
 
-    while (-1 != (option = getopt(argc, argv, "p:P:a:A:h")))
+    if (NULL == rules_file || NULL != *rules_file)
+    {
+        (void)fprintf(stderr, "rules_file must be a NULL double pointer\n");
+        goto end;
+    }
+
+    if (NULL == raw_send)
+    {
+        (void)fprintf(stderr, "raw_send can not be NULL\n");
+        goto end;
+    }
+
+    if (NULL == config)
+    {
+        (void)fprintf(stderr, "config can not be NULL\n");
+        goto end;
+    }
+
+    while (-1 != (option = getopt(argc, argv,
+                                  "p:P:a:A:f:hrXVtx:k:z:w:W:q:e:g:D:j:m:b:d:"
+                                  "GUY:Q:RB:F:T:L:S:o:M:s:l:")))
     {
         switch (option)
         {
@@ -147,6 +366,10 @@ static int GetOptions(int argc, char* argv[], char** listen_port, char** forward
                 *src_address = optarg;
                 break;
 
+            case 'f':
+                *rules_file = optarg;
+                break;
+
             case 'h':
                 exit_code = EXIT_FAILURE;
                 help = enabled;  // was called
@@ -156,12 +379,303 @@ static int GetOptions(int argc, char* argv[], char** listen_port, char** forward
                 *raw_send = enabled;  // was called
                 break;
 
+            case 'X':
+                config->tx_ring = enabled;  // was called
+                break;
+
+            case 'V':
+                config->vnet_hdr = enabled;  // was called
+                break;
+
+            case 't':
+                config->timestamping = enabled;  // was called
+                break;
+
+            case 'x':
+                config->xdp_if = optarg;
+                break;
+
+            case 'k':
+                config->xsk_if = optarg;
+                break;
+
+            case 'z':
+                if (ParseXskMode(optarg, &config->xsk_mode))
+                {
+                    exit_code = EXIT_FAILURE;
+                }
+                xsk_mode_set = enabled;
+                break;
+
+            case 'w':
+                if (ParsePortRanges(optarg, &reply) || 1 != reply.port_count)
+                {
+                    (void)fprintf(stderr, "-w takes a single FIRST-LAST port range\n");
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->return_path = enabled;
+                config->reply_ports = reply.ports[0];
+                break;
+
+            case 'W':
+                if (ParseNumber(optarg, "flow timeout", 1, FLOW_MAX_TIMEOUT, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->flow_timeout = (uint32_t)value;
+                flow_timeout_set = enabled;
+                break;
+
+            case 'q':
+                if (ParseNumber(optarg, "source rate", 1, LIMIT_MAX_RATE, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->source_rate = (uint32_t)value;
+                break;
+
+            case 'e':
+                if (ParseNumber(optarg, "source burst", 1, LIMIT_MAX_RATE, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->source_burst = (uint32_t)value;
+                break;
+
+            case 'g':
+                if (ParseNumber(optarg, "global rate", 1, LIMIT_MAX_RATE, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->global_rate = (uint32_t)value;
+                break;
+
+            case 'D':
+                if (ParseNumber(optarg, "flow limit", 1, FQ_MAX_FLOW_LIMIT, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->fq_flow_limit = (uint32_t)value;
+                break;
+
+            case 'j':
+                if (ParseNumber(optarg, "worker count", 1, MAX_WORKERS, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->workers = (uint32_t)value;
+                break;
+
+            case 'm':
+                if (ParseNumber(optarg, "buffer size", 1, UINT16_MAX, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->buf_size = (size_t)value;
+                break;
+
+            case 'b':
+                if (ParseNumber(optarg, "batch size", 1, BATCH_MAX_SIZE, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->batch_size = (uint32_t)value;
+                break;
+
+            case 'd':
+                if (ParseNumber(optarg, "batch delay", 0, UINT32_MAX, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->batch_delay_us = (uint32_t)value;
+                break;
+
+            case 'G':
+                config->udp_gso = enabled;  // was called
+                break;
+
+            case 'U':
+                config->uring = enabled;  // was called
+                break;
+
+            case 'Y':
+                if (ParseNumber(optarg, "spin time", 1, 1000000, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->spin_us = (uint32_t)value;
+                break;
+
+            case 'Q':
+                if (ParseNumber(optarg, "real-time priority", 1, 99, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->rt_priority = (int)value;
+                break;
+
+            case 'R':
+                config->rx_ring.enabled = enabled;  // was called
+                break;
+
+            case 'B':
+                if (ParseNumber(optarg, "block size", 1, UINT32_MAX, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->rx_ring.block_size = (uint32_t)value;
+                break;
+
+            case 'F':
+                if (ParseNumber(optarg, "frame count", 1, UINT32_MAX, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->rx_ring.frame_count = (uint32_t)value;
+                break;
+
+            case 'T':
+                if (ParseNumber(optarg, "block timeout", 0, UINT32_MAX, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->rx_ring.block_timeout_ms = (uint32_t)value;
+                break;
+
+            case 'L':
+                if (ParseLogLevel(optarg, &config->log.level))
+                {
+                    exit_code = EXIT_FAILURE;
+                }
+                break;
+
+            case 'S':
+                if (ParseNumber(optarg, "log sample rate", 1, UINT32_MAX, &value))
+                {
+                    exit_code = EXIT_FAILURE;
+                    break;
+                }
+                config->log.sample = (uint32_t)value;
+                break;
+
+            case 'o':
+                config->log.path = optarg;
+                break;
+
+            case 'M':
+                config->stats_path = optarg;
+                break;
+
+            case 's':
+                if (ParseSourcePrefixes(optarg, &config->filter))
+                {
+                    exit_code = EXIT_FAILURE;
+                }
+                break;
+
+            case 'l':
+                if (ParseLengthRange(optarg, &config->filter))
+                {
+                    exit_code = EXIT_FAILURE;
+                }
+                break;
+
             case '?':
                 exit_code = EXIT_FAILURE;
                 break;
         }
     }
 
+    if (xsk_mode_set && NULL == config->xsk_if)
+    {
+        (void)fprintf(stderr, "-z option requires -k\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (config->uring && config->rx_ring.enabled)
+    {
+        (void)fprintf(stderr, "-U option can not be combined with -R\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (config->vnet_hdr && (config->tx_ring || config->rx_ring.enabled))
+    {
+        (void)fprintf(stderr, "-V option can not be combined with -X or -R\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (0 != config->rt_priority && 0 == config->spin_us)
+    {
+        (void)fprintf(stderr, "-Q option requires -Y\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (0 != config->source_burst && 0 == config->source_rate)
+    {
+        (void)fprintf(stderr, "-e option requires -q\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    // a tenth of a second worth of packets unless told otherwise
+    if (0 != config->source_rate && 0 == config->source_burst)
+    {
+        config->source_burst = config->source_rate / 10U + (config->source_rate < 10U);
+    }
+
+    if ((0 != config->source_rate || 0 != config->global_rate) && NULL != config->xdp_if)
+    {
+        (void)fprintf(stderr, "-q and -g options can not be combined with -x\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    // the NIC spreads AF_XDP traffic over the workers by its own hash, ports included
+    if (0 != config->source_rate && NULL != config->xsk_if && config->workers > 1)
+    {
+        (void)fprintf(stderr, "-q option can not be combined with -k and more than one worker\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    // the queues hold pool buffers and drive the plain socket sends themselves
+    if (0 != config->fq_flow_limit &&
+        (config->rx_ring.enabled || config->tx_ring || config->uring || NULL != config->xsk_if ||
+         0 != config->batch_delay_us))
+    {
+        (void)fprintf(stderr, "-D option can not be combined with -R, -X, -U, -k or -d\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (flow_timeout_set && !config->return_path)
+    {
+        (void)fprintf(stderr, "-W option requires -w\n");
+        exit_code = EXIT_FAILURE;
+    }
+
+    if (NULL != *rules_file)
+    {
+        if (NULL != *listen_port || NULL != *forward_port || NULL != *forward_address ||
+            NULL != *src_address || *raw_send)
+        {
+            (void)fprintf(stderr, "-f option can not be combined with -P, -p, -a, -A or -r\n");
+            exit_code = EXIT_FAILURE;
+        }
+        goto end;
+    }
+
     if (NULL == *listen_port && !help)
     {
         (void)fprintf(stderr, "-P option is required\n");
@@ -186,6 +700,43 @@ static int GetOptions(int argc, char* argv[], char** listen_port, char** forward
         exit_code = EXIT_FAILURE;
     }
 
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Parses a base 10 number and checks that it is in range.
+ *
+ * @param str String to parse
+ * @param name Name of the option, used in error messages
+ * @param min Smallest accepted value
+ * @param max Largest accepted value
+ * @param value Set to the parsed number on success
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+static int ParseNumber(const char* str, const char* name, long min, long max, long* value)
+{
+    int exit_code = EXIT_FAILURE;
+    const int base_10 = 10;
+    char* endptr = NULL;
+    long number = 0;
+
+    if (NULL == str || NULL == value)
+    {
+        (void)fprintf(stderr, "str and value can not be NULL\n");
+        goto end;
+    }
+
+    number = strtol(str, &endptr, base_10);
+    if ('\0' == *str || *endptr != '\0' || number < min || number > max)
+    {
+        (void)fprintf(stderr, "Invalid %s: %s\n", name, str);
+        goto end;
+    }
+
+    *value = number;
+    exit_code = EXIT_SUCCESS;
+
 end:
     return exit_code;
 }
\ No newline at end of file
@@ -1,186 +1,1853 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <linux/filter.h>
 #include <linux/if_ether.h>
+#include <linux/virtio_net.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "checksum.h"
 #include "common.h"
+#include "filter.h"
+#include "flow.h"
+#include "fq.h"
+#include "limiter.h"
+#include "log.h"
+#include "metrics.h"
 #include "networking.h"
+#include "nexthop.h"
+#include "packet_ring.h"
+#include "pool.h"
+#include "rawparser.h"
 #include "redirector.h"
+#include "rewrite.h"
+#include "rules.h"
+#include "tstamp.h"
+#include "uring.h"
+#include "xdp.h"
+#include "xsk.h"
 
-static int CreateUDPFilterSocket(uint16_t port);
-static int RawSendLoop(uint16_t l_port, uint16_t f_port, char* f_addr, char* s_addr);
-static int UdpSendLoop(uint16_t l_port, uint16_t f_port, char* f_addr, char* s_addr);
-int StartRedirector(uint16_t l_port, uint16_t f_port, int raw_send, char* f_addr, char* s_addr)
+struct engine
+{
+    int stop_fd;
+    int bpf_sock;
+    int out_sock;
+    int tx_if_index;
+    const struct rule_table* rules;
+    struct log_ring* log;
+    struct worker_metrics* metrics;
+    struct latency_runs latency;
+    uint64_t rx_ns;
+    uint64_t stats_ns;
+    struct rx_ring* rx_ring;
+    struct tx_ring* tx_ring;
+    struct buf_pool* pool;
+    struct udp_batch* batch;
+    struct flow_table* flows;
+    struct limiter* limiter;  // admission control of rule traffic, NULL without -q or -g
+    struct fair_queue* fq;    // pool frames wait here for their output with -D, NULL otherwise
+    const struct nexthop* hops;  // L2 headers of the raw rules, indexed like the rules
+    struct xsk_socket* xsk;
+    uint64_t xsk_frame;  // UMEM address of the frame being forwarded, XSK_NO_FRAME once it is sent
+    struct uring* uring;  // receives on the filter socket and sends in place of recvmmsg/sendmmsg
+    int vnet_hdr;         // pool frames start with a virtio_net_hdr, raw sends need one too
+    uint64_t spin_ns;     // how long the loop keeps polling after the last frame, 0 to sleep
+    struct tstamp_ring* raw_stamps;  // sends on the filter socket with -t, NULL otherwise
+    struct tstamp_ring* udp_stamps;  // sends on the UDP socket with -t and a UDP rule
+    uint64_t rx_real_ns;             // rx_ns on the clock of the kernel timestamps, with -t
+    uint32_t recv_batch;
+};
+
+/**
+ * One forwarding thread. Every worker owns its filter socket, output socket, ring and buffer
+ * pool, the only things workers share are the read only rule table, the filter program and the
+ * stop eventfd. Each worker produces into its own log ring and is the only writer of its
+ * metrics.
+ */
+struct worker
+{
+    const struct redirector_config* config;
+    const struct rule_table* rules;
+    const struct sock_fprog* filter;
+    const struct xdp_path* xdp;
+    const struct nexthop* hops;
+    struct sock_fprog* steer;  // fanout program, NULL to hash
+    struct log_ring* log;
+    struct worker_metrics* metrics;
+    pthread_t thread;
+    uint32_t index;
+    int cpu;
+    int stop_fd;
+    int joined_fd;
+    int exit_code;
+};
+
+static int CreateSignalFd(void);
+static int GetWorkerCpu(uint32_t index);
+static int WaitForStop(int sig_fd, int stop_fd, int stats_sock, const struct metrics* metrics,
+                       struct nexthop_cache* nexthops);
+static int WaitForJoin(int joined_fd, int stop_fd);
+static void* WorkerThread(void* arg);
+static int JoinWorkerFanout(const struct worker* worker, int sock);
+static int ForwardLoop(struct worker* worker);
+static int SetupEngineInput(struct engine* engine, const struct redirector_config* config,
+                            struct rx_ring* ring, struct buf_pool* pool);
+static int RunEngine(struct engine* engine);
+static uint32_t DrainFilterSocket(struct engine* engine);
+static uint32_t DrainXskSocket(struct engine* engine);
+static uint32_t DrainUring(struct engine* engine);
+static uint32_t PollInputs(struct engine* engine);
+static void ReadKernelStats(struct engine* engine);
+static void ForwardFrame(struct engine* engine, unsigned char* packet, ssize_t frame_len,
+                         uint32_t status, struct pkt_buf* buf);
+static int ForwardPacket(struct engine* engine, const struct rule* rule,
+                         struct virtio_net_hdr* vnet, unsigned char* packet, ssize_t packet_len,
+                         unsigned char* data, struct pkt_buf* buf);
+static void FlushOutputs(struct engine* engine, int force);
+static void DrainFairQueue(struct engine* engine);
+static void SendFairBatch(struct engine* engine, struct fq_node** nodes, uint32_t count);
+int StartRedirector(const struct redirector_config* config)
 {
     int exit_code = EXIT_FAILURE;
+    int sig_fd = -1;
+    int stop_fd = -1;
+    int joined_fd = -1;
+    int stats_sock = -1;
+    int result = 0;
+    uint32_t started = 0;
+    uint32_t index = 0;
+    uint64_t stop = 1;
+    uint64_t xdp_forwarded = 0;
+    struct filter_spec filter = {0};
+    struct filter_prog* filter_prog = NULL;
+    struct sock_fprog bpf = {0};
+    struct filter_prog* steer_prog = NULL;
+    struct sock_fprog steer = {0};
+    struct xdp_path xdp = {
+        .rules_fd = -1, .stats_fd = -1, .xsks_fd = -1, .prog_fd = -1, .link_fd = -1};
+    struct nexthop_cache nexthops = {.event_sock = -1, .query_sock = -1};
+    struct logger logger = {0};
+    struct metrics metrics = {0};
+    struct worker* workers = NULL;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
 
-    if (raw_send)
+    if (NULL == config)
     {
-        exit_code = RawSendLoop(l_port, f_port, f_addr, s_addr);
+        (void)fprintf(stderr, "config can not be NULL\n");
+        goto end;
     }
-    else
+
+    if (0 == config->workers || NULL == config->rules)
+    {
+        (void)fprintf(stderr, "at least one worker and a rule table are required\n");
+        goto end;
+    }
+
+    // picked once here, workers only ever read the kernel pointer
+    checksum_init();
+
+    // one filter for every rule, the kernel only wakes us up for ports some rule covers
+    filter = config->filter;
+    if (RuleFilterSpec(config->rules, &filter))
+    {
+        (void)fprintf(stderr, "Could not derive the packet filter from the rules\n");
+        goto end;
+    }
+
+    if (config->return_path && FlowFilterSpec(config->rules, &config->reply_ports, &filter))
+    {
+        (void)fprintf(stderr, "Could not let replies through the packet filter\n");
+        goto end;
+    }
+
+    // signals are blocked before any worker starts so only the signalfd ever sees them
+    sig_fd = CreateSignalFd();
+    if (-1 == sig_fd)
+    {
+        (void)fprintf(stderr, "Could not create signal fd\n");
+        goto end;
+    }
+
+    // like the workers, the log thread inherits the blocked signal mask
+    if (CreateLogger(&logger, &config->log, config->workers))
+    {
+        (void)fprintf(stderr, "Could not start packet logging\n");
+        goto clean;
+    }
+
+    if (CreateMetrics(&metrics, config->workers))
+    {
+        (void)fprintf(stderr, "Could not set up metrics\n");
+        goto clean;
+    }
+
+    if (NULL != config->stats_path)
+    {
+        stats_sock = CreateStatsSocket(config->stats_path);
+        if (-1 == stats_sock)
+        {
+            (void)fprintf(stderr, "Could not create stats socket\n");
+            goto clean;
+        }
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (-1 == stop_fd)
+    {
+        perror("eventfd");
+        goto clean;
+    }
+
+    // raw rule traffic on this interface never reaches the workers, they handle the rest
+    if (NULL != config->xdp_if && CreateXdpPath(&xdp, config->rules, &config->filter,
+                                                config->xdp_if, 0))
+    {
+        (void)fprintf(stderr, "Could not set up the XDP fast path\n");
+        goto clean;
+    }
+
+    // one socket per worker, worker N takes the traffic of receive queue N
+    if (NULL != config->xsk_if && CreateXdpPath(&xdp, config->rules, &config->filter,
+                                                config->xsk_if, config->workers))
+    {
+        (void)fprintf(stderr, "Could not set up AF_XDP redirection\n");
+        goto clean;
+    }
+
+    // raw frames leave with the next hop's address, this thread keeps it current
+    if (config->rules->has_raw &&
+        CreateNexthopCache(&nexthops, config->rules, NULL != config->xdp_if ? &xdp : NULL))
+    {
+        (void)fprintf(stderr, "Could not resolve the next hops of the raw rules\n");
+        goto clean;
+    }
+
+    workers = calloc(config->workers, sizeof(*workers));
+    if (NULL == workers)
+    {
+        perror("calloc");
+        goto clean;
+    }
+
+    // built once, the kernel keeps a copy for every worker's socket
+    filter_prog = malloc(sizeof(*filter_prog));
+    if (NULL == filter_prog)
+    {
+        perror("malloc");
+        goto clean;
+    }
+
+    if (BuildFilter(&filter, filter_prog))
+    {
+        (void)fprintf(stderr, "Could not build the packet filter\n");
+        goto clean;
+    }
+    bpf.len = filter_prog->len;
+    bpf.filter = filter_prog->insns;
+
+    printf("Filtering packets for udp dst port: ");
+    for (index = 0; index < filter.port_count; ++index)
+    {
+        printf(filter.ports[index].first == filter.ports[index].last ? "%s%u" : "%s%u-%u",
+               index ? "," : "", filter.ports[index].first, filter.ports[index].last);
+    }
+    printf(", %u source prefixes, %u bpf instructions\n", filter.prefix_count, filter_prog->len);
+
+    // replies have to reach the worker that handed out their port and a rate limited source the
+    // worker holding its bucket, whatever the kernel's hash
+    if ((config->return_path || 0 != config->source_rate) && config->workers > 1)
+    {
+        steer_prog = malloc(sizeof(*steer_prog));
+        if (NULL == steer_prog)
+        {
+            perror("malloc");
+            goto clean;
+        }
+
+        if (BuildFanoutFilter(config->return_path ? &config->reply_ports : NULL,
+                              config->workers, 0 != config->source_rate, steer_prog))
+        {
+            (void)fprintf(stderr, "Could not build the fanout program\n");
+            goto clean;
+        }
+        steer.len = steer_prog->len;
+        steer.filter = steer_prog->insns;
+
+        joined_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (-1 == joined_fd)
+        {
+            perror("eventfd");
+            goto clean;
+        }
+    }
+
+    printf("Starting Redirector with %u worker%s, %u rule%s, %s checksums\n\n", config->workers,
+           1 == config->workers ? "" : "s", config->rules->rule_count,
+           1 == config->rules->rule_count ? "" : "s", checksum_impl());
+
+    if (config->return_path)
+    {
+        printf("Rewriting replies to ports %u-%u back to their senders, flows time out after %u "
+               "seconds\n",
+               config->reply_ports.first, config->reply_ports.last, config->flow_timeout);
+    }
+
+    if (0 != config->source_rate)
+    {
+        printf("Limiting every source to %u packets/s with a burst of %u\n", config->source_rate,
+               config->source_burst);
+    }
+
+    if (0 != config->global_rate)
+    {
+        printf("Limiting all sources together to %u packets/s\n", config->global_rate);
+    }
+
+    if (0 != config->fq_flow_limit)
+    {
+        printf("Fair queueing up to %u frames per flow in front of the outputs\n",
+               config->fq_flow_limit);
+    }
+
+    if (0 != config->spin_us)
+    {
+        printf("Low latency mode, workers spin for %u us after the last frame\n", config->spin_us);
+
+        // the pools, rings and stacks the workers allocate next are locked as they appear
+        if (mlockall(MCL_CURRENT | MCL_FUTURE))
+        {
+            perror("mlockall, memory stays pageable");
+        }
+
+        // sched_yield never hands a SCHED_FIFO core to ordinary tasks
+        CPU_ZERO(&cpus);
+        if (0 != config->rt_priority && 0 == sched_getaffinity(0, sizeof(cpus), &cpus) &&
+            (uint32_t)CPU_COUNT(&cpus) <= config->workers)
+        {
+            (void)fprintf(stderr, "SCHED_FIFO workers leave no core free, other tasks only run "
+                                  "once a worker stops spinning\n");
+        }
+    }
+
+    for (started = 0; started < config->workers; ++started)
+    {
+        workers[started].config = config;
+        workers[started].rules = config->rules;
+        workers[started].filter = &bpf;
+        workers[started].xdp = -1 == xdp.xsks_fd ? NULL : &xdp;
+        workers[started].hops = nexthops.hops;
+        workers[started].steer = NULL == steer_prog ? NULL : &steer;
+        workers[started].joined_fd = joined_fd;
+        workers[started].log = LoggerRing(&logger, started);
+        workers[started].metrics = &metrics.workers[started];
+        workers[started].index = started;
+        workers[started].stop_fd = stop_fd;
+        workers[started].cpu = GetWorkerCpu(started);
+        workers[started].exit_code = EXIT_FAILURE;
+
+        (void)pthread_attr_init(&attr);
+        if (-1 != workers[started].cpu)
+        {
+            CPU_ZERO(&cpus);
+            CPU_SET((size_t)workers[started].cpu, &cpus);
+            (void)pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+
+        result = pthread_create(&workers[started].thread, &attr, WorkerThread, &workers[started]);
+        (void)pthread_attr_destroy(&attr);
+        if (result)
+        {
+            (void)fprintf(stderr, "Could not start worker %u: %s\n", started, strerror(result));
+            break;
+        }
+
+        // fanout members are numbered in join order, which has to be the worker order
+        if (NULL != steer_prog && WaitForJoin(joined_fd, stop_fd))
+        {
+            started++;
+            break;
+        }
+    }
+
+    if (started == config->workers)
+    {
+        exit_code = WaitForStop(sig_fd, stop_fd, stats_sock, &metrics,
+                                NULL == nexthops.hops ? NULL : &nexthops);
+    }
+
+    if (-1 == write(stop_fd, &stop, sizeof(stop)))
+    {
+        perror("write stop_fd");
+    }
+
+    for (index = 0; index < started; ++index)
+    {
+        (void)pthread_join(workers[index].thread, NULL);
+        if (workers[index].exit_code)
+        {
+            exit_code = EXIT_FAILURE;
+        }
+    }
+
+clean:
+    if (-1 != xdp.link_fd && EXIT_SUCCESS == XdpForwarded(&xdp, &xdp_forwarded))
+    {
+        printf("XDP %s %llu packets\n",
+               -1 == xdp.xsks_fd ? "fast path forwarded" : "program redirected",
+               (unsigned long long)xdp_forwarded);
+    }
+    DestroyXdpPath(&xdp);
+    DestroyNexthopCache(&nexthops);
+    NFREE(workers);
+    NFREE(steer_prog);
+    NFREE(filter_prog);
+    if (-1 != joined_fd)
+        close(joined_fd);
+    if (-1 != stop_fd)
+        close(stop_fd);
+    if (-1 != stats_sock)
     {
-        exit_code = UdpSendLoop(l_port, f_port, f_addr, s_addr);
+        close(stats_sock);
+        (void)unlink(config->stats_path);
     }
+    DestroyMetrics(&metrics);
+    // after the join, so every record the workers queued is still written out
+    DestroyLogger(&logger);
+    close(sig_fd);
 
+end:
     return exit_code;
 }
 
-static int RawSendLoop(uint16_t l_port, uint16_t f_port, char* f_addr, char* s_addr)
+/**
+ * @brief Waits until a signal arrives or a worker gives up and asks everyone to stop, answering
+ * stats requests and keeping the next hops current in the meantime.
+ *
+ * @param sig_fd signalfd reporting SIGINT and SIGTERM.
+ * @param stop_fd eventfd the workers write to when they fail.
+ * @param stats_sock Listening stats socket, -1 if there is none.
+ * @param metrics Metrics reported on the stats socket.
+ * @param nexthops Next hop cache of the raw rules, NULL if there are none.
+ * @return int EXIT_SUCCESS if stopped by a signal, EXIT_FAILURE otherwise.
+ */
+static int WaitForStop(int sig_fd, int stop_fd, int stats_sock, const struct metrics* metrics,
+                       struct nexthop_cache* nexthops)
 {
     int exit_code = EXIT_FAILURE;
-    int sock = -1;
-    unsigned char* packet = NULL;
-    char* interface = NULL;
-    ssize_t packet_len = -1;
+    const int kick_timeout_ms = 1000;
+    struct signalfd_siginfo siginfo = {0};
+    // poll skips the negative fds when there is no stats socket or next hop cache
+    struct pollfd fds[4] = {
+        {.fd = sig_fd, .events = POLLIN, .revents = 0},
+        {.fd = stop_fd, .events = POLLIN, .revents = 0},
+        {.fd = stats_sock, .events = POLLIN, .revents = 0},
+        {.fd = NULL == nexthops ? -1 : nexthops->event_sock, .events = POLLIN, .revents = 0},
+    };
+
+    for (;;)
+    {
+        if (-1 == poll(fds, sizeof(fds) / sizeof(*fds), NULL == nexthops ? -1 : kick_timeout_ms))
+        {
+            if (EINTR == errno)
+                continue;
 
-    sock = CreateUDPFilterSocket(l_port);
+            perror("poll");
+            goto end;
+        }
 
-    if (-1 == sock)
+        if (fds[0].revents & POLLIN || fds[1].revents & POLLIN)
+            break;
+
+        if (fds[2].revents & POLLIN && ServeStats(stats_sock, metrics))
+        {
+            (void)fprintf(stderr, "Could not answer stats request\n");
+        }
+
+        // on a notification, and once a second for next hops the kernel still has to resolve
+        if (NULL != nexthops && UpdateNexthopCache(nexthops, MonotonicNs()))
+        {
+            (void)fprintf(stderr, "Could not update next hops\n");
+        }
+    }
+
+    if (fds[0].revents & POLLIN)
     {
-        (void)fprintf(stderr, "Could not create raw udp filter socket\n");
+        if (read(sig_fd, &siginfo, sizeof(siginfo)) == (ssize_t)sizeof(siginfo))
+        {
+            printf("Received signal %u, stopping Redirector\n", siginfo.ssi_signo);
+        }
+        exit_code = EXIT_SUCCESS;
+    }
+    else
+    {
+        (void)fprintf(stderr, "A worker failed, stopping Redirector\n");
+    }
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Picks the CPU a worker is pinned to, the index-th CPU the process may run on.
+ *
+ * @param index Index of the worker.
+ * @return int the CPU number, or -1 if the affinity mask could not be read.
+ */
+static int GetWorkerCpu(uint32_t index)
+{
+    int cpu = 0;
+    int allowed = 0;
+    int wanted = 0;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus))
+    {
+        perror("sched_getaffinity");
+        return -1;
+    }
+
+    allowed = CPU_COUNT(&cpus);
+    if (0 == allowed)
+        return -1;
+
+    wanted = (int)(index % (uint32_t)allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET((size_t)cpu, &cpus))
+            continue;
+
+        if (0 == wanted--)
+            return cpu;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Waits until the worker just started has joined the fanout group.
+ *
+ * @param joined_fd eventfd the worker writes to once it joined.
+ * @param stop_fd eventfd written to when a worker fails, left unread.
+ * @return int EXIT_SUCCESS once the worker joined, EXIT_FAILURE if it failed.
+ */
+static int WaitForJoin(int joined_fd, int stop_fd)
+{
+    uint64_t joined = 0;
+    struct pollfd fds[2] = {
+        {.fd = joined_fd, .events = POLLIN, .revents = 0},
+        {.fd = stop_fd, .events = POLLIN, .revents = 0},
+    };
+
+    for (;;)
+    {
+        if (-1 == poll(fds, sizeof(fds) / sizeof(*fds), -1))
+        {
+            if (EINTR == errno)
+                continue;
+
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        if (fds[1].revents & POLLIN)
+            return EXIT_FAILURE;
+
+        if (fds[0].revents & POLLIN && read(joined_fd, &joined, sizeof(joined)) > 0)
+            return EXIT_SUCCESS;
+    }
+}
+
+static void* WorkerThread(void* arg)
+{
+    struct worker* worker = arg;
+    uint64_t stop = 1;
+
+    worker->exit_code = ForwardLoop(worker);
+
+    // a worker that could not start or died takes the others down with it
+    if (worker->exit_code && -1 == write(worker->stop_fd, &stop, sizeof(stop)))
+    {
+        perror("write stop_fd");
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Joins a worker's filter socket to the redirector's PACKET_FANOUT group.
+ *
+ * @param worker Worker owning the socket.
+ * @param sock Filter socket of the worker.
+ * @return int EXIT_SUCCESS on success or with a single worker, EXIT_FAILURE on failure.
+ */
+static int JoinWorkerFanout(const struct worker* worker, int sock)
+{
+    int exit_code = EXIT_SUCCESS;
+    uint64_t joined = 1;
+
+    if (worker->config->workers < 2)
+        goto end;
+
+    // one group per redirector process, the pid keeps concurrent redirectors apart
+    if (JoinFanoutGroup(sock, (uint16_t)getpid(), worker->steer))
+    {
+        (void)fprintf(stderr, "Could not join fanout group\n");
+        exit_code = EXIT_FAILURE;
         goto end;
     }
 
-    if (GetInterface(s_addr, &interface))
+    if (NULL != worker->steer && -1 == write(worker->joined_fd, &joined, sizeof(joined)))
     {
-        (void)fprintf(stderr, "Could not get interface for address: %s\n", s_addr);
+        perror("write joined_fd");
+        exit_code = EXIT_FAILURE;
         goto end;
     }
 
-    printf("Sending packets on interface: %s\n", interface);
-    printf("Starting Redirector\n\n");
-    packet_len = RecvAndModifyPacket(sock, f_port, l_port, NULL, f_addr, s_addr, &packet);
+    if (0 == worker->index)
+    {
+        printf("Spreading flows over %u workers\n", worker->config->workers);
+    }
 
-    if (-1 == packet_len)
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Sets up a worker's sockets and outputs and runs its engine until the redirector stops.
+ *
+ * The filter socket doubles as the raw output, a UDP socket and send batch are only created
+ * when some rule sends over UDP. With -X the TX ring is bound to the interface of the first raw
+ * rule, raw rules on other interfaces send through the filter socket. With -k the worker also
+ * receives on an AF_XDP socket, raw rules on that interface send out of its UMEM. With -U the
+ * filter socket is read and the UDP and raw sends are written through an io_uring, or with
+ * recvmmsg and sendmmsg if the kernel can not do that.
+ *
+ * @param worker Worker to run.
+ * @return int EXIT_SUCCESS on a clean shutdown, EXIT_FAILURE on failure.
+ */
+static int ForwardLoop(struct worker* worker)
+{
+    const struct redirector_config* config = worker->config;
+    int exit_code = EXIT_FAILURE;
+    int udp_gso = 0;
+    int result = 0;
+    uint32_t index = 0;
+    struct sched_param param = {0};
+    struct engine engine = {0};
+    struct rx_ring ring = {0};
+    struct tx_ring tx_ring = {0};
+    struct buf_pool pool = {0};
+    struct udp_batch batch = {0};
+    struct flow_table flows = {0};
+    struct limiter limiter = {0};
+    struct fair_queue fq = {0};
+    struct xsk_socket xsk = {.fd = -1};
+    struct uring uring = {.fd = -1};
+    struct tstamp_ring raw_stamps;
+    struct tstamp_ring udp_stamps;
+
+    engine.stop_fd = worker->stop_fd;
+    engine.out_sock = -1;
+    engine.xsk_frame = XSK_NO_FRAME;
+    engine.rules = worker->rules;
+    engine.log = worker->log;
+    engine.metrics = worker->metrics;
+    engine.hops = worker->hops;
+
+    engine.bpf_sock = CreateRawFilterSocket(worker->filter);
+    if (-1 == engine.bpf_sock)
+    {
+        (void)fprintf(stderr, "Could not create raw udp filter socket\n");
+        goto end;
+    }
+
+    if (JoinWorkerFanout(worker, engine.bpf_sock))
     {
-        (void)fprintf(stderr, "Could not Recv and Modify Packet\n");
         goto clean;
     }
 
-    if (SendRawSocket(sock, (size_t)packet_len, packet, interface))
+    if (config->vnet_hdr)
+    {
+        if (EnableVnetHdr(engine.bpf_sock))
+        {
+            goto clean;
+        }
+        engine.vnet_hdr = 1;
+    }
+
+    if (0 != config->spin_us)
+    {
+        engine.spin_ns = (uint64_t)config->spin_us * NSEC_PER_USEC;
+        if (EnableBusyPoll(engine.bpf_sock, config->spin_us, config->batch_size))
+        {
+            (void)fprintf(stderr, "Busy polling is not allowed, spinning on the socket only\n");
+        }
+    }
+
+    // before the first send, the kernel numbers the sends from there
+    if (config->timestamping)
+    {
+        if (EnableTimestamping(engine.bpf_sock, 1))
+        {
+            goto clean;
+        }
+        TstampInit(&raw_stamps, engine.bpf_sock);
+        engine.raw_stamps = &raw_stamps;
+    }
+
+    // the worker is already pinned to its core, only its policy is left to change
+    if (0 != config->rt_priority)
+    {
+        param.sched_priority = config->rt_priority;
+        result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (result)
+        {
+            (void)fprintf(stderr, "Could not run worker %u SCHED_FIFO: %s\n", worker->index,
+                          strerror(result));
+        }
+    }
+
+    if (config->return_path)
+    {
+        if (CreateFlowTable(&flows, &config->reply_ports, config->workers, worker->index,
+                            config->flow_timeout))
+        {
+            (void)fprintf(stderr, "Could not create flow table\n");
+            goto clean;
+        }
+        engine.flows = &flows;
+    }
+
+    if (0 != config->source_rate || 0 != config->global_rate)
+    {
+        // every worker takes its share of the cap, the fanout spreads the load about evenly
+        if (CreateLimiter(&limiter, config->source_rate, config->source_burst,
+                          (config->global_rate + config->workers - 1) / config->workers))
+        {
+            (void)fprintf(stderr, "Could not create rate limiter\n");
+            goto clean;
+        }
+        engine.limiter = &limiter;
+    }
+
+    if (engine.rules->has_udp)
+    {
+        // the fair queue holds on to what a full socket can not take yet
+        engine.out_sock =
+            socket(AF_INET, SOCK_DGRAM | (0 != config->fq_flow_limit ? SOCK_NONBLOCK : 0), 0);
+        if (-1 == engine.out_sock)
+        {
+            (void)fprintf(stderr, "Could not create UDP socket\n");
+            goto clean;
+        }
+
+        udp_gso = config->udp_gso;
+        if (udp_gso && UdpGsoSupported(engine.out_sock))
+        {
+            (void)fprintf(stderr, "UDP GSO is not supported, sending one datagram per payload\n");
+            udp_gso = 0;
+        }
+
+        if (CreateUdpBatch(&batch, config->batch_size, config->batch_delay_us, udp_gso))
+        {
+            (void)fprintf(stderr, "Could not create send batch\n");
+            goto clean;
+        }
+        engine.batch = &batch;
+
+        if (config->timestamping)
+        {
+            if (EnableTimestamping(engine.out_sock, 0))
+            {
+                goto clean;
+            }
+            TstampInit(&udp_stamps, engine.out_sock);
+            engine.udp_stamps = &udp_stamps;
+            batch.stamps = &udp_stamps;
+        }
+    }
+
+    if (SetupEngineInput(&engine, config, &ring, &pool))
     {
-        (void)fprintf(stderr, "Could not send raw socket\n");
         goto clean;
     }
 
-    printf("SENDING %s:%d --> %s:%d\n", s_addr, l_port, f_addr, f_port);
+    if (0 != config->fq_flow_limit)
+    {
+        // half the pool at most, receives always find a buffer while the queues are full
+        if (CreateFairQueue(&fq, pool.count / 2, config->fq_flow_limit))
+        {
+            (void)fprintf(stderr, "Could not create fair queue\n");
+            goto clean;
+        }
+        engine.fq = &fq;
+    }
+
+    if (config->uring)
+    {
+        // room for a send per received frame and a full send batch between two reaps
+        if (UringOpen(&uring, engine.bpf_sock, &pool, 2 * config->batch_size))
+        {
+            (void)fprintf(stderr, "Could not set up io_uring, receiving with recvmmsg\n");
+        }
+        else
+        {
+            engine.uring = &uring;
+        }
+    }
+
+    if (NULL != worker->xdp)
+    {
+        if (XskOpen(&xsk, worker->xdp->if_index, worker->index, config->xsk_mode))
+        {
+            (void)fprintf(stderr, "Could not open AF_XDP socket\n");
+            goto clean;
+        }
+        engine.xsk = &xsk;
+
+        if (0 != config->spin_us && EnableBusyPoll(xsk.fd, config->spin_us, config->batch_size))
+        {
+            (void)fprintf(stderr, "Busy polling the AF_XDP socket is not allowed\n");
+        }
+
+        if (XdpAddSocket(worker->xdp, worker->index, xsk.fd))
+        {
+            goto clean;
+        }
+    }
+
+    if (config->tx_ring && engine.rules->has_raw)
+    {
+        for (index = 0; !engine.rules->rules[index].rewrite.raw_send; ++index)
+        {
+        }
+        engine.tx_if_index = engine.rules->rules[index].rewrite.if_index;
+
+        if (SetupTxRing((unsigned int)engine.tx_if_index, &tx_ring))
+        {
+            (void)fprintf(stderr, "Could not set up tx ring\n");
+            goto clean;
+        }
+        engine.tx_ring = &tx_ring;
+    }
+
+    exit_code = RunEngine(&engine);
+    FlushOutputs(&engine, 1);
 
 clean:
-    NFREE(interface);
-    NFREE(packet);
-    close(sock);
+    DestroyFlowTable(&flows);
+    DestroyLimiter(&limiter);
+    // before the pool, the ring's receive writes into its buffers
+    UringClose(&uring);
+    XskClose(&xsk);
+    TeardownTxRing(&tx_ring);
+    TeardownRxRing(&ring);
+    DestroyFairQueue(&fq, &pool);
+    DestroyBufPool(&pool);
+    DestroyUdpBatch(&batch);
+    if (-1 != engine.out_sock)
+        close(engine.out_sock);
+    close(engine.bpf_sock);
 
 end:
     return exit_code;
 }
 
-static int UdpSendLoop(uint16_t l_port, uint16_t f_port, char* f_addr, char* s_addr)
+/**
+ * @brief Sets up what the engine receives into, a TPACKET_V3 ring if one was configured and a
+ * preallocated buffer pool for recv otherwise. With io_uring every buffer also has room for
+ * the recvmsg header the kernel writes in front of the frame, with -V for the virtio_net_hdr.
+ *
+ * @param engine Engine whose filter socket gets the ring.
+ * @param config Redirector configuration holding the ring and buffer parameters.
+ * @param ring Storage for the ring, owned by the caller.
+ * @param pool Storage for the buffer pool, owned by the caller.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure.
+ */
+static int SetupEngineInput(struct engine* engine, const struct redirector_config* config,
+                            struct rx_ring* ring, struct buf_pool* pool)
 {
-    int exit_code = EXIT_FAILURE;
-    int bpf_sock = -1;
-    int udp_sock = -1;
-    unsigned char* data = NULL;
+    int exit_code = EXIT_SUCCESS;
 
-    unsigned char* packet = NULL;
-    ssize_t packet_len = -1;
-    struct sockaddr_in dest_addr = {0};
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(f_port);
+    engine->recv_batch = config->batch_size;
 
-    if (inet_pton(AF_INET, f_addr, &dest_addr.sin_addr) <= 0)
+    if (!config->rx_ring.enabled)
     {
-        (void)fprintf(stderr, "Invalid address: %s\n", f_addr);
-        goto clean;
+        // room for a full receive batch on top of a full send batch still holding references
+        if (CreateBufPool(pool, POOL_DEFAULT_BUF_COUNT + 2 * config->batch_size,
+                          config->buf_size + (config->uring ? URING_RECV_HEADROOM : 0) +
+                              (config->vnet_hdr ? VNET_HDR_LEN : 0)))
+        {
+            (void)fprintf(stderr, "Could not create buffer pool\n");
+            exit_code = EXIT_FAILURE;
+            goto end;
+        }
+
+        engine->pool = pool;
+        goto end;
     }
-    bpf_sock = CreateUDPFilterSocket(l_port);
 
-    if (-1 == bpf_sock)
+    if (SetupRxRing(engine->bpf_sock, &config->rx_ring, ring))
     {
-        (void)fprintf(stderr, "Could not create raw udp filter socket\n");
+        (void)fprintf(stderr, "Could not set up rx ring\n");
+        exit_code = EXIT_FAILURE;
         goto end;
     }
 
-    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (-1 == udp_sock)
+    engine->rx_ring = ring;
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Runs the forwarding engine until the stop eventfd becomes readable.
+ *
+ * The filter socket is level triggered in epoll, every wakeup drains it until EAGAIN. With an
+ * io_uring the ring is polled in its place and drained until no completion is left. Errors on
+ * a single packet are logged and skipped, the sockets stay open for the lifetime of the engine.
+ *
+ * In low latency mode epoll_wait does not sleep while frames keep coming, the inputs are
+ * polled on every pass instead. Once no frame arrived for spin_ns the loop backs off to
+ * sleeping in epoll_wait again, the next frame's wakeup starts the spinning over.
+ *
+ * @param engine Sockets and rewrite parameters to forward with.
+ * @return int EXIT_SUCCESS on a clean shutdown, EXIT_FAILURE on failure.
+ */
+static int RunEngine(struct engine* engine)
+{
+    int exit_code = EXIT_FAILURE;
+    int epoll_fd = -1;
+    int ready = 0;
+    int index = 0;
+    int running = 1;
+    int spinning = 0;
+    int timeout_ms = 0;
+    const int idle_timeout_ms = 1000;
+    uint32_t drained = 0;
+    uint64_t now = 0;
+    uint64_t active_ns = 0;  // when the last frame arrived in low latency mode
+    struct epoll_event event = {0};
+    struct epoll_event events[3] = {0};
+
+    if (NULL == engine)
     {
-        (void)fprintf(stderr, "Could not create UDP socket\n");
-        goto clean;
+        (void)fprintf(stderr, "engine can not be NULL\n");
+        goto end;
     }
 
-    printf("Starting Redirector\n\n");
-    packet_len = RecvAndModifyPacket(bpf_sock, f_port, l_port, &data, f_addr, s_addr, &packet);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epoll_fd)
+    {
+        perror("epoll_create1");
+        goto end;
+    }
 
-    if (-1 == packet_len)
+    event.events = EPOLLIN;
+    event.data.fd = NULL == engine->uring ? engine->bpf_sock : engine->uring->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event))
     {
-        (void)fprintf(stderr, "Could not Recv and Modify Packet\n");
+        perror("epoll_ctl");
         goto clean;
     }
 
-    if (NULL == data)
+    event.events = EPOLLIN;
+    event.data.fd = engine->stop_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, engine->stop_fd, &event))
     {
-        (void)fprintf(stderr, "Data section is NULL\n");
+        perror("epoll_ctl");
         goto clean;
     }
-    if (sendto(udp_sock, data, (size_t)packet_len, 0, (struct sockaddr*)&dest_addr,
-               sizeof(dest_addr)) < 0)
+
+    if (NULL != engine->xsk)
     {
-        (void)fprintf(stderr, "Could not send UDP packet\n");
-        goto clean;
+        event.events = EPOLLIN;
+        event.data.fd = engine->xsk->fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, engine->xsk->fd, &event))
+        {
+            perror("epoll_ctl");
+            goto clean;
+        }
     }
-    printf("SENDING %s:%d --> %s:%d\n", s_addr, l_port, f_addr, f_port);
+
+    while (running)
+    {
+        // a partially filled send batch shortens the wait to when it falls due
+        timeout_ms = UdpBatchTimeout(engine->batch, MonotonicNs());
+        // frames an output pushed back on are tried again once it had time to drain
+        if (NULL != engine->fq && 0 != engine->fq->backlog &&
+            (-1 == timeout_ms || timeout_ms > FQ_RETRY_MS))
+        {
+            timeout_ms = FQ_RETRY_MS;
+        }
+        if (-1 == timeout_ms)
+        {
+            timeout_ms = idle_timeout_ms;
+        }
+        if (spinning)
+        {
+            timeout_ms = 0;
+        }
+
+        ready = epoll_wait(epoll_fd, events, (int)(sizeof(events) / sizeof(*events)), timeout_ms);
+        if (-1 == ready)
+        {
+            if (EINTR == errno)
+                continue;
+
+            perror("epoll_wait");
+            goto clean;
+        }
+
+        if (0 == ready)
+        {
+            FlushOutputs(engine, 0);
+        }
+
+        // the kernel counters are cheap to read but reset on read, once a second is plenty
+        if (MonotonicNs() - engine->stats_ns >= NSEC_PER_SEC)
+        {
+            ReadKernelStats(engine);
+        }
+
+        // the wheel turns once a second, most calls find nothing to do
+        if (NULL != engine->flows)
+        {
+            MetricAdd(&engine->metrics->flows_expired, FlowExpire(engine->flows, MonotonicNs()));
+        }
+
+        drained = 0;
+        for (index = 0; index < ready; ++index)
+        {
+            if (events[index].data.fd == engine->stop_fd)
+            {
+                // left unread, every worker's epoll has to see the same stop event
+                running = 0;
+            }
+            else if (events[index].data.fd == engine->bpf_sock)
+            {
+                drained += DrainFilterSocket(engine);
+            }
+            else if (NULL != engine->uring && events[index].data.fd == engine->uring->fd)
+            {
+                drained += DrainUring(engine);
+            }
+            else
+            {
+                drained += DrainXskSocket(engine);
+            }
+        }
+
+        if (0 != engine->spin_ns)
+        {
+            if (spinning && 0 == ready)
+            {
+                drained = PollInputs(engine);
+            }
+
+            now = MonotonicNs();
+            if (0 != drained)
+            {
+                active_ns = now;
+            }
+            spinning = now - active_ns < engine->spin_ns;
+
+            // an empty pass gives the core to whatever else is runnable, returns at once if
+            // nothing is, so a worker sharing its core does not delay its own senders
+            if (spinning && 0 == drained)
+            {
+                (void)sched_yield();
+            }
+        }
+    }
+
+    ReadKernelStats(engine);
+    exit_code = EXIT_SUCCESS;
 
 clean:
-    NFREE(packet);
-    close(bpf_sock);
+    close(epoll_fd);
 
 end:
     return exit_code;
 }
 
 /**
- * @brief Creates a raw UDP bpf socket that filters for UDP dst port.
- * 
- * @param port UDP dst port to filter for.
- * @return int the file descriptor of the created socket, or -1 on failure.
+ * @brief Receives, rewrites and forwards packets until the filter socket would block.
+ *
+ * The drain is bounded so a sustained flood can not starve signal handling, anything left over
+ * is still readable and is picked up by the next epoll_wait immediately.
+ *
+ * @param engine Sockets and rewrite parameters to forward with.
+ * @return uint32_t number of frames received.
  */
-static int CreateUDPFilterSocket(uint16_t port)
+static uint32_t DrainFilterSocket(struct engine* engine)
 {
-    int sock = -1;
-    const short unsigned int code_size = 16;
-    const int port_idx_1 = 5;
-    const int port_idx_2 = 13;
+    const int drain_budget = 4096;
+    int drained = 0;
+    int received = 0;
+    int index = 0;
+    size_t frame_len = 0;
+    uint32_t status = 0;
+    uint64_t truncated = 0;
+    unsigned char* packet = NULL;
+    struct pkt_buf* bufs[BATCH_MAX_SIZE];
 
-    // udp and dst port = port
-    struct sock_filter code[] = {
-        {0x28, 0, 0, 0x0000000c},  {0x15, 0, 4, 0x000086dd}, {0x30, 0, 0, 0x00000014},
-        {0x15, 0, 11, 0x00000011}, {0x28, 0, 0, 0x00000038}, {0x15, 8, 9, 0xffffffff},
-        {0x15, 0, 8, 0x00000800},  {0x30, 0, 0, 0x00000017}, {0x15, 0, 6, 0x00000011},
-        {0x28, 0, 0, 0x00000014},  {0x45, 4, 0, 0x00001fff}, {0xb1, 0, 0, 0x0000000e},
-        {0x48, 0, 0, 0x00000010},  {0x15, 0, 1, 0xffffffff}, {0x6, 0, 0, 0x00040000},
-        {0x6, 0, 0, 0x00000000},
-    };
+    if (NULL != engine->rx_ring)
+    {
+        // frames are rewritten and sent straight out of the ring, no recv and no copy
+        for (drained = 0; drained < drain_budget; ++drained)
+        {
+            if (!RxRingNextFrame(engine->rx_ring, &packet, &frame_len, &status))
+                break;
 
-    code[port_idx_1].k = port;
-    code[port_idx_2].k = port;
+            // one clock read per receive batch worth of frames, like the recvmmsg path
+            if (0 == (uint32_t)drained % engine->recv_batch)
+            {
+                engine->rx_ns = MonotonicNs();
+            }
 
-    struct sock_fprog bpf = {
-        .len = code_size,
-        .filter = code,
-    };
-    printf("Filtering packets for udp dst port: %u\n", port);
+            MetricAdd(&engine->metrics->rx_packets, 1);
+            ForwardFrame(engine, packet, (ssize_t)frame_len, status, NULL);
+
+            // payloads queued in the send batch point into the block the ring hands back next
+            if (0 == engine->rx_ring->frames_left)
+            {
+                FlushOutputs(engine, 1);
+            }
+        }
+
+        MetricAdd(&engine->metrics->truncated, engine->rx_ring->truncated);
+        engine->rx_ring->truncated = 0;
+        goto end;
+    }
+
+    while (drained < drain_budget)
+    {
+        received = RecvPacketBatch(engine->bpf_sock, engine->pool, bufs, engine->recv_batch,
+                                   &truncated);
+
+        if (received <= 0)
+            break;
+
+        engine->rx_ns = MonotonicNs();
+        if (NULL != engine->raw_stamps)
+        {
+            engine->rx_real_ns = RealtimeNs();
+        }
+        MetricAdd(&engine->metrics->rx_packets, (uint64_t)received);
+
+        for (index = 0; index < received; ++index)
+        {
+            ForwardFrame(engine, bufs[index]->data, (ssize_t)bufs[index]->len, bufs[index]->status,
+                         bufs[index]);
+            BufPoolPut(engine->pool, bufs[index]);
+        }
+
+        // queued frames hold buffers, they go out with every receive batch and not only at the
+        // end of the drain
+        if (NULL != engine->fq)
+        {
+            DrainFairQueue(engine);
+        }
+
+        drained += received;
+    }
+
+    MetricAdd(&engine->metrics->truncated, truncated);
+
+end:
+    FlushOutputs(engine, NULL == engine->batch || 0 == engine->batch->max_delay_us);
+    return (uint32_t)drained;
+}
+
+/**
+ * @brief Rewrites and forwards the frames on the AF_XDP RX ring, in place in the UMEM.
+ *
+ * Frames sent on the socket's TX ring come back through the completion ring, every other frame
+ * is handed straight back to the fill ring. The send batch may still point into those, so it
+ * is flushed before the fill ring is published at the end of every receive batch.
+ *
+ * @param engine Engine with an AF_XDP socket.
+ * @return uint32_t number of frames received.
+ */
+static uint32_t DrainXskSocket(struct engine* engine)
+{
+    const uint32_t drain_budget = 4096;
+    uint32_t drained = 0;
+    uint32_t received = 0;
+    uint32_t index = 0;
+    struct xdp_desc descs[BATCH_MAX_SIZE];
+
+    while (drained < drain_budget)
+    {
+        received = XskReceive(engine->xsk, descs, engine->recv_batch);
+        if (0 == received)
+            break;
+
+        engine->rx_ns = MonotonicNs();
+        MetricAdd(&engine->metrics->rx_packets, received);
+
+        for (index = 0; index < received; ++index)
+        {
+            engine->xsk_frame = descs[index].addr;
+            ForwardFrame(engine, engine->xsk->umem + descs[index].addr,
+                         (ssize_t)descs[index].len, 0, NULL);
+
+            if (XSK_NO_FRAME != engine->xsk_frame)
+            {
+                XskRecycle(engine->xsk, descs[index].addr);
+            }
+        }
+
+        engine->xsk_frame = XSK_NO_FRAME;
+        FlushOutputs(engine, 1);
+        drained += received;
+    }
+
+    return drained;
+}
+
+/**
+ * @brief Rewrites and forwards the frames the multishot receive completed, and releases the
+ * sends that finished in the meantime.
+ *
+ * Frames sit in pool buffers behind the recvmsg header, they are forwarded like recvmmsg
+ * frames. The sends they cause are queued on the ring and submitted together when the outputs
+ * are flushed.
+ *
+ * @param engine Engine with an io_uring.
+ * @return uint32_t number of frames received.
+ */
+static uint32_t DrainUring(struct engine* engine)
+{
+    const uint32_t drain_budget = 4096;
+    uint32_t drained = 0;
+    uint32_t received = 0;
+    uint32_t index = 0;
+    struct uring_frame frames[BATCH_MAX_SIZE];
+
+    while (drained < drain_budget)
+    {
+        received = UringReceive(engine->uring, frames, engine->recv_batch);
+        MetricAdd(&engine->metrics->send_errors, UringSendErrors(engine->uring));
+        if (0 == received)
+            break;
 
-    sock = CreateRawFilterSocket(&bpf);
-    if (-1 == sock)
+        engine->rx_ns = MonotonicNs();
+        if (NULL != engine->raw_stamps)
+        {
+            engine->rx_real_ns = RealtimeNs();
+        }
+        MetricAdd(&engine->metrics->rx_packets, received);
+
+        for (index = 0; index < received; ++index)
+        {
+            ForwardFrame(engine, frames[index].packet, (ssize_t)frames[index].len,
+                         frames[index].status, frames[index].buf);
+            BufPoolPut(engine->pool, frames[index].buf);
+        }
+
+        // sends are submitted per receive batch, their completions free the slots of the next
+        FlushOutputs(engine, 0);
+        drained += received;
+    }
+
+    MetricAdd(&engine->metrics->truncated, engine->uring->truncated);
+    engine->uring->truncated = 0;
+
+    FlushOutputs(engine, NULL == engine->batch || 0 == engine->batch->max_delay_us);
+    return drained;
+}
+
+/**
+ * @brief Drains every input whether epoll reported it readable or not. With SO_BUSY_POLL the
+ * receive that ends in EAGAIN polls the device queue, so frames are picked up before their
+ * interrupt would have woken the worker.
+ *
+ * @param engine Engine to poll.
+ * @return uint32_t number of frames forwarded.
+ */
+static uint32_t PollInputs(struct engine* engine)
+{
+    uint32_t drained = NULL == engine->uring ? DrainFilterSocket(engine) : DrainUring(engine);
+
+    if (NULL != engine->xsk)
+    {
+        drained += DrainXskSocket(engine);
+    }
+
+    return drained;
+}
+
+/**
+ * @brief Rewrites one received frame in place and hands it to the output.
+ *
+ * With -w a raw rule's datagram is forwarded from the port of its flow, and a datagram to a
+ * flow's port from where the flow forwards to goes back to the flow's client as if it came
+ * from the address the client sent to.
+ *
+ * With -V a pool frame starts with the virtio_net_hdr the kernel wrote. A raw rule's frame is
+ * sent with the same header, so a checksum left partial stays partial and a GSO frame is
+ * segmented on the way out. A UDP rule can only forward single datagrams.
+ *
+ * @param engine Sockets and rewrite parameters to forward with.
+ * @param packet The received frame, starting at the ethernet header or the virtio_net_hdr.
+ * @param frame_len Length of the received frame.
+ * @param status TP_STATUS_* flags the kernel reported for the frame.
+ * @param buf Pool buffer holding the frame, NULL for ring frames.
+ */
+static void ForwardFrame(struct engine* engine, unsigned char* packet, ssize_t frame_len,
+                         uint32_t status, struct pkt_buf* buf)
+{
+    ssize_t packet_len = -1;
+    unsigned char* data = NULL;
+    enum parse_stage failed_stage = PARSE_STAGE_ETHER;
+    enum csum_state csum = status & TP_STATUS_CSUMNOTREADY ? CSUM_PARTIAL : CSUM_COMPLETE;
+    struct virtio_net_hdr* vnet = NULL;
+    const struct rule* rule = NULL;
+    const struct rewrite_ctx* rewrite = NULL;
+    struct rewrite_ctx flow_rewrite;
+    struct flow* flow = NULL;
+    union nexthop_l2 l2;
+    struct fq_node entry;
+    uint32_t fq_bucket = 0;
+    int reply = 0;
+
+    // how long the frame sat in the socket after the kernel stamped it, only set with -t
+    if (NULL != buf && 0 != buf->rx_stamp && engine->rx_real_ns >= buf->rx_stamp)
+    {
+        HistRecord(&engine->metrics->rx_queue, engine->rx_real_ns - buf->rx_stamp, 1);
+    }
+
+    if (engine->vnet_hdr && NULL != buf)
+    {
+        if ((size_t)frame_len < VNET_HDR_LEN)
+        {
+            MetricAdd(&engine->metrics->parse_errors[PARSE_STAGE_ETHER], 1);
+            return;
+        }
+        vnet = (struct virtio_net_hdr*)packet;
+        packet += VNET_HDR_LEN;
+        frame_len -= (ssize_t)VNET_HDR_LEN;
+    }
+
+    if (NULL != engine->flows)
+    {
+        flow = FlowReply(engine->flows, engine->rules, packet, (size_t)frame_len, engine->rx_ns);
+        reply = NULL != flow;
+    }
+
+    rule = reply ? &engine->rules->rules[flow->rule]
+                 : MatchRule(engine->rules, packet, (size_t)frame_len, &failed_stage);
+    if (NULL == rule)
+    {
+        MetricAdd(PARSE_STAGE_COUNT == failed_stage ? &engine->metrics->unmatched
+                                                    : &engine->metrics->parse_errors[failed_stage],
+                  1);
+        return;
+    }
+
+    // replies of admitted flows are not limited again, the source of a flow is never the server
+    if (NULL != engine->limiter && !reply)
+    {
+        switch (LimitAdmit(engine->limiter, packet, engine->rx_ns))
+        {
+            case LIMIT_SOURCE:
+                MetricAdd(&engine->metrics->source_limited, 1);
+                return;
+            case LIMIT_GLOBAL:
+                MetricAdd(&engine->metrics->global_limited, 1);
+                return;
+            default:
+                break;
+        }
+    }
+
+    rewrite = &rule->rewrite;
+    if (NULL != vnet)
+    {
+        // the payload of a GSO frame is many datagrams, only a raw send can split it again
+        if (VIRTIO_NET_HDR_GSO_NONE != vnet->gso_type && !rule->rewrite.raw_send)
+        {
+            MetricAdd(&engine->metrics->parse_errors[PARSE_STAGE_UDP], 1);
+            return;
+        }
+
+        csum = !(vnet->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) ? CSUM_COMPLETE
+               : rule->rewrite.raw_send                     ? CSUM_OFFLOAD
+                                                            : CSUM_PARTIAL;
+        // DATA_VALID only describes the received frame, the send header keeps NEEDS_CSUM
+        vnet->flags &= VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    }
+
+    // the flow as the sender addressed it, the rewrite makes all of a rule's packets look alike
+    if (NULL != engine->fq)
+    {
+        fq_bucket = FqBucket(packet);
+    }
+
+    if (NULL != engine->flows && rule->rewrite.raw_send)
+    {
+        if (!reply)
+        {
+            switch (FlowTrack(engine->flows, packet, (uint16_t)(rule - engine->rules->rules),
+                              engine->rx_ns, &flow))
+            {
+                case FLOW_EVICTED:
+                    MetricAdd(&engine->metrics->flows_evicted, 1);
+                    // fall through
+                case FLOW_CREATED:
+                    MetricAdd(&engine->metrics->flows_created, 1);
+                    break;
+                case FLOW_FOUND:
+                    break;
+            }
+        }
+
+        FlowRewriteCtx(flow, rule, reply, &flow_rewrite);
+        rewrite = &flow_rewrite;
+    }
+
+    packet_len = ModifyPacket(packet, frame_len, rewrite, &data, csum, &failed_stage);
+    if (-1 == packet_len)
+    {
+        MetricAdd(&engine->metrics->parse_errors[failed_stage], 1);
+        return;
+    }
+
+    // straight back to the station the client's datagram came from
+    if (reply)
+    {
+        memcpy(packet, flow->client_mac, ETH_ALEN);
+        memcpy(packet + ETH_ALEN, flow->local_mac, ETH_ALEN);
+    }
+    else if (rule->rewrite.raw_send)
+    {
+        // to the next hop towards the rule's destination, not back to whoever sent the frame
+        if (!ReadNexthop(&engine->hops[rule - engine->rules->rules], &l2))
+        {
+            MetricAdd(&engine->metrics->unresolved, 1);
+            return;
+        }
+        memcpy(packet, l2.words, 2 * ETH_ALEN);
+    }
+
+    // a copy of the frame head goes to the log thread, formatting never happens here
+    if (LogSample(engine->log))
+    {
+        LogPacket(engine->log, packet, (size_t)packet_len);
+    }
+
+    if (NULL != engine->fq && NULL != buf)
+    {
+        // sent by DrainFairQueue, the queue keeps its own reference on buf
+        entry = (struct fq_node){.buf = buf,
+                                 .rule = rule,
+                                 .vnet = vnet,
+                                 .packet = packet,
+                                 .data = data,
+                                 .len = (uint32_t)packet_len,
+                                 .rx_ns = engine->rx_ns};
+        if (FqEnqueue(engine->fq, fq_bucket, &entry))
+        {
+            MetricAdd(&engine->metrics->queue_drops, 1);
+            return;
+        }
+    }
+    else if (ForwardPacket(engine, rule, vnet, packet, packet_len, data, buf))
     {
-        (void)fprintf(stderr, "Could not create raw udp filter socket");
+        MetricAdd(&engine->metrics->send_errors, 1);
+        return;
     }
 
-    return sock;
+    MetricAdd(&engine->metrics->forwarded, 1);
+    if (reply)
+    {
+        MetricAdd(&engine->metrics->replied, 1);
+    }
+}
+
+/**
+ * @brief Pushes out whatever the TX ring, the send batch and the io_uring have queued.
+ *
+ * @param engine Engine whose outputs are flushed.
+ * @param force Flush the send batch even if its batching delay has not run out.
+ */
+static void FlushOutputs(struct engine* engine, int force)
+{
+    int failed = 0;
+
+    if (NULL != engine->fq)
+    {
+        DrainFairQueue(engine);
+    }
+
+    if (NULL != engine->tx_ring)
+    {
+        if (TxRingFlush(engine->tx_ring))
+        {
+            (void)fprintf(stderr, "Could not flush tx ring\n");
+        }
+        LatencyFlush(&engine->latency, &engine->metrics->latency, MonotonicNs());
+    }
+
+    if (NULL != engine->batch && 0 != engine->batch->count &&
+        (force || 0 == UdpBatchTimeout(engine->batch, MonotonicNs())))
+    {
+        MetricAdd(&engine->metrics->udp_sends, engine->batch->msg_count);
+        if (NULL == engine->uring)
+        {
+            failed = UdpBatchFlush(engine->batch, engine->out_sock, engine->pool);
+            LatencyFlush(&engine->latency, &engine->metrics->latency, MonotonicNs());
+        }
+        else
+        {
+            failed = UdpBatchSubmit(engine->batch, engine->out_sock, engine->uring, engine->pool);
+        }
+        if (failed)
+        {
+            MetricAdd(&engine->metrics->send_errors, (uint64_t)failed);
+        }
+    }
+
+    // the batch's messages and the raw frames go to the kernel with one io_uring_enter
+    if (NULL != engine->uring && 0 != engine->uring->sq_pending)
+    {
+        if (UringSubmit(engine->uring))
+        {
+            (void)fprintf(stderr, "Could not submit to io_uring\n");
+        }
+        LatencyFlush(&engine->latency, &engine->metrics->latency, MonotonicNs());
+    }
+
+    // after the send batch, its payloads may sit in frames that are back on the fill ring
+    if (NULL != engine->xsk)
+    {
+        if (XskFlush(engine->xsk))
+        {
+            (void)fprintf(stderr, "Could not flush AF_XDP socket\n");
+        }
+        MetricAdd(&engine->metrics->send_errors, XskSendErrors(engine->xsk));
+        LatencyFlush(&engine->latency, &engine->metrics->latency, MonotonicNs());
+    }
+
+    // the kernel queues a transmit timestamp as each frame leaves, io_uring sends still in
+    // flight are picked up by a later flush
+    if (NULL != engine->raw_stamps)
+    {
+        (void)TstampReap(engine->raw_stamps, &engine->metrics->transit);
+    }
+    if (NULL != engine->udp_stamps)
+    {
+        (void)TstampReap(engine->udp_stamps, &engine->metrics->transit);
+    }
+}
+
+/**
+ * @brief Sends queued frames in deficit round robin order until the queue is empty or an output
+ * pushes back. Frames an output had no room for go back to the head of their flow's queue and
+ * the queue is left alone for FQ_RETRY_MS, a bulk flow fills its own queue and drops at its
+ * tail while the other flows keep their turns.
+ *
+ * @param engine Engine with a fair queue.
+ */
+static void DrainFairQueue(struct engine* engine)
+{
+    int failed = 0;
+    uint32_t queued = 0;
+    struct fq_node* node = NULL;
+    struct fq_node* batched[BATCH_MAX_SIZE];
+    const struct rewrite_ctx* rewrite = NULL;
+
+    if (0 == engine->fq->backlog || MonotonicNs() < engine->fq->retry_ns)
+        return;
+
+    engine->fq->retry_ns = 0;
+    while (0 == engine->fq->retry_ns && NULL != (node = FqDequeue(engine->fq)))
+    {
+        rewrite = &node->rule->rewrite;
+        if (rewrite->raw_send)
+        {
+            failed = NULL != node->vnet ? SendRawVnet(engine->bpf_sock, node->vnet, node->len,
+                                                      node->packet, &rewrite->device)
+                                        : SendRawSocket(engine->bpf_sock, node->len, node->packet,
+                                                        &rewrite->device);
+            if (failed && SEND_BACKED_OFF(errno))
+            {
+                FqRequeue(engine->fq, node);
+                MetricAdd(&engine->metrics->queue_deferred, 1);
+                engine->fq->retry_ns = MonotonicNs() + FQ_RETRY_MS * NSEC_PER_MSEC;
+                break;
+            }
+
+            if (failed)
+            {
+                MetricAdd(&engine->metrics->send_errors, 1);
+            }
+            else
+            {
+                if (NULL != engine->raw_stamps)
+                {
+                    TstampSent(engine->raw_stamps, node->buf->rx_stamp);
+                }
+                HistRecord(&engine->metrics->latency, MonotonicNs() - node->rx_ns, 1);
+            }
+            FqRelease(engine->fq, node, engine->pool);
+            continue;
+        }
+
+        if (UdpBatchAdd(engine->batch, node->data,
+                        node->len - (uint32_t)(node->data - node->packet), &rewrite->dest_addr,
+                        node->buf))
+        {
+            MetricAdd(&engine->metrics->send_errors, 1);
+            FqRelease(engine->fq, node, engine->pool);
+            continue;
+        }
+
+        batched[queued++] = node;
+        if (engine->batch->count == engine->batch->size)
+        {
+            SendFairBatch(engine, batched, queued);
+            queued = 0;
+        }
+    }
+
+    if (0 != queued)
+    {
+        SendFairBatch(engine, batched, queued);
+    }
+}
+
+/**
+ * @brief Sends the batch DrainFairQueue filled, the frames the socket had no room for go back
+ * on the queue.
+ *
+ * @param engine Engine with a fair queue and a UDP output.
+ * @param nodes Frames in the batch, in the order they were added.
+ * @param count Number of frames in the batch.
+ */
+static void SendFairBatch(struct engine* engine, struct fq_node** nodes, uint32_t count)
+{
+    int failed = 0;
+    uint32_t done = 0;
+    uint32_t msgs_done = 0;
+    uint32_t index = 0;
+    uint64_t now = 0;
+
+    // only what the socket took counts, the rest is handed to it again from the queue
+    failed = UdpBatchSendSome(engine->batch, engine->out_sock, engine->pool, &done, &msgs_done);
+    MetricAdd(&engine->metrics->udp_sends, msgs_done);
+    if (failed)
+    {
+        MetricAdd(&engine->metrics->send_errors, (uint64_t)failed);
+    }
+
+    // last first, every flow's queue keeps its order
+    for (index = count; index > done; --index)
+    {
+        FqRequeue(engine->fq, nodes[index - 1]);
+    }
+
+    now = MonotonicNs();
+    if (done < count)
+    {
+        MetricAdd(&engine->metrics->queue_deferred, count - done);
+        engine->fq->retry_ns = now + FQ_RETRY_MS * NSEC_PER_MSEC;
+    }
+
+    for (index = 0; index < done; ++index)
+    {
+        HistRecord(&engine->metrics->latency, now - nodes[index]->rx_ns, 1);
+        FqRelease(engine->fq, nodes[index], engine->pool);
+    }
+}
+
+/**
+ * @brief Sends a rewritten packet out of the output its rule asks for.
+ *
+ * @param engine Sockets and outputs to forward with.
+ * @param rule Rule the packet matched.
+ * @param vnet Header to send a raw frame with when the filter socket has PACKET_VNET_HDR, NULL
+ * for a frame received without one.
+ * @param packet The rewritten packet, starting at the ethernet header.
+ * @param packet_len Length of the rewritten packet.
+ * @param data Start of the UDP payload inside packet.
+ * @param buf Pool buffer holding packet, the send batch keeps a reference. NULL for ring frames.
+ * @return int EXIT_SUCCESS on success, EXIT_FAILURE on failure, which is counted by the caller and
+ * not printed.
+ */
+static int ForwardPacket(struct engine* engine, const struct rule* rule,
+                         struct virtio_net_hdr* vnet, unsigned char* packet, ssize_t packet_len,
+                         unsigned char* data, struct pkt_buf* buf)
+{
+    // AF_XDP frames arrive without a header, they are sent as plain frames
+    static const struct virtio_net_hdr plain_vnet = {.gso_type = VIRTIO_NET_HDR_GSO_NONE};
+    int exit_code = EXIT_FAILURE;
+    size_t data_len = 0;
+    struct iovec iovs[2] = {0};
+    struct pkt_buf* iov_bufs[2] = {NULL, buf};
+    struct msghdr msg = {0};
+
+    if (engine->vnet_hdr && NULL == vnet)
+    {
+        vnet = (struct virtio_net_hdr*)&plain_vnet;
+    }
+
+    if (XSK_NO_FRAME != engine->xsk_frame && rule->rewrite.raw_send &&
+        rule->rewrite.if_index == engine->xsk->if_index)
+    {
+        // out of the UMEM frame it arrived in, not copied at all
+        if (XskSend(engine->xsk, engine->xsk_frame, (uint32_t)packet_len))
+            goto end;
+
+        engine->xsk_frame = XSK_NO_FRAME;
+        LatencyQueue(&engine->latency, engine->rx_ns);
+    }
+    else if (NULL != engine->tx_ring && rule->rewrite.if_index == engine->tx_if_index &&
+             (size_t)packet_len <= TxRingMaxFrame())
+    {
+        // copied straight from the rx frame into the tx slot, flushed once per drain
+        if (TxRingSend(engine->tx_ring, packet, (size_t)packet_len))
+            goto end;
+
+        LatencyQueue(&engine->latency, engine->rx_ns);
+    }
+    else if (rule->rewrite.raw_send && NULL != engine->uring && NULL != buf)
+    {
+        // the ring references the buffer until the frame is sent, submitted once per drain, a
+        // received header lives in the same buffer
+        iovs[0].iov_base = vnet;
+        iovs[0].iov_len = VNET_HDR_LEN;
+        iovs[1].iov_base = packet;
+        iovs[1].iov_len = (size_t)packet_len;
+        msg.msg_name = (void*)&rule->rewrite.device;
+        msg.msg_namelen = sizeof(rule->rewrite.device);
+        msg.msg_iov = NULL != vnet ? iovs : &iovs[1];
+        msg.msg_iovlen = NULL != vnet ? 2 : 1;
+        if (UringSend(engine->uring, engine->bpf_sock, &msg, NULL != vnet ? iov_bufs : &buf))
+            goto end;
+
+        if (NULL != engine->raw_stamps)
+        {
+            TstampSent(engine->raw_stamps, NULL == buf ? 0 : buf->rx_stamp);
+        }
+
+        LatencyQueue(&engine->latency, engine->rx_ns);
+    }
+    else if (rule->rewrite.raw_send && NULL != vnet)
+    {
+        if (SendRawVnet(engine->bpf_sock, vnet, (size_t)packet_len, packet, &rule->rewrite.device))
+            goto end;
+
+        if (NULL != engine->raw_stamps)
+        {
+            TstampSent(engine->raw_stamps, NULL == buf ? 0 : buf->rx_stamp);
+        }
+
+        HistRecord(&engine->metrics->latency, MonotonicNs() - engine->rx_ns, 1);
+    }
+    else if (rule->rewrite.raw_send)
+    {
+        if (SendRawSocket(engine->bpf_sock, (size_t)packet_len, packet, &rule->rewrite.device))
+            goto end;
+
+        if (NULL != engine->raw_stamps)
+        {
+            TstampSent(engine->raw_stamps, NULL == buf ? 0 : buf->rx_stamp);
+        }
+
+        HistRecord(&engine->metrics->latency, MonotonicNs() - engine->rx_ns, 1);
+    }
+    else
+    {
+        if (NULL == data)
+            goto end;
+
+        data_len = (size_t)packet_len - (size_t)(data - packet);
+        if (UdpBatchAdd(engine->batch, data, data_len, &rule->rewrite.dest_addr, buf))
+            goto end;
+
+        LatencyQueue(&engine->latency, engine->rx_ns);
+
+        if (engine->batch->count == engine->batch->size)
+        {
+            FlushOutputs(engine, 1);
+        }
+    }
+
+    exit_code = EXIT_SUCCESS;
+
+end:
+    return exit_code;
+}
+
+/**
+ * @brief Adds the kernel's PACKET_STATISTICS since the last read to the worker's metrics.
+ *
+ * @param engine Engine whose filter socket is read.
+ */
+static void ReadKernelStats(struct engine* engine)
+{
+    uint64_t packets = 0;
+    uint64_t drops = 0;
+
+    engine->stats_ns = MonotonicNs();
+
+    if (GetPacketStats(engine->bpf_sock, &packets, &drops))
+        return;
+
+    MetricAdd(&engine->metrics->kernel_packets, packets);
+    MetricAdd(&engine->metrics->kernel_drops, drops);
+
+    if (NULL != engine->xsk && EXIT_SUCCESS == XskDrops(engine->xsk, &drops))
+    {
+        MetricAdd(&engine->metrics->kernel_drops, drops);
+    }
+}
+
+/**
+ * @brief Blocks SIGINT and SIGTERM and returns a signalfd that reports them.
+ *
+ * @return int the file descriptor of the signalfd, or -1 on failure.
+ */
+static int CreateSignalFd(void)
+{
+    int sig_fd = -1;
+    sigset_t mask;
+
+    (void)sigemptyset(&mask);
+    (void)sigaddset(&mask, SIGINT);
+    (void)sigaddset(&mask, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL))
+    {
+        perror("sigprocmask");
+        goto end;
+    }
+
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (-1 == sig_fd)
+    {
+        perror("signalfd");
+    }
+
+end:
+    return sig_fd;
 }
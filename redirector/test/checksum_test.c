@@ -0,0 +1,416 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "rawparser.h"
+#include "rewrite.h"
+
+#define TEST_SEED 0x5DEECE66DULL
+#define TEST_BUF_SIZE 2048U
+#define TEST_ALIGN_SLACK 64U
+#define TEST_KERNEL_ROUNDS 20000U
+#define TEST_REWRITE_ROUNDS 20000U
+#define TEST_ETH_SIZE 14U
+#define TEST_UDP_SIZE 8U
+#define TEST_MAX_PAYLOAD 1400U
+
+static const char* const kernels[] = {"generic", "sse2", "avx2"};
+
+static uint64_t Next(uint64_t* state);
+static void FillRandom(unsigned char* data, size_t len, uint64_t* state);
+static uint64_t ReferenceSum(const unsigned char* data, size_t len, uint64_t sum);
+static uint16_t UdpSum(const unsigned char* frame);
+static size_t BuildFrame(unsigned char* frame, uint64_t* state, size_t payload_len);
+static void SealFrame(unsigned char* frame, int udp_check);
+static void RandomCtx(struct rewrite_ctx* ctx, uint64_t* state);
+static int CheckRewritten(const unsigned char* frame, const struct rewrite_ctx* ctx,
+                          int had_udp_check, const char* what);
+static int TestKernels(void);
+static int TestRewrite(void);
+static int TestZeroSums(void);
+
+int main(void)
+{
+    int failed = 0;
+
+    failed |= TestKernels();
+
+    // the rewrite tests run on whatever kernel is fastest, like the redirector
+    checksum_init();
+    failed |= TestRewrite();
+    failed |= TestZeroSums();
+
+    printf("checksum tests %s\n", failed ? "FAILED" : "passed");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Every kernel folds to the same sum as a plain 16 bit loop, at any length, alignment
+ * and starting sum, for random, all zero and all ones data.
+ */
+static int TestKernels(void)
+{
+    int failed = 0;
+    size_t kernel = 0;
+    uint32_t round = 0;
+    uint64_t state = TEST_SEED;
+    uint64_t sum = 0;
+    size_t len = 0;
+    size_t offset = 0;
+    uint16_t expected = 0;
+    uint16_t actual = 0;
+    unsigned char buf[TEST_BUF_SIZE + TEST_ALIGN_SLACK];
+
+    for (kernel = 0; kernel < sizeof(kernels) / sizeof(*kernels); ++kernel)
+    {
+        if (checksum_use(kernels[kernel]))
+        {
+            printf("%s kernel not supported here, skipped\n", kernels[kernel]);
+            continue;
+        }
+
+        for (round = 0; round < TEST_KERNEL_ROUNDS; ++round)
+        {
+            len = (size_t)(Next(&state) % TEST_BUF_SIZE);
+            offset = (size_t)(Next(&state) % TEST_ALIGN_SLACK);
+            sum = round % 4 == 0 ? 0 : (uint32_t)Next(&state);
+
+            switch (round % 8)
+            {
+                case 1:
+                    memset(buf + offset, 0, len);
+                    break;
+                case 2:
+                    memset(buf + offset, 0xFF, len);
+                    break;
+                default:
+                    FillRandom(buf + offset, len, &state);
+                    break;
+            }
+
+            expected = checksum_fold(ReferenceSum(buf + offset, len, sum));
+            actual = checksum_fold(checksum_partial(buf + offset, len, sum));
+            if (expected != actual)
+            {
+                (void)fprintf(stderr,
+                              "%s: len %zu offset %zu start %llu: got 0x%04x, expected 0x%04x\n",
+                              kernels[kernel], len, offset, (unsigned long long)sum, actual,
+                              expected);
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * @brief The incremental IP and UDP checksum updates of ModifyPacket leave checksums a full
+ * recompute accepts, and the CHECKSUM_PARTIAL recompute does too.
+ */
+static int TestRewrite(void)
+{
+    int failed = 0;
+    int udp_check = 0;
+    uint32_t round = 0;
+    uint64_t state = TEST_SEED + 1;
+    size_t frame_len = 0;
+    enum csum_state csum = CSUM_COMPLETE;
+    struct rewrite_ctx ctx;
+    unsigned char frame[TEST_BUF_SIZE];
+
+    for (round = 0; round < TEST_REWRITE_ROUNDS && !failed; ++round)
+    {
+        frame_len = BuildFrame(frame, &state, (size_t)(Next(&state) % TEST_MAX_PAYLOAD));
+        RandomCtx(&ctx, &state);
+
+        // one in eight senders computed no UDP checksum, every fourth frame is CHECKSUM_PARTIAL
+        udp_check = 0 != round % 8;
+        csum = 0 == round % 4 ? CSUM_PARTIAL : CSUM_COMPLETE;
+        SealFrame(frame, udp_check);
+        if (CSUM_PARTIAL == csum)
+        {
+            // the kernel leaves only the pseudo header sum, anything works for the recompute
+            frame[TEST_ETH_SIZE + (frame[TEST_ETH_SIZE] & 0xFU) * 4 + 6] = (unsigned char)round;
+            udp_check = 1;
+        }
+
+        if (-1 == ModifyPacket(frame, (ssize_t)frame_len, &ctx, NULL, csum, NULL))
+        {
+            (void)fprintf(stderr, "rewrite: ModifyPacket failed on a valid frame\n");
+            failed = 1;
+            break;
+        }
+
+        failed = CheckRewritten(frame, &ctx, udp_check,
+                                CSUM_PARTIAL == csum ? "partial rewrite" : "rewrite");
+    }
+
+    return failed;
+}
+
+/**
+ * @brief Frames whose checksums come out as 0x0000 or 0xFFFF: a UDP checksum of zero is never
+ * sent, and a received 0xFFFF is adjusted like any other value.
+ */
+static int TestZeroSums(void)
+{
+    int failed = 0;
+    uint32_t word = 0;
+    uint64_t state = TEST_SEED + 2;
+    size_t frame_len = 0;
+    size_t udp_offset = 0;
+    size_t tail = 0;
+    uint16_t check = 0;
+    int mode = 0;
+    struct rewrite_ctx ctx;
+    struct udphdr udp;
+    unsigned char frame[TEST_BUF_SIZE];
+    unsigned char rewritten[TEST_BUF_SIZE];
+
+    // the adjust keeps the two zeros of one's complement apart when nothing changes
+    if (0x0000 != checksum_adjust(0x0000, 0) || 0xFFFF != checksum_adjust(0xFFFF, 0))
+    {
+        (void)fprintf(stderr, "zero sums: checksum_adjust does not keep 0x0000 and 0xFFFF\n");
+        failed = 1;
+    }
+
+    for (mode = 0; mode < 3 && !failed; ++mode)
+    {
+        frame_len = BuildFrame(frame, &state, 16);
+        RandomCtx(&ctx, &state);
+        udp_offset = TEST_ETH_SIZE + (frame[TEST_ETH_SIZE] & 0xFU) * 4;
+        tail = frame_len - 2;
+
+        // search the last payload word for the frame whose checksum is the one under test
+        for (word = 0; word <= UINT16_MAX; ++word)
+        {
+            frame[tail] = (unsigned char)(word >> 8);
+            frame[tail + 1] = (unsigned char)word;
+            SealFrame(frame, 1);
+
+            memcpy(&udp, frame + udp_offset, sizeof(udp));
+            if (0 == mode && 0xFFFF != udp.check)
+                continue;
+
+            memcpy(rewritten, frame, frame_len);
+            memcpy(rewritten + TEST_ETH_SIZE + 12, &ctx.s_addr, sizeof(ctx.s_addr));
+            memcpy(rewritten + TEST_ETH_SIZE + 16, &ctx.f_addr, sizeof(ctx.f_addr));
+            memcpy(rewritten + udp_offset, &ctx.s_port, sizeof(ctx.s_port));
+            memcpy(rewritten + udp_offset + 2, &ctx.f_port, sizeof(ctx.f_port));
+            memset(rewritten + udp_offset + 6, 0, 2);
+            check = (uint16_t)~UdpSum(rewritten);
+            if (0 != mode && 0x0000 != check)
+                continue;
+
+            break;
+        }
+
+        if (word > UINT16_MAX)
+        {
+            (void)fprintf(stderr, "zero sums: no payload gives mode %d its checksum\n", mode);
+            failed = 1;
+            break;
+        }
+
+        if (-1 == ModifyPacket(frame, (ssize_t)frame_len, &ctx, NULL,
+                               2 == mode ? CSUM_PARTIAL : CSUM_COMPLETE, NULL))
+        {
+            (void)fprintf(stderr, "zero sums: ModifyPacket failed on a valid frame\n");
+            failed = 1;
+            break;
+        }
+
+        failed = CheckRewritten(frame, &ctx, 1, 0 == mode   ? "received 0xFFFF"
+                                                : 1 == mode ? "adjusted to zero"
+                                                            : "recomputed to zero");
+        memcpy(&udp, frame + udp_offset, sizeof(udp));
+        if (!failed && 0 != mode && 0xFFFF != udp.check)
+        {
+            (void)fprintf(stderr, "zero sums: mode %d sent 0x%04x instead of 0xFFFF\n", mode,
+                          udp.check);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+/**
+ * @brief Headers carry the context's addresses and ports and checksums a receiver accepts.
+ */
+static int CheckRewritten(const unsigned char* frame, const struct rewrite_ctx* ctx,
+                          int had_udp_check, const char* what)
+{
+    size_t header_len = (size_t)(frame[TEST_ETH_SIZE] & 0xFU) * 4;
+    struct ip ip;
+    struct udphdr udp;
+
+    memcpy(&ip, frame + TEST_ETH_SIZE, sizeof(ip));
+    memcpy(&udp, frame + TEST_ETH_SIZE + header_len, sizeof(udp));
+
+    if (ip.ip_src.s_addr != ctx->s_addr.s_addr || ip.ip_dst.s_addr != ctx->f_addr.s_addr ||
+        udp.source != ctx->s_port || udp.dest != ctx->f_port)
+    {
+        (void)fprintf(stderr, "%s: addresses or ports were not rewritten\n", what);
+        return 1;
+    }
+
+    if (0xFFFF != checksum_fold(ReferenceSum(frame + TEST_ETH_SIZE, header_len, 0)))
+    {
+        (void)fprintf(stderr, "%s: IP checksum 0x%04x does not verify\n", what, ip.ip_sum);
+        return 1;
+    }
+
+    if (!had_udp_check)
+    {
+        if (0 != udp.check)
+        {
+            (void)fprintf(stderr, "%s: a missing UDP checksum became 0x%04x\n", what, udp.check);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (0 == udp.check || 0xFFFF != UdpSum(frame))
+    {
+        (void)fprintf(stderr, "%s: UDP checksum 0x%04x does not verify\n", what, udp.check);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Folded sum of a frame's UDP pseudo header, header and payload, checksum included.
+ */
+static uint16_t UdpSum(const unsigned char* frame)
+{
+    size_t udp_offset = TEST_ETH_SIZE + (size_t)(frame[TEST_ETH_SIZE] & 0xFU) * 4;
+    uint16_t udp_len = 0;
+    uint64_t sum = 0;
+    unsigned char pseudo[12];
+
+    memcpy(&udp_len, frame + udp_offset + 4, sizeof(udp_len));
+    memcpy(pseudo, frame + TEST_ETH_SIZE + 12, 8);
+    pseudo[8] = 0;
+    pseudo[9] = IPPROTO_UDP;
+    memcpy(pseudo + 10, &udp_len, sizeof(udp_len));
+
+    sum = ReferenceSum(pseudo, sizeof(pseudo), 0);
+    sum = ReferenceSum(frame + udp_offset, ntohs(udp_len), sum);
+    return checksum_fold(sum);
+}
+
+/**
+ * @brief Random ethernet, IPv4 with 0 to 2 option words and UDP headers around a random
+ * payload, checksums left for SealFrame.
+ *
+ * @return size_t length of the frame.
+ */
+static size_t BuildFrame(unsigned char* frame, uint64_t* state, size_t payload_len)
+{
+    size_t header_len = 20U + 4U * (size_t)(Next(state) % 3);
+    size_t udp_len = TEST_UDP_SIZE + payload_len;
+    uint16_t field = 0;
+
+    FillRandom(frame, TEST_ETH_SIZE + header_len + udp_len, state);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    frame[TEST_ETH_SIZE] = (unsigned char)(0x40 | header_len / 4);
+    field = htons((uint16_t)(header_len + udp_len));
+    memcpy(frame + TEST_ETH_SIZE + 2, &field, sizeof(field));
+    frame[TEST_ETH_SIZE + 9] = IPPROTO_UDP;
+
+    field = htons((uint16_t)udp_len);
+    memcpy(frame + TEST_ETH_SIZE + header_len + 4, &field, sizeof(field));
+
+    return TEST_ETH_SIZE + header_len + udp_len;
+}
+
+/**
+ * @brief Computes the IP checksum and, if udp_check, the UDP one in full, 0 stands for none.
+ */
+static void SealFrame(unsigned char* frame, int udp_check)
+{
+    size_t header_len = (size_t)(frame[TEST_ETH_SIZE] & 0xFU) * 4;
+    unsigned char* check = frame + TEST_ETH_SIZE + header_len + 6;
+    uint16_t sum = 0;
+
+    memset(frame + TEST_ETH_SIZE + 10, 0, 2);
+    sum = (uint16_t)~checksum_fold(ReferenceSum(frame + TEST_ETH_SIZE, header_len, 0));
+    memcpy(frame + TEST_ETH_SIZE + 10, &sum, sizeof(sum));
+
+    memset(check, 0, 2);
+    if (udp_check)
+    {
+        sum = (uint16_t)~UdpSum(frame);
+        sum = 0 == sum ? 0xFFFF : sum;
+        memcpy(check, &sum, sizeof(sum));
+    }
+}
+
+static void RandomCtx(struct rewrite_ctx* ctx, uint64_t* state)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->s_addr.s_addr = (uint32_t)Next(state);
+    ctx->f_addr.s_addr = (uint32_t)Next(state);
+    ctx->s_port = (uint16_t)Next(state);
+    ctx->f_port = (uint16_t)Next(state);
+    SetRewriteSums(ctx);
+}
+
+/**
+ * @brief The one's complement sum of RFC 1071, one 16 bit word in memory order at a time.
+ */
+static uint64_t ReferenceSum(const unsigned char* data, size_t len, uint64_t sum)
+{
+    size_t index = 0;
+    uint16_t word = 0;
+    unsigned char last[2] = {0};
+
+    for (index = 0; index + 1 < len; index += 2)
+    {
+        memcpy(&word, data + index, sizeof(word));
+        sum += word;
+    }
+
+    if (len & 1U)
+    {
+        last[0] = data[len - 1];
+        memcpy(&word, last, sizeof(word));
+        sum += word;
+    }
+
+    return sum;
+}
+
+static void FillRandom(unsigned char* data, size_t len, uint64_t* state)
+{
+    size_t index = 0;
+
+    for (index = 0; index < len; ++index)
+    {
+        data[index] = (unsigned char)(Next(state) >> 56);
+    }
+}
+
+/**
+ * @brief xorshift64*, the same numbers on every run.
+ */
+static uint64_t Next(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}